@@ -4,17 +4,38 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
 	main.c \
+	activation.c \
+	archive.c \
 	autoconf.c \
+	batch.c \
+	cgroup.c \
 	cmdserver.c \
+	evloop.c \
+	executor.c \
+	journal.c \
+	logdir.c \
+	logfilter.c \
+	logindex.c \
+	logstream.c \
+	metrics.c \
 	mldproc.c \
+	pool.c \
+	procstat.c \
+	recorder.c \
+	spawnopt.c \
+	template.c \
+	timerwheel.c \
 	tracecmd.c \
+	upgrade.c \
+	uring.c \
 	utils.c
 
 LOCAL_C_INCLUDES:= $(call include-path-for, dbus)
 
 LOCAL_SHARED_LIBRARIES:= \
 	libutils \
-	libcutils
+	libcutils \
+	libz
 
 LOCAL_CFLAGS:= -fno-short-enums -Wall -DANDROID_OS
 
@@ -0,0 +1,191 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "activation.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "activation.c"
+
+// Environment set by the supervisor for socket activation.
+#define ENV_LISTEN_PID "LISTEN_PID"
+#define ENV_LISTEN_FDS "LISTEN_FDS"
+#define ENV_LISTEN_FDNAMES "LISTEN_FDNAMES"
+
+// Environment set by the supervisor for readiness notification.
+#define ENV_NOTIFY_SOCKET "NOTIFY_SOCKET"
+
+// First inherited file descriptor.
+#define LISTEN_FDS_START 3
+
+// Inherited sockets not yet taken.
+static int first_fd = -1;
+static int num_fds = 0;
+
+// Forward declarations.
+static int is_listening(int fd);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Pick up listening sockets passed by the supervisor. The sockets are
+ *        only accepted if they are meant for this process. The activation
+ *        environment is cleared so it isn't passed on further.
+ */
+void activation_init(void)
+{
+    const char *pid, *fds;
+    int fd, n;
+
+    pid = getenv(ENV_LISTEN_PID);
+    fds = getenv(ENV_LISTEN_FDS);
+
+    if (pid && fds && strtol(pid, NULL, 10) == getpid()) {
+        n = (int)strtol(fds, NULL, 10);
+
+        for (fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + n; fd++) {
+            (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+
+        if (n > 0) {
+            first_fd = LISTEN_FDS_START;
+            num_fds = n;
+        }
+    }
+
+    unsetenv(ENV_LISTEN_PID);
+    unsetenv(ENV_LISTEN_FDS);
+    unsetenv(ENV_LISTEN_FDNAMES);
+}
+
+/**
+ * @brief Take the listening socket passed by the supervisor. Only the first
+ *        listening stream socket is used, any other inherited sockets are
+ *        closed.
+ *
+ * @return Returns the socket, or -1 if no socket was passed.
+ */
+int activation_listen_fd(void)
+{
+    int fd, sockfd = -1;
+
+    for (fd = first_fd; fd >= 0 && fd < first_fd + num_fds; fd++) {
+        if (-1 == sockfd && is_listening(fd)) {
+            sockfd = fd;
+        } else {
+            ALOGE("%s:%d: Ignored inherited socket (fd: %d)", _FILE,
+                  __LINE__, fd);
+            close(fd);
+        }
+    }
+
+    first_fd = -1;
+    num_fds = 0;
+
+    return sockfd;
+}
+
+/**
+ * @brief Send a state notification, e.g. "READY=1", to the supervisor.
+ *        Nothing is sent if the proxy isn't supervised.
+ *
+ * @param [in] state Newline separated list of state assignments.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int activation_notify(const char *state)
+{
+    struct sockaddr_un addr;
+    const char *path;
+    socklen_t addrlen;
+    size_t len;
+    int fd, rc;
+
+    path = getenv(ENV_NOTIFY_SOCKET);
+
+    if (NULL == path) {
+        return 0;
+    }
+
+    len = strlen(path);
+
+    if (len < 2 || len >= sizeof(addr.sun_path) ||
+            (path[0] != '/' && path[0] != '@')) {
+        ALOGE("%s:%d: Bad notify socket (%s)", _FILE, __LINE__, path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+
+    // A leading '@' denotes an abstract socket.
+    if ('@' == addr.sun_path[0]) {
+        addr.sun_path[0] = '\0';
+    }
+
+    addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1) {
+        ALOGE("%s:%d: Failed to open notify socket (errno=%d)", _FILE,
+              __LINE__, errno);
+        return -1;
+    }
+
+    rc = sendto(fd, state, strlen(state), MSG_NOSIGNAL,
+                (struct sockaddr *)&addr, addrlen);
+    close(fd);
+
+    if (-1 == rc) {
+        ALOGE("%s:%d: Failed to notify supervisor (errno=%d)", _FILE,
+              __LINE__, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Check if a file descriptor is a listening stream socket.
+ *
+ * @param [in] fd File descriptor.
+ *
+ * @return Returns 1 if it is, else 0.
+ */
+static int is_listening(int fd)
+{
+    int type, accepting;
+    socklen_t len;
+
+    len = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == -1 ||
+            type != SOCK_STREAM) {
+        return 0;
+    }
+
+    len = sizeof(accepting);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) == -1 ||
+            !accepting) {
+        return 0;
+    }
+
+    return 1;
+}
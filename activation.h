@@ -0,0 +1,9 @@
+
+#ifndef ACTIVATION_H
+#define ACTIVATION_H
+
+void activation_init(void);
+int activation_listen_fd(void);
+int activation_notify(const char *state);
+
+#endif
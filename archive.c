@@ -0,0 +1,719 @@
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include "archive.h"
+#include "mldproc.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "archive.c"
+
+// Option compressing the archive.
+#define OPT_GZIP "--gzip"
+
+// Extension of the archived files.
+#define LOG_EXT ".log"
+
+// Tar block size, headers and file data are padded to whole blocks.
+#define TAR_BLOCK 512
+
+// Zero blocks ending a tar archive.
+#define TAR_END_BLOCKS 2
+
+// Largest file size written as octal digits, larger sizes are written
+// base-256 as by GNU tar.
+#define TAR_MAX_OCTAL 077777777777ULL
+
+// Mode of the archived files.
+#define FILE_MODE 0644
+
+// Archive data compressed at a time.
+#define GZIP_BUF_LEN (16 * 1024)
+
+// Compression level, fast enough to keep up with the link.
+#define GZIP_LEVEL Z_BEST_SPEED
+
+// Window bits selecting the gzip format and memory level of deflate.
+#define GZIP_WINDOW_BITS (15 + 16)
+#define GZIP_MEM_LEVEL 8
+
+// Response to a completed download.
+#define ARCHIVE_RESP "files=%u bytes=%" PRIu64
+
+// POSIX ustar header.
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+struct archive {
+    char name[MAX_NAME_LEN];         // Session name, directory in the archive.
+    int dir_fd;                      // Log directory.
+    struct dirent **files;           // Log files, in name order.
+    int num_files;
+    int next;                        // Next file to add.
+    int fd;                          // File being added, -1 if none.
+    loff_t off;                      // Offset of the file data left.
+    uint64_t body;                   // File data left to add.
+    char block[TAR_BLOCK];           // Header being added.
+    uint32_t block_pos;              // Header data added.
+    uint32_t zeros;                  // Padding or end blocks left to add.
+    int ended;                       // Set once the end blocks are added.
+    int zero_copy;                   // Set to splice file data.
+    int pipe_fds[2];                 // File data spliced to the client.
+    uint32_t piped;                  // File data in the pipe.
+    z_stream *zs;                    // Compression, gzip only.
+    char *in;                        // Tar data being compressed.
+    int finished;                    // Set once the gzip data is complete.
+    uint32_t count;                  // Files added.
+    uint64_t total;                  // Archive data handed out.
+};
+
+// Forward declarations.
+static int do_splice(const struct archive_step *step);
+static int parse_open(char *line, char **name, int *gzip);
+static int is_log(const struct dirent *entry);
+static int start_gzip(struct archive *ar);
+static int tar_read(struct archive *ar, char *buf, uint32_t len, int copy);
+static int next_file(struct archive *ar);
+static void make_header(struct archive *ar, const char *file,
+                        const struct stat *st);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Check if a command downloads an archive.
+ *
+ * @param [in] cmd Command string.
+ *
+ * @return Returns 1 if the command downloads an archive, else 0.
+ */
+int archive_is_open(const char *cmd)
+{
+    size_t n = strlen(ARCHIVE_CMD);
+
+    return strncmp(cmd, ARCHIVE_CMD, n) == 0 &&
+           (' ' == cmd[n] || '\t' == cmd[n] || '\0' == cmd[n]);
+}
+
+/**
+ * @brief Open a tar archive of the log files of a session,
+ *        "archive <name> [--gzip]". The archive holds the *.log files in
+ *        the log directory of the session, as of when each file is added,
+ *        and is generated as it is read.
+ *
+ * @param [in] cmd       Command string.
+ * @param [in] zero_copy Set to splice file data of an uncompressed archive
+ *                       with archive_splice() or archive_splice_step(),
+ *                       else all data is copied by archive_next().
+ *
+ * @return Returns the archive, or NULL at failure.
+ */
+struct archive * archive_open(const char *cmd, int zero_copy)
+{
+    char line[CMD_LINE_LENGTH];
+    char path[CMD_LINE_LENGTH];
+    struct archive *ar;
+    char *name, *p;
+    int gzip;
+
+    snprintf(line, sizeof(line), "%s", cmd + strlen(ARCHIVE_CMD));
+
+    if (parse_open(line, &name, &gzip) == -1) {
+        return NULL;
+    }
+
+    if (mldproc_logpath(name, path, sizeof(path)) == -1) {
+        ALOGE("%s:%d: No log files to archive (name: %s)", _FILE, __LINE__,
+              name);
+        return NULL;
+    }
+
+    // The log directory of the session.
+    p = strrchr(path, '/');
+
+    if (NULL == p) {
+        ALOGE("%s:%d: Bad log path: %s", _FILE, __LINE__, path);
+        return NULL;
+    }
+
+    p[(p == path) ? 1 : 0] = '\0';
+
+    ar = calloc(1, sizeof(*ar));
+
+    if (NULL == ar) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        return NULL;
+    }
+
+    snprintf(ar->name, sizeof(ar->name), "%s", name);
+    ar->block_pos = TAR_BLOCK;
+    ar->fd = -1;
+    ar->pipe_fds[0] = -1;
+    ar->pipe_fds[1] = -1;
+
+    ar->dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (-1 == ar->dir_fd) {
+        ALOGE("%s:%d: Failed to open %s (errno=%d)", _FILE, __LINE__, path,
+              errno);
+        archive_close(ar);
+        return NULL;
+    }
+
+    ar->num_files = scandirat(ar->dir_fd, ".", &ar->files, is_log,
+                              alphasort);
+
+    if (-1 == ar->num_files) {
+        ALOGE("%s:%d: Failed to list %s (errno=%d)", _FILE, __LINE__, path,
+              errno);
+        ar->num_files = 0;
+        archive_close(ar);
+        return NULL;
+    }
+
+    if (gzip && start_gzip(ar) == -1) {
+        archive_close(ar);
+        return NULL;
+    }
+
+    // Compressed data can't be spliced, neither without a pipe.
+    if (zero_copy && !gzip) {
+        ar->zero_copy = (pipe2(ar->pipe_fds, O_NONBLOCK | O_CLOEXEC) == 0);
+    }
+
+    return ar;
+}
+
+/**
+ * @brief Get the next data of an archive. File data to splice is left to
+ *        archive_splice() and only reported.
+ *
+ * @param [in out] ar   Archive.
+ * @param [out]    buf  Archive data.
+ * @param [in]     len  Size of the buffer.
+ * @param [out]    body File data to splice before further data, 0 if none.
+ *
+ * @return Returns the length of the data, 0 at the end of the archive or
+ *         while file data is to be spliced, or -1 at failure.
+ */
+int archive_next(struct archive *ar, char *buf, uint32_t len,
+                 uint64_t *body)
+{
+    int n, rc;
+
+    *body = 0;
+
+    if (NULL == ar->zs) {
+        n = tar_read(ar, buf, len, !ar->zero_copy);
+
+        if (0 == n) {
+            *body = ar->body + ar->piped;
+        } else if (n > 0) {
+            ar->total += n;
+        }
+
+        return n;
+    }
+
+    ar->zs->next_out = (Bytef *)buf;
+    ar->zs->avail_out = len;
+
+    while (ar->zs->avail_out > 0 && !ar->finished) {
+        if (0 == ar->zs->avail_in) {
+            if ((n = tar_read(ar, ar->in, GZIP_BUF_LEN, 1)) == -1) {
+                return -1;
+            }
+            ar->zs->next_in = (Bytef *)ar->in;
+            ar->zs->avail_in = n;
+        }
+
+        // The tar data ends when no more is read.
+        rc = deflate(ar->zs, (0 == ar->zs->avail_in) ? Z_FINISH :
+                                                       Z_NO_FLUSH);
+
+        if (Z_STREAM_END == rc) {
+            ar->finished = 1;
+        } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            ALOGE("%s:%d: Failed to compress (rc=%d)", _FILE, __LINE__, rc);
+            return -1;
+        }
+    }
+
+    n = len - ar->zs->avail_out;
+    ar->total += n;
+
+    return n;
+}
+
+/**
+ * @brief Splice file data of an archive to a socket, through a pipe so the
+ *        data isn't copied. Never blocks on the socket.
+ *
+ * @param [in out] ar  Archive.
+ * @param [in]     fd  Socket file descriptor.
+ * @param [in]     len Max data to splice, at most the data reported by
+ *                     archive_next().
+ *
+ * @return Returns the length of the spliced data, or -1 at failure, with
+ *         errno EAGAIN if the socket takes no data.
+ */
+int archive_splice(struct archive *ar, int fd, uint32_t len)
+{
+    struct archive_step step;
+
+    if (0 == ar->piped) {
+        archive_splice_step(ar, fd, len, &step);
+
+        if (archive_splice_done(ar, do_splice(&step)) == -1) {
+            return -1;
+        }
+    }
+
+    archive_splice_step(ar, fd, len, &step);
+
+    return archive_splice_done(ar, do_splice(&step));
+}
+
+/**
+ * @brief Describe the next splice of file data to a socket, for a caller
+ *        doing the splice itself, e.g. asynchronously. The data is moved
+ *        from the file to an empty pipe, then from the pipe to the socket.
+ *        The result is passed to archive_splice_done() before the next
+ *        splice.
+ *
+ * @param [in]  ar   Archive.
+ * @param [in]  fd   Socket file descriptor.
+ * @param [in]  len  Max data to splice, at most the data reported by
+ *                   archive_next().
+ * @param [out] step Splice to carry out.
+ */
+void archive_splice_step(const struct archive *ar, int fd, uint32_t len,
+                         struct archive_step *step)
+{
+    if (0 == ar->piped) {
+        step->fd_in = ar->fd;
+        step->off_in = ar->off;
+        step->fd_out = ar->pipe_fds[1];
+        step->len = (len < ar->body) ? len : ar->body;
+        step->flags = SPLICE_F_MOVE;
+    } else {
+        step->fd_in = ar->pipe_fds[0];
+        step->off_in = -1;
+        step->fd_out = fd;
+        step->len = (len < ar->piped) ? len : ar->piped;
+        step->flags = SPLICE_F_MOVE | ((ar->body > 0) ? SPLICE_F_MORE : 0);
+    }
+}
+
+/**
+ * @brief Account for a splice described by archive_splice_step().
+ *
+ * @param [in out] ar  Archive.
+ * @param [in]     res Length of the spliced data, or negative error code.
+ *
+ * @return Returns the length of the data spliced to the socket, 0 once the
+ *         pipe is filled, or -1 at failure, with errno EAGAIN if the splice
+ *         is to be tried again.
+ */
+int archive_splice_done(struct archive *ar, int res)
+{
+    static const char zeros[TAR_BLOCK];
+    ssize_t n;
+
+    if (-EINTR == res || -EAGAIN == res) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (ar->piped > 0) {
+        if (res < 0) {
+            errno = -res;
+            return -1;
+        }
+
+        ar->piped -= res;
+        ar->total += res;
+
+        return res;
+    }
+
+    // A file truncated since its header was added is padded with zeros.
+    if (0 == res) {
+        n = write(ar->pipe_fds[1], zeros,
+                  (ar->body < sizeof(zeros)) ? ar->body : sizeof(zeros));
+        res = (-1 == n) ? -errno : n;
+    }
+
+    if (res < 0) {
+        ALOGE("%s:%d: Failed to splice (errno=%d)", _FILE, __LINE__, -res);
+        errno = -res;
+        return -1;
+    }
+
+    ar->off += res;
+    ar->body -= res;
+    ar->piped = res;
+
+    return 0;
+}
+
+/**
+ * @brief Describe a completed archive, the number of files and the archive
+ *        size.
+ *
+ * @param [in]  ar   Archive.
+ * @param [out] resp Response buffer.
+ * @param [in]  len  Length of response buffer.
+ */
+void archive_result(const struct archive *ar, char *resp, uint32_t len)
+{
+    snprintf(resp, len, ARCHIVE_RESP, ar->count, ar->total);
+}
+
+/**
+ * @brief Close an archive, complete or not.
+ *
+ * @param [in] ar Archive.
+ */
+void archive_close(struct archive *ar)
+{
+    int i;
+
+    if (NULL == ar) {
+        return;
+    }
+
+    for (i = 0; i < ar->num_files; i++) {
+        free(ar->files[i]);
+    }
+    free(ar->files);
+
+    if (ar->fd != -1) {
+        close(ar->fd);
+    }
+    if (ar->dir_fd != -1) {
+        close(ar->dir_fd);
+    }
+    for (i = 0; i < 2; i++) {
+        if (ar->pipe_fds[i] != -1) {
+            close(ar->pipe_fds[i]);
+        }
+    }
+
+    if (ar->zs) {
+        (void)deflateEnd(ar->zs);
+        free(ar->zs);
+    }
+
+    free(ar->in);
+    free(ar);
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Carry out a splice without blocking.
+ *
+ * @param [in] step Splice.
+ *
+ * @return Returns the length of the spliced data, or negative error code.
+ */
+static int do_splice(const struct archive_step *step)
+{
+    loff_t off = step->off_in;
+    ssize_t n;
+
+    n = splice(step->fd_in, (step->off_in >= 0) ? &off : NULL, step->fd_out,
+               NULL, step->len, step->flags | SPLICE_F_NONBLOCK);
+
+    return (-1 == n) ? -errno : (int)n;
+}
+
+/**
+ * @brief Parse the options of an archive command.
+ *
+ * @param [in out] line Options, split in place.
+ * @param [out]    name Session name.
+ * @param [out]    gzip Set if the archive is compressed.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int parse_open(char *line, char **name, int *gzip)
+{
+    char *token, *save;
+
+    *name = NULL;
+    *gzip = 0;
+
+    for (token = strtok_r(line, " \t", &save); token;
+            token = strtok_r(NULL, " \t", &save)) {
+        if (strcmp(token, OPT_GZIP) == 0) {
+            *gzip = 1;
+        } else if ('-' == token[0] || *name) {
+            ALOGE("%s:%d: Bad archive option: %s", _FILE, __LINE__, token);
+            return -1;
+        } else {
+            *name = token;
+        }
+    }
+
+    // The session name is the directory of the files in the archive.
+    if (NULL == *name ||
+            strlen(*name) >= sizeof(((struct tar_header *)0)->prefix)) {
+        ALOGE("%s:%d: Bad archive command", _FILE, __LINE__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Select the log files of a directory.
+ *
+ * @param [in] entry Directory entry.
+ *
+ * @return Returns 1 for a log file, else 0.
+ */
+static int is_log(const struct dirent *entry)
+{
+    size_t n = strlen(entry->d_name);
+
+    return (DT_REG == entry->d_type || DT_UNKNOWN == entry->d_type) &&
+           n > strlen(LOG_EXT) &&
+           strcmp(entry->d_name + n - strlen(LOG_EXT), LOG_EXT) == 0;
+}
+
+/**
+ * @brief Set up gzip compression of an archive.
+ *
+ * @param [in out] ar Archive.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int start_gzip(struct archive *ar)
+{
+    ar->zs = calloc(1, sizeof(*ar->zs));
+    ar->in = malloc(GZIP_BUF_LEN);
+
+    if (NULL == ar->zs || NULL == ar->in) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        free(ar->zs);
+        ar->zs = NULL;
+        return -1;
+    }
+
+    if (deflateInit2(ar->zs, GZIP_LEVEL, Z_DEFLATED, GZIP_WINDOW_BITS,
+                     GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        ALOGE("%s:%d: Failed to init compression", _FILE, __LINE__);
+        free(ar->zs);
+        ar->zs = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Get the next tar data, adding the files one after another.
+ *
+ * @param [in out] ar   Archive.
+ * @param [out]    buf  Tar data.
+ * @param [in]     len  Size of the buffer.
+ * @param [in]     copy Set to copy file data, else the data stops before it.
+ *
+ * @return Returns the length of the data, 0 at the end of the archive or
+ *         before file data not copied, or -1 at failure.
+ */
+static int tar_read(struct archive *ar, char *buf, uint32_t len, int copy)
+{
+    uint32_t n = 0, k;
+    ssize_t r;
+    int rc;
+
+    while (n < len) {
+        if (ar->block_pos < TAR_BLOCK) {
+            k = TAR_BLOCK - ar->block_pos;
+            k = (len - n < k) ? len - n : k;
+            memcpy(buf + n, ar->block + ar->block_pos, k);
+            ar->block_pos += k;
+            n += k;
+        } else if (ar->body > 0) {
+            if (!copy) {
+                break;
+            }
+
+            k = (len - n < ar->body) ? len - n : ar->body;
+            r = pread(ar->fd, buf + n, k, ar->off);
+
+            if (-1 == r) {
+                if (EINTR == errno) {
+                    continue;
+                }
+                ALOGE("%s:%d: Failed to read log (errno=%d)", _FILE,
+                      __LINE__, errno);
+                return -1;
+            }
+
+            // A file truncated since its header was added is padded with
+            // zeros.
+            if (0 == r) {
+                memset(buf + n, 0, k);
+                r = k;
+            }
+
+            ar->off += r;
+            ar->body -= r;
+            n += r;
+        } else if (ar->zeros > 0) {
+            k = (len - n < ar->zeros) ? len - n : ar->zeros;
+            memset(buf + n, 0, k);
+            ar->zeros -= k;
+            n += k;
+        } else if ((rc = next_file(ar)) <= 0) {
+            return (-1 == rc) ? -1 : (int)n;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * @brief Add the header of the next file, or the end blocks after the last
+ *        file. Files removed since the archive was opened are skipped.
+ *
+ * @param [in out] ar Archive.
+ *
+ * @return Returns 1 if data was added, 0 at the end of the archive, or -1
+ *         at failure.
+ */
+static int next_file(struct archive *ar)
+{
+    const char *file;
+    struct stat st;
+
+    if (ar->fd != -1) {
+        close(ar->fd);
+        ar->fd = -1;
+    }
+
+    while (ar->next < ar->num_files) {
+        file = ar->files[ar->next++]->d_name;
+
+        if (strlen(file) >= sizeof(((struct tar_header *)0)->name)) {
+            ALOGE("%s:%d: Name too long to archive: %s", _FILE, __LINE__,
+                  file);
+            continue;
+        }
+
+        ar->fd = openat(ar->dir_fd, file, O_RDONLY | O_CLOEXEC);
+
+        if (-1 == ar->fd || fstat(ar->fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            if (ar->fd != -1) {
+                close(ar->fd);
+                ar->fd = -1;
+            }
+            continue;
+        }
+
+        // The file is archived as large as it is now.
+        make_header(ar, file, &st);
+        ar->off = 0;
+        ar->body = st.st_size;
+        ar->zeros = (TAR_BLOCK - st.st_size % TAR_BLOCK) % TAR_BLOCK;
+        ar->count++;
+
+        return 1;
+    }
+
+    if (ar->ended) {
+        return 0;
+    }
+
+    ar->zeros = TAR_END_BLOCKS * TAR_BLOCK;
+    ar->ended = 1;
+
+    return 1;
+}
+
+/**
+ * @brief Make the ustar header of a file, to be added next.
+ *
+ * @param [in out] ar   Archive.
+ * @param [in]     file File name.
+ * @param [in]     st   File status.
+ */
+static void make_header(struct archive *ar, const char *file,
+                        const struct stat *st)
+{
+    struct tar_header *h = (struct tar_header *)ar->block;
+    uint64_t size = st->st_size;
+    uint32_t sum = 0, i;
+
+    memset(ar->block, 0, sizeof(ar->block));
+
+    memcpy(h->name, file, strlen(file));
+    memcpy(h->prefix, ar->name, strlen(ar->name));
+    snprintf(h->mode, sizeof(h->mode), "%07o", FILE_MODE);
+    snprintf(h->uid, sizeof(h->uid), "%07o", 0);
+    snprintf(h->gid, sizeof(h->gid), "%07o", 0);
+    snprintf(h->mtime, sizeof(h->mtime), "%011llo",
+             (unsigned long long)st->st_mtime);
+
+    if (size <= TAR_MAX_OCTAL) {
+        snprintf(h->size, sizeof(h->size), "%011" PRIo64, size);
+    } else {
+        h->size[0] = (char)0x80;
+        for (i = sizeof(h->size) - 1; i > 0; i--, size >>= 8) {
+            h->size[i] = (char)(size & 0xff);
+        }
+    }
+
+    h->typeflag = '0';
+    memcpy(h->magic, "ustar", sizeof(h->magic));
+    memcpy(h->version, "00", sizeof(h->version));
+
+    // The checksum is taken with the checksum field as spaces.
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    for (i = 0; i < sizeof(ar->block); i++) {
+        sum += (uint8_t)ar->block[i];
+    }
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+    h->chksum[sizeof(h->chksum) - 1] = ' ';
+
+    ar->block_pos = 0;
+}
@@ -0,0 +1,33 @@
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+
+// Command downloading the log files of a session as an archive.
+#define ARCHIVE_CMD "archive"
+
+struct archive;
+
+// One splice of file data, carried out by the caller, from fd_in at offset
+// off_in, -1 for a pipe, to fd_out.
+struct archive_step {
+    int fd_in;
+    int64_t off_in;
+    int fd_out;
+    uint32_t len;
+    uint32_t flags;
+};
+
+int archive_is_open(const char *cmd);
+struct archive * archive_open(const char *cmd, int zero_copy);
+int archive_next(struct archive *ar, char *buf, uint32_t len,
+                 uint64_t *body);
+int archive_splice(struct archive *ar, int fd, uint32_t len);
+void archive_splice_step(const struct archive *ar, int fd, uint32_t len,
+                         struct archive_step *step);
+int archive_splice_done(struct archive *ar, int res);
+void archive_result(const struct archive *ar, char *resp, uint32_t len);
+void archive_close(struct archive *ar);
+
+#endif
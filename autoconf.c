@@ -10,6 +10,8 @@
 
 #include "autoconf.h"
 #include "mldproc.h"
+#include "spawnopt.h"
+#include "template.h"
 #include "utils.h"
 
 // For logging.
@@ -24,15 +26,24 @@
 // Number of autostart command-line args.
 #define AUTOSTART_ARGS 2
 
+// Number of args on a spawn option line (key and value).
+#define SPAWNOPT_ARGS 2
+
 // Autostart command.
 #define AUTOSTART_CMD "AUTOSTART"
 #define AUTOSTART_YES "1"
 
+// Session started from a template, "TEMPLATE <name> [<key>=<value> ...]".
+#define TEMPLATE_CMD "TEMPLATE"
+
 // Path to look for configuration files.
 static char confpath[MAX_PATH_LEN] = AUTOCONF_PATH;
 
 // Forward declarations.
 static void parse_conf(const char *file);
+static int parse_spawnopt(const char *line, struct spawnopt *opt);
+static int parse_template(const char *line, const char *session,
+                          const struct spawnopt *opt);
 
 
 /*============================================================================
@@ -41,19 +52,25 @@ static void parse_conf(const char *file);
  */
 
 /**
- * @brief Check all MLD configuration files for the autostart flag.
+ * @brief Set the location of MLD configuration files.
  *
  * @param [in] path Location of configuration files.
  */
 void autoconf_init(const char *path)
 {
-    struct dirent *file;
-    DIR *dir;
-
     if (NULL != path) {
         strncpy(confpath, path, MAX_PATH_LEN);
         confpath[MAX_PATH_LEN - 1] = '\0';
-    } 
+    }
+}
+
+/**
+ * @brief Check all MLD configuration files for the autostart flag.
+ */
+void autoconf_autostart(void)
+{
+    struct dirent *file;
+    DIR *dir;
 
     dir = opendir(confpath);
 
@@ -100,8 +117,11 @@ static void parse_conf(const char *filename)
     char *argv[AUTOSTART_ARGS];
     uint32_t argc;
     uint32_t start = 0;
+    struct spawnopt opt;
 
-    snprintf(conf, CMD_LINE_LENGTH, "%s/%s", AUTOCONF_PATH, filename);
+    spawnopt_init(&opt);
+
+    snprintf(conf, CMD_LINE_LENGTH, "%s/%s", confpath, filename);
 
     // Check if the suffix is correct.
     suffix = strrchr(conf, '.');
@@ -128,6 +148,11 @@ static void parse_conf(const char *filename)
     }
 
     while (fgets(buf, CMD_LINE_LENGTH, file)) {
+        // Spawn options apply to all following MLD command-lines.
+        if (parse_spawnopt(buf, &opt) == 0) {
+            continue;
+        }
+
         if (0 == start) {
             // Look for autostart command.
             if (split_cmd_line(buf, argv, AUTOSTART_ARGS, &argc) != -1) {
@@ -138,17 +163,87 @@ static void parse_conf(const char *filename)
                 }
             }
         } else {
-            // Look for MLD command-line.
-            if (!space_only(buf)) {
+            // Look for a template, else a MLD command-line.
+            if (parse_template(buf, session, &opt) == -1 &&
+                    !space_only(buf)) {
                 // Remove trailing newline or EOF.
                 size_t len = strlen(buf);
                 buf[len - 1] = '\0';
 
                 // Start a new MLD log session.
-                (void)mldproc_start(session, buf);
+                (void)mldproc_start(session, buf, &opt, NULL);
             }
         }
     }
 
     fclose(file);
 }
+
+/**
+ * @brief Parse a spawn option line on the form <KEY> <value>, e.g.
+ *        "AFFINITY 2-3" or "IONICE idle".
+ *
+ * @param [in]     line Line to parse.
+ * @param [in out] opt  Spawn options to update.
+ *
+ * @return Returns 0 if the line is a spawn option, or -1 if it is not.
+ */
+static int parse_spawnopt(const char *line, struct spawnopt *opt)
+{
+    char tmp[CMD_LINE_LENGTH];
+    char *argv[SPAWNOPT_ARGS + 1];
+    uint32_t argc;
+
+    // Splitting modifies the line, use a copy.
+    strncpy(tmp, line, CMD_LINE_LENGTH);
+    tmp[CMD_LINE_LENGTH - 1] = '\0';
+    tmp[strcspn(tmp, "\r\n")] = '\0';
+
+    if (split_cmd_line(tmp, argv, SPAWNOPT_ARGS + 1, &argc) == -1 ||
+            argc != SPAWNOPT_ARGS || !spawnopt_iskey(argv[0])) {
+        return -1;
+    }
+
+    if (spawnopt_set(opt, argv[0], argv[1]) == -1) {
+        ALOGE("%s:%d: Ignoring bad spawn option (%s)", _FILE, __LINE__,
+              argv[0]);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Parse a template line on the form TEMPLATE <name> [<key>=<value>
+ *        ...], and start the session from the template.
+ *
+ * @param [in] line    Line to parse.
+ * @param [in] session Session name.
+ * @param [in] opt     Spawn options for the MLD process.
+ *
+ * @return Returns 0 if the line is a template line, or -1 if it is not.
+ */
+static int parse_template(const char *line, const char *session,
+                          const struct spawnopt *opt)
+{
+    char tmp[CMD_LINE_LENGTH];
+    char *argv[MLDARGS_MAX];
+    struct mldargs args;
+    uint32_t argc;
+
+    // Splitting modifies the line, use a copy.
+    snprintf(tmp, sizeof(tmp), "%s", line);
+    tmp[strcspn(tmp, "\r\n")] = '\0';
+
+    if (split_cmd_line(tmp, argv, MLDARGS_MAX, &argc) == -1 ||
+            strcmp(argv[0], TEMPLATE_CMD) != 0) {
+        return -1;
+    }
+
+    if (argc < 2 || template_fill(argv[1], argv + 2, argc - 2, &args) == -1 ||
+            mldproc_start_args(session, &args, opt, NULL) == -1) {
+        ALOGE("%s:%d: Failed to start session from template (%s)", _FILE,
+              __LINE__, session);
+    }
+
+    return 0;
+}
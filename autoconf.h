@@ -3,6 +3,7 @@
 #define AUTOCONF_H
 
 void autoconf_init(const char *path);
+void autoconf_autostart(void);
 char * autoconf_getpath(void);
 
 #endif
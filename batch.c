@@ -0,0 +1,442 @@
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "executor.h"
+#include "pool.h"
+#include "tracecmd.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "batch.c"
+
+// Max number of commands in a batch.
+#define MAX_ITEMS 64
+
+// Default number of commands of a batch executing at the same time.
+#define DEFAULT_JOBS 4
+
+// Response buffer size of each command.
+#define ITEM_RESP_LENGTH 512
+
+// Batches added to the pool at a time, each is large.
+#define BATCHES_PER_SLAB 1
+
+// Item states.
+enum item_state {
+    ITEM_QUEUED,
+    ITEM_DONE,
+    ITEM_SKIPPED,
+    ITEM_ROLLED_BACK
+};
+
+struct batch_item {
+    struct batch *batch;
+    char cmd[CMD_LINE_LENGTH];
+    char undo[CMD_LINE_LENGTH];      // Command reverting this one, if any.
+    char resp[ITEM_RESP_LENGTH];
+    int rc;
+    enum item_state state;
+};
+
+struct batch {
+    pthread_mutex_t mutex;           // Protects the dispatch state.
+    int atomic;                      // Set to revert all if one fails.
+    uint32_t jobs;                   // Max number of executing commands.
+    int bad;                         // Set if a command couldn't be added.
+    uint32_t num_items;
+    struct batch_item items[MAX_ITEMS];
+    int rollback;                    // Set while reverting.
+    int failed;                      // Set if a command failed.
+    uint32_t next;                   // Next item to dispatch.
+    uint32_t running;                // Items dispatched, not completed.
+    batch_exec_fn exec;
+    batch_done_fn done;
+    void *arg;
+};
+
+// Pool of batches.
+static struct pool batch_pool = POOL_INITIALIZER("batches", struct batch,
+                                                 BATCHES_PER_SLAB);
+
+// Forward declarations.
+static int dispatch(struct batch *batch);
+static void run_item(void *arg);
+static void finish(struct batch *batch);
+static const char * item_status(const struct batch_item *item);
+static int append(char *buf, uint32_t len, uint32_t *pos, const char *fmt,
+                  uint32_t index, const char *text);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Check if a command opens a batch.
+ *
+ * @param [in] cmd Command string.
+ *
+ * @return Returns 1 if the command opens a batch, else 0.
+ */
+int batch_is_open(const char *cmd)
+{
+    size_t n = strlen(BATCH_CMD);
+
+    return strncmp(cmd, BATCH_CMD, n) == 0 &&
+           (' ' == cmd[n] || '\t' == cmd[n] || '\0' == cmd[n]);
+}
+
+/**
+ * @brief Create a batch from the command opening it,
+ *        "batch [-a | --atomic] [-j <num> | --jobs=<num>]".
+ *
+ * @param [in] cmd Command string.
+ *
+ * @return Returns the batch, or NULL at failure.
+ */
+struct batch * batch_create(const char *cmd)
+{
+    char line[CMD_LINE_LENGTH];
+    char *token, *save;
+    struct batch *batch;
+    int atomic = 0, next = 0;
+    long jobs = DEFAULT_JOBS;
+
+    snprintf(line, sizeof(line), "%s", cmd + strlen(BATCH_CMD));
+
+    for (token = strtok_r(line, " \t", &save); token;
+            token = strtok_r(NULL, " \t", &save)) {
+        if (next) {
+            jobs = strtol(token, NULL, 10);
+            next = 0;
+        } else if (strcmp(token, "-a") == 0 ||
+                   strcmp(token, "--atomic") == 0) {
+            atomic = 1;
+        } else if (strcmp(token, "-j") == 0) {
+            next = 1;
+        } else if (strncmp(token, "-j", 2) == 0) {
+            jobs = strtol(token + 2, NULL, 10);
+        } else if (strncmp(token, "--jobs=", strlen("--jobs=")) == 0) {
+            jobs = strtol(token + strlen("--jobs="), NULL, 10);
+        } else {
+            ALOGE("%s:%d: Bad batch option: %s", _FILE, __LINE__, token);
+            return NULL;
+        }
+    }
+
+    if (next || jobs < 1) {
+        ALOGE("%s:%d: Bad number of batch jobs", _FILE, __LINE__);
+        return NULL;
+    }
+
+    batch = pool_alloc(&batch_pool);
+
+    if (NULL == batch) {
+        return NULL;
+    }
+
+    memset(batch, 0, sizeof(*batch));
+    pthread_mutex_init(&batch->mutex, NULL);
+    batch->atomic = atomic;
+    batch->jobs = (jobs > MAX_ITEMS) ? MAX_ITEMS : jobs;
+
+    return batch;
+}
+
+/**
+ * @brief Add a command to a batch.
+ *
+ * @param [in out] batch Batch.
+ * @param [in]     cmd   Command string.
+ *
+ * @return Returns 0 at success, or -1 at failure. The batch then fails when
+ *         run.
+ */
+int batch_add(struct batch *batch, const char *cmd)
+{
+    struct batch_item *item;
+
+    if (batch->num_items == MAX_ITEMS) {
+        ALOGE("%s:%d: Too many commands in batch", _FILE, __LINE__);
+        batch->bad = 1;
+        return -1;
+    }
+
+    item = &batch->items[batch->num_items++];
+    item->batch = batch;
+    item->rc = -1;
+    item->state = ITEM_QUEUED;
+    snprintf(item->cmd, sizeof(item->cmd), "%s", cmd);
+
+    // Only started sessions can be reverted.
+    if (tracecmd_undo(cmd, item->undo, sizeof(item->undo)) == -1) {
+        item->undo[0] = '\0';
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Execute the commands of a batch by the executor, at most the
+ *        configured number at the same time. Commands for the same log
+ *        session execute in the order added. For an atomic batch no further
+ *        commands are executed once one fails, and the sessions already
+ *        started are stopped.
+ *
+ *        The response has the lines of each command's response followed by
+ *        its status, OK, KO, SKIPPED or ROLLED_BACK, all prefixed with the
+ *        command's number. The status is 0 if all commands succeeded.
+ *
+ * @param [in] batch Batch, freed after it's done.
+ * @param [in] exec  Function executing a command.
+ * @param [in] done  Function called with the status and response when all
+ *                   commands are done, from the thread of the last one.
+ * @param [in] arg   Argument passed to done.
+ *
+ * @return Returns 0 at success, or -1 at failure. The batch isn't freed then.
+ */
+int batch_run(struct batch *batch, batch_exec_fn exec, batch_done_fn done,
+              void *arg)
+{
+    int running;
+
+    if (batch->bad) {
+        return -1;
+    }
+
+    batch->exec = exec;
+    batch->done = done;
+    batch->arg = arg;
+
+    pthread_mutex_lock(&batch->mutex);
+    running = dispatch(batch);
+    pthread_mutex_unlock(&batch->mutex);
+
+    if (!running) {
+        finish(batch);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Free a batch that isn't run.
+ *
+ * @param [in] batch Batch.
+ */
+void batch_free(struct batch *batch)
+{
+    if (batch) {
+        pthread_mutex_destroy(&batch->mutex);
+        pool_free(&batch_pool, batch);
+    }
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Hand items to the executor up to the job limit. Once all items are
+ *        done, a failed atomic batch continues with reverting them. Called
+ *        with the batch mutex locked.
+ *
+ * @param [in] batch Batch.
+ *
+ * @return Returns 1 while items execute, or 0 when the batch is done.
+ */
+static int dispatch(struct batch *batch)
+{
+    char key[CMD_LINE_LENGTH];
+    struct batch_item *item;
+    const char *cmd;
+
+    while (batch->running < batch->jobs && batch->next < batch->num_items) {
+        item = &batch->items[batch->next++];
+
+        if (batch->rollback) {
+            if (item->state != ITEM_DONE || item->rc != 0 ||
+                    '\0' == item->undo[0]) {
+                continue;
+            }
+            cmd = item->undo;
+        } else if (batch->atomic && batch->failed) {
+            item->state = ITEM_SKIPPED;
+            continue;
+        } else {
+            cmd = item->cmd;
+        }
+
+        batch->running++;
+
+        if (executor_submit((tracecmd_key(cmd, key, sizeof(key)) == 0) ?
+                            key : NULL, run_item, item) == -1) {
+            batch->running--;
+            if (!batch->rollback) {
+                item->state = ITEM_DONE;
+                batch->failed = 1;
+            }
+        }
+    }
+
+    if (batch->running > 0) {
+        return 1;
+    }
+
+    // Revert a failed atomic batch.
+    if (batch->atomic && batch->failed && !batch->rollback) {
+        batch->rollback = 1;
+        batch->next = 0;
+        return dispatch(batch);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Execute one item of a batch, called from an executor thread.
+ *
+ * @param [in] arg Batch item.
+ */
+static void run_item(void *arg)
+{
+    struct batch_item *item = arg;
+    struct batch *batch = item->batch;
+    char resp[ITEM_RESP_LENGTH];
+    int rc, running;
+
+    if (batch->rollback) {
+        resp[0] = '\0';
+        rc = batch->exec(item->undo, resp, sizeof(resp) - 1);
+    } else {
+        item->resp[0] = '\0';
+        rc = batch->exec(item->cmd, item->resp, sizeof(item->resp) - 1);
+    }
+
+    pthread_mutex_lock(&batch->mutex);
+    if (batch->rollback) {
+        if (0 == rc) {
+            item->state = ITEM_ROLLED_BACK;
+        }
+    } else {
+        item->rc = rc;
+        item->state = ITEM_DONE;
+        if (rc != 0) {
+            batch->failed = 1;
+        }
+    }
+
+    batch->running--;
+    running = dispatch(batch);
+    pthread_mutex_unlock(&batch->mutex);
+
+    if (!running) {
+        finish(batch);
+    }
+}
+
+/**
+ * @brief Build the response of a batch, hand it over and free the batch.
+ *
+ * @param [in] batch Batch.
+ */
+static void finish(struct batch *batch)
+{
+    struct batch_item *item;
+    char *resp, *line, *save;
+    uint32_t i, pos = 0;
+    int rc = batch->failed ? -1 : 0;
+
+    resp = malloc(RESP_LENGTH + 1);
+
+    if (NULL == resp) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        batch->done(batch->arg, -1, NULL);
+        batch_free(batch);
+        return;
+    }
+
+    resp[0] = '\0';
+
+    for (i = 0; i < batch->num_items; i++) {
+        item = &batch->items[i];
+        item->resp[sizeof(item->resp) - 1] = '\0';
+
+        if (ITEM_DONE == item->state) {
+            for (line = strtok_r(item->resp, "\n", &save); line;
+                    line = strtok_r(NULL, "\n", &save)) {
+                (void)append(resp, RESP_LENGTH + 1, &pos, "%u %s\n", i + 1,
+                             line);
+            }
+        }
+
+        (void)append(resp, RESP_LENGTH + 1, &pos, "%u %s\n", i + 1,
+                     item_status(item));
+    }
+
+    // Drop the last line ending, it's added with the status.
+    if (pos > 0) {
+        resp[pos - 1] = '\0';
+    }
+
+    batch->done(batch->arg, rc, resp);
+
+    free(resp);
+    batch_free(batch);
+}
+
+/**
+ * @brief Get the status of a batch item.
+ *
+ * @param [in] item Batch item.
+ *
+ * @return Returns the status string.
+ */
+static const char * item_status(const struct batch_item *item)
+{
+    switch (item->state) {
+    case ITEM_SKIPPED:
+        return "SKIPPED";
+
+    case ITEM_ROLLED_BACK:
+        return "ROLLED_BACK";
+
+    case ITEM_DONE:
+        return (0 == item->rc) ? "OK" : "KO";
+
+    default:
+        return "KO";
+    }
+}
+
+/**
+ * @brief Append a numbered line to a response buffer.
+ *
+ * @param [in out] buf   Response buffer.
+ * @param [in]     len   Length of response buffer.
+ * @param [in out] pos   End of the response.
+ * @param [in]     fmt   Line format.
+ * @param [in]     index Number of the command.
+ * @param [in]     text  Line text.
+ *
+ * @return Returns 0 at success, or -1 if the buffer is full.
+ */
+static int append(char *buf, uint32_t len, uint32_t *pos, const char *fmt,
+                  uint32_t index, const char *text)
+{
+    int n = snprintf(buf + *pos, len - *pos, fmt, index, text);
+
+    if (n < 0 || (uint32_t)n >= len - *pos) {
+        buf[*pos] = '\0';
+        return -1;
+    }
+
+    *pos += n;
+
+    return 0;
+}
@@ -0,0 +1,23 @@
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+
+// Commands opening and closing a batch.
+#define BATCH_CMD "batch"
+#define BATCH_END "end"
+
+struct batch;
+
+typedef int (*batch_exec_fn)(const char *cmd, char *resp, uint32_t len);
+typedef void (*batch_done_fn)(void *arg, int rc, const char *resp);
+
+int batch_is_open(const char *cmd);
+struct batch * batch_create(const char *cmd);
+int batch_add(struct batch *batch, const char *cmd);
+int batch_run(struct batch *batch, batch_exec_fn exec, batch_done_fn done,
+              void *arg);
+void batch_free(struct batch *batch);
+
+#endif
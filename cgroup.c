@@ -0,0 +1,595 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cgroup.h"
+#include "spawnopt.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "cgroup.c"
+
+// Mount table and own cgroup membership.
+#define PROC_MOUNTS "/proc/self/mounts"
+#define PROC_CGROUP "/proc/self/cgroup"
+
+// Unified hierarchy file system type and membership line prefix.
+#define CGROUP2_FSTYPE "cgroup2"
+#define CGROUP2_PREFIX "0::"
+
+// Subtree used when the proxy lives in the root cgroup.
+#define ROOT_SUBTREE "dip"
+
+// Leaf for the proxy itself and parent of all session cgroups.
+#define PROXY_LEAF "proxy"
+#define SESSIONS_DIR "sessions"
+
+// Interface files.
+#define CG_PROCS "cgroup.procs"
+#define CG_KILL "cgroup.kill"
+#define CG_EVENTS "cgroup.events"
+#define CG_SUBTREE "cgroup.subtree_control"
+#define CG_CPU_STAT "cpu.stat"
+#define CG_MEM_CURRENT "memory.current"
+#define CG_POPULATED_NO "populated 0"
+#define CG_USAGE_USEC "usage_usec "
+
+// Time to wait for a killed cgroup to become empty before removing it.
+#define REMOVE_RETRIES 20
+#define REMOVE_DELAY_NS 5000000L
+
+// Permission when creating cgroup directories.
+#define DIR_PERM 0755
+
+// Separator used instead of space in limit values.
+#define VALUE_SEP ','
+
+// Buffer size for a cgroup interface file.
+#define CG_BUF_LEN 1024
+
+// Controllers enabled for session cgroups (if available).
+static const char *controllers[] = {"+cpu", "+memory", "+io", NULL};
+
+// Base of the proxy-owned subtree, empty if cgroups are not used.
+static char base[MAX_PATH_LEN] = "";
+
+// Forward declarations.
+static int find_mount(char *mnt, size_t size);
+static int find_own_cgroup(char *path, size_t size);
+static int session_path(const char *name, const char *file, char *path,
+                        size_t size);
+static int write_file(const char *path, const char *value);
+static int read_file(const char *path, char *buf, size_t size);
+static void enable_controllers(const char *dir);
+static int write_limit(const char *name, const char *file, const char *value);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Set up the proxy-owned cgroup v2 subtree. Each MLD session will get
+ *        its own cgroup in <path>/sessions. If the proxy itself is a member of
+ *        <path> it is moved to the leaf <path>/proxy, since a cgroup with
+ *        controllers enabled for its children can't have member processes.
+ *
+ * @param [in] path Delegated cgroup directory to use, or NULL to use the
+ *                  cgroup of the proxy.
+ *
+ * @return Returns 0 at success, or -1 if cgroups can't be used. Sessions are
+ *         then started without cgroups.
+ */
+int cgroup_init(const char *path)
+{
+    char mnt[MAX_PATH_LEN];
+    char own[MAX_PATH_LEN];
+    char dir[MAX_PATH_LEN];
+    char self[MAX_PATH_LEN * 2];
+    char leaf[MAX_PATH_LEN + sizeof(PROXY_LEAF) + 1];
+    char procs[sizeof(leaf) + sizeof(CG_PROCS) + 1];
+    char pid[16];
+    char *leafname;
+    int len;
+
+    base[0] = '\0';
+
+    if (find_mount(mnt, sizeof(mnt)) == -1) {
+        ALOGD("%s:%d: cgroup v2 not mounted", _FILE, __LINE__);
+        return -1;
+    }
+
+    if (find_own_cgroup(own, sizeof(own)) == -1) {
+        ALOGD("%s:%d: Not a member of a cgroup v2 hierarchy", _FILE, __LINE__);
+        return -1;
+    }
+
+    // Resolve the base directory of the subtree.
+    if (path) {
+        len = snprintf(dir, sizeof(dir), "%s", path);
+    } else if (strcmp(own, "/") == 0) {
+        len = snprintf(dir, sizeof(dir), "%s/%s", mnt, ROOT_SUBTREE);
+    } else {
+        len = snprintf(dir, sizeof(dir), "%s%s", mnt, own);
+    }
+
+    if (len < 0 || len >= (int)sizeof(dir)) {
+        ALOGE("%s:%d: Long path", _FILE, __LINE__);
+        return -1;
+    }
+
+    // Already moved to the leaf, e.g. before an upgrade.
+    if (!path && strcmp(own, "/") != 0 &&
+            (leafname = strrchr(dir, '/')) &&
+            strcmp(leafname + 1, PROXY_LEAF) == 0) {
+        *leafname = '\0';
+    }
+
+    if (mkdir(dir, DIR_PERM) == -1 && errno != EEXIST) {
+        ALOGE("%s:%d: Failed to create cgroup %s (errno=%d)", _FILE, __LINE__,
+              dir, errno);
+        return -1;
+    }
+
+    // Move the proxy out of the base if it's a member of it.
+    snprintf(self, sizeof(self), "%s%s", mnt,
+             strcmp(own, "/") == 0 ? "" : own);
+
+    if (strcmp(self, dir) == 0) {
+        snprintf(leaf, sizeof(leaf), "%s/%s", dir, PROXY_LEAF);
+        snprintf(procs, sizeof(procs), "%s/%s", leaf, CG_PROCS);
+        snprintf(pid, sizeof(pid), "%d", getpid());
+
+        if ((mkdir(leaf, DIR_PERM) == -1 && errno != EEXIST) ||
+                write_file(procs, pid) == -1) {
+            ALOGE("%s:%d: Failed to move proxy to %s (errno=%d)", _FILE,
+                  __LINE__, leaf, errno);
+            return -1;
+        }
+    }
+
+    enable_controllers(dir);
+
+    len = snprintf(base, sizeof(base), "%s/%s", dir, SESSIONS_DIR);
+
+    if (len < 0 || len >= (int)sizeof(base)) {
+        ALOGE("%s:%d: Long path", _FILE, __LINE__);
+        base[0] = '\0';
+        return -1;
+    }
+
+    if (mkdir(base, DIR_PERM) == -1 && errno != EEXIST) {
+        ALOGE("%s:%d: Failed to create cgroup %s (errno=%d)", _FILE, __LINE__,
+              base, errno);
+        base[0] = '\0';
+        return -1;
+    }
+
+    enable_controllers(base);
+
+    ALOGD("%s:%d: Using cgroup subtree %s", _FILE, __LINE__, base);
+
+    return 0;
+}
+
+/**
+ * @brief Check if sessions are placed in cgroups.
+ *
+ * @return Returns 1 if enabled, else 0.
+ */
+int cgroup_enabled(void)
+{
+    return ('\0' != base[0]);
+}
+
+/**
+ * @brief Create the cgroup of a session and apply its limits.
+ *
+ * @param [in] name Unique session name.
+ * @param [in] opt  Spawn options holding the limits (may be NULL).
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int cgroup_create(const char *name, const struct spawnopt *opt)
+{
+    char path[MAX_PATH_LEN];
+
+    if (session_path(name, NULL, path, sizeof(path)) == -1) {
+        return -1;
+    }
+
+    // A cgroup left behind by an earlier session is reused.
+    if (mkdir(path, DIR_PERM) == -1 && errno != EEXIST) {
+        ALOGE("%s:%d: Failed to create cgroup %s (errno=%d)", _FILE, __LINE__,
+              path, errno);
+        return -1;
+    }
+
+    if (opt) {
+        if (write_limit(name, "cpu.max", opt->cpu_max) == -1 ||
+                write_limit(name, "memory.max", opt->memory_max) == -1 ||
+                write_limit(name, "io.max", opt->io_max) == -1) {
+            (void)rmdir(path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Open the process list of a session cgroup. A forked child joins the
+ *        cgroup by writing "0" to the descriptor before it executes MLD.
+ *
+ * @param [in] name Unique session name.
+ *
+ * @return Returns an open file descriptor (close-on-exec), or -1 at failure.
+ */
+int cgroup_open_procs(const char *name)
+{
+    char path[MAX_PATH_LEN];
+    int fd;
+
+    if (session_path(name, CG_PROCS, path, sizeof(path)) == -1) {
+        return -1;
+    }
+
+    if ((fd = open(path, O_WRONLY | O_CLOEXEC)) == -1) {
+        ALOGE("%s:%d: Failed to open %s (errno=%d)", _FILE, __LINE__, path,
+              errno);
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Kill all processes in a session cgroup, including any processes
+ *        forked by MLD.
+ *
+ * @param [in] name Unique session name.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int cgroup_kill(const char *name)
+{
+    char path[MAX_PATH_LEN];
+    char buf[CG_BUF_LEN];
+    char *pos, *end;
+    long pid;
+
+    if (session_path(name, CG_KILL, path, sizeof(path)) == -1) {
+        return -1;
+    }
+
+    if (write_file(path, "1") == 0) {
+        return 0;
+    }
+
+    // Kernels before 5.14 lack cgroup.kill, signal each member instead.
+    if (session_path(name, CG_PROCS, path, sizeof(path)) == -1 ||
+            read_file(path, buf, sizeof(buf)) == -1) {
+        return -1;
+    }
+
+    for (pos = buf; *pos; pos = end) {
+        pid = strtol(pos, &end, 10);
+        if (end == pos) {
+            break;
+        }
+        if (pid > 0) {
+            (void)kill((pid_t)pid, SIGKILL);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Remove a session cgroup. Waits briefly for killed members to exit.
+ *
+ * @param [in] name Unique session name.
+ *
+ * @return Returns 0 at success, or -1 if the cgroup is still populated.
+ */
+int cgroup_remove(const char *name)
+{
+    char path[MAX_PATH_LEN];
+    char events[MAX_PATH_LEN];
+    char buf[CG_BUF_LEN];
+    struct timespec delay = {0, REMOVE_DELAY_NS};
+    uint32_t i;
+
+    if (session_path(name, NULL, path, sizeof(path)) == -1 ||
+            session_path(name, CG_EVENTS, events, sizeof(events)) == -1) {
+        return -1;
+    }
+
+    for (i = 0; i < REMOVE_RETRIES; i++) {
+        if (read_file(events, buf, sizeof(buf)) == 0 &&
+                strstr(buf, CG_POPULATED_NO)) {
+            break;
+        }
+        nanosleep(&delay, NULL);
+    }
+
+    if (rmdir(path) == -1 && errno != ENOENT) {
+        ALOGE("%s:%d: Failed to remove cgroup %s (errno=%d)", _FILE, __LINE__,
+              path, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Get accounted CPU time and memory of a session cgroup.
+ *
+ * @param [in]  name   Unique session name.
+ * @param [out] cpu_ms CPU time of all members.
+ * @param [out] mem_kb Current memory usage of all members (0 if the memory
+ *                     controller is not enabled).
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int cgroup_stat(const char *name, uint64_t *cpu_ms, uint64_t *mem_kb)
+{
+    char path[MAX_PATH_LEN];
+    char buf[CG_BUF_LEN];
+    char *pos;
+
+    *cpu_ms = 0;
+    *mem_kb = 0;
+
+    if (session_path(name, CG_CPU_STAT, path, sizeof(path)) == -1 ||
+            read_file(path, buf, sizeof(buf)) == -1) {
+        return -1;
+    }
+
+    if ((pos = strstr(buf, CG_USAGE_USEC))) {
+        *cpu_ms = strtoull(pos + strlen(CG_USAGE_USEC), NULL, 10) / 1000;
+    }
+
+    if (session_path(name, CG_MEM_CURRENT, path, sizeof(path)) == 0 &&
+            read_file(path, buf, sizeof(buf)) == 0) {
+        *mem_kb = strtoull(buf, NULL, 10) / 1024;
+    }
+
+    return 0;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Find the mount point of the cgroup v2 hierarchy.
+ *
+ * @param [out] mnt  Mount point.
+ * @param [in]  size Size of mount point buffer.
+ *
+ * @return Returns 0 at success, or -1 if not mounted.
+ */
+static int find_mount(char *mnt, size_t size)
+{
+    char line[CMD_LINE_LENGTH];
+    char dev[CMD_LINE_LENGTH], dir[CMD_LINE_LENGTH], type[CMD_LINE_LENGTH];
+    FILE *file;
+    int rc = -1;
+
+    file = fopen(PROC_MOUNTS, "r");
+
+    if (NULL == file) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "%255s %255s %255s", dev, dir, type) == 3 &&
+                strcmp(type, CGROUP2_FSTYPE) == 0 && strlen(dir) < size) {
+            strcpy(mnt, dir);
+            rc = 0;
+            break;
+        }
+    }
+
+    fclose(file);
+
+    return rc;
+}
+
+/**
+ * @brief Find the cgroup v2 membership of the proxy.
+ *
+ * @param [out] path Cgroup path relative to the mount point.
+ * @param [in]  size Size of path buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int find_own_cgroup(char *path, size_t size)
+{
+    char line[CMD_LINE_LENGTH];
+    FILE *file;
+    int rc = -1;
+
+    file = fopen(PROC_CGROUP, "r");
+
+    if (NULL == file) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, CGROUP2_PREFIX, strlen(CGROUP2_PREFIX)) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            if (strlen(line + strlen(CGROUP2_PREFIX)) < size) {
+                strcpy(path, line + strlen(CGROUP2_PREFIX));
+                rc = 0;
+            }
+            break;
+        }
+    }
+
+    fclose(file);
+
+    return rc;
+}
+
+/**
+ * @brief Build the path of a session cgroup or one of its files.
+ *
+ * @param [in]  name Unique session name.
+ * @param [in]  file Interface file, or NULL for the cgroup directory.
+ * @param [out] path Destination buffer.
+ * @param [in]  size Size of destination buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int session_path(const char *name, const char *file, char *path,
+                        size_t size)
+{
+    int n;
+
+    if (!cgroup_enabled() || NULL == name) {
+        return -1;
+    }
+
+    // The name is used as a directory name.
+    if (strchr(name, '/') || strcmp(name, ".") == 0 ||
+            strcmp(name, "..") == 0) {
+        ALOGE("%s:%d: Bad cgroup name (%s)", _FILE, __LINE__, name);
+        return -1;
+    }
+
+    if (file) {
+        n = snprintf(path, size, "%s/%s/%s", base, name, file);
+    } else {
+        n = snprintf(path, size, "%s/%s", base, name);
+    }
+
+    if (n < 0 || (size_t)n >= size) {
+        ALOGE("%s:%d: Long path", _FILE, __LINE__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write a value to a cgroup interface file.
+ *
+ * @param [in] path  File path.
+ * @param [in] value Null-terminated value.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int write_file(const char *path, const char *value)
+{
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_WRONLY | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+
+    n = write(fd, value, strlen(value));
+    close(fd);
+
+    return (n == (ssize_t)strlen(value)) ? 0 : -1;
+}
+
+/**
+ * @brief Read a cgroup interface file into a null-terminated buffer.
+ *
+ * @param [in]  path File path.
+ * @param [out] buf  Destination buffer.
+ * @param [in]  size Size of destination buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int read_file(const char *path, char *buf, size_t size)
+{
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+
+    n = read(fd, buf, size - 1);
+    close(fd);
+
+    if (n < 0) {
+        return -1;
+    }
+
+    buf[n] = '\0';
+
+    return 0;
+}
+
+/**
+ * @brief Enable controllers for the children of a cgroup. Controllers that
+ *        are not available are skipped.
+ *
+ * @param [in] dir Cgroup directory.
+ */
+static void enable_controllers(const char *dir)
+{
+    char path[MAX_PATH_LEN + sizeof(CG_SUBTREE) + 1];
+    uint32_t i;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, CG_SUBTREE);
+
+    for (i = 0; controllers[i]; i++) {
+        if (write_file(path, controllers[i]) == -1) {
+            ALOGD("%s:%d: Controller %s not enabled in %s (errno=%d)", _FILE,
+                  __LINE__, controllers[i] + 1, dir, errno);
+        }
+    }
+}
+
+/**
+ * @brief Write a limit to a session cgroup. Commas in the value are written
+ *        as spaces, e.g. "50000,100000" is written as "50000 100000".
+ *
+ * @param [in] name  Unique session name.
+ * @param [in] file  Interface file.
+ * @param [in] value Limit value, empty for no limit.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int write_limit(const char *name, const char *file, const char *value)
+{
+    char path[MAX_PATH_LEN];
+    char buf[SPAWNOPT_LIMIT_LEN];
+    char *pos;
+
+    if ('\0' == value[0]) {
+        return 0;
+    }
+
+    if (session_path(name, file, path, sizeof(path)) == -1) {
+        return -1;
+    }
+
+    snprintf(buf, sizeof(buf), "%s", value);
+    for (pos = buf; (pos = strchr(pos, VALUE_SEP)) != NULL; pos++) {
+        *pos = ' ';
+    }
+
+    if (write_file(path, buf) == -1) {
+        ALOGE("%s:%d: Failed to set %s to \"%s\" (errno=%d)", _FILE, __LINE__,
+              file, buf, errno);
+        return -1;
+    }
+
+    return 0;
+}
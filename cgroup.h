@@ -0,0 +1,17 @@
+
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <stdint.h>
+
+struct spawnopt;
+
+int cgroup_init(const char *path);
+int cgroup_enabled(void);
+int cgroup_create(const char *name, const struct spawnopt *opt);
+int cgroup_open_procs(const char *name);
+int cgroup_kill(const char *name);
+int cgroup_remove(const char *name);
+int cgroup_stat(const char *name, uint64_t *cpu_ms, uint64_t *mem_kb);
+
+#endif
@@ -1,22 +1,44 @@
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <netdb.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 
+#include <linux/filter.h>
+
+#include "activation.h"
+#include "archive.h"
+#include "batch.h"
 #include "cmdserver.h"
+#include "executor.h"
+#include "logindex.h"
+#include "logstream.h"
+#include "metrics.h"
+#include "pool.h"
+#include "procstat.h"
+#include "recorder.h"
 #include "tracecmd.h"
+#include "upgrade.h"
+#include "uring.h"
 #include "utils.h"
 
 #define _FILE "cmdserver.c"
@@ -24,15 +46,107 @@
 // Default TCP port.
 #define DEFAULT_PORT "3002"
 
-// Queue size for pending server connections.
-#define BACKLOG 2
+// Default queue size for pending server connections.
+#define BACKLOG 16
 
-// Max number of connected clients.
+// Max number of listening sockets with their own I/O loop.
+#define MAX_ACCEPTORS 16
+
+// Default max number of connected clients.
 #define MAX_CONNECTED_CLIENTS 3
 
+// Upper limit for the max number of connected clients.
+#define CLIENTS_LIMIT 64
+
+// Default max number of commands queued or executing at the same time.
+#define MAX_PENDING_COMMANDS 8
+
+// Time clients are asked to wait before retrying a refused request.
+#define RETRY_MS 200
+
+// Max number of events handled per wakeup.
+#define MAX_EVENTS 16
+
+// Max interval between checks for idle connections.
+#define IDLE_CHECK_MS 1000
+
+// Stack size of the I/O loop threads.
+#define LOOP_STACK_SIZE (128 * 1024)
+
+// Connections and jobs added to their pools at a time.
+#define CONNS_PER_SLAB 4
+#define JOBS_PER_SLAB 8
+
+// Number of io_uring submission queue entries per I/O loop.
+#define RING_ENTRIES 128
+
+// Provided receive buffers per io_uring I/O loop, one per connection.
+#define RING_BUFS CLIENTS_LIMIT
+
+// Group ID of the provided receive buffers.
+#define RING_BGID 1
+
+// Operation kind, kept in the low bits of the io_uring user data, as
+// connections are aligned to 16 bytes by their pool.
+#define OP_MASK 0xf
+
+// Max number of commands executing at the same time for a binary connection.
+#define MAX_CONN_COMMANDS 8
+
+// Output above which a binary connection receives no further requests.
+#define MAX_CONN_OUTPUT (4 * RESP_LENGTH)
+
+// Max output handed to a socket at a time.
+#define OUT_CHUNK (64 * 1024)
+
+// Stream and bulk output a connection may send per round while others
+// wait for their turn.
+#define OUT_QUANTUM (16 * 1024)
+
+// Interval at which output held back by a rate limit is retried.
+#define SHAPE_MS 10
+
+// Output a rate limit allows at once after a pause.
+#define BURST_MS 100
+
+// Streamed output held for a slow client, further lines are dropped.
+#define MAX_STREAM_OUTPUT (64 * 1024)
+
+// Max chunks of streamed output handed to the I/O loops and not yet queued.
+// Log reads wait for room, live streams drop lines.
+#define MAX_CHUNKS 64
+
+// Memory accounted for a chunk of streamed output, a frame at most.
+#define CHUNK_CHARGE(len) ((int64_t)(len) + FRAME_HDR_LEN)
+
+// Response to a stopped stream.
+#define STREAM_RESP "dropped=%" PRIu64
+
+// Text command switching a connection to the binary protocol.
+#define PROTO_BINARY "proto binary"
+
+// Binary frame header: type, flags, two reserved bytes, request ID and
+// payload length, in network byte order.
+#define FRAME_HDR_LEN 12
+
+// Binary frame types.
+#define FRAME_REQUEST 1
+#define FRAME_RESPONSE 2
+#define FRAME_DATA 3
+
+// Binary frame flags.
+#define FRAME_F_KO 0x01
+#define FRAME_F_BUSY 0x02
+#define FRAME_F_MORE 0x04
+
 // Client acknowledgments.
 #define RES_OK "OK\n"
 #define RES_KO "KO\n"
+#define RES_BUSY "BUSY retry_ms=%u\n"
+#define RES_RETRY "retry_ms=%u"
+
+// Header of the server statistics.
+#define STATS_HEADER "CLIENTS PENDING ACCEPTED REJECTED BUSY TIMED_OUT"
 
 // Empty string.
 #define NULL_STR ""
@@ -46,46 +160,457 @@ enum status {
     RUNNING
 };
 
-struct server_data {
+// io_uring operations.
+enum ring_op {
+    OP_ACCEPT = 1,
+    OP_EVENT,
+    OP_TIMEOUT,
+    OP_BUFFERS,
+    OP_RECV,
+    OP_SEND,
+    OP_SHAPE,
+    OP_SPLICE
+};
+
+// Output classes, sent in this order of priority.
+enum out_class {
+    OUT_CONTROL,                     // Command responses.
+    OUT_STREAM,                      // Live streams.
+    OUT_BULK,                        // Downloads.
+    NUM_OUT_CLASSES
+};
+
+// Output message queued on a connection.
+struct msg {
+    struct msg *next;
+    uint32_t len;
+    char data[];
+};
+
+struct msg_queue {
+    struct msg *head;
+    struct msg *tail;
+};
+
+// Token bucket limiting an output rate. Tokens are counted in thousandths
+// of bytes, so no fraction is lost at refill. A message is sent while
+// tokens remain, the tokens may then become negative.
+struct bucket {
+    uint64_t rate;                   // Bytes per second, 0 for no limit.
+    int64_t tokens;
+    uint64_t last_ms;                // Time of the last refill.
+};
+
+struct ioloop;
+struct conn;
+
+// I/O backend of the loops.
+struct backend {
+    const char *name;
+    int (*init)(struct ioloop *loop);       // Set up the loop.
+    void (*run)(struct ioloop *loop);       // Run the loop.
+    int (*watch)(struct conn *conn);        // Start serving a connection.
+    void (*unwatch)(struct conn *conn);     // Stop serving a connection.
+    void (*update)(struct conn *conn);      // Wait for input as needed.
+    int (*send)(struct conn *conn);         // Send pending output.
+};
+
+// Client connection, owned by the I/O loop that accepted it.
+struct conn {
+    struct conn *next;
+    struct ioloop *loop;
+    int fd;
+    char peer[INET6_ADDRSTRLEN];
+    char in[CMD_LINE_LENGTH + FRAME_HDR_LEN]; // Data not yet a command.
+    uint32_t in_len;
+    uint32_t skip;                   // Bytes of a bad frame to discard.
+    char *out;                       // Output being sent.
+    uint32_t out_len;
+    uint32_t out_pos;
+    struct msg_queue queues[NUM_OUT_CLASSES]; // Output not yet in out.
+    uint32_t backlog;                // Output not yet sent.
+    uint32_t deficit;                // Output the round robin allows.
+    uint32_t rounds[NUM_OUT_CLASSES]; // Last round robin turn taken.
+    struct bucket bucket;            // Rate limit of the client.
+    int binary;                      // Set for the binary protocol.
+    uint32_t busy;                   // Number of executing commands.
+    int closed;                      // Set if closed while busy.
+    uint64_t active_ms;              // Time of last activity.
+    uint32_t inflight;               // io_uring operations not completed.
+    int recving;                     // Set while a receive is queued.
+    int sending;                     // Set while a send is queued.
+    struct batch *batch;             // Batch being received, if any.
+    uint32_t batch_id;               // Request ID of the batch.
+    struct logstream *stream;        // Live log stream, if any.
+    struct job *stream_job;          // Job answering the stream once ended.
+    uint64_t dropped;                // Streamed lines dropped.
+    struct archive *archive;         // Archive being downloaded, if any.
+    uint32_t archive_id;             // Request ID of the download.
+    uint32_t splice_len;             // Announced file data not yet sent.
+    uint32_t serial;                 // Connection number.
+};
+
+// Command handed from an I/O loop to the executor and back.
+struct job {
+    struct job *next;
+    struct conn *conn;
+    uint32_t id;                     // Request ID, binary protocol only.
+    int rc;
+    int detailed;                    // Set to send the response on failure.
+    int streamed;                    // Set for output of a stream or read.
+    uint32_t len;                    // Length of streamed output.
+    uint64_t lost;                   // Stream lines not handed to the loop.
+    enum out_class cls;              // Class of the output and response.
+    char cmd[CMD_LINE_LENGTH];
+    char resp[RESP_LENGTH + 1];
+};
+
+// Event loop serving one listening socket and its connections.
+struct ioloop {
     pthread_t thread;
-    int sockfd;
+    uint32_t index;
+    int sockfd;                      // Listening socket.
+    int epfd;
+    int evfd;                        // Signaled when commands complete.
+    pthread_mutex_t mutex;           // Protects the completed jobs.
+    struct job *done;
+    struct job *done_tail;
+    struct conn *conns;
+    const struct backend *io;
+    struct uring ring;               // io_uring backend only.
+    char *bufs;                      // Provided receive buffers.
+    uint64_t count;                  // Event counter read by the ring.
+    struct __kernel_timespec ts;     // Idle check interval.
+    int multishot;                   // Set if accept is multishot.
+    uint32_t rounds[NUM_OUT_CLASSES]; // Current round robin turn.
+    int throttled;                   // Output held back by a rate limit.
+    int shaping;                     // Set while a retry timeout is queued.
+    struct __kernel_timespec shape_ts; // Retry interval.
+    int quiet;                       // Drained for an upgrade, under mutex.
+};
+
+struct server_data {
+    struct ioloop loops[MAX_ACCEPTORS];
+    uint32_t num_loops;
     enum status status;
 };
 
+struct client_slot {
+    int fd;                          // Connected socket, -1 if free.
+    int binary;                      // Set for the binary protocol.
+    char peer[INET6_ADDRSTRLEN];     // Peer address.
+};
+
 struct client_data {
     uint32_t ref_count;
+    uint32_t pending;                // Commands queued or executing.
+    int upgrading;                   // Set while draining for an upgrade.
+    int upgrader;                    // Set once a loop carries it out.
+    uint32_t chunks;                 // Streamed output not yet queued.
+    struct client_slot slots[CLIENTS_LIMIT];
+    uint64_t accepted;               // Accepted connections.
+    uint64_t rejected;               // Connections refused as busy.
+    uint64_t busy;                   // Commands refused as busy.
+    uint64_t timed_out;              // Connections closed when idle.
 };
 
 // Thread synchronization.
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER;
+
+// Set until the first command after start has been executed.
+static int first_cmd = 1;
 
 // Server data.
 static struct server_data server;
 
+// Admission limits, 0 for no limit.
+static uint32_t max_clients = MAX_CONNECTED_CLIENTS;
+static uint32_t max_per_peer = 0;
+static uint32_t max_pending = MAX_PENDING_COMMANDS;
+static uint32_t idle_timeout_ms = 0;
+
+// Output rate limits per client and of all clients, the latter shared by
+// the loops.
+static uint64_t client_rate = 0;
+static struct bucket total_bucket;
+static pthread_mutex_t rate_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Listener configuration.
+static uint32_t num_acceptors = 1;
+static int steer_cpu = 0;
+static int backlog = BACKLOG;
+
 // Client data.
 static struct client_data client;
 
+// Number of the last accepted connection, for recording.
+static uint32_t last_serial = 0;
+
+// Pools of connections and of jobs, including chunks of streamed output.
+static struct pool conn_pool = POOL_INITIALIZER("conns", struct conn,
+                                                CONNS_PER_SLAB);
+static struct pool job_pool = POOL_INITIALIZER("jobs", struct job,
+                                               JOBS_PER_SLAB);
+
+// Operations the io_uring backend depends on.
+static const uint8_t ring_ops[] = {
+    IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ,
+    IORING_OP_TIMEOUT, IORING_OP_PROVIDE_BUFFERS, IORING_OP_SPLICE
+};
+
 // Process ID.
 static pid_t pid;
 
 // Forward declarations.
-static void * server_thread(void *arg);
-static void * client_thread(void *arg);
+static int open_socket(const char *port, int reuseport);
+static uint32_t open_sockets(const char *port, int *sockfds);
+static void steer_connections(int sockfd);
+static int init_loop(struct ioloop *loop, uint32_t index, int sockfd);
+static void * loop_thread(void *arg);
+static void get_peer(int fd, char *peer, size_t size);
+static int start_client(struct ioloop *loop, int fd, const char *peer,
+                        int binary);
+static void refuse(int fd);
+static void set_nonblock(int fd, int on);
+static void close_conn(struct conn *conn);
+static void release_conn(struct conn *conn);
+static void free_conn(struct conn *conn);
+static void serve_conn(struct conn *conn);
+static int want_input(struct conn *conn);
+static void sent_conn(struct conn *conn, uint32_t len);
+static int fill_output(struct conn *conn, enum out_class cls,
+                       uint32_t limit);
+static void schedule_output(struct ioloop *loop);
+static int client_allowed(struct conn *conn);
+static int total_allowed(void);
+static void take_tokens(struct conn *conn, uint32_t len);
+static void refill(struct bucket *bucket, uint64_t now);
+static int epoll_init(struct ioloop *loop);
+static void epoll_run(struct ioloop *loop);
+static int epoll_watch(struct conn *conn);
+static void epoll_unwatch(struct conn *conn);
+static void epoll_update(struct conn *conn);
+static int epoll_send(struct conn *conn);
+static void epoll_accept(struct ioloop *loop);
+static void epoll_recv(struct conn *conn);
+static int ring_init(struct ioloop *loop);
+static void ring_run(struct ioloop *loop);
+static int ring_watch(struct conn *conn);
+static void ring_unwatch(struct conn *conn);
+static void ring_update(struct conn *conn);
+static int ring_send(struct conn *conn);
+static int ring_splice(struct conn *conn);
+static void ring_complete(struct ioloop *loop, uint64_t data, int res,
+                          uint32_t flags);
+static void ring_accept(struct ioloop *loop);
+static void ring_read_event(struct ioloop *loop);
+static void ring_timeout(struct ioloop *loop);
+static void ring_shape(struct ioloop *loop);
+static void ring_provide(struct ioloop *loop, uint32_t bid, uint32_t num);
+static void ring_recv(struct conn *conn);
+static void ring_received(struct conn *conn, int res, uint32_t flags);
+static struct io_uring_sqe * ring_sqe(struct ioloop *loop, struct conn *conn,
+                                      enum ring_op op);
+static int next_command(struct conn *conn, char *cmd, uint32_t *id);
+static int next_frame(struct conn *conn, char *cmd, uint32_t *id);
+static int submit_command(struct conn *conn, uint32_t id, const char *cmd);
+static int submit_batch(struct conn *conn);
+static struct job * new_job(struct conn *conn, uint32_t id, const char *cmd);
+static void run_job(void *arg);
+static void finish_batch(void *arg, int rc, const char *resp);
+static void finish_job(struct job *job);
+static void post_job(struct job *job);
+static int start_stream(struct conn *conn, uint32_t id, const char *cmd);
+static void run_read(void *arg);
+static void stream_data(void *arg, const char *data, uint32_t len);
+static int read_data(void *arg, const char *data, uint32_t len);
+static uint32_t post_output(const struct job *parent, const char *data,
+                            uint32_t len, int wait);
+static void chunk_queued(void);
+static void stop_stream(struct conn *conn);
+static int add_stream_output(struct conn *conn, const struct job *job);
+static int end_stream(struct conn *conn, struct job *job);
+static int end_read(struct conn *conn, struct job *job);
+static int start_archive(struct conn *conn, uint32_t id, const char *cmd);
+static int pump_archive(struct conn *conn, uint32_t limit);
+static int end_archive(struct conn *conn, int rc);
+static void complete_jobs(struct ioloop *loop);
+static void check_idle(struct ioloop *loop);
+static int set_output(struct conn *conn, uint32_t id, int status,
+                      const char *resp);
+static int add_response(struct conn *conn, enum out_class cls, uint32_t id,
+                        int status, const char *resp);
+static int set_busy(struct conn *conn, uint32_t id);
+static int add_frame(struct conn *conn, enum out_class cls, uint8_t type,
+                     uint8_t flags, uint32_t id, const char *data,
+                     uint32_t len);
+static void make_header(uint8_t *hdr, uint8_t type, uint8_t flags,
+                        uint32_t id, uint32_t len);
+static int add_output(struct conn *conn, enum out_class cls,
+                      const char *head, uint32_t head_len, const char *data,
+                      uint32_t len);
+static int queue_output(struct conn *conn, enum out_class cls,
+                        const char *head, uint32_t head_len,
+                        const char *data, uint32_t len);
+static void check_upgrade(struct ioloop *loop);
+static void upgrade(void);
+static void report_first_command(void);
 static enum status get_server_status(void);
 static void set_server_status(enum status status);
-static int accept_connection(void);
-static void inc_ref_count(void);
-static void dec_ref_count(void);
+static int add_client(int fd, const char *peer, int binary);
+static void remove_client(int fd);
+static void set_client_binary(int fd);
+static int begin_command(struct ioloop *loop);
+static int draining(struct ioloop *loop);
+static void end_command(void);
 static int dispatch_command(const char *cmd, char *resp, uint32_t len);
-static int recv_line(int fd, char *line, uint32_t size);
-static int send_buf(int fd, const char *buf, uint32_t size);
-static int send_response(int fd, int status, char *resp, uint32_t size);
+
+// I/O backends.
+static const struct backend epoll_backend = {
+    "epoll", epoll_init, epoll_run, epoll_watch, epoll_unwatch, epoll_update,
+    epoll_send
+};
+
+static const struct backend ring_backend = {
+    "io_uring", ring_init, ring_run, ring_watch, ring_unwatch, ring_update,
+    ring_send
+};
+
+// I/O backend of new loops.
+static const struct backend *io_backend = &epoll_backend;
 
 /*============================================================================
  * Public functions
  *============================================================================
  */
 
+/**
+ * @brief Set the number of listening sockets. With more than one socket, each
+ *        socket is bound to the port with SO_REUSEPORT and served by its own
+ *        I/O loop pinned to a CPU.
+ *
+ * @param [in] num   Number of listening sockets.
+ * @param [in] steer Set to let the CPU that receives a connection select
+ *                   the socket, instead of the kernel's hash.
+ */
+void cmdserver_set_acceptors(uint32_t num, int steer)
+{
+    if (num < 1) {
+        num = 1;
+    } else if (num > MAX_ACCEPTORS) {
+        num = MAX_ACCEPTORS;
+    }
+
+    num_acceptors = num;
+    steer_cpu = steer;
+}
+
+/**
+ * @brief Set the queue size for pending connections on each listening socket.
+ *
+ * @param [in] size Queue size.
+ */
+void cmdserver_set_backlog(int size)
+{
+    backlog = (size < 1) ? BACKLOG : size;
+}
+
+/**
+ * @brief Select the I/O backend, "epoll" or "io_uring". A loop falls back to
+ *        epoll if io_uring isn't supported by the kernel.
+ *
+ * @param [in] name Backend name.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int cmdserver_set_backend(const char *name)
+{
+    if (strcmp(name, epoll_backend.name) == 0) {
+        io_backend = &epoll_backend;
+    } else if (strcmp(name, ring_backend.name) == 0 ||
+               strcmp(name, "uring") == 0) {
+        io_backend = &ring_backend;
+    } else {
+        ALOGE("%s:%d: Unknown I/O backend: %s", _FILE, __LINE__, name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Set the admission limits for clients.
+ *
+ * @param [in] clients  Max number of connected clients, or 0 for the default.
+ * @param [in] per_peer Max number of connections from the same address, or 0
+ *                      for no limit.
+ * @param [in] pending  Max number of commands queued or executing at the same
+ *                      time, or 0 for the default.
+ * @param [in] idle_ms  Time after which idle connections are closed, or 0 to
+ *                      keep them open.
+ */
+void cmdserver_set_limits(uint32_t clients, uint32_t per_peer,
+                          uint32_t pending, uint32_t idle_ms)
+{
+    if (clients > CLIENTS_LIMIT) {
+        clients = CLIENTS_LIMIT;
+    }
+
+    max_clients = (0 == clients) ? MAX_CONNECTED_CLIENTS : clients;
+    max_per_peer = per_peer;
+    max_pending = (0 == pending) ? MAX_PENDING_COMMANDS : pending;
+    idle_timeout_ms = idle_ms;
+}
+
+/**
+ * @brief Set the output rate limits. Command responses are always sent at
+ *        once, live streams and downloads are held back to stay within the
+ *        limits.
+ *
+ * @param [in] client Max output rate of each client in bytes per second, or
+ *                    0 for no limit.
+ * @param [in] total  Max output rate of all clients together in bytes per
+ *                    second, or 0 for no limit.
+ */
+void cmdserver_set_rates(uint64_t client, uint64_t total)
+{
+    client_rate = client;
+
+    pthread_mutex_lock(&rate_mutex);
+    total_bucket.rate = total;
+    total_bucket.tokens = 0;
+    total_bucket.last_ms = get_monotonic_ms();
+    pthread_mutex_unlock(&rate_mutex);
+}
+
+/**
+ * @brief Get the server statistics, as a header line followed by a line with
+ *        the number of connected clients, queued and executing commands, accepted
+ *        connections, connections and commands refused as busy and
+ *        connections closed when idle.
+ *
+ * @param [out] resp Response buffer.
+ * @param [in]  len  Length of response buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int cmdserver_stats(char *resp, uint32_t len)
+{
+    int n;
+
+    pthread_mutex_lock(&mutex);
+    n = snprintf(resp, len, "%s\n%u %u %llu %llu %llu %llu", STATS_HEADER,
+                 client.ref_count, client.pending,
+                 (unsigned long long)client.accepted,
+                 (unsigned long long)client.rejected,
+                 (unsigned long long)client.busy,
+                 (unsigned long long)client.timed_out);
+    pthread_mutex_unlock(&mutex);
+
+    return (n < 0 || (uint32_t)n >= len) ? -1 : 0;
+}
+
 /**
  * @brief Start the comand server.
  *
@@ -95,10 +620,11 @@ static int send_response(int fd, int status, char *resp, uint32_t size);
  */
 int cmdserver_start(const char *port)
 {
-    int rc;
-    const char *tcp_port;
-    struct addrinfo *servinfo, *info;
-    struct addrinfo hints;
+    int sockfds[MAX_ACCEPTORS];
+    int fds[CLIENTS_LIMIT];
+    int binary[CLIENTS_LIMIT];
+    char peer[INET6_ADDRSTRLEN];
+    uint32_t i, n;
 
     // Save the process ID.
     pid = getpid();
@@ -110,62 +636,48 @@ int cmdserver_start(const char *port)
 
     // Server not started yet.
     server.status = STOPPED;
-    server.sockfd = -1;
+    server.num_loops = 0;
 
     // Init client connection data.
-    client.ref_count = 0U;
-
-    // Setup address structure(s).
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC; // Handle both IPv4 and IPv6.
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
-
-    // Check server port.
-    tcp_port = (NULL == port) ? DEFAULT_PORT : port;
+    memset(&client, 0, sizeof(client));
+    for (i = 0; i < CLIENTS_LIMIT; i++) {
+        client.slots[i].fd = -1;
+    }
 
-    if ((rc = getaddrinfo(NULL, tcp_port, &hints, &servinfo)) != 0) {
-        ALOGE("%s:%d: Failed to get address info (%s)", _FILE, __LINE__,
-             gai_strerror(rc));
+    // Use the listening socket handed over at upgrade or passed by the
+    // supervisor, if any.
+    if ((n = upgrade_listen_fds(sockfds, MAX_ACCEPTORS)) > 0) {
+        first_cmd = 0;
+    } else if ((sockfds[0] = activation_listen_fd()) != -1) {
+        n = 1;
+    } else if ((n = open_sockets(port, sockfds)) == 0) {
         return -1;
     }
 
-    // Bind to the first located socket.
-    for (info = servinfo; info != NULL; info = info->ai_next) {
-        if ((server.sockfd = socket(info->ai_family, info->ai_socktype,
-                                    info->ai_protocol)) == -1) {
-            continue;
-        }
-
-        if (bind(server.sockfd, info->ai_addr, info->ai_addrlen) == -1) {
-            close(server.sockfd);
-            continue;
+    // One I/O loop per listening socket.
+    for (i = 0; i < n; i++) {
+        if (init_loop(&server.loops[i], i, sockfds[i]) == -1) {
+            return -1;
         }
-
-        // At this point we are successfully bound to a socket.
-        break;
-    }
-
-    if (NULL == info) {
-        ALOGE("%s:%d: Failed to bind to socket", _FILE,
-              __LINE__);
-        freeaddrinfo(servinfo);
-        return -1;
+        server.num_loops++;
     }
 
-    freeaddrinfo(servinfo);
+    // Resume serving clients connected before an upgrade.
+    n = upgrade_client_fds(fds, binary, CLIENTS_LIMIT);
 
-    if (listen(server.sockfd, BACKLOG) == -1) {
-        ALOGE("%s:%d: Refused to listen to server socket", _FILE,
-              __LINE__);
-        return -1;
+    for (i = 0; i < n; i++) {
+        get_peer(fds[i], peer, sizeof(peer));
+        (void)start_client(&server.loops[i % server.num_loops], fds[i],
+                           peer, binary[i]);
     }
 
-    // Start server thread.
-    if (pthread_create(&server.thread, NULL, server_thread, NULL) != 0) {
-        ALOGE("%s:%d: Failed to create server thread", _FILE,
-              __LINE__);
-        return -1;
+    for (i = 0; i < server.num_loops; i++) {
+        if (pool_start_thread(&server.loops[i].thread, LOOP_STACK_SIZE,
+                              loop_thread, &server.loops[i]) == -1) {
+            ALOGE("%s:%d: Failed to create server thread", _FILE,
+                  __LINE__);
+            return -1;
+        }
     }
 
     return 0;
@@ -176,7 +688,11 @@ int cmdserver_start(const char *port)
  */
 void cmdserver_wait(void)
 {
-    (void)pthread_join(server.thread, NULL);
+    uint32_t i;
+
+    for (i = 0; i < server.num_loops; i++) {
+        (void)pthread_join(server.loops[i].thread, NULL);
+    }
 }
 
 /**
@@ -186,13 +702,15 @@ void cmdserver_wait(void)
  */
 void cmdserver_closefd(void)
 {
+    uint32_t i;
+
     ALOGD("%s:%d: pid=%d, getpid()=%d", _FILE, __LINE__, pid, getpid());
     if (getpid() == pid) {
         return;
     }
 
-    if (server.sockfd != -1) {
-        close(server.sockfd);
+    for (i = 0; i < server.num_loops; i++) {
+        close(server.loops[i].sockfd);
     }
 }
 
@@ -202,140 +720,2408 @@ void cmdserver_closefd(void)
  */
 
 /**
- * @brief Waiting for clients to connect.
+ * @brief Open the configured number of listening sockets.
  *
- * @param [in] arg <Not in use>.
+ * @param [in]  port    TCP port for the service to listen on.
+ * @param [out] sockfds Listening sockets.
  *
- * @return Returns NULL at thread exit.
+ * @return Returns the number of sockets, 0 at failure.
  */
-static void * server_thread(void *arg)
+static uint32_t open_sockets(const char *port, int *sockfds)
 {
-    struct sockaddr_storage caddr; // Client address info.
-    socklen_t caddr_len = sizeof(caddr);
-    int *fd;
-    pthread_t conn;
-
-    UNUSED(arg);
-
-    set_server_status(RUNNING);
-
-    while (1) {
-        // Allocate file descriptor for the client connection socket. The
-        // client is responsible to free this memory.
-        fd = malloc(sizeof(*fd));
+    int sockfd;
+    uint32_t n;
 
-        if (NULL == fd) {
-            ALOGE("%s:%d: Failed to allocated memory", _FILE,
-                  __LINE__);
+    for (n = 0; n < num_acceptors; n++) {
+        if ((sockfd = open_socket(port, num_acceptors > 1)) == -1) {
             break;
         }
 
-        // Wait for a client to connect.
-        *fd = accept(server.sockfd, (struct sockaddr *)&caddr, &caddr_len);
-
-        if (-1 == *fd) {
-            ALOGE("%s:%d: Connection not accepted", _FILE,
-                  __LINE__);
-            free(fd);
-            continue;
-        }
+        sockfds[n] = sockfd;
+    }
 
-        // Check if the maximum number of connected clients has been reached.
-        if (accept_connection()) {
-            // Create a client connection handler.
-            if (pthread_create(&conn, NULL, client_thread, fd) != 0) {
-                ALOGE("%s:%d: Failed to create client connection thread",
-                      _FILE, __LINE__);
-                free(fd);
-            }
-        } else {
-            ALOGD("%s:%d: Max number of connections reached", _FILE,
-                  __LINE__);
-            free(fd);
-        }
+    // Serve on the sockets that could be opened.
+    if (steer_cpu && n > 1) {
+        steer_connections(sockfds[0]);
     }
 
-    ALOGD("%s:%d: Exit server thread", _FILE, __LINE__);
-    close(server.sockfd);
-    set_server_status(STOPPED);
+    return n;
+}
 
-    return NULL;
+/**
+ * @brief Let the CPU that receives a connection select the listening socket.
+ *        I/O loop i is pinned to CPU i, so a connection is accepted on
+ *        the CPU that handled its packets. CPUs without a socket fall back to
+ *        the kernel's hash.
+ *
+ * @param [in] sockfd Socket in the SO_REUSEPORT group.
+ */
+static void steer_connections(int sockfd)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter code[] = {
+        // A = current CPU.
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        // Return A as socket index.
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    // The program applies to the whole SO_REUSEPORT group.
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   &prog, sizeof(prog)) == -1) {
+        ALOGE("%s:%d: Failed to attach steering program (errno=%d)", _FILE,
+              __LINE__, errno);
+    }
+#else
+    ALOGE("%s:%d: Connection steering not supported", _FILE, __LINE__);
+#endif
 }
 
 /**
- * @brief Handle the communication with a connected client.
+ * @brief Open a listening server socket.
  *
- * @param [in] arg Pointer to a client socket file descriptor.
+ * @param [in] port      TCP port for the service to listen on.
+ * @param [in] reuseport Set to share the port with other sockets.
  *
- * @return Returns NULL at thread exit.
+ * @return Returns the socket at success and -1 at failure.
  */
-static void * client_thread(void *arg)
+static int open_socket(const char *port, int reuseport)
 {
-    int rc;
-    int *fd;
-    ssize_t bytes_read;
-    char command[CMD_LINE_LENGTH + 1];
-    char response[CMD_LINE_LENGTH + 1];
+    int rc, sockfd = -1;
+    const char *tcp_port;
+    const int reuse = 1;
+    struct addrinfo *servinfo, *info;
+    struct addrinfo hints;
 
-    // Get socket file desc.
-    fd = (int *)arg;
+    // Setup address structure(s).
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC; // Handle both IPv4 and IPv6.
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
 
-    // Keep the resp buffer terminated.
-    response[CMD_LINE_LENGTH] = '\0';
+    // Check server port.
+    tcp_port = (NULL == port) ? DEFAULT_PORT : port;
 
-    inc_ref_count();
+    if ((rc = getaddrinfo(NULL, tcp_port, &hints, &servinfo)) != 0) {
+        ALOGE("%s:%d: Failed to get address info (%s)", _FILE, __LINE__,
+             gai_strerror(rc));
+        return -1;
+    }
 
-    ALOGD("%s:%d: Enter client thread", _FILE, __LINE__);
+    // Bind to the first located socket.
+    for (info = servinfo; info != NULL; info = info->ai_next) {
+        if ((sockfd = socket(info->ai_family, info->ai_socktype,
+                                    info->ai_protocol)) == -1) {
+            continue;
+        }
 
-    while (1) {
-        // Wait for a client command.
-        bytes_read = recv_line(*fd, command, CMD_LINE_LENGTH);
+        // Allow a restarted proxy to bind while old connections linger.
+        (void)setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                         sizeof(reuse));
 
-        if (0 == bytes_read) {
-            ALOGD("%s:%d: Connection closed by peer", _FILE, __LINE__);
-            break;
-        } else if (bytes_read < 0) {
-            ALOGD("%s:%d: Connection error (errno=%d)", _FILE, __LINE__,
+        if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse,
+                                    sizeof(reuse)) == -1) {
+            ALOGE("%s:%d: Failed to share port (errno=%d)", _FILE, __LINE__,
                   errno);
-            break;
-        } else {
-            // Message received (remove line feed character).
-            command[bytes_read - 1] = '\0';
-
-            // Clear response string.
-            strncpy(response, NULL_STR, CMD_LINE_LENGTH);
+            close(sockfd);
+            continue;
+        }
 
-            // Dispatch the message to a valid handler and send back response.
-            rc = dispatch_command(command, response, CMD_LINE_LENGTH);
-            if (send_response(*fd, rc, response, CMD_LINE_LENGTH) == -1) {
-                break;
-            }
+        if (bind(sockfd, info->ai_addr, info->ai_addrlen) == -1) {
+            close(sockfd);
+            continue;
         }
+
+        // At this point we are successfully bound to a socket.
+        break;
     }
 
-    ALOGD("%s:%d: Exit client thread", _FILE, __LINE__);
+    if (NULL == info) {
+        ALOGE("%s:%d: Failed to bind to socket", _FILE,
+              __LINE__);
+        freeaddrinfo(servinfo);
+        return -1;
+    }
 
-    dec_ref_count();
-    close(*fd);
-    free(fd);
+    freeaddrinfo(servinfo);
 
-    return NULL;
+    if (listen(sockfd, backlog) == -1) {
+        ALOGE("%s:%d: Refused to listen to server socket", _FILE,
+              __LINE__);
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
 }
 
 /**
- * @brief Get server status
+ * @brief Initialize an I/O loop with the selected backend, or with epoll if
+ *        the backend can't be used.
  *
- * @return Returns the status of the server.
+ * @param [out] loop   I/O loop.
+ * @param [in]  index  Index of the loop.
+ * @param [in]  sockfd Listening socket.
+ *
+ * @return Returns 0 at success and -1 at failure.
  */
-static enum status get_server_status(void)
+static int init_loop(struct ioloop *loop, uint32_t index, int sockfd)
 {
-    enum status status;
+    memset(loop, 0, sizeof(*loop));
+    loop->index = index;
+    loop->sockfd = sockfd;
+    loop->epfd = -1;
+    loop->ring.fd = -1;
+    pthread_mutex_init(&loop->mutex, NULL);
+
+    if ((loop->evfd = eventfd(0, EFD_CLOEXEC)) == -1) {
+        ALOGE("%s:%d: Failed to create I/O loop (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
 
-    pthread_mutex_lock(&mutex);
-    status = server.status;
-    pthread_mutex_unlock(&mutex);
+    loop->io = io_backend;
 
-    return status;
+    if (loop->io->init(loop) == 0) {
+        ALOGD("%s:%d: I/O loop %u uses %s", _FILE, __LINE__, index,
+              loop->io->name);
+        return 0;
+    }
+
+    if (loop->io == &epoll_backend) {
+        return -1;
+    }
+
+    ALOGE("%s:%d: io_uring not available, using epoll", _FILE, __LINE__);
+    loop->io = &epoll_backend;
+
+    return loop->io->init(loop);
+}
+
+/**
+ * @brief Accept clients and handle their I/O. Commands are executed by the
+ *        executor and completed in this thread.
+ *
+ * @param [in] arg I/O loop.
+ *
+ * @return Returns NULL at thread exit.
+ */
+static void * loop_thread(void *arg)
+{
+    struct ioloop *loop = arg;
+    long cpus;
+    cpu_set_t set;
+
+    // Pin the loop to a CPU, connections stay on the CPU that accepted them.
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (server.num_loops > 1 && cpus > 0) {
+        CPU_ZERO(&set);
+        CPU_SET(loop->index % cpus, &set);
+        (void)pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    set_server_status(RUNNING);
+
+    // Only returns at failure.
+    loop->io->run(loop);
+
+    ALOGD("%s:%d: Exit server thread", _FILE, __LINE__);
+    close(loop->sockfd);
+    set_server_status(STOPPED);
+
+    return NULL;
+}
+
+/**
+ * @brief Get the address of the peer of a connected socket.
+ *
+ * @param [in]  fd   Socket file descriptor.
+ * @param [out] peer Destination buffer.
+ * @param [in]  size Size of destination buffer.
+ */
+static void get_peer(int fd, char *peer, size_t size)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (getpeername(fd, (struct sockaddr *)&addr, &len) == -1 ||
+            getnameinfo((struct sockaddr *)&addr, len, peer, size, NULL, 0,
+                        NI_NUMERICHOST) != 0) {
+        snprintf(peer, size, "?");
+    }
+}
+
+/**
+ * @brief Add a connected client to an I/O loop, if admitted. A refused
+ *        client is answered with BUSY and the connection is closed.
+ *
+ * @param [in] loop   I/O loop.
+ * @param [in] fd     Client socket file descriptor.
+ * @param [in] peer   Peer address.
+ * @param [in] binary Set if the client already uses the binary protocol,
+ *                    i.e. it was handed over at an upgrade.
+ *
+ * @return Returns 0 at success and -1 at failure.
+ */
+static int start_client(struct ioloop *loop, int fd, const char *peer,
+                        int binary)
+{
+    struct conn *conn;
+    int on = 1;
+
+    // Check the connection limits.
+    if (add_client(fd, peer, binary) == -1) {
+        ALOGD("%s:%d: Connection refused (peer: %s)", _FILE, __LINE__, peer);
+        refuse(fd);
+        close(fd);
+        return -1;
+    }
+
+    conn = pool_alloc(&conn_pool);
+
+    // Refused like at the connection limits when out of memory.
+    if (NULL == conn) {
+        remove_client(fd);
+        refuse(fd);
+        close(fd);
+        return -1;
+    }
+
+    memset(conn, 0, sizeof(*conn));
+
+    // Output is already sent in chunks, a response following read output
+    // must not wait for the client to acknowledge it.
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    conn->loop = loop;
+    conn->fd = fd;
+    conn->binary = binary;
+    conn->active_ms = get_monotonic_ms();
+    conn->bucket.rate = client_rate;
+    conn->bucket.last_ms = conn->active_ms;
+    conn->serial = __atomic_add_fetch(&last_serial, 1, __ATOMIC_RELAXED);
+    snprintf(conn->peer, sizeof(conn->peer), "%s", peer);
+
+    recorder_add(RECORDER_OPEN, conn->serial, NULL);
+
+    conn->next = loop->conns;
+    loop->conns = conn;
+
+    if (loop->io->watch(conn) == -1) {
+        ALOGE("%s:%d: Failed to watch client socket (errno=%d)", _FILE,
+              __LINE__, errno);
+        close_conn(conn);
+        return -1;
+    }
+
+    ALOGD("%s:%d: Client connected (peer: %s)", _FILE, __LINE__, peer);
+
+    return 0;
+}
+
+/**
+ * @brief Tell a client to retry later. Never blocks, the client may not be
+ *        reading.
+ *
+ * @param [in] fd Client socket file descriptor.
+ */
+static void refuse(int fd)
+{
+    char busy[sizeof(RES_BUSY) + 10];
+
+    snprintf(busy, sizeof(busy), RES_BUSY, RETRY_MS);
+    (void)send(fd, busy, strlen(busy), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/**
+ * @brief Set or clear non-blocking mode of a file descriptor.
+ *
+ * @param [in] fd File descriptor.
+ * @param [in] on Set for non-blocking mode.
+ */
+static void set_nonblock(int fd, int on)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags != -1) {
+        (void)fcntl(fd, F_SETFL, on ? (flags | O_NONBLOCK) :
+                                      (flags & ~O_NONBLOCK));
+    }
+}
+
+/**
+ * @brief Close a client connection. A connection with an executing command
+ *        or outstanding I/O is only unwatched, it is freed when they
+ *        complete.
+ *
+ * @param [in] conn Client connection.
+ */
+static void close_conn(struct conn *conn)
+{
+    if (!conn->closed) {
+        conn->loop->io->unwatch(conn);
+        conn->closed = 1;
+    }
+
+    // A live stream ends with the connection.
+    if (conn->stream) {
+        stop_stream(conn);
+    }
+
+    // So does a download, its files are closed once no splice uses them.
+    conn->splice_len = 0;
+
+    release_conn(conn);
+}
+
+/**
+ * @brief Free a closed connection unless still in use.
+ *
+ * @param [in] conn Client connection.
+ */
+static void release_conn(struct conn *conn)
+{
+    if (0 == conn->busy && 0 == conn->inflight) {
+        free_conn(conn);
+    }
+}
+
+/**
+ * @brief Unlink and free a client connection.
+ *
+ * @param [in] conn Client connection.
+ */
+static void free_conn(struct conn *conn)
+{
+    struct msg *msg, *next;
+    struct conn **p;
+    uint32_t i;
+
+    for (p = &conn->loop->conns; *p; p = &(*p)->next) {
+        if (*p == conn) {
+            *p = conn->next;
+            break;
+        }
+    }
+
+    ALOGD("%s:%d: Client disconnected (peer: %s)", _FILE, __LINE__,
+          conn->peer);
+
+    recorder_add(RECORDER_CLOSE, conn->serial, NULL);
+
+    remove_client(conn->fd);
+    close(conn->fd);
+    archive_close(conn->archive);
+    (void)pool_charge(-(int64_t)conn->backlog);
+    free(conn->out);
+    for (i = 0; i < NUM_OUT_CLASSES; i++) {
+        for (msg = conn->queues[i].head; msg; msg = next) {
+            next = msg->next;
+            free(msg);
+        }
+    }
+    batch_free(conn->batch);
+    pool_free(&conn_pool, conn);
+}
+
+/**
+ * @brief Send pending response data and handle received commands, until
+ *        the connection has to wait for the socket or a command to complete.
+ *
+ * @param [in] conn Client connection.
+ */
+static void serve_conn(struct conn *conn)
+{
+    char cmd[CMD_LINE_LENGTH];
+    uint32_t id;
+
+    while (1) {
+        // Command responses don't wait for their turn.
+        do {
+            if (fill_output(conn, OUT_CONTROL, OUT_CHUNK) == -1 ||
+                    conn->loop->io->send(conn) == -1) {
+                return;
+            }
+        } while (0 == conn->out_len && 0 == conn->splice_len &&
+                 conn->queues[OUT_CONTROL].head);
+
+        if (!want_input(conn)) {
+            break;
+        }
+
+        if (next_command(conn, cmd, &id) == -1) {
+            break;
+        }
+
+        if (submit_command(conn, id, cmd) == -1) {
+            return;
+        }
+    }
+
+    conn->loop->io->update(conn);
+}
+
+/**
+ * @brief Check if a connection takes further commands. Text commands are
+ *        handled one at a time, so responses are sent in order. Binary
+ *        requests execute concurrently and are answered as they complete.
+ *        A connection with a live stream takes the command stopping it,
+ *        whatever output is pending.
+ *
+ * @param [in] conn Client connection.
+ *
+ * @return Returns 1 if further commands are taken, else 0.
+ */
+static int want_input(struct conn *conn)
+{
+    if (conn->binary) {
+        return conn->busy < MAX_CONN_COMMANDS &&
+               (conn->stream || conn->backlog < MAX_CONN_OUTPUT);
+    }
+
+    return conn->stream || (0 == conn->busy && 0 == conn->backlog);
+}
+
+/**
+ * @brief Account for response data sent to a client.
+ *
+ * @param [in] conn Client connection.
+ * @param [in] len  Number of bytes sent.
+ */
+static void sent_conn(struct conn *conn, uint32_t len)
+{
+    conn->out_pos += len;
+    conn->backlog -= len;
+    (void)pool_charge(-(int64_t)len);
+
+    if (conn->out_pos >= conn->out_len) {
+        free(conn->out);
+        conn->out = NULL;
+        conn->out_len = 0;
+        conn->out_pos = 0;
+    }
+}
+
+/**
+ * @brief Move queued messages of a class to the output being sent, once
+ *        the previous output is sent. Messages are moved whole, so the
+ *        classes are only interleaved between messages.
+ *
+ * @param [in out] conn  Client connection.
+ * @param [in]     cls   Output class.
+ * @param [in]     limit Max output to move, at least one message is moved.
+ *
+ * @return Returns 0 on success and -1 on failure, the connection is then
+ *         closed.
+ */
+static int fill_output(struct conn *conn, enum out_class cls,
+                       uint32_t limit)
+{
+    struct msg_queue *q = &conn->queues[cls];
+    struct msg *msg;
+    char *p;
+
+    // Announced file data follows its frame header, once the header is no
+    // longer queued.
+    if (conn->sending || conn->out_pos < conn->out_len ||
+            (conn->splice_len > 0 && NULL == conn->queues[OUT_BULK].head)) {
+        return 0;
+    }
+
+    while ((msg = q->head) != NULL) {
+        if (conn->out_len > 0 && conn->out_len + msg->len > limit) {
+            break;
+        }
+
+        p = realloc(conn->out, conn->out_len + msg->len);
+
+        if (NULL == p) {
+            ALOGE("%s:%d: Failed to allocated memory", _FILE, __LINE__);
+            close_conn(conn);
+            return -1;
+        }
+
+        memcpy(p + conn->out_len, msg->data, msg->len);
+        conn->out = p;
+        conn->out_len += msg->len;
+
+        q->head = msg->next;
+        if (NULL == q->head) {
+            q->tail = NULL;
+        }
+        free(msg);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Send queued stream and bulk output. Streams are served before
+ *        downloads, and connections of the same class take turns by
+ *        deficit round robin, each sending up to a quantum per turn, as
+ *        long as the rate limits allow. A connection held back by a rate
+ *        limit keeps its turn for the next call.
+ *
+ * @param [in] loop I/O loop.
+ */
+static void schedule_output(struct ioloop *loop)
+{
+    struct conn *conn, *next;
+    uint32_t cls, i, len;
+    int active, waiting;
+
+    loop->throttled = 0;
+
+    for (cls = OUT_STREAM; cls < NUM_OUT_CLASSES; cls++) {
+        do {
+            active = 0;
+            waiting = 0;
+
+            for (conn = loop->conns; conn; conn = next) {
+                next = conn->next;
+
+                // Downloads are generated as their turn comes.
+                if (conn->closed || conn->sending ||
+                        conn->out_pos < conn->out_len ||
+                        conn->splice_len > 0 ||
+                        (NULL == conn->queues[cls].head &&
+                         (cls != OUT_BULK || NULL == conn->archive))) {
+                    continue;
+                }
+
+                // Output of a higher class is sent first.
+                for (i = OUT_CONTROL; i < cls; i++) {
+                    if (conn->queues[i].head) {
+                        break;
+                    }
+                }
+
+                if (i < cls) {
+                    continue;
+                }
+
+                // Already had its turn in this round.
+                if (conn->rounds[cls] == loop->rounds[cls]) {
+                    waiting = 1;
+                    continue;
+                }
+
+                // Nobody may send until the total limit allows.
+                if (!total_allowed()) {
+                    loop->throttled = 1;
+                    return;
+                }
+
+                if (!client_allowed(conn)) {
+                    loop->throttled = 1;
+                    continue;
+                }
+
+                conn->rounds[cls] = loop->rounds[cls];
+                conn->deficit += OUT_QUANTUM;
+                if ((NULL == conn->queues[cls].head &&
+                     pump_archive(conn, conn->deficit) == -1) ||
+                        fill_output(conn, cls, conn->deficit) == -1) {
+                    continue;
+                }
+                len = conn->out_len + conn->splice_len;
+
+                // A message longer than the deficit is sent whole.
+                conn->deficit = (NULL == conn->queues[cls].head ||
+                                 len >= conn->deficit) ? 0 :
+                                conn->deficit - len;
+                take_tokens(conn, len);
+                active = 1;
+
+                // The connection may be freed.
+                serve_conn(conn);
+            }
+
+            // Start the next round once every connection had its turn.
+            if (!active && waiting) {
+                loop->rounds[cls]++;
+                active = 1;
+            }
+        } while (active);
+    }
+}
+
+/**
+ * @brief Check if the rate limit of a client allows it to send stream or
+ *        bulk output.
+ *
+ * @param [in out] conn Client connection.
+ *
+ * @return Returns 1 if output may be sent, else 0.
+ */
+static int client_allowed(struct conn *conn)
+{
+    if (0 == conn->bucket.rate) {
+        return 1;
+    }
+
+    refill(&conn->bucket, get_monotonic_ms());
+
+    return conn->bucket.tokens > 0;
+}
+
+/**
+ * @brief Check if the rate limit of all clients allows stream or bulk
+ *        output to be sent.
+ *
+ * @return Returns 1 if output may be sent, else 0.
+ */
+static int total_allowed(void)
+{
+    int allowed;
+
+    if (0 == total_bucket.rate) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&rate_mutex);
+    refill(&total_bucket, get_monotonic_ms());
+    allowed = total_bucket.tokens > 0;
+    pthread_mutex_unlock(&rate_mutex);
+
+    return allowed;
+}
+
+/**
+ * @brief Account for output of a connection in the rate limits.
+ *
+ * @param [in out] conn Client connection.
+ * @param [in]     len  Output length.
+ */
+static void take_tokens(struct conn *conn, uint32_t len)
+{
+    if (conn->bucket.rate > 0) {
+        conn->bucket.tokens -= (int64_t)len * 1000;
+    }
+
+    if (total_bucket.rate > 0) {
+        pthread_mutex_lock(&rate_mutex);
+        total_bucket.tokens -= (int64_t)len * 1000;
+        pthread_mutex_unlock(&rate_mutex);
+    }
+}
+
+/**
+ * @brief Add the tokens of the time passed to a bucket, up to a burst.
+ *
+ * @param [in out] bucket Token bucket.
+ * @param [in]     now    Monotonic time.
+ */
+static void refill(struct bucket *bucket, uint64_t now)
+{
+    int64_t burst = (int64_t)bucket->rate * BURST_MS;
+
+    if (now > bucket->last_ms) {
+        bucket->tokens += (int64_t)(now - bucket->last_ms) * bucket->rate;
+        bucket->last_ms = now;
+    }
+
+    if (bucket->tokens > burst) {
+        bucket->tokens = burst;
+    }
+}
+
+/**
+ * @brief Set up an I/O loop for epoll.
+ *
+ * @param [in out] loop I/O loop.
+ *
+ * @return Returns 0 at success and -1 at failure.
+ */
+static int epoll_init(struct ioloop *loop)
+{
+    struct epoll_event ev;
+
+    // Accept connections without blocking the loop.
+    set_nonblock(loop->sockfd, 1);
+    set_nonblock(loop->evfd, 1);
+
+    if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        ALOGE("%s:%d: Failed to create I/O loop (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
+
+    // The listening socket and event counter are told apart by address.
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->sockfd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->sockfd, &ev) == -1) {
+        ALOGE("%s:%d: Failed to watch server socket (errno=%d)", _FILE,
+              __LINE__, errno);
+        return -1;
+    }
+
+    ev.data.ptr = &loop->evfd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev) == -1) {
+        ALOGE("%s:%d: Failed to watch event counter (errno=%d)", _FILE,
+              __LINE__, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Wait for and handle events with epoll.
+ *
+ * @param [in] loop I/O loop.
+ */
+static void epoll_run(struct ioloop *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct conn *conn;
+    int i, n, completed, wait, timeout = -1;
+    uint64_t count;
+
+    if (idle_timeout_ms > 0) {
+        timeout = (idle_timeout_ms < IDLE_CHECK_MS) ? idle_timeout_ms :
+                                                      IDLE_CHECK_MS;
+    }
+
+    while (1) {
+        // Output held back by a rate limit is retried soon.
+        wait = timeout;
+        if (loop->throttled && (-1 == wait || wait > SHAPE_MS)) {
+            wait = SHAPE_MS;
+        }
+
+        n = epoll_wait(loop->epfd, events, MAX_EVENTS, wait);
+
+        if (-1 == n && errno != EINTR) {
+            ALOGE("%s:%d: Failed to wait for events (errno=%d)", _FILE,
+                  __LINE__, errno);
+            break;
+        }
+
+        for (i = 0, completed = 0; i < n; i++) {
+            if (events[i].data.ptr == &loop->sockfd) {
+                epoll_accept(loop);
+            } else if (events[i].data.ptr == &loop->evfd) {
+                completed = 1;
+            } else {
+                conn = events[i].data.ptr;
+
+                // Output is sent first, further input is received later.
+                if (events[i].events & EPOLLOUT) {
+                    serve_conn(conn);
+                } else {
+                    epoll_recv(conn);
+                }
+            }
+        }
+
+        // Completions may free connections, so they are handled last.
+        if (completed) {
+            if (read(loop->evfd, &count, sizeof(count)) == -1 &&
+                    errno != EAGAIN) {
+                ALOGE("%s:%d: Failed to read event counter (errno=%d)", _FILE,
+                      __LINE__, errno);
+            }
+            complete_jobs(loop);
+        }
+
+        schedule_output(loop);
+
+        if (idle_timeout_ms > 0) {
+            check_idle(loop);
+        }
+
+        check_upgrade(loop);
+    }
+}
+
+/**
+ * @brief Watch a client socket with epoll.
+ *
+ * @param [in] conn Client connection.
+ *
+ * @return Returns 0 at success and -1 at failure.
+ */
+static int epoll_watch(struct conn *conn)
+{
+    struct epoll_event ev;
+
+    // Sockets handed over at upgrade may still be blocking.
+    set_nonblock(conn->fd, 1);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+
+    return epoll_ctl(conn->loop->epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+}
+
+/**
+ * @brief Stop watching a client socket with epoll.
+ *
+ * @param [in] conn Client connection.
+ */
+static void epoll_unwatch(struct conn *conn)
+{
+    (void)epoll_ctl(conn->loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+}
+
+/**
+ * @brief Update the events watched for a connection. Data is left in the
+ *        socket while the connection takes no further commands.
+ *
+ * @param [in] conn Client connection.
+ */
+static void epoll_update(struct conn *conn)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.ptr = conn;
+
+    if (conn->out_pos < conn->out_len || conn->splice_len > 0) {
+        ev.events = EPOLLOUT;
+    }
+
+    if (want_input(conn)) {
+        ev.events |= EPOLLIN;
+    }
+
+    (void)epoll_ctl(conn->loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/**
+ * @brief Send pending response data to a client, as far as the socket
+ *        accepts it.
+ *
+ * @param [in] conn Client connection.
+ *
+ * @return Returns 0 on success, or -1 if the connection was closed.
+ */
+static int epoll_send(struct conn *conn)
+{
+    ssize_t n;
+
+    while (conn->out_pos < conn->out_len) {
+        // A client that went away must not terminate the proxy.
+        n = send(conn->fd, conn->out + conn->out_pos,
+                 conn->out_len - conn->out_pos, MSG_NOSIGNAL);
+
+        if (-1 == n) {
+            if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                return 0;
+            } else if (errno != EINTR) {
+                ALOGE("%s:%d: Failed to send (errno=%d)", _FILE, __LINE__,
+                      errno);
+                close_conn(conn);
+                return -1;
+            }
+        } else {
+            sent_conn(conn, n);
+        }
+    }
+
+    // File data announced by a sent frame header follows it.
+    while (conn->splice_len > 0) {
+        n = archive_splice(conn->archive, conn->fd, conn->splice_len);
+
+        if (-1 == n) {
+            if (EAGAIN == errno) {
+                return 0;
+            }
+            close_conn(conn);
+            return -1;
+        }
+
+        conn->splice_len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Accept all pending connections on the listening socket.
+ *
+ * @param [in] loop I/O loop.
+ */
+static void epoll_accept(struct ioloop *loop)
+{
+    char peer[INET6_ADDRSTRLEN];
+    int fd;
+
+    while (1) {
+        // The connection must not be inherited by MLD processes, they would
+        // keep it open after the proxy exits.
+        fd = accept4(loop->sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (-1 == fd) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                ALOGE("%s:%d: Connection not accepted (errno=%d)", _FILE,
+                      __LINE__, errno);
+            }
+            break;
+        }
+
+        get_peer(fd, peer, sizeof(peer));
+
+        // Refused connections are answered and closed in start_client().
+        (void)start_client(loop, fd, peer, 0);
+    }
+}
+
+/**
+ * @brief Receive data from a client and handle a complete command.
+ *
+ * @param [in] conn Client connection.
+ */
+static void epoll_recv(struct conn *conn)
+{
+    ssize_t n;
+
+    // Wait for the received command to be handled.
+    if (conn->in_len == sizeof(conn->in)) {
+        return;
+    }
+
+    n = recv(conn->fd, conn->in + conn->in_len,
+             sizeof(conn->in) - conn->in_len, 0);
+
+    if (0 == n) {
+        ALOGD("%s:%d: Connection closed by peer", _FILE, __LINE__);
+        close_conn(conn);
+        return;
+    } else if (-1 == n) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            ALOGD("%s:%d: Connection error (errno=%d)", _FILE, __LINE__,
+                  errno);
+            close_conn(conn);
+        }
+        return;
+    }
+
+    conn->in_len += n;
+    conn->active_ms = get_monotonic_ms();
+
+    serve_conn(conn);
+}
+
+/**
+ * @brief Set up an I/O loop for io_uring. Connections are accepted by one
+ *        multishot request and received into buffers provided to the kernel,
+ *        so idle connections hold no buffer.
+ *
+ * @param [in out] loop I/O loop.
+ *
+ * @return Returns 0 at success and -1 at failure.
+ */
+static int ring_init(struct ioloop *loop)
+{
+    uint32_t interval;
+
+    if (!uring_supported(ring_ops, sizeof(ring_ops)) ||
+            uring_init(&loop->ring, RING_ENTRIES) == -1) {
+        return -1;
+    }
+
+    loop->bufs = malloc(RING_BUFS * CMD_LINE_LENGTH);
+
+    if (NULL == loop->bufs) {
+        ALOGE("%s:%d: Failed to allocated memory", _FILE, __LINE__);
+        uring_exit(&loop->ring);
+        return -1;
+    }
+
+    // Requests on non-blocking files fail instead of waiting.
+    set_nonblock(loop->sockfd, 0);
+    set_nonblock(loop->evfd, 0);
+
+    loop->multishot = 1;
+    ring_provide(loop, 0, RING_BUFS);
+    ring_accept(loop);
+    ring_read_event(loop);
+
+    if (idle_timeout_ms > 0) {
+        interval = (idle_timeout_ms < IDLE_CHECK_MS) ? idle_timeout_ms :
+                                                       IDLE_CHECK_MS;
+        loop->ts.tv_sec = interval / 1000;
+        loop->ts.tv_nsec = (interval % 1000) * 1000000L;
+        ring_timeout(loop);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Submit requests and handle their completions with io_uring.
+ *
+ * @param [in] loop I/O loop.
+ */
+static void ring_run(struct ioloop *loop)
+{
+    struct io_uring_cqe *cqe;
+    uint64_t data;
+    uint32_t flags;
+    int res;
+
+    while (1) {
+        if (uring_submit(&loop->ring, 1) == -1) {
+            ALOGE("%s:%d: Failed to wait for completions (errno=%d)", _FILE,
+                  __LINE__, errno);
+            break;
+        }
+
+        while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+            data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            uring_cqe_seen(&loop->ring);
+
+            ring_complete(loop, data, res, flags);
+        }
+
+        schedule_output(loop);
+
+        // Output held back by a rate limit is retried soon.
+        if (loop->throttled && !loop->shaping) {
+            ring_shape(loop);
+        }
+
+        if (idle_timeout_ms > 0) {
+            check_idle(loop);
+        }
+
+        check_upgrade(loop);
+    }
+}
+
+/**
+ * @brief Start receiving from a client socket with io_uring.
+ *
+ * @param [in] conn Client connection.
+ *
+ * @return Returns 0 at success and -1 at failure.
+ */
+static int ring_watch(struct conn *conn)
+{
+    // Sockets handed over at upgrade may be non-blocking.
+    set_nonblock(conn->fd, 0);
+
+    ring_recv(conn);
+
+    return conn->recving ? 0 : -1;
+}
+
+/**
+ * @brief Stop serving a client socket with io_uring. Outstanding requests
+ *        are completed by shutting the socket down.
+ *
+ * @param [in] conn Client connection.
+ */
+static void ring_unwatch(struct conn *conn)
+{
+    if (conn->inflight > 0) {
+        (void)shutdown(conn->fd, SHUT_RDWR);
+    }
+}
+
+/**
+ * @brief Receive further commands once the connection takes them.
+ *
+ * @param [in] conn Client connection.
+ */
+static void ring_update(struct conn *conn)
+{
+    if (!want_input(conn) || conn->recving) {
+        return;
+    }
+
+    ring_recv(conn);
+}
+
+/**
+ * @brief Queue a send of the pending response data, or of the file data
+ *        announced by a sent frame header. For text commands a receive for
+ *        the next command is linked to it, and starts once the send is
+ *        complete.
+ *
+ * @param [in] conn Client connection.
+ *
+ * @return Returns 0 on success, or -1 if the connection was closed.
+ */
+static int ring_send(struct conn *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    if (conn->sending) {
+        return 0;
+    }
+
+    if (conn->out_pos == conn->out_len) {
+        return (conn->splice_len > 0) ? ring_splice(conn) : 0;
+    }
+
+    sqe = ring_sqe(conn->loop, conn, OP_SEND);
+
+    if (NULL == sqe) {
+        close_conn(conn);
+        return -1;
+    }
+
+    // A client that went away must not terminate the proxy.
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)(conn->out + conn->out_pos);
+    sqe->len = conn->out_len - conn->out_pos;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    conn->sending = 1;
+
+    // A short send cancels the receive, it's queued again after the send.
+    if (!conn->binary && 0 == conn->busy && !conn->recving) {
+        sqe->flags |= IOSQE_IO_LINK;
+        ring_recv(conn);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Queue a splice of file data announced by a sent frame header. The
+ *        data is moved from the file to a pipe, then from the pipe to the
+ *        socket, one request at a time.
+ *
+ * @param [in] conn Client connection.
+ *
+ * @return Returns 0 on success, or -1 if the connection was closed.
+ */
+static int ring_splice(struct conn *conn)
+{
+    struct archive_step step;
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_sqe(conn->loop, conn, OP_SPLICE);
+
+    if (NULL == sqe) {
+        close_conn(conn);
+        return -1;
+    }
+
+    archive_splice_step(conn->archive, conn->fd, conn->splice_len, &step);
+
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = step.fd_out;
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = step.fd_in;
+    sqe->splice_off_in = (uint64_t)step.off_in;
+    sqe->len = step.len;
+    sqe->splice_flags = step.flags;
+    conn->sending = 1;
+
+    return 0;
+}
+
+/**
+ * @brief Handle a completed io_uring request.
+ *
+ * @param [in] loop  I/O loop.
+ * @param [in] data  User data of the request.
+ * @param [in] res   Result of the request.
+ * @param [in] flags Completion flags.
+ */
+static void ring_complete(struct ioloop *loop, uint64_t data, int res,
+                          uint32_t flags)
+{
+    struct conn *conn = (struct conn *)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+    char peer[INET6_ADDRSTRLEN];
+    int n;
+
+    switch (data & OP_MASK) {
+    case OP_ACCEPT:
+        if (res >= 0) {
+            get_peer(res, peer, sizeof(peer));
+
+            // Refused connections are answered and closed in start_client().
+            (void)start_client(loop, res, peer, 0);
+        } else if (-EINVAL == res && loop->multishot) {
+            // Multishot accept isn't supported by older kernels.
+            loop->multishot = 0;
+        } else {
+            ALOGE("%s:%d: Connection not accepted (errno=%d)", _FILE,
+                  __LINE__, -res);
+        }
+
+        if (!(flags & IORING_CQE_F_MORE)) {
+            ring_accept(loop);
+        }
+        break;
+
+    case OP_EVENT:
+        if (res < 0) {
+            ALOGE("%s:%d: Failed to read event counter (errno=%d)", _FILE,
+                  __LINE__, -res);
+        }
+        complete_jobs(loop);
+        ring_read_event(loop);
+        break;
+
+    case OP_TIMEOUT:
+        ring_timeout(loop);
+        break;
+
+    case OP_SHAPE:
+        loop->shaping = 0;
+        break;
+
+    case OP_BUFFERS:
+        if (res < 0) {
+            ALOGE("%s:%d: Failed to provide buffers (errno=%d)", _FILE,
+                  __LINE__, -res);
+        }
+        break;
+
+    case OP_RECV:
+        conn->inflight--;
+        conn->recving = 0;
+        ring_received(conn, res, flags);
+        break;
+
+    case OP_SEND:
+        conn->inflight--;
+        conn->sending = 0;
+
+        if (conn->closed) {
+            release_conn(conn);
+        } else if (res < 0) {
+            ALOGE("%s:%d: Failed to send (errno=%d)", _FILE, __LINE__, -res);
+            close_conn(conn);
+        } else {
+            sent_conn(conn, res);
+            serve_conn(conn);
+        }
+        break;
+
+    case OP_SPLICE:
+        conn->inflight--;
+        conn->sending = 0;
+
+        if (conn->closed) {
+            release_conn(conn);
+        } else if ((n = archive_splice_done(conn->archive, res)) == -1 &&
+                   errno != EAGAIN) {
+            close_conn(conn);
+        } else {
+            conn->splice_len -= (n > 0) ? n : 0;
+            serve_conn(conn);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Queue an accept request on the listening socket.
+ *
+ * @param [in] loop I/O loop.
+ */
+static void ring_accept(struct ioloop *loop)
+{
+    struct io_uring_sqe *sqe = ring_sqe(loop, NULL, OP_ACCEPT);
+
+    if (NULL == sqe) {
+        return;
+    }
+
+    // The connection must not be inherited by MLD processes, they would
+    // keep it open after the proxy exits.
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->sockfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+
+    if (loop->multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+}
+
+/**
+ * @brief Queue a read of the event counter signaled by completed commands.
+ *
+ * @param [in] loop I/O loop.
+ */
+static void ring_read_event(struct ioloop *loop)
+{
+    struct io_uring_sqe *sqe = ring_sqe(loop, NULL, OP_EVENT);
+
+    if (NULL == sqe) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->evfd;
+    sqe->addr = (uintptr_t)&loop->count;
+    sqe->len = sizeof(loop->count);
+}
+
+/**
+ * @brief Queue a timeout, so idle connections are checked even if there is
+ *        no I/O.
+ *
+ * @param [in] loop I/O loop.
+ */
+static void ring_timeout(struct ioloop *loop)
+{
+    struct io_uring_sqe *sqe = ring_sqe(loop, NULL, OP_TIMEOUT);
+
+    if (NULL == sqe) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&loop->ts;
+    sqe->len = 1;
+}
+
+/**
+ * @brief Queue a one-shot timeout, so output held back by a rate limit is
+ *        retried even if there is no I/O.
+ *
+ * @param [in] loop I/O loop.
+ */
+static void ring_shape(struct ioloop *loop)
+{
+    struct io_uring_sqe *sqe = ring_sqe(loop, NULL, OP_SHAPE);
+
+    if (NULL == sqe) {
+        return;
+    }
+
+    loop->shape_ts.tv_sec = 0;
+    loop->shape_ts.tv_nsec = SHAPE_MS * 1000000L;
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&loop->shape_ts;
+    sqe->len = 1;
+    loop->shaping = 1;
+}
+
+/**
+ * @brief Provide receive buffers to the kernel.
+ *
+ * @param [in] loop I/O loop.
+ * @param [in] bid  ID of the first buffer.
+ * @param [in] num  Number of buffers.
+ */
+static void ring_provide(struct ioloop *loop, uint32_t bid, uint32_t num)
+{
+    struct io_uring_sqe *sqe = ring_sqe(loop, NULL, OP_BUFFERS);
+
+    if (NULL == sqe) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = num;
+    sqe->addr = (uintptr_t)(loop->bufs + bid * CMD_LINE_LENGTH);
+    sqe->len = CMD_LINE_LENGTH;
+    sqe->off = bid;
+    sqe->buf_group = RING_BGID;
+}
+
+/**
+ * @brief Queue a receive into a provided buffer.
+ *
+ * @param [in] conn Client connection.
+ */
+static void ring_recv(struct conn *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    // Wait for the received command to be handled.
+    if (conn->in_len == sizeof(conn->in)) {
+        return;
+    }
+
+    sqe = ring_sqe(conn->loop, conn, OP_RECV);
+
+    if (NULL == sqe) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->len = sizeof(conn->in) - conn->in_len;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RING_BGID;
+    conn->recving = 1;
+}
+
+/**
+ * @brief Handle received data. The provided buffer is copied and given back
+ *        to the kernel.
+ *
+ * @param [in] conn  Client connection.
+ * @param [in] res   Number of bytes received, or negative error code.
+ * @param [in] flags Completion flags.
+ */
+static void ring_received(struct conn *conn, int res, uint32_t flags)
+{
+    uint32_t bid;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (res > 0 && !conn->closed) {
+            memcpy(conn->in + conn->in_len,
+                   conn->loop->bufs + bid * CMD_LINE_LENGTH, res);
+            conn->in_len += res;
+        }
+
+        ring_provide(conn->loop, bid, 1);
+    }
+
+    if (conn->closed) {
+        release_conn(conn);
+    } else if (0 == res) {
+        ALOGD("%s:%d: Connection closed by peer", _FILE, __LINE__);
+        close_conn(conn);
+    } else if (res < 0) {
+        // A receive linked to a short send is canceled.
+        if (-ECANCELED == res || -EINTR == res || -ENOBUFS == res) {
+            serve_conn(conn);
+        } else {
+            ALOGD("%s:%d: Connection error (errno=%d)", _FILE, __LINE__,
+                  -res);
+            close_conn(conn);
+        }
+    } else {
+        conn->active_ms = get_monotonic_ms();
+        serve_conn(conn);
+    }
+}
+
+/**
+ * @brief Get a submission queue entry for a request.
+ *
+ * @param [in] loop I/O loop.
+ * @param [in] conn Client connection, or NULL for requests of the loop.
+ * @param [in] op   Kind of request.
+ *
+ * @return Returns the entry, or NULL at failure.
+ */
+static struct io_uring_sqe * ring_sqe(struct ioloop *loop, struct conn *conn,
+                                      enum ring_op op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+
+    if (NULL == sqe) {
+        return NULL;
+    }
+
+    sqe->user_data = (uintptr_t)conn | op;
+
+    if (conn) {
+        conn->inflight++;
+    }
+
+    return sqe;
+}
+
+/**
+ * @brief Take the next received command.
+ *
+ * @param [in]  conn Client connection.
+ * @param [out] cmd  Destination buffer of CMD_LINE_LENGTH bytes.
+ * @param [out] id   Request ID, 0 for text commands.
+ *
+ * @return Returns 0 at success, or -1 if no complete command is received.
+ */
+static int next_command(struct conn *conn, char *cmd, uint32_t *id)
+{
+    char *end;
+    uint32_t len;
+
+    if (conn->binary) {
+        return next_frame(conn, cmd, id);
+    }
+
+    *id = 0;
+    end = memchr(conn->in, ASCII_LF, conn->in_len);
+
+    if (NULL == end) {
+        // Discard a line too long to be a command.
+        if (conn->in_len == sizeof(conn->in)) {
+            conn->in_len = 0;
+        }
+        return -1;
+    }
+
+    // Message received (remove line feed character).
+    len = end - conn->in;
+    memcpy(cmd, conn->in, len);
+    cmd[len] = '\0';
+
+    conn->in_len -= len + 1;
+    memmove(conn->in, end + 1, conn->in_len);
+
+    return 0;
+}
+
+/**
+ * @brief Take the next received request frame. The payload of a frame that
+ *        isn't a request, or is too long to be a command, is discarded and
+ *        the request is answered as an empty command.
+ *
+ * @param [in]  conn Client connection.
+ * @param [out] cmd  Destination buffer of CMD_LINE_LENGTH bytes.
+ * @param [out] id   Request ID.
+ *
+ * @return Returns 0 at success, or -1 if no complete frame is received.
+ */
+static int next_frame(struct conn *conn, char *cmd, uint32_t *id)
+{
+    const uint8_t *hdr = (const uint8_t *)conn->in;
+    uint32_t len, n;
+
+    // Discard the rest of a bad frame.
+    if (conn->skip > 0) {
+        n = (conn->skip < conn->in_len) ? conn->skip : conn->in_len;
+        conn->skip -= n;
+        conn->in_len -= n;
+        memmove(conn->in, conn->in + n, conn->in_len);
+    }
+
+    if (conn->in_len < FRAME_HDR_LEN) {
+        return -1;
+    }
+
+    *id = ((uint32_t)hdr[4] << 24) | ((uint32_t)hdr[5] << 16) |
+          ((uint32_t)hdr[6] << 8) | hdr[7];
+    len = ((uint32_t)hdr[8] << 24) | ((uint32_t)hdr[9] << 16) |
+          ((uint32_t)hdr[10] << 8) | hdr[11];
+
+    if (hdr[0] != FRAME_REQUEST || len >= CMD_LINE_LENGTH) {
+        ALOGD("%s:%d: Bad frame (type=%u, len=%u)", _FILE, __LINE__, hdr[0],
+              len);
+        cmd[0] = '\0';
+        conn->in_len -= FRAME_HDR_LEN;
+        memmove(conn->in, conn->in + FRAME_HDR_LEN, conn->in_len);
+        conn->skip = len;
+        return 0;
+    }
+
+    if (conn->in_len < FRAME_HDR_LEN + len) {
+        return -1;
+    }
+
+    memcpy(cmd, conn->in + FRAME_HDR_LEN, len);
+    cmd[len] = '\0';
+
+    conn->in_len -= FRAME_HDR_LEN + len;
+    memmove(conn->in, conn->in + FRAME_HDR_LEN + len, conn->in_len);
+
+    return 0;
+}
+
+/**
+ * @brief Hand a command to the executor. Commands for the same log session
+ *        execute in the order received. A command that can't be queued is
+ *        answered directly.
+ *
+ * @param [in] conn Client connection.
+ * @param [in] id   Request ID, binary protocol only.
+ * @param [in] cmd  Command string.
+ *
+ * @return Returns 0 on success, or -1 if the connection was closed.
+ */
+static int submit_command(struct conn *conn, uint32_t id, const char *cmd)
+{
+    char key[CMD_LINE_LENGTH];
+    struct job *job;
+    int rc;
+
+    recorder_add(conn->binary ? RECORDER_BINARY : RECORDER_TEXT,
+                 conn->serial, cmd);
+
+    // Switch the connection to binary frames once acknowledged.
+    if (!conn->binary && strcmp(cmd, PROTO_BINARY) == 0) {
+        if (set_output(conn, id, 0, NULL) == -1) {
+            return -1;
+        }
+        conn->binary = 1;
+        set_client_binary(conn->fd);
+        return 0;
+    }
+
+    // Any line ends the live stream of a text connection.
+    if (conn->stream && (!conn->binary || strcmp(cmd, STREAM_STOP) == 0)) {
+        stop_stream(conn);
+        return conn->binary ? set_output(conn, id, 0, NULL) : 0;
+    }
+
+    // Collect the commands of a batch until its end.
+    if (conn->batch) {
+        if (strcmp(cmd, BATCH_END) == 0) {
+            return submit_batch(conn);
+        }
+        (void)batch_add(conn->batch, cmd);
+        return 0;
+    }
+
+    if (batch_is_open(cmd)) {
+        conn->batch = batch_create(cmd);
+        if (NULL == conn->batch) {
+            return set_output(conn, id, -1, NULL);
+        }
+        conn->batch_id = id;
+        return 0;
+    }
+
+    // Streams and downloads don't take a place in the queue, but neither is
+    // started while draining for an upgrade.
+    if ((logstream_is_open(cmd) || archive_is_open(cmd)) &&
+            draining(conn->loop)) {
+        return set_busy(conn, id);
+    }
+
+    if (logstream_is_open(cmd)) {
+        return start_stream(conn, id, cmd);
+    }
+
+    if (archive_is_open(cmd)) {
+        return start_archive(conn, id, cmd);
+    }
+
+    // Shed the command if too many are already queued.
+    if (begin_command(conn->loop) == -1) {
+        return set_busy(conn, id);
+    }
+
+    job = new_job(conn, id, cmd);
+
+    // Out of memory is transient, like a full queue.
+    if (NULL == job) {
+        end_command();
+        return set_busy(conn, id);
+    }
+
+    // Log reads don't change sessions, they run in any order.
+    if (logindex_is_read(cmd)) {
+        job->cls = OUT_BULK;
+        rc = executor_submit(NULL, run_read, job);
+    } else {
+        rc = executor_submit((tracecmd_key(cmd, key, sizeof(key)) == 0) ?
+                             key : NULL, run_job, job);
+    }
+
+    if (-1 == rc) {
+        end_command();
+        conn->busy--;
+        pool_free(&job_pool, job);
+        return set_output(conn, id, -1, NULL);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Hand the batch received on a connection to the executor. The batch
+ *        takes one place in the queue of commands, whatever its size.
+ *
+ * @param [in] conn Client connection.
+ *
+ * @return Returns 0 on success, or -1 if the connection was closed.
+ */
+static int submit_batch(struct conn *conn)
+{
+    struct batch *batch = conn->batch;
+    uint32_t id = conn->batch_id;
+    struct job *job;
+
+    conn->batch = NULL;
+
+    if (begin_command(conn->loop) == -1) {
+        batch_free(batch);
+        return set_busy(conn, id);
+    }
+
+    job = new_job(conn, id, BATCH_CMD);
+
+    if (NULL == job) {
+        end_command();
+        batch_free(batch);
+        return set_output(conn, id, -1, NULL);
+    }
+
+    if (batch_run(batch, dispatch_command, finish_batch, job) == -1) {
+        end_command();
+        conn->busy--;
+        batch_free(batch);
+        pool_free(&job_pool, job);
+        return set_output(conn, id, -1, NULL);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Allocate the job of a command, counted as executing on the
+ *        connection.
+ *
+ * @param [in] conn Client connection.
+ * @param [in] id   Request ID, binary protocol only.
+ * @param [in] cmd  Command string.
+ *
+ * @return Returns the job, or NULL at failure.
+ */
+static struct job * new_job(struct conn *conn, uint32_t id, const char *cmd)
+{
+    struct job *job = pool_alloc(&job_pool);
+
+    if (NULL == job) {
+        return NULL;
+    }
+
+    job->next = NULL;
+    job->conn = conn;
+    job->id = id;
+    job->rc = -1;
+    job->detailed = 0;
+    job->streamed = 0;
+    job->len = 0;
+    job->lost = 0;
+    job->cls = OUT_CONTROL;
+    snprintf(job->cmd, sizeof(job->cmd), "%s", cmd);
+
+    // Keep the resp buffer terminated.
+    job->resp[0] = '\0';
+    job->resp[RESP_LENGTH] = '\0';
+
+    conn->busy++;
+
+    return job;
+}
+
+/**
+ * @brief Execute a command, called from an executor thread.
+ *
+ * @param [in] arg Job.
+ */
+static void run_job(void *arg)
+{
+    struct job *job = arg;
+
+    // Dispatch the message to a valid handler.
+    job->rc = dispatch_command(job->cmd, job->resp, RESP_LENGTH);
+
+    finish_job(job);
+}
+
+/**
+ * @brief Take the result of a batch, called from the executor thread of its
+ *        last command. The response is sent also when the batch failed, to
+ *        tell which commands did.
+ *
+ * @param [in] arg  Job of the batch.
+ * @param [in] rc   Batch status.
+ * @param [in] resp Batch response, or NULL for none.
+ */
+static void finish_batch(void *arg, int rc, const char *resp)
+{
+    struct job *job = arg;
+
+    job->rc = rc;
+    job->detailed = 1;
+
+    if (resp) {
+        snprintf(job->resp, sizeof(job->resp), "%s", resp);
+    }
+
+    finish_job(job);
+}
+
+/**
+ * @brief Hand an executed job back to the I/O loop of the connection.
+ *
+ * @param [in] job Job.
+ */
+static void finish_job(struct job *job)
+{
+    end_command();
+    post_job(job);
+}
+
+/**
+ * @brief Queue a job to the I/O loop of its connection. Jobs are taken in
+ *        the order queued.
+ *
+ * @param [in] job Job.
+ */
+static void post_job(struct job *job)
+{
+    struct ioloop *loop = job->conn->loop;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&loop->mutex);
+    if (loop->done_tail) {
+        loop->done_tail->next = job;
+    } else {
+        loop->done = job;
+    }
+    loop->done_tail = job;
+    pthread_mutex_unlock(&loop->mutex);
+
+    if (write(loop->evfd, &one, sizeof(one)) == -1) {
+        ALOGE("%s:%d: Failed to signal I/O loop (errno=%d)", _FILE, __LINE__,
+              errno);
+    }
+}
+
+/**
+ * @brief Open a live stream of session output on a connection. The stream
+ *        counts as an executing command until it ends, but isn't queued to
+ *        the executor.
+ *
+ * @param [in] conn Client connection.
+ * @param [in] id   Request ID, binary protocol only.
+ * @param [in] cmd  Command string.
+ *
+ * @return Returns 0 on success, or -1 if the connection was closed.
+ */
+static int start_stream(struct conn *conn, uint32_t id, const char *cmd)
+{
+    struct job *job;
+
+    // One stream at a time per connection.
+    if (conn->stream_job) {
+        return set_output(conn, id, -1, NULL);
+    }
+
+    job = new_job(conn, id, cmd);
+
+    if (NULL == job) {
+        return set_output(conn, id, -1, NULL);
+    }
+
+    job->cls = OUT_STREAM;
+    conn->dropped = 0;
+    conn->stream_job = job;
+    conn->stream = logstream_open(cmd, stream_data, job);
+
+    if (NULL == conn->stream) {
+        conn->stream_job = NULL;
+        conn->busy--;
+        pool_free(&job_pool, job);
+        return set_output(conn, id, -1, NULL);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read a part of a session log, called from an executor thread. The
+ *        output is sent as bulk output, ahead of the response.
+ *
+ * @param [in] arg Job.
+ */
+static void run_read(void *arg)
+{
+    struct job *job = arg;
+
+    job->rc = logindex_read(job->cmd, read_data, job, job->resp,
+                            RESP_LENGTH);
+
+    finish_job(job);
+}
+
+/**
+ * @brief Hand the output of a live stream to the I/O loop of the connection,
+ *        called from the event loop thread. Lines that can't be handed over
+ *        for lack of room or memory are counted as dropped.
+ *
+ * @param [in] arg  Job of the stream.
+ * @param [in] data Output.
+ * @param [in] len  Output length.
+ */
+static void stream_data(void *arg, const char *data, uint32_t len)
+{
+    struct job *stream_job = arg;
+    const char *p = data + post_output(stream_job, data, len, 0);
+    const char *end = data + len;
+    uint64_t lost = 0;
+
+    while ((p = memchr(p, ASCII_LF, end - p)) != NULL) {
+        lost++;
+        p++;
+    }
+
+    if (lost > 0) {
+        __atomic_add_fetch(&stream_job->lost, lost, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Hand the output of a log read to the I/O loop of the connection,
+ *        called from an executor thread. Waits while too much streamed
+ *        output is not yet queued.
+ *
+ * @param [in] arg  Job of the read.
+ * @param [in] data Output.
+ * @param [in] len  Output length.
+ *
+ * @return Returns 0 at success, or -1 at failure, the read then fails.
+ */
+static int read_data(void *arg, const char *data, uint32_t len)
+{
+    if (post_output(arg, data, len, 1) < len) {
+        ALOGE("%s:%d: Log read output lost", _FILE, __LINE__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Hand streamed output to the I/O loop of the connection in chunks,
+ *        accounted against the memory ceiling until sent. The output is
+ *        split at line ends, so whole lines are dropped if the client
+ *        doesn't keep up with a stream.
+ *
+ * @param [in] parent Job of the stream or read.
+ * @param [in] data   Output.
+ * @param [in] len    Output length.
+ * @param [in] wait   Set to wait for room, else output is only handed over
+ *                    while less than MAX_CHUNKS chunks are not yet queued.
+ *
+ * @return Returns the length of the output handed over.
+ */
+static uint32_t post_output(const struct job *parent, const char *data,
+                            uint32_t len, int wait)
+{
+    const char *start = data;
+    const char *end;
+    struct job *job;
+    uint32_t n;
+    int taken;
+
+    while (len > 0) {
+        n = (len < RESP_LENGTH) ? len : RESP_LENGTH;
+        if (n < len && (end = memrchr(data, ASCII_LF, n)) != NULL) {
+            n = end + 1 - data;
+        }
+
+        pthread_mutex_lock(&mutex);
+        while (wait && client.chunks >= MAX_CHUNKS) {
+            pthread_cond_wait(&room, &mutex);
+        }
+        taken = (client.chunks < MAX_CHUNKS);
+        if (taken) {
+            client.chunks++;
+        }
+        pthread_mutex_unlock(&mutex);
+
+        if (taken && pool_charge(CHUNK_CHARGE(n)) == -1) {
+            chunk_queued();
+            taken = 0;
+        }
+
+        job = taken ? pool_alloc(&job_pool) : NULL;
+
+        if (NULL == job) {
+            if (taken) {
+                (void)pool_charge(-CHUNK_CHARGE(n));
+                chunk_queued();
+            }
+            break;
+        }
+
+        job->next = NULL;
+        job->conn = parent->conn;
+        job->id = parent->id;
+        job->streamed = 1;
+        job->len = n;
+        job->cls = parent->cls;
+        memcpy(job->resp, data, n);
+
+        post_job(job);
+
+        data += n;
+        len -= n;
+    }
+
+    return data - start;
+}
+
+/**
+ * @brief Make room for a further chunk of streamed output, once a chunk is
+ *        queued or dropped by the I/O loop.
+ */
+static void chunk_queued(void)
+{
+    pthread_mutex_lock(&mutex);
+    client.chunks--;
+    pthread_cond_signal(&room);
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief End the live stream of a connection. The stream is answered after
+ *        the output already handed to the I/O loop.
+ *
+ * @param [in] conn Client connection.
+ */
+static void stop_stream(struct conn *conn)
+{
+    logstream_close(conn->stream);
+    conn->stream = NULL;
+
+    conn->stream_job->rc = 0;
+    post_job(conn->stream_job);
+}
+
+/**
+ * @brief Queue streamed output, already accounted against the memory
+ *        ceiling by post_output(). Live stream output is dropped if too
+ *        much is already pending.
+ *
+ * @param [in] conn Client connection.
+ * @param [in] job  Job with streamed output.
+ *
+ * @return Returns 0 on success and -1 on failure, the connection is then
+ *         closed.
+ */
+static int add_stream_output(struct conn *conn, const struct job *job)
+{
+    const char *p = job->resp;
+    const char *end = job->resp + job->len;
+    uint8_t hdr[FRAME_HDR_LEN];
+
+    if (OUT_STREAM == job->cls && conn->backlog >= MAX_STREAM_OUTPUT) {
+        while ((p = memchr(p, ASCII_LF, end - p)) != NULL) {
+            conn->dropped++;
+            p++;
+        }
+        (void)pool_charge(-CHUNK_CHARGE(job->len));
+        return 0;
+    }
+
+    if (conn->binary) {
+        make_header(hdr, FRAME_DATA, FRAME_F_MORE, job->id, job->len);
+        return queue_output(conn, job->cls, (const char *)hdr, sizeof(hdr),
+                            job->resp, job->len);
+    }
+
+    (void)pool_charge(-CHUNK_CHARGE(0));
+
+    return queue_output(conn, job->cls, job->resp, job->len, NULL_STR, 0);
+}
+
+/**
+ * @brief Queue the response of an ended stream after its output, telling
+ *        how many lines were dropped. Binary streams end with a data frame
+ *        without more flag.
+ *
+ * @param [in] conn Client connection.
+ * @param [in] job  Job of the stream.
+ *
+ * @return Returns 0 on success and -1 on failure, the connection is then
+ *         closed.
+ */
+static int end_stream(struct conn *conn, struct job *job)
+{
+    conn->stream_job = NULL;
+    conn->dropped += __atomic_load_n(&job->lost, __ATOMIC_RELAXED);
+
+    snprintf(job->resp, sizeof(job->resp), STREAM_RESP, conn->dropped);
+
+    if (conn->binary &&
+            add_frame(conn, OUT_STREAM, FRAME_DATA, 0, job->id, NULL_STR,
+                      0) == -1) {
+        return -1;
+    }
+
+    return add_response(conn, OUT_STREAM, job->id, 0, job->resp);
+}
+
+/**
+ * @brief Queue the response of a log read after its output. Binary reads
+ *        end with a data frame without more flag on success.
+ *
+ * @param [in] conn Client connection.
+ * @param [in] job  Job of the read.
+ *
+ * @return Returns 0 on success and -1 on failure, the connection is then
+ *         closed.
+ */
+static int end_read(struct conn *conn, struct job *job)
+{
+    if (conn->binary && 0 == job->rc &&
+            add_frame(conn, job->cls, FRAME_DATA, 0, job->id, NULL_STR,
+                      0) == -1) {
+        return -1;
+    }
+
+    return add_response(conn, job->cls, job->id, job->rc,
+                        (0 == job->rc) ? job->resp : NULL);
+}
+
+/**
+ * @brief Start the download of a session archive on a connection. The
+ *        archive is generated as the connection takes turns sending bulk
+ *        output, so at most a quantum of it is held at a time. Downloads
+ *        need the binary protocol, the data has no line structure.
+ *
+ * @param [in] conn Client connection.
+ * @param [in] id   Request ID.
+ * @param [in] cmd  Command string.
+ *
+ * @return Returns 0 on success, or -1 if the connection was closed.
+ */
+static int start_archive(struct conn *conn, uint32_t id, const char *cmd)
+{
+    // One download at a time per connection.
+    if (!conn->binary || conn->archive) {
+        ALOGE("%s:%d: Archive not started (peer: %s)", _FILE, __LINE__,
+              conn->peer);
+        return set_output(conn, id, -1, NULL);
+    }
+
+    // File data is spliced to the socket by either backend.
+    conn->archive = archive_open(cmd, 1);
+
+    if (NULL == conn->archive) {
+        return set_output(conn, id, -1, NULL);
+    }
+
+    conn->archive_id = id;
+
+    return 0;
+}
+
+/**
+ * @brief Queue the next data of a download, up to a limit. File data to be
+ *        spliced is queued as a frame header only, the data follows the
+ *        header when sent. The download is answered once complete.
+ *
+ * @param [in] conn  Client connection.
+ * @param [in] limit Max data to queue.
+ *
+ * @return Returns 0 on success and -1 on failure, the connection is then
+ *         closed.
+ */
+static int pump_archive(struct conn *conn, uint32_t limit)
+{
+    uint8_t hdr[FRAME_HDR_LEN];
+    char buf[OUT_QUANTUM];
+    uint64_t body;
+    int n;
+
+    if (limit > sizeof(buf)) {
+        limit = sizeof(buf);
+    }
+
+    n = archive_next(conn->archive, buf, limit, &body);
+
+    if (n > 0) {
+        return add_frame(conn, OUT_BULK, FRAME_DATA, FRAME_F_MORE,
+                         conn->archive_id, buf, n);
+    } else if (-1 == n || 0 == body) {
+        return end_archive(conn, n);
+    }
+
+    conn->splice_len = (body < limit) ? body : limit;
+    make_header(hdr, FRAME_DATA, FRAME_F_MORE, conn->archive_id,
+                conn->splice_len);
+
+    return add_output(conn, OUT_BULK, (const char *)hdr, sizeof(hdr),
+                      NULL_STR, 0);
+}
+
+/**
+ * @brief End a download, with a data frame without more flag on success,
+ *        and answer it with the number of files and the archive size.
+ *
+ * @param [in] conn Client connection.
+ * @param [in] rc   Download status.
+ *
+ * @return Returns 0 on success and -1 on failure, the connection is then
+ *         closed.
+ */
+static int end_archive(struct conn *conn, int rc)
+{
+    char resp[RESP_LENGTH];
+
+    archive_result(conn->archive, resp, sizeof(resp));
+    archive_close(conn->archive);
+    conn->archive = NULL;
+
+    if (0 == rc && add_frame(conn, OUT_BULK, FRAME_DATA, 0, conn->archive_id,
+                             NULL_STR, 0) == -1) {
+        return -1;
+    }
+
+    return add_response(conn, OUT_BULK, conn->archive_id, rc,
+                        (0 == rc) ? resp : NULL);
+}
+
+/**
+ * @brief Send the responses of completed commands.
+ *
+ * @param [in] loop I/O loop.
+ */
+static void complete_jobs(struct ioloop *loop)
+{
+    struct job *job, *next;
+    struct conn *conn;
+    int rc;
+
+    pthread_mutex_lock(&loop->mutex);
+    job = loop->done;
+    loop->done = NULL;
+    loop->done_tail = NULL;
+    pthread_mutex_unlock(&loop->mutex);
+
+    for (; job; job = next) {
+        next = job->next;
+        conn = job->conn;
+
+        // Output of a live stream, sent when its turn comes.
+        if (job->streamed) {
+            if (!conn->closed) {
+                (void)add_stream_output(conn, job);
+            } else {
+                (void)pool_charge(-CHUNK_CHARGE(job->len));
+            }
+            pool_free(&job_pool, job);
+            chunk_queued();
+            continue;
+        }
+
+        conn->busy--;
+
+        report_first_command();
+
+        if (conn->closed) {
+            release_conn(conn);
+        } else {
+            conn->active_ms = get_monotonic_ms();
+            if (job == conn->stream_job) {
+                rc = end_stream(conn, job);
+            } else if (job->cls != OUT_CONTROL) {
+                rc = end_read(conn, job);
+            } else {
+                rc = set_output(conn, job->id, job->rc,
+                                (job->rc != -1 || job->detailed) ? job->resp :
+                                NULL);
+            }
+            if (0 == rc) {
+                serve_conn(conn);
+            }
+        }
+
+        pool_free(&job_pool, job);
+    }
+}
+
+/**
+ * @brief Close connections that have been idle too long, to reclaim their
+ *        slots.
+ *
+ * @param [in] loop I/O loop.
+ */
+static void check_idle(struct ioloop *loop)
+{
+    struct conn *conn, *next;
+    uint64_t now = get_monotonic_ms();
+
+    for (conn = loop->conns; conn; conn = next) {
+        next = conn->next;
+
+        if (0 == conn->busy && !conn->closed &&
+                now - conn->active_ms >= idle_timeout_ms) {
+            ALOGD("%s:%d: Connection idle, closed (peer: %s)", _FILE,
+                  __LINE__, conn->peer);
+            pthread_mutex_lock(&mutex);
+            client.timed_out++;
+            pthread_mutex_unlock(&mutex);
+            metrics_add(METRICS_TIMED_OUT, 1);
+            close_conn(conn);
+        }
+    }
+}
+
+/**
+ * @brief Set the response to a received command as pending output.
+ *
+ * @param [in] conn   Client connection.
+ * @param [in] id     Request ID, binary protocol only.
+ * @param [in] status Command execution status.
+ * @param [in] resp   Response string, or NULL for none. Also sent on
+ *                    failure.
+ *
+ * @return Returns 0 on success and -1 on failure, the connection is then
+ *         closed.
+ */
+static int set_output(struct conn *conn, uint32_t id, int status,
+                      const char *resp)
+{
+    return add_response(conn, OUT_CONTROL, id, status, resp);
+}
+
+/**
+ * @brief Queue a response in an output class.
+ *
+ * @param [in] conn   Client connection.
+ * @param [in] cls    Output class.
+ * @param [in] id     Request ID, binary protocol only.
+ * @param [in] status Command execution status.
+ * @param [in] resp   Response string, or NULL for none.
+ *
+ * @return Returns 0 on success and -1 on failure, the connection is then
+ *         closed.
+ */
+static int add_response(struct conn *conn, enum out_class cls, uint32_t id,
+                        int status, const char *resp)
+{
+    char ack[sizeof(LINE_END) + sizeof(RES_OK)];
+
+    if (NULL == resp) {
+        resp = NULL_STR;
+    }
+
+    if (conn->binary) {
+        return add_frame(conn, cls, FRAME_RESPONSE,
+                         (-1 == status) ? FRAME_F_KO : 0, id, resp,
+                         strlen(resp));
+    }
+
+    // Send response string, if any, before the acknowledgment.
+    snprintf(ack, sizeof(ack), "%s%s",
+             (strcmp(resp, NULL_STR) != 0) ? LINE_END : NULL_STR,
+             (-1 == status) ? RES_KO : RES_OK);
+
+    return add_output(conn, cls, resp, strlen(resp), ack, strlen(ack));
+}
+
+/**
+ * @brief Get server status
+ *
+ * @return Returns the status of the server.
+ */
+static enum status get_server_status(void)
+{
+    enum status status;
+
+    pthread_mutex_lock(&mutex);
+    status = server.status;
+    pthread_mutex_unlock(&mutex);
+
+    return status;
 }
 
 /**
@@ -351,176 +3137,504 @@ static void set_server_status(enum status status)
 }
 
 /**
- * @brief Check if the connection request can be accepted.
+ * @brief Register a connection, if the connection limits allow it.
+ *
+ * @param [in] fd     Client socket file descriptor.
+ * @param [in] peer   Peer address.
+ * @param [in] binary Set if the client uses the binary protocol.
  *
- * @return Returns 1 if accepted, otherwise 0.
+ * @return Returns 0 if accepted, or -1 if refused.
  */
-static int accept_connection(void)
+static int add_client(int fd, const char *peer, int binary)
 {
-    int accept = 0;
+    struct client_slot *slot = NULL;
+    uint32_t i, same_peer = 0;
+    int rc = -1;
 
     pthread_mutex_lock(&mutex);
-    if (client.ref_count < MAX_CONNECTED_CLIENTS) {
-        accept = 1;
+
+    for (i = 0; i < CLIENTS_LIMIT; i++) {
+        if (-1 == client.slots[i].fd) {
+            if (NULL == slot) {
+                slot = &client.slots[i];
+            }
+        } else if (strcmp(client.slots[i].peer, peer) == 0) {
+            same_peer++;
+        }
     }
+
+    if (slot && client.ref_count < max_clients &&
+            (0 == max_per_peer || same_peer < max_per_peer)) {
+        slot->fd = fd;
+        slot->binary = binary;
+        snprintf(slot->peer, sizeof(slot->peer), "%s", peer);
+        client.ref_count++;
+        client.accepted++;
+        rc = 0;
+    } else {
+        client.rejected++;
+    }
+
     pthread_mutex_unlock(&mutex);
 
-    return accept;
+    if (0 == rc) {
+        metrics_add(METRICS_CONNECTED, 1);
+        metrics_add(METRICS_ACCEPTED, 1);
+    } else {
+        metrics_add(METRICS_REJECTED, 1);
+    }
+
+    return rc;
 }
 
 /**
- * @brief Increase the client reference counter.
+ * @brief Unregister a connection.
+ *
+ * @param [in] fd Client socket file descriptor.
  */
-static void inc_ref_count(void)
+static void remove_client(int fd)
 {
+    uint32_t i;
+
     pthread_mutex_lock(&mutex);
-    client.ref_count++;
+    for (i = 0; i < CLIENTS_LIMIT; i++) {
+        if (fd == client.slots[i].fd) {
+            client.slots[i].fd = -1;
+            client.ref_count--;
+            metrics_add(METRICS_CONNECTED, -1);
+            break;
+        }
+    }
     pthread_mutex_unlock(&mutex);
 }
 
 /**
- * @brief Decrease the client reference counter.
+ * @brief Record that a connection switched to the binary protocol, so the
+ *        protocol is kept when the connection is handed over at an upgrade.
+ *
+ * @param [in] fd Client socket file descriptor.
  */
-static void dec_ref_count(void)
+static void set_client_binary(int fd)
 {
+    uint32_t i;
+
     pthread_mutex_lock(&mutex);
-    if (client.ref_count > 0) {
-        client.ref_count--;
+    for (i = 0; i < CLIENTS_LIMIT; i++) {
+        if (fd == client.slots[i].fd) {
+            client.slots[i].binary = 1;
+            break;
+        }
     }
     pthread_mutex_unlock(&mutex);
 }
 
 /**
- * @brief Dispatches the command to the correct sub-handler.
+ * @brief Tell if draining for an upgrade, then a command is refused.
  *
- * @param [in]  cmd  Command string.
- * @param [out] resp Response buffer.
- * @param [in]  len  Length of response buffer.
+ * @param [in out] loop I/O loop of the command, no longer drained if so.
  *
- * @return Returns 0 at success, or -1 at failure.
+ * @return Returns 1 if draining, or 0 otherwise.
  */
-static int dispatch_command(const char *cmd, char *resp, uint32_t len)
+static int draining(struct ioloop *loop)
+{
+    int rc;
+
+    pthread_mutex_lock(&mutex);
+    rc = client.upgrading;
+    if (rc) {
+        client.busy++;
+        // The BUSY reply has to be sent before the upgrade.
+        loop->quiet = 0;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Reserve a place in the bounded queue of commands. No command is
+ *        started while draining for an upgrade.
+ *
+ * @param [in out] loop I/O loop of the command, no longer drained if the
+ *                      command is refused for an upgrade.
+ *
+ * @return Returns 0 at success, or -1 if the queue is full.
+ */
+static int begin_command(struct ioloop *loop)
 {
     int rc = -1;
 
-    // Remove leading whitespace.
-    while (isspace(*cmd)) {
-        cmd++;
+    pthread_mutex_lock(&mutex);
+    if (client.pending < max_pending && !client.upgrading) {
+        client.pending++;
+        rc = 0;
+    } else {
+        client.busy++;
+        if (client.upgrading) {
+            // The BUSY reply has to be sent before the upgrade.
+            loop->quiet = 0;
+        }
     }
+    pthread_mutex_unlock(&mutex);
 
-    // Check for empty command.
-    if ('\0' == *cmd) {
-        ALOGE("%s:%d: No command found", _FILE, __LINE__);
-        return -1;
+    metrics_add((0 == rc) ? METRICS_PENDING : METRICS_BUSY, 1);
+
+    return rc;
+}
+
+/**
+ * @brief Release a place in the queue of commands.
+ */
+static void end_command(void)
+{
+    pthread_mutex_lock(&mutex);
+    client.pending--;
+    pthread_mutex_unlock(&mutex);
+
+    metrics_add(METRICS_PENDING, -1);
+}
+
+/**
+ * @brief Log the time from process start to the first executed command, to
+ *        measure how fast clients are served at boot.
+ */
+static void report_first_command(void)
+{
+    struct procstat stat;
+    struct timespec ts;
+    uint64_t boot_ms, start_ms;
+    char status[CMD_LINE_LENGTH];
+    long hz;
+
+    pthread_mutex_lock(&mutex);
+    if (!first_cmd) {
+        pthread_mutex_unlock(&mutex);
+        return;
     }
+    first_cmd = 0;
+    pthread_mutex_unlock(&mutex);
 
-    // Dispatch command-line to correct handler.
-    if (strncmp(cmd, TRACE_CMD, strlen(TRACE_CMD)) == 0) {
-        rc = tracecmd_exec(cmd, resp, len);
+    hz = sysconf(_SC_CLK_TCK);
+
+    // The process start time has the same base as CLOCK_BOOTTIME.
+    if (hz <= 0 || clock_gettime(CLOCK_BOOTTIME, &ts) == -1 ||
+            procstat_read(pid, &stat) == -1) {
+        return;
     }
 
-    return rc;
+    boot_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    start_ms = stat.starttime * 1000 / hz;
+
+    snprintf(status, sizeof(status),
+             "STATUS=First command after %llu ms (%llu ms after boot)",
+             (unsigned long long)(boot_ms - start_ms),
+             (unsigned long long)boot_ms);
+
+    ALOGD("%s:%d: %s", _FILE, __LINE__, status + strlen("STATUS="));
+    (void)activation_notify(status);
 }
 
 /**
- * @brief Receive line from the socket.
+ * @brief Set a BUSY reply as pending output.
  *
- * @param [in]  fd   Socket file descriptor.
- * @param [out] line Destination buffer.
- * @param [in]  size size of destination buffer.
+ * @param [in] conn Client connection.
+ * @param [in] id   Request ID, binary protocol only.
  *
- * @return Returns the number of bytes received, or -1 on failure. The return
- *         value will be 0 if the peer has shutdown.
+ * @return Returns 0 on success and -1 on failure, the connection is then
+ *         closed.
  */
-static int recv_line(int fd, char *line, uint32_t size)
+static int set_busy(struct conn *conn, uint32_t id)
 {
-    int n, bytes_read = 0;
-    const uint32_t recv_len = 1;
+    char busy[sizeof(RES_BUSY) + 10];
 
-    if (size < 1) {
-        ALOGE("%s:%d: BUffer size is 0", _FILE, __LINE__);
-        return -1;
+    if (conn->binary) {
+        snprintf(busy, sizeof(busy), RES_RETRY, RETRY_MS);
+        return add_frame(conn, OUT_CONTROL, FRAME_RESPONSE, FRAME_F_BUSY, id,
+                         busy, strlen(busy));
     }
 
-    while (1) {
-        if ((bytes_read + recv_len) <= size) {
-            n = recv(fd, &line[bytes_read], recv_len, 0);
-            if (n > 0) {
-                if (ASCII_LF == line[bytes_read]) {
-                    return (bytes_read + n);
-                }
-                bytes_read += n;
-            } else {
-                return n;
+    snprintf(busy, sizeof(busy), RES_BUSY, RETRY_MS);
+
+    return add_output(conn, OUT_CONTROL, busy, strlen(busy), NULL_STR, 0);
+}
+
+/**
+ * @brief Carry out a requested upgrade once it has been acknowledged. Each
+ *        loop tells when none of its connections has a command executing,
+ *        the upgrade command itself included, or output left to send. Live
+ *        streams are ended first, so that their response is sent before the
+ *        handoff. The loop that finds all loops drained first, and no command
+ *        pending, carries out the upgrade. Commands of closed connections
+ *        count as well, the loops keep running until they have completed.
+ *
+ * @param [in out] loop I/O loop.
+ */
+static void check_upgrade(struct ioloop *loop)
+{
+    struct conn *conn;
+    uint64_t one = 1;
+    uint32_t i;
+    int quiet = 1, start = 0, first;
+
+    if (!upgrade_pending()) {
+        return;
+    }
+
+    for (conn = loop->conns; conn; conn = conn->next) {
+        if (conn->closed) {
+            continue;
+        }
+
+        // The stream job is answered like any other.
+        if (conn->stream) {
+            stop_stream(conn);
+        }
+
+        if (conn->backlog > 0 || conn->splice_len > 0 || conn->busy > 0 ||
+                conn->archive) {
+            quiet = 0;
+        }
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    // The first loop to see the request stops new commands, and the other
+    // loops are woken to check their connections.
+    first = !client.upgrading;
+
+    if (first) {
+        client.upgrading = 1;
+        for (i = 0; i < server.num_loops; i++) {
+            server.loops[i].quiet = 0;
+        }
+    }
+
+    loop->quiet = quiet;
+
+    if (!client.upgrader) {
+        start = (0 == client.pending);
+        for (i = 0; i < server.num_loops; i++) {
+            if (!server.loops[i].quiet) {
+                start = 0;
+            }
+        }
+        client.upgrader = start;
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    if (first) {
+        for (i = 0; i < server.num_loops; i++) {
+            if (&server.loops[i] != loop &&
+                    write(server.loops[i].evfd, &one, sizeof(one)) == -1) {
+                ALOGE("%s:%d: Failed to signal I/O loop (errno=%d)", _FILE,
+                      __LINE__, errno);
             }
-        } else {
-            bytes_read = 0;
         }
     }
+
+    if (start) {
+        upgrade();
+    }
 }
 
 /**
- * @brief Send a buffer on the socket.
+ * @brief Queue a binary frame as pending output.
  *
- * @param [in] fd   Socket file descriptor.
- * @param [in] buf  Data source buffer.
- * @param [in] size Data size
+ * @param [in] conn  Client connection.
+ * @param [in] cls   Output class.
+ * @param [in] type  Frame type.
+ * @param [in] flags Frame flags.
+ * @param [in] id    Request ID.
+ * @param [in] data  Payload.
+ * @param [in] len   Payload length.
  *
- * @return Returns 0 on success and -1 on failure.
+ * @return Returns 0 on success and -1 on failure, the connection is then
+ *         closed.
  */
-static int send_buf(int fd, const char *buf, uint32_t size)
+static int add_frame(struct conn *conn, enum out_class cls, uint8_t type,
+                     uint8_t flags, uint32_t id, const char *data,
+                     uint32_t len)
 {
-    uint32_t bytes_sent = 0;
-    uint32_t bytes_left = size;
-    int n = 0;
+    uint8_t hdr[FRAME_HDR_LEN];
 
-    while (bytes_sent < size) {
-        n = send(fd, buf + bytes_sent, bytes_left, 0);
+    make_header(hdr, type, flags, id, len);
 
-        if (-1 == n) {
-            ALOGE("%s:%d: Failed to send (errno=%d)", _FILE,  __LINE__,
-                  errno);
-            break;
-        }
+    return add_output(conn, cls, (const char *)hdr, sizeof(hdr), data, len);
+}
+
+/**
+ * @brief Make the header of a binary frame.
+ *
+ * @param [out] hdr   Frame header, FRAME_HDR_LEN bytes.
+ * @param [in]  type  Frame type.
+ * @param [in]  flags Frame flags.
+ * @param [in]  id    Request ID.
+ * @param [in]  len   Payload length.
+ */
+static void make_header(uint8_t *hdr, uint8_t type, uint8_t flags,
+                        uint32_t id, uint32_t len)
+{
+    hdr[0] = type;
+    hdr[1] = flags;
+    hdr[2] = 0;
+    hdr[3] = 0;
+    hdr[4] = id >> 24;
+    hdr[5] = id >> 16;
+    hdr[6] = id >> 8;
+    hdr[7] = id;
+    hdr[8] = len >> 24;
+    hdr[9] = len >> 16;
+    hdr[10] = len >> 8;
+    hdr[11] = len;
+}
 
-        bytes_sent += n;
-        bytes_left -= n;
+/**
+ * @brief Queue a message of an output class. Messages of a class are sent
+ *        in order, command responses before stream output before downloads.
+ *        The output is accounted against the memory ceiling until sent.
+ *
+ * @param [in] conn     Client connection.
+ * @param [in] cls      Output class.
+ * @param [in] head     First part of the message.
+ * @param [in] head_len Length of the first part.
+ * @param [in] data     Second part of the message.
+ * @param [in] len      Length of the second part.
+ *
+ * @return Returns 0 on success and -1 on failure, the connection is then
+ *         closed.
+ */
+static int add_output(struct conn *conn, enum out_class cls,
+                      const char *head, uint32_t head_len, const char *data,
+                      uint32_t len)
+{
+    if (pool_charge((int64_t)head_len + len) == -1) {
+        ALOGE("%s:%d: Memory limit reached", _FILE, __LINE__);
+        close_conn(conn);
+        return -1;
     }
 
-    return ((-1 == n) ? -1 : 0);
+    return queue_output(conn, cls, head, head_len, data, len);
 }
 
 /**
- * @brief Send response to a received command.
+ * @brief Queue a message already accounted against the memory ceiling.
  *
- * @param [in]     fd     Socket file descriptor.
- * @param [in]     status Command execution status.
- * @param [in out] resp   Response buffer containing null-terminated string.
- * @param [in]     size   Size of response buffer.
+ * @param [in] conn     Client connection.
+ * @param [in] cls      Output class.
+ * @param [in] head     First part of the message.
+ * @param [in] head_len Length of the first part.
+ * @param [in] data     Second part of the message.
+ * @param [in] len      Length of the second part.
  *
- * @return Returns 0 on success and -1 on failure.
+ * @return Returns 0 on success and -1 on failure, the connection is then
+ *         closed.
  */
-static int send_response(int fd, int status, char *resp, uint32_t size)
+static int queue_output(struct conn *conn, enum out_class cls,
+                        const char *head, uint32_t head_len,
+                        const char *data, uint32_t len)
 {
-    if (-1 == status) {
-        if (send_buf(fd, RES_KO, strlen(RES_KO)) == -1) {
-            return -1;
-        }
+    struct msg_queue *q = &conn->queues[cls];
+    struct msg *msg;
+
+    msg = malloc(sizeof(*msg) + head_len + len);
+
+    if (NULL == msg) {
+        ALOGE("%s:%d: Failed to allocated memory", _FILE, __LINE__);
+        (void)pool_charge(-((int64_t)head_len + len));
+        close_conn(conn);
+        return -1;
+    }
+
+    msg->next = NULL;
+    msg->len = head_len + len;
+    memcpy(msg->data, head, head_len);
+    memcpy(msg->data + head_len, data, len);
+
+    if (q->tail) {
+        q->tail->next = msg;
     } else {
-        if (strcmp(resp, NULL_STR) != 0) {
-            // Send response string.
-            if (strlen(resp) + strlen(LINE_END) < size) {
-                strcat(resp, LINE_END);
-                if (send_buf(fd, resp, strlen(resp)) == -1) {
-                    return -1;
-                }
-            }
-        }
+        q->head = msg;
+    }
+    q->tail = msg;
+    conn->backlog += msg->len;
 
-        if (send_buf(fd, RES_OK, strlen(RES_OK)) == -1) {
-            return -1;
+    return 0;
+}
+
+/**
+ * @brief Replace the running binary, called by one loop once all loops are
+ *        drained and no command is pending. The listening sockets and all
+ *        client connections are handed over.
+ */
+static void upgrade(void)
+{
+    int fds[CLIENTS_LIMIT];
+    int binary[CLIENTS_LIMIT];
+    int sockfds[MAX_ACCEPTORS];
+    uint32_t i, n = 0;
+
+    pthread_mutex_lock(&mutex);
+    for (i = 0; i < CLIENTS_LIMIT; i++) {
+        if (client.slots[i].fd != -1) {
+            binary[n] = client.slots[i].binary;
+            fds[n++] = client.slots[i].fd;
         }
     }
+    pthread_mutex_unlock(&mutex);
 
-    return 0;
+    for (i = 0; i < server.num_loops; i++) {
+        sockfds[i] = server.loops[i].sockfd;
+    }
+
+    recorder_flush();
+
+    // Only returns if the new binary couldn't be executed.
+    (void)upgrade_exec(sockfds, server.num_loops, fds, binary, n);
+
+    pthread_mutex_lock(&mutex);
+    client.upgrading = 0;
+    client.upgrader = 0;
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Dispatches the command to the correct sub-handler.
+ *
+ * @param [in]  cmd  Command string.
+ * @param [out] resp Response buffer.
+ * @param [in]  len  Length of response buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int dispatch_command(const char *cmd, char *resp, uint32_t len)
+{
+    uint64_t start_us = get_monotonic_us();
+    int rc = -1;
+
+    // Remove leading whitespace.
+    while (isspace(*cmd)) {
+        cmd++;
+    }
+
+    // Check for empty command.
+    if ('\0' == *cmd) {
+        ALOGE("%s:%d: No command found", _FILE, __LINE__);
+        return -1;
+    }
+
+    // Dispatch command-line to correct handler.
+    if (strncmp(cmd, TRACE_CMD, strlen(TRACE_CMD)) == 0) {
+        rc = tracecmd_exec(cmd, resp, len);
+    }
+
+    // Scratch memory of the command is released at once.
+    arena_reset();
+
+    metrics_observe(METRICS_COMMAND, get_monotonic_us() - start_us);
+    if (-1 == rc) {
+        metrics_add(METRICS_COMMAND_ERRORS, 1);
+    }
+
+    return rc;
 }
@@ -2,6 +2,15 @@
 #ifndef CMDSERVER_H
 #define CMDSERVER_H
 
+#include <stdint.h>
+
+void cmdserver_set_acceptors(uint32_t num, int steer);
+void cmdserver_set_backlog(int backlog);
+int cmdserver_set_backend(const char *name);
+void cmdserver_set_limits(uint32_t clients, uint32_t per_peer,
+                          uint32_t pending, uint32_t idle_ms);
+void cmdserver_set_rates(uint64_t client, uint64_t total);
+int cmdserver_stats(char *resp, uint32_t len);
 int cmdserver_start(const char *port);
 void cmdserver_wait(void);
 void cmdserver_closefd(void);
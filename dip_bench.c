@@ -0,0 +1,275 @@
+
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "dipclient.h"
+#include "utils.h"
+
+// Default address of the proxy and command measured.
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "3002"
+#define DEFAULT_CMD "trace -q"
+
+// Default number of commands of each run.
+#define DEFAULT_COUNT 20000
+
+// Default number of pooled connections.
+#define DEFAULT_CONNS 4
+
+// Requests each connection executes at the same time.
+#define DEPTH 8
+
+// Counts of a run.
+struct run {
+    uint32_t sent;
+    uint32_t done;
+    uint32_t failed;
+};
+
+// Benchmark parameters.
+static const char *host = DEFAULT_HOST;
+static const char *port = DEFAULT_PORT;
+static const char *cmd = DEFAULT_CMD;
+static uint32_t count = DEFAULT_COUNT;
+
+// Forward declarations.
+static double run_naive(uint32_t *failed);
+static double run_client(uint32_t conns, uint32_t depth, uint32_t *failed);
+static void on_done(void *arg, enum dip_status status, const char *resp,
+                    uint32_t len);
+static double now_s(void);
+
+/**
+ * @brief Compare the commands per second of naive use of the proxy, one
+ *        command per round trip on a text connection, with the client
+ *        library, "dip_bench [-h <host>] [-p <port>] [-n <count>]
+ *        [-c <conns>] [<command>]".
+ */
+int main(int argc, char *argv[])
+{
+    uint32_t conns = DEFAULT_CONNS, failed;
+    double naive, rate;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:n:c:")) != -1) {
+        switch (opt) {
+        case 'h':
+            host = optarg;
+            break;
+
+        case 'p':
+            port = optarg;
+            break;
+
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'c':
+            conns = strtoul(optarg, NULL, 10);
+            break;
+
+        default:
+            fprintf(stderr, "Usage: dip_bench [-h <host>] [-p <port>] "
+                    "[-n <count>] [-c <conns>] [<command>]\n");
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        cmd = argv[optind];
+    }
+
+    printf("%-28s %12s %8s %8s\n", "MODE", "COMMANDS/S", "SPEEDUP",
+           "FAILED");
+
+    if ((naive = run_naive(&failed)) <= 0) {
+        return 1;
+    }
+    printf("%-28s %12.0f %7.1fx %8u\n", "naive, text round trips", naive,
+           1.0, failed);
+
+    rate = run_client(1, 1, &failed);
+    printf("%-28s %12.0f %7.1fx %8u\n", "library, one at a time", rate,
+           rate / naive, failed);
+
+    rate = run_client(1, DEPTH, &failed);
+    printf("%-28s %12.0f %7.1fx %8u\n", "library, pipelined", rate,
+           rate / naive, failed);
+
+    rate = run_client(conns, conns * DEPTH, &failed);
+    printf("library, %2u pooled conns    %12.0f %7.1fx %8u\n", conns, rate,
+           rate / naive, failed);
+
+    return 0;
+}
+
+/**
+ * @brief Send commands one at a time on a text connection, waiting for the
+ *        status line of each, the way ad-hoc tools do.
+ *
+ * @param [out] failed Number of commands not answered with OK.
+ *
+ * @return Returns the commands per second, or 0 at failure.
+ */
+static double run_naive(uint32_t *failed)
+{
+    char line[DIP_CMD_LENGTH + 2], buf[RESP_LENGTH];
+    struct addrinfo hints, *addr;
+    uint32_t i, len, pos = 0, end = 0;
+    double start;
+    char *nl;
+    int fd;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &addr) != 0) {
+        fprintf(stderr, "Failed to resolve %s\n", host);
+        return 0;
+    }
+
+    fd = socket(addr->ai_family, SOCK_STREAM, 0);
+
+    if (-1 == fd || connect(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+        fprintf(stderr, "Failed to connect to %s:%s\n", host, port);
+        freeaddrinfo(addr);
+        return 0;
+    }
+
+    freeaddrinfo(addr);
+
+    len = snprintf(line, sizeof(line), "%s\n", cmd);
+    *failed = 0;
+    start = now_s();
+
+    for (i = 0; i < count; i++) {
+        if (send(fd, line, len, MSG_NOSIGNAL) != (ssize_t)len) {
+            fprintf(stderr, "Failed to send\n");
+            close(fd);
+            return 0;
+        }
+
+        // Read lines until the status line.
+        while (1) {
+            nl = memchr(buf + pos, '\n', end - pos);
+            if (NULL == nl) {
+                memmove(buf, buf + pos, end - pos);
+                end -= pos;
+                pos = 0;
+                ssize_t n = recv(fd, buf + end, sizeof(buf) - end, 0);
+                if (n <= 0) {
+                    fprintf(stderr, "Connection lost\n");
+                    close(fd);
+                    return 0;
+                }
+                end += n;
+                continue;
+            }
+            *nl = '\0';
+            if (strcmp(buf + pos, "OK") == 0) {
+                pos = nl + 1 - buf;
+                break;
+            }
+            if (strcmp(buf + pos, "KO") == 0 ||
+                    strncmp(buf + pos, "BUSY", 4) == 0) {
+                (*failed)++;
+                pos = nl + 1 - buf;
+                break;
+            }
+            pos = nl + 1 - buf;
+        }
+    }
+
+    start = now_s() - start;
+    close(fd);
+
+    return count / start;
+}
+
+/**
+ * @brief Send commands with the client library, keeping a number of them
+ *        executing at the same time.
+ *
+ * @param [in]  conns  Number of pooled connections.
+ * @param [in]  depth  Commands executing at the same time.
+ * @param [out] failed Number of commands not answered with OK.
+ *
+ * @return Returns the commands per second, or 0 at failure.
+ */
+static double run_client(uint32_t conns, uint32_t depth, uint32_t *failed)
+{
+    struct dip_client *client = dip_open(host, port, conns);
+    struct run run = {0, 0, 0};
+    double start;
+
+    if (NULL == client) {
+        fprintf(stderr, "Failed to resolve %s\n", host);
+        return 0;
+    }
+
+    start = now_s();
+
+    while (run.done < count) {
+        while (run.sent < count && run.sent - run.done < depth) {
+            if (dip_send(client, cmd, NULL, on_done, &run) == -1) {
+                fprintf(stderr, "Bad command: %s\n", cmd);
+                dip_close(client);
+                return 0;
+            }
+            run.sent++;
+        }
+        if (dip_poll(client, -1) == -1) {
+            break;
+        }
+    }
+
+    start = now_s() - start;
+    dip_close(client);
+    *failed = run.failed;
+
+    return run.done / start;
+}
+
+/**
+ * @brief Count a completed command.
+ *
+ * @param [in out] arg    Run.
+ * @param [in]     status Status.
+ * @param [in]     resp   <Not in use>.
+ * @param [in]     len    <Not in use>.
+ */
+static void on_done(void *arg, enum dip_status status, const char *resp,
+                    uint32_t len)
+{
+    struct run *run = arg;
+
+    UNUSED(resp);
+    UNUSED(len);
+
+    run->done++;
+    run->failed += (DIP_OK == status) ? 0 : 1;
+}
+
+/**
+ * @brief Get the monotonic time.
+ *
+ * @return Returns the time in seconds.
+ */
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
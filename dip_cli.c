@@ -0,0 +1,341 @@
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dipclient.h"
+#include "utils.h"
+
+// Default address of the proxy, e.g. forwarded with "adb forward".
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "3002"
+
+// Command opening a live stream.
+#define STREAM_CMD "stream "
+
+// Connections used to pipeline commands.
+#define PIPELINE_CONNS 4
+
+// Result of a command.
+struct result {
+    int done;
+    enum dip_status status;
+    char *resp;
+};
+
+// Status lines, as answered on the text protocol.
+static const char *status_str[] = {"OK", "KO", "BUSY", "ERROR"};
+
+// Set by SIGINT, ends a live stream.
+static volatile sig_atomic_t interrupted = 0;
+
+// Forward declarations.
+static int run(struct dip_client *client, const char *cmd);
+static int run_stream(struct dip_client *client, const char *cmd);
+static int run_pipelined(struct dip_client *client, char **cmds,
+                         uint32_t num);
+static char ** read_commands(uint32_t *num);
+static void print_result(const struct result *res);
+static void on_data(void *arg, const char *data, uint32_t len);
+static void on_done(void *arg, enum dip_status status, const char *resp,
+                    uint32_t len);
+static void on_interrupt(int sig);
+
+/**
+ * @brief Send commands to the proxy, "dip_cli [-h <host>] [-p <port>] [-a]
+ *        [<command> ...]". Commands are read from stdin, one per line, if
+ *        none are given. Each response is printed as on the text protocol,
+ *        output of log reads and archives is written to stdout as received.
+ *        With -a all commands are sent at once and the responses printed in
+ *        the order of the commands. A live stream is printed until SIGINT.
+ */
+int main(int argc, char *argv[])
+{
+    const char *host = DEFAULT_HOST, *port = DEFAULT_PORT;
+    struct dip_client *client;
+    struct sigaction sa;
+    char line[DIP_CMD_LENGTH + 2];
+    int pipelined = 0, rc = 0, opt;
+    uint32_t num;
+    char **cmds;
+
+    while ((opt = getopt(argc, argv, "h:p:a")) != -1) {
+        switch (opt) {
+        case 'h':
+            host = optarg;
+            break;
+
+        case 'p':
+            port = optarg;
+            break;
+
+        case 'a':
+            pipelined = 1;
+            break;
+
+        default:
+            fprintf(stderr, "Usage: dip_cli [-h <host>] [-p <port>] [-a] "
+                    "[<command> ...]\n");
+            return 2;
+        }
+    }
+
+    client = dip_open(host, port, pipelined ? PIPELINE_CONNS : 1);
+
+    if (NULL == client) {
+        fprintf(stderr, "Failed to resolve %s\n", host);
+        return 2;
+    }
+
+    // Interrupt a blocking read or poll instead of restarting it.
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_interrupt;
+    sigaction(SIGINT, &sa, NULL);
+
+    if (pipelined) {
+        if (optind < argc) {
+            rc = run_pipelined(client, argv + optind, argc - optind);
+        } else if ((cmds = read_commands(&num))) {
+            rc = run_pipelined(client, cmds, num);
+        } else {
+            rc = -1;
+        }
+    } else if (optind < argc) {
+        for (; optind < argc && !interrupted; optind++) {
+            rc |= run(client, argv[optind]);
+        }
+    } else {
+        while (!interrupted && fgets(line, sizeof(line), stdin)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0') {
+                rc |= run(client, line);
+            }
+        }
+    }
+
+    dip_close(client);
+
+    return (-1 == rc) ? 2 : (rc ? 1 : 0);
+}
+
+/**
+ * @brief Send a command and print the response.
+ *
+ * @param [in] client Client.
+ * @param [in] cmd    Command.
+ *
+ * @return Returns 0 if the command succeeded, 1 if not, or -1 at failure.
+ */
+static int run(struct dip_client *client, const char *cmd)
+{
+    struct result res = {0, DIP_ERROR, NULL};
+
+    if (strncmp(cmd, STREAM_CMD, strlen(STREAM_CMD)) == 0) {
+        return run_stream(client, cmd);
+    }
+
+    if (dip_send(client, cmd, on_data, on_done, &res) == -1) {
+        fprintf(stderr, "Bad command: %s\n", cmd);
+        return 1;
+    }
+
+    while (!res.done) {
+        if (interrupted || dip_poll(client, -1) == -1) {
+            return -1;
+        }
+    }
+
+    print_result(&res);
+
+    return (DIP_OK == res.status) ? 0 : 1;
+}
+
+/**
+ * @brief Print a live stream until interrupted.
+ *
+ * @param [in] client Client.
+ * @param [in] cmd    Stream command.
+ *
+ * @return Returns 0 if the stream succeeded, 1 if not, or -1 at failure.
+ */
+static int run_stream(struct dip_client *client, const char *cmd)
+{
+    struct result res = {0, DIP_ERROR, NULL};
+    int sub;
+
+    sub = dip_subscribe(client, cmd, on_data, on_done, &res);
+
+    if (-1 == sub) {
+        fprintf(stderr, "Bad command: %s\n", cmd);
+        return 1;
+    }
+
+    while (!res.done && !interrupted) {
+        if (dip_poll(client, -1) == -1 && errno != EINTR) {
+            return -1;
+        }
+    }
+
+    // The next command is read after the stream, a second SIGINT exits.
+    if (!res.done) {
+        interrupted = 0;
+        (void)dip_unsubscribe(client, sub);
+    }
+
+    while (!res.done) {
+        if (dip_poll(client, -1) == -1) {
+            return -1;
+        }
+    }
+
+    print_result(&res);
+
+    return (DIP_OK == res.status) ? 0 : 1;
+}
+
+/**
+ * @brief Send all commands at once and print the responses in order.
+ *
+ * @param [in] client Client.
+ * @param [in] cmds   Commands.
+ * @param [in] num    Number of commands.
+ *
+ * @return Returns 0 if all commands succeeded, 1 if not, or -1 at failure.
+ */
+static int run_pipelined(struct dip_client *client, char **cmds,
+                         uint32_t num)
+{
+    struct result *res;
+    uint32_t i, next = 0;
+    int rc = 0;
+
+    res = calloc(num ? num : 1, sizeof(*res));
+
+    if (NULL == res) {
+        return -1;
+    }
+
+    for (i = 0; i < num; i++) {
+        if (dip_send(client, cmds[i], on_data, on_done, &res[i]) == -1) {
+            fprintf(stderr, "Bad command: %s\n", cmds[i]);
+            res[i].done = 1;
+            res[i].status = DIP_KO;
+        }
+    }
+
+    while (next < num) {
+        for (; next < num && res[next].done; next++) {
+            print_result(&res[next]);
+            rc |= (DIP_OK == res[next].status) ? 0 : 1;
+        }
+        if (next < num && dip_poll(client, -1) == -1) {
+            free(res);
+            return -1;
+        }
+    }
+
+    free(res);
+
+    return rc;
+}
+
+/**
+ * @brief Read all commands from stdin, one per line.
+ *
+ * @param [out] num Number of commands.
+ *
+ * @return Returns the commands, or NULL at failure.
+ */
+static char ** read_commands(uint32_t *num)
+{
+    char line[DIP_CMD_LENGTH + 2];
+    char **cmds = NULL, **more;
+    uint32_t max = 0;
+
+    *num = 0;
+
+    while (fgets(line, sizeof(line), stdin)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if ('\0' == line[0]) {
+            continue;
+        }
+        if (*num == max) {
+            max = max ? 2 * max : 64;
+            more = realloc(cmds, max * sizeof(*cmds));
+            if (NULL == more) {
+                free(cmds);
+                return NULL;
+            }
+            cmds = more;
+        }
+        if (NULL == (cmds[(*num)++] = strdup(line))) {
+            return NULL;
+        }
+    }
+
+    return cmds ? cmds : calloc(1, sizeof(*cmds));
+}
+
+/**
+ * @brief Print a response and its status line.
+ *
+ * @param [in] res Result.
+ */
+static void print_result(const struct result *res)
+{
+    const char *resp = res->resp ? res->resp : "";
+    size_t len = strlen(resp);
+
+    printf("%s%s%s\n", resp, (len > 0 && resp[len - 1] != '\n') ? "\n" : "",
+           status_str[res->status]);
+    fflush(stdout);
+    free(res->resp);
+}
+
+/**
+ * @brief Write streamed output to stdout.
+ *
+ * @param [in] arg  <Not in use>.
+ * @param [in] data Output.
+ * @param [in] len  Output length.
+ */
+static void on_data(void *arg, const char *data, uint32_t len)
+{
+    UNUSED(arg);
+
+    fwrite(data, 1, len, stdout);
+    fflush(stdout);
+}
+
+/**
+ * @brief Keep the response of a command.
+ *
+ * @param [in out] arg    Result.
+ * @param [in]     status Status.
+ * @param [in]     resp   Response data.
+ * @param [in]     len    Response length.
+ */
+static void on_done(void *arg, enum dip_status status, const char *resp,
+                    uint32_t len)
+{
+    struct result *res = arg;
+
+    res->done = 1;
+    res->status = status;
+    res->resp = strndup(resp, len);
+}
+
+/**
+ * @brief Note an interrupt, to end a live stream or exit.
+ *
+ * @param [in] sig <Not in use>.
+ */
+static void on_interrupt(int sig)
+{
+    UNUSED(sig);
+
+    interrupted = 1;
+}
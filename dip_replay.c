@@ -0,0 +1,849 @@
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "recorder.h"
+#include "utils.h"
+
+// Protocol of the proxy, see "BINARY PROTOCOL" in the README.
+#define PROTO_BINARY "proto binary\n"
+#define RES_OK "OK\n"
+#define STREAM_STOP "stream --stop"
+#define FRAME_HDR_LEN 12
+#define FRAME_REQUEST 1
+#define FRAME_RESPONSE 2
+#define FRAME_F_KO 0x01
+#define FRAME_F_BUSY 0x02
+
+// Time to wait for outstanding responses after the last command.
+#define DRAIN_MS 10000
+
+// Max number of distinct command kinds reported.
+#define MAX_KINDS 64
+
+// Max length of a command kind.
+#define KIND_LENGTH 64
+
+// Recorded client event.
+struct event {
+    uint64_t us;                     // Time since the first record.
+    uint8_t type;
+    uint32_t client;                 // Index of the client, not for SYNC.
+    int kind;                        // Command kind, -1 if not measured.
+    char *cmd;
+};
+
+// Request waiting for its response.
+struct request {
+    uint32_t id;
+    int kind;                        // Command kind, -1 if not measured.
+    uint64_t sent_us;
+};
+
+// Replayed client connection.
+struct client {
+    int fd;
+    int closing;                     // Close once all responses are in.
+    uint32_t next_id;
+    uint32_t stream;                 // Request ID of a text stream, if any.
+    uint32_t batch;                  // Request ID of an open batch, if any.
+    int batch_kind;                  // Command kind of the batch.
+    struct request *reqs;
+    uint32_t num_reqs;
+    uint32_t max_reqs;
+    uint8_t hdr[FRAME_HDR_LEN];      // Header of the frame being received.
+    uint32_t hdr_len;
+    uint32_t skip;                   // Payload of the frame not yet received.
+};
+
+// Latencies of one command kind.
+struct kind {
+    char name[KIND_LENGTH];
+    uint32_t *lat;                   // Latencies in microseconds.
+    uint32_t num;
+    uint32_t max;
+    uint32_t ko;
+    uint32_t busy;
+};
+
+// Recording.
+static struct event *events = NULL;
+static uint32_t num_events = 0;
+static uint32_t num_clients = 0;
+
+// Command kinds.
+static struct kind kinds[MAX_KINDS];
+static uint32_t num_kinds = 0;
+
+// Replay state.
+static struct client *clients = NULL;
+static uint32_t num_copies = 1;
+static struct addrinfo *addr = NULL;
+static uint64_t start_us;
+static uint64_t max_lag_us = 0;
+static uint32_t refused = 0;
+static uint32_t lost = 0;
+
+// Forward declarations.
+static int load(const char *path);
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *val);
+static int get_kind(const char *cmd);
+static void run_event(const struct event *ev, struct client *cl);
+static void open_client(struct client *cl);
+static void close_client(struct client *cl);
+static uint32_t send_request(struct client *cl, const char *cmd);
+static void add_request(struct client *cl, uint32_t id, int kind);
+static void receive(struct client *cl);
+static void handle_frame(struct client *cl);
+static uint32_t pending(const struct client *cl);
+static void report(const char *baseline, const char *output);
+static uint32_t percentile(const struct kind *k, double q);
+static int compare(const void *a, const void *b);
+static uint64_t now_us(void);
+
+/**
+ * @brief Replay commands recorded by the proxy (option -X) against a proxy,
+ *        "dip_replay [-s <speed>] [-c <copies>] [-o <file>] [-b <file>]
+ *        <recording> <host> <port>", and report the latency of each kind of
+ *        command. Each copy replays the recording over its own connections.
+ */
+int main(int argc, char *argv[])
+{
+    const char *output = NULL, *baseline = NULL;
+    struct addrinfo hints;
+    struct pollfd *fds;
+    struct client **polled;
+    uint64_t due, now, deadline = 0;
+    double speed = 1;
+    uint32_t next = 0, n, i, c;
+    int opt, timeout;
+
+    while ((opt = getopt(argc, argv, "s:c:o:b:")) != -1) {
+        switch (opt) {
+        case 's':
+            speed = strtod(optarg, NULL);
+            break;
+
+        case 'c':
+            num_copies = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'o':
+            output = optarg;
+            break;
+
+        case 'b':
+            baseline = optarg;
+            break;
+
+        default:
+            return 1;
+        }
+    }
+
+    if (argc - optind != 3 || speed <= 0 || 0 == num_copies) {
+        fprintf(stderr, "Usage: dip_replay [-s <speed>] [-c <copies>] "
+                "[-o <file>] [-b <file>] <recording> <host> <port>\n");
+        return 1;
+    }
+
+    if (load(argv[optind]) == -1) {
+        return 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(argv[optind + 1], argv[optind + 2], &hints, &addr) != 0) {
+        fprintf(stderr, "Failed to resolve %s\n", argv[optind + 1]);
+        return 1;
+    }
+
+    n = num_clients * num_copies;
+    clients = calloc(n ? n : 1, sizeof(*clients));
+    fds = calloc(n ? n : 1, sizeof(*fds));
+    polled = calloc(n ? n : 1, sizeof(*polled));
+
+    if (NULL == clients || NULL == fds || NULL == polled) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        clients[i].fd = -1;
+    }
+
+    start_us = now_us();
+
+    while (1) {
+        now = now_us() - start_us;
+
+        // Run the events that are due, in every copy.
+        while (next < num_events &&
+                (due = events[next].us / speed) <= now) {
+            if (now - due > max_lag_us) {
+                max_lag_us = now - due;
+            }
+            for (c = 0; c < num_copies; c++) {
+                run_event(&events[next], &clients[c * num_clients]);
+            }
+            next++;
+        }
+
+        // Close the clients that are done.
+        for (i = 0, n = 0; i < num_clients * num_copies; i++) {
+            if (clients[i].fd != -1 && clients[i].closing &&
+                    0 == pending(&clients[i])) {
+                close_client(&clients[i]);
+            }
+            if (clients[i].fd != -1) {
+                fds[n].fd = clients[i].fd;
+                fds[n].events = POLLIN;
+                polled[n++] = &clients[i];
+            }
+        }
+
+        if (next == num_events) {
+            for (i = 0; i < n && 0 == pending(polled[i]); i++) {
+            }
+            if (i == n) {
+                break;
+            }
+            if (0 == deadline) {
+                deadline = now + DRAIN_MS * 1000ULL;
+            } else if (now >= deadline) {
+                break;
+            }
+            timeout = (deadline - now) / 1000 + 1;
+        } else {
+            due = events[next].us / speed;
+            timeout = (due > now) ? (due - now + 999) / 1000 : 0;
+        }
+
+        if (poll(fds, n, timeout) == -1 && errno != EINTR) {
+            fprintf(stderr, "Failed to poll (errno=%d)\n", errno);
+            return 1;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (fds[i].revents) {
+                receive(polled[i]);
+            }
+        }
+    }
+
+    // Responses still missing at the end are lost.
+    for (i = 0; i < num_clients * num_copies; i++) {
+        if (clients[i].fd != -1) {
+            lost += pending(&clients[i]);
+            close_client(&clients[i]);
+        }
+    }
+
+    printf("events=%u clients=%u copies=%u speed=%g duration_s=%.3f "
+           "max_lag_ms=%.3f refused=%u lost=%u\n", num_events, num_clients,
+           num_copies, speed, (now_us() - start_us) / 1e6, max_lag_us / 1e3,
+           refused, lost);
+
+    report(baseline, output);
+
+    freeaddrinfo(addr);
+
+    return 0;
+}
+
+/**
+ * @brief Load a recording. Connection numbers restart in each recording
+ *        appended by an upgraded proxy, so clients are numbered per SYNC.
+ *
+ * @param [in] path Recording file.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int load(const char *path)
+{
+    const uint8_t *p, *end;
+    uint64_t time, conn, len, abs_us = 0, first_us = 0;
+    uint32_t base = 0, max_conn = 0, max_events = 0;
+    struct event *ev;
+    struct stat st;
+    uint8_t *data;
+    FILE *file;
+
+    file = fopen(path, "rb");
+
+    if (NULL == file || fstat(fileno(file), &st) == -1) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return -1;
+    }
+
+    data = malloc(st.st_size + 1);
+
+    if (NULL == data || fread(data, 1, st.st_size, file) != (size_t)st.st_size) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+
+    if (st.st_size < RECORDER_MAGIC_LEN ||
+            memcmp(data, RECORDER_MAGIC, RECORDER_MAGIC_LEN) != 0) {
+        fprintf(stderr, "Not a recording: %s\n", path);
+        return -1;
+    }
+
+    p = data + RECORDER_MAGIC_LEN;
+    end = data + st.st_size;
+
+    while (p < end) {
+        if (num_events == max_events) {
+            max_events = max_events ? 2 * max_events : 1024;
+            events = realloc(events, max_events * sizeof(*events));
+            if (NULL == events) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                return -1;
+            }
+        }
+
+        ev = &events[num_events];
+        ev->type = *p++;
+        ev->kind = -1;
+        ev->cmd = NULL;
+
+        if (get_varint(&p, end, &time) == -1 ||
+                get_varint(&p, end, &conn) == -1) {
+            break;
+        }
+
+        if (RECORDER_TEXT == ev->type || RECORDER_BINARY == ev->type) {
+            if (get_varint(&p, end, &len) == -1 || len > (uint64_t)(end - p)) {
+                break;
+            }
+            ev->cmd = strndup((const char *)p, len);
+            if (NULL == ev->cmd) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                return -1;
+            }
+            p += len;
+            ev->kind = get_kind(ev->cmd);
+        } else if (ev->type > RECORDER_CLOSE) {
+            fprintf(stderr, "Bad record in %s\n", path);
+            return -1;
+        }
+
+        if (RECORDER_SYNC == ev->type) {
+            // Monotonic time only moves on within one boot.
+            if (0 == first_us) {
+                first_us = time;
+            }
+            abs_us = (time > abs_us) ? time : abs_us;
+            base += max_conn;
+            max_conn = 0;
+        } else {
+            abs_us += time;
+            if (0 == conn) {
+                continue;
+            }
+            max_conn = (conn > max_conn) ? conn : max_conn;
+            ev->client = base + conn - 1;
+        }
+
+        ev->us = abs_us - first_us;
+        num_events++;
+    }
+
+    if (p < end) {
+        fprintf(stderr, "Recording truncated, replaying %u events\n",
+                num_events);
+    }
+
+    num_clients = base + max_conn;
+    free(data);
+
+    return 0;
+}
+
+/**
+ * @brief Decode a varint.
+ *
+ * @param [in out] p   Read position.
+ * @param [in]     end End of the data.
+ * @param [out]    val Value.
+ *
+ * @return Returns 0 at success, or -1 if the data ends first.
+ */
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *val)
+{
+    uint32_t shift = 0;
+
+    *val = 0;
+
+    while (*p < end && shift < 64) {
+        *val |= (uint64_t)(**p & 0x7f) << shift;
+        if (0 == (*(*p)++ & 0x80)) {
+            return 0;
+        }
+        shift += 7;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Get the kind of a command, its first word and first option, e.g.
+ *        "trace -q" for "trace -q -v".
+ *
+ * @param [in] cmd Command.
+ *
+ * @return Returns the index of the kind, or -1 if not measured.
+ */
+static int get_kind(const char *cmd)
+{
+    char name[KIND_LENGTH];
+    size_t n;
+    uint32_t i;
+
+    n = strcspn(cmd, " \t");
+    if (' ' == cmd[n] || '\t' == cmd[n]) {
+        n += strspn(cmd + n, " \t");
+        if ('-' == cmd[n]) {
+            n += strcspn(cmd + n, " \t=");
+        }
+    }
+
+    if (n >= KIND_LENGTH) {
+        n = KIND_LENGTH - 1;
+    }
+
+    memcpy(name, cmd, n);
+    name[n] = '\0';
+
+    for (i = 0; i < num_kinds; i++) {
+        if (strcmp(kinds[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    if (MAX_KINDS == num_kinds) {
+        return -1;
+    }
+
+    memcpy(kinds[num_kinds].name, name, n + 1);
+
+    return num_kinds++;
+}
+
+/**
+ * @brief Run a recorded event for the clients of one copy. All commands are
+ *        sent as binary requests, text commands are mapped to the protocol
+ *        the proxy uses for binary connections.
+ *
+ * @param [in]     ev Event.
+ * @param [in out] cl Clients of the copy.
+ */
+static void run_event(const struct event *ev, struct client *cl)
+{
+    uint32_t i, id;
+    size_t n;
+
+    if (RECORDER_SYNC == ev->type) {
+        // Connections of an earlier recording aren't used anymore.
+        for (i = 0; i < num_clients; i++) {
+            cl[i].closing = 1;
+        }
+        return;
+    }
+
+    cl += ev->client;
+
+    if (RECORDER_OPEN == ev->type) {
+        open_client(cl);
+        return;
+    }
+
+    if (RECORDER_CLOSE == ev->type) {
+        cl->closing = 1;
+        return;
+    }
+
+    if (-1 == cl->fd || strcmp(ev->cmd, "proto binary") == 0) {
+        return;
+    }
+
+    // Any line ends the live stream of a text connection.
+    if (cl->stream && RECORDER_TEXT == ev->type) {
+        add_request(cl, send_request(cl, STREAM_STOP), get_kind(STREAM_STOP));
+        cl->stream = 0;
+        return;
+    }
+
+    // A batch is answered once, with the ID of its first request.
+    if (cl->batch) {
+        if (send_request(cl, ev->cmd) && strcmp(ev->cmd, "end") == 0) {
+            add_request(cl, cl->batch, cl->batch_kind);
+            cl->batch = 0;
+        }
+        return;
+    }
+
+    id = send_request(cl, ev->cmd);
+    n = strcspn(ev->cmd, " \t");
+
+    if (strncmp(ev->cmd, "batch", n) == 0 && 5 == n) {
+        cl->batch = id;
+        cl->batch_kind = ev->kind;
+    } else if (strncmp(ev->cmd, "stream", n) == 0 && 6 == n &&
+               strcmp(ev->cmd, STREAM_STOP) != 0) {
+        // Streams last until stopped, their response isn't a latency.
+        add_request(cl, id, -1);
+        cl->stream = id;
+    } else {
+        add_request(cl, id, ev->kind);
+    }
+}
+
+/**
+ * @brief Connect a client and switch it to the binary protocol.
+ *
+ * @param [in out] cl Client.
+ */
+static void open_client(struct client *cl)
+{
+    char resp[sizeof(RES_OK)];
+    int on = 1;
+    ssize_t n;
+
+    if (cl->fd != -1) {
+        close_client(cl);
+    }
+
+    cl->fd = socket(addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (-1 == cl->fd || connect(cl->fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+        fprintf(stderr, "Failed to connect (errno=%d)\n", errno);
+        exit(1);
+    }
+
+    (void)setsockopt(cl->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    // A refused client is answered with BUSY and closed.
+    if (send(cl->fd, PROTO_BINARY, strlen(PROTO_BINARY), MSG_NOSIGNAL) == -1 ||
+            (n = recv(cl->fd, resp, strlen(RES_OK), MSG_WAITALL)) !=
+            (ssize_t)strlen(RES_OK) || memcmp(resp, RES_OK, n) != 0) {
+        refused++;
+        close_client(cl);
+        return;
+    }
+
+    cl->closing = 0;
+    cl->stream = 0;
+    cl->batch = 0;
+    cl->hdr_len = 0;
+    cl->skip = 0;
+}
+
+/**
+ * @brief Close a client, responses not received are dropped.
+ *
+ * @param [in out] cl Client.
+ */
+static void close_client(struct client *cl)
+{
+    close(cl->fd);
+    cl->fd = -1;
+    cl->num_reqs = 0;
+}
+
+/**
+ * @brief Send a command as request frame. The client is closed if the
+ *        command can't be sent.
+ *
+ * @param [in out] cl  Client.
+ * @param [in]     cmd Command.
+ *
+ * @return Returns the request ID, or 0 at failure.
+ */
+static uint32_t send_request(struct client *cl, const char *cmd)
+{
+    uint8_t frame[FRAME_HDR_LEN + CMD_LINE_LENGTH];
+    uint32_t len = strnlen(cmd, CMD_LINE_LENGTH);
+    uint32_t id = ++cl->next_id;
+
+    memset(frame, 0, FRAME_HDR_LEN);
+    frame[0] = FRAME_REQUEST;
+    frame[4] = id >> 24;
+    frame[5] = id >> 16;
+    frame[6] = id >> 8;
+    frame[7] = id;
+    frame[8] = len >> 24;
+    frame[9] = len >> 16;
+    frame[10] = len >> 8;
+    frame[11] = len;
+    memcpy(frame + FRAME_HDR_LEN, cmd, len);
+
+    if (send(cl->fd, frame, FRAME_HDR_LEN + len, MSG_NOSIGNAL) == -1) {
+        lost += pending(cl);
+        close_client(cl);
+        return 0;
+    }
+
+    return id;
+}
+
+/**
+ * @brief Wait for the response to a request, timed from now.
+ *
+ * @param [in out] cl   Client.
+ * @param [in]     id   Request ID of the response, 0 if not sent.
+ * @param [in]     kind Command kind, -1 if not measured.
+ */
+static void add_request(struct client *cl, uint32_t id, int kind)
+{
+    struct request *req;
+
+    if (0 == id) {
+        return;
+    }
+
+    if (cl->num_reqs == cl->max_reqs) {
+        cl->max_reqs = cl->max_reqs ? 2 * cl->max_reqs : 8;
+        cl->reqs = realloc(cl->reqs, cl->max_reqs * sizeof(*cl->reqs));
+        if (NULL == cl->reqs) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+    }
+
+    req = &cl->reqs[cl->num_reqs++];
+    req->id = id;
+    req->kind = kind;
+    req->sent_us = now_us();
+}
+
+/**
+ * @brief Receive frames of a client. Only the headers are kept, responses
+ *        are matched by request ID.
+ *
+ * @param [in out] cl Client.
+ */
+static void receive(struct client *cl)
+{
+    uint8_t buf[64 * 1024];
+    uint32_t pos = 0, n;
+    ssize_t len;
+
+    len = recv(cl->fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+    if (len <= 0) {
+        if (0 == len || (errno != EAGAIN && errno != EINTR)) {
+            lost += pending(cl);
+            close_client(cl);
+        }
+        return;
+    }
+
+    while (pos < (uint32_t)len) {
+        if (cl->skip) {
+            n = ((uint32_t)len - pos < cl->skip) ? (uint32_t)len - pos :
+                cl->skip;
+            cl->skip -= n;
+            pos += n;
+            continue;
+        }
+
+        n = FRAME_HDR_LEN - cl->hdr_len;
+        n = ((uint32_t)len - pos < n) ? (uint32_t)len - pos : n;
+        memcpy(cl->hdr + cl->hdr_len, buf + pos, n);
+        cl->hdr_len += n;
+        pos += n;
+
+        if (FRAME_HDR_LEN == cl->hdr_len) {
+            handle_frame(cl);
+            cl->hdr_len = 0;
+        }
+    }
+}
+
+/**
+ * @brief Handle a received frame header.
+ *
+ * @param [in out] cl Client.
+ */
+static void handle_frame(struct client *cl)
+{
+    uint32_t id = (uint32_t)cl->hdr[4] << 24 | cl->hdr[5] << 16 |
+                  cl->hdr[6] << 8 | cl->hdr[7];
+    struct kind *k;
+    uint32_t i;
+
+    cl->skip = (uint32_t)cl->hdr[8] << 24 | cl->hdr[9] << 16 |
+               cl->hdr[10] << 8 | cl->hdr[11];
+
+    if (cl->hdr[0] != FRAME_RESPONSE) {
+        return;
+    }
+
+    for (i = 0; i < cl->num_reqs && cl->reqs[i].id != id; i++) {
+    }
+
+    if (i == cl->num_reqs) {
+        return;
+    }
+
+    if (cl->reqs[i].kind >= 0) {
+        k = &kinds[cl->reqs[i].kind];
+        if (k->num == k->max) {
+            k->max = k->max ? 2 * k->max : 1024;
+            k->lat = realloc(k->lat, k->max * sizeof(*k->lat));
+            if (NULL == k->lat) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                exit(1);
+            }
+        }
+        k->lat[k->num++] = now_us() - cl->reqs[i].sent_us;
+        k->ko += (cl->hdr[1] & FRAME_F_KO) ? 1 : 0;
+        k->busy += (cl->hdr[1] & FRAME_F_BUSY) ? 1 : 0;
+    }
+
+    cl->reqs[i] = cl->reqs[--cl->num_reqs];
+}
+
+/**
+ * @brief Get the number of measured requests of a client without response.
+ *
+ * @param [in] cl Client.
+ *
+ * @return Returns the number of requests.
+ */
+static uint32_t pending(const struct client *cl)
+{
+    uint32_t i, n = 0;
+
+    for (i = 0; i < cl->num_reqs; i++) {
+        n += (cl->reqs[i].kind >= 0) ? 1 : 0;
+    }
+
+    return n;
+}
+
+/**
+ * @brief Print the latencies of each command kind, compared to an earlier
+ *        run if a baseline is given, and save them for later comparison.
+ *
+ * @param [in] baseline File saved by an earlier run, or NULL.
+ * @param [in] output   File to save the latencies to, or NULL.
+ */
+static void report(const char *baseline, const char *output)
+{
+    char line[256], name[KIND_LENGTH];
+    unsigned int p50, p99, base50[MAX_KINDS] = {0}, base99[MAX_KINDS] = {0};
+    FILE *file;
+    uint32_t i;
+    int kind;
+
+    if (baseline && NULL == (file = fopen(baseline, "r"))) {
+        fprintf(stderr, "Failed to open %s\n", baseline);
+        baseline = NULL;
+    }
+
+    while (baseline && fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "%63[^\t]\t%*u\t%u\t%u", name, &p50, &p99) == 3 &&
+                (kind = get_kind(name)) >= 0) {
+            base50[kind] = p50;
+            base99[kind] = p99;
+        }
+    }
+
+    if (baseline) {
+        fclose(file);
+    }
+
+    if (output && NULL == (file = fopen(output, "w"))) {
+        fprintf(stderr, "Failed to create %s\n", output);
+        output = NULL;
+    }
+
+    printf("%-20s %8s %6s %6s %10s %10s %10s", "COMMAND", "COUNT", "KO",
+           "BUSY", "P50_MS", "P99_MS", "MAX_MS");
+    printf(baseline ? " %9s %9s\n" : "\n", "P50_DIFF", "P99_DIFF");
+
+    for (i = 0; i < num_kinds; i++) {
+        if (0 == kinds[i].num) {
+            continue;
+        }
+
+        qsort(kinds[i].lat, kinds[i].num, sizeof(*kinds[i].lat), compare);
+        p50 = percentile(&kinds[i], 0.5);
+        p99 = percentile(&kinds[i], 0.99);
+
+        printf("%-20s %8u %6u %6u %10.3f %10.3f %10.3f", kinds[i].name,
+               kinds[i].num, kinds[i].ko, kinds[i].busy, p50 / 1e3,
+               p99 / 1e3, kinds[i].lat[kinds[i].num - 1] / 1e3);
+
+        if (baseline && base50[i] && base99[i]) {
+            printf(" %+8.1f%% %+8.1f%%\n", 100.0 * p50 / base50[i] - 100,
+                   100.0 * p99 / base99[i] - 100);
+        } else {
+            printf("\n");
+        }
+
+        if (output) {
+            fprintf(file, "%s\t%u\t%u\t%u\n", kinds[i].name, kinds[i].num,
+                    p50, p99);
+        }
+    }
+
+    if (output) {
+        fclose(file);
+    }
+}
+
+/**
+ * @brief Get a percentile of the sorted latencies of a command kind.
+ *
+ * @param [in] k Command kind.
+ * @param [in] q Quantile.
+ *
+ * @return Returns the latency in microseconds.
+ */
+static uint32_t percentile(const struct kind *k, double q)
+{
+    return k->lat[(uint32_t)(q * (k->num - 1) + 0.5)];
+}
+
+/**
+ * @brief Compare latencies for sorting.
+ */
+static int compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Get the monotonic time.
+ *
+ * @return Returns the time in microseconds.
+ */
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,1336 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "dipclient.h"
+
+// Protocol of the proxy, see "BINARY PROTOCOL" in the README.
+#define PROTO_BINARY "proto binary\n"
+#define RES_OK "OK\n"
+#define BATCH_CMD "batch"
+#define BATCH_END "end"
+#define STREAM_STOP "stream --stop"
+#define BUSY_RETRY "retry_ms="
+#define FRAME_HDR_LEN 12
+#define FRAME_REQUEST 1
+#define FRAME_RESPONSE 2
+#define FRAME_DATA 3
+#define FRAME_F_KO 0x01
+#define FRAME_F_BUSY 0x02
+
+// Requests executing at the same time on one connection, as the proxy
+// allows.
+#define MAX_INFLIGHT 8
+
+// Times a request refused as busy is sent again.
+#define BUSY_RETRIES 3
+
+// Delay before connecting again, doubled at each failure up to the max.
+#define RECONNECT_MS 100
+#define MAX_RECONNECT_MS 5000
+
+// Time to wait for a connection and the binary protocol acknowledge.
+#define CONNECT_TIMEOUT_MS 2000
+
+// Time a request waits for a connection before it fails.
+#define QUEUE_TIMEOUT_MS 10000
+
+// Max time to wait in poll while requests wait to be sent.
+#define RETRY_POLL_MS 10
+
+// Initial size of the receive buffer, grown to the largest frame.
+#define IN_LEN (64 * 1024)
+
+// Request, queued until sent and kept until answered.
+struct request {
+    struct request *next;
+    uint32_t id;                     // ID of the answered frame.
+    int conn;                        // Connection of the session, or -1.
+    int tracked;                     // Set if counted as pending.
+    uint32_t tries;                  // Times refused as busy.
+    uint64_t retry_ms;               // Time to send again after BUSY.
+    uint64_t queued_ms;              // Time queued.
+    dip_data_cb data;
+    dip_done_cb done;
+    void *arg;
+    uint32_t len;                    // Length of the frames.
+    char frames[];                   // Request frames, sent as one.
+};
+
+// Connection to the proxy.
+struct conn {
+    int fd;                          // -1 while not connected.
+    uint64_t retry_ms;               // Time of the next connect attempt.
+    uint32_t backoff_ms;
+    struct request *sent;            // Requests waiting for the response.
+    uint32_t inflight;
+    char *out;                       // Frames not yet sent.
+    uint32_t out_len;
+    uint32_t out_pos;
+    uint32_t out_size;
+    char *in;                        // Frames not yet complete.
+    uint32_t in_len;
+    uint32_t in_size;
+};
+
+// Subscription to a live stream, on a connection of its own.
+struct sub {
+    struct sub *next;
+    int handle;
+    int stopping;                    // Set once the stop is requested.
+    struct conn conn;
+    struct request *req;             // Stream request, sent on reconnect.
+};
+
+// Client of one proxy.
+struct dip_client {
+    struct addrinfo *addr;
+    struct conn conns[DIP_MAX_CONNS];
+    uint32_t num_conns;
+    struct request *queue;           // Requests not yet sent, in order.
+    struct sub *subs;
+    int last_sub;
+    uint32_t last_id;
+    uint32_t pending;                // Requests not yet answered.
+    struct pollfd *fds;              // Descriptors polled.
+    struct polled *polled;           // Connections polled.
+    uint32_t max_polled;
+};
+
+// Connection polled by dip_poll().
+struct polled {
+    struct conn *conn;
+    struct sub *sub;
+};
+
+// Result of a synchronous call.
+struct call {
+    int done;
+    enum dip_status status;
+    char *resp;
+    uint32_t len;
+};
+
+// Forward declarations.
+static struct request * new_request(struct dip_client *client,
+                                    const char * const *cmds, uint32_t num,
+                                    dip_data_cb data, dip_done_cb done,
+                                    void *arg);
+static char * put_frame(char *p, uint32_t id, const char *cmd);
+static int get_conn(const struct dip_client *client, const char *cmd);
+static void enqueue(struct dip_client *client, struct request *req);
+static void dispatch(struct dip_client *client);
+static int pick_conn(struct dip_client *client, const struct request *req,
+                     uint64_t blocked, uint64_t now);
+static int ensure_conn(struct dip_client *client, struct conn *conn,
+                       uint64_t now);
+static int closed_by_peer(int fd);
+static int connected(const struct dip_client *client, int c);
+static int add_out(struct conn *conn, const char *data, uint32_t len);
+static int flush_out(struct conn *conn);
+static void drop_conn(struct dip_client *client, struct conn *conn,
+                      struct sub *sub);
+static void close_conn(struct conn *conn);
+static void free_sent(struct conn *conn);
+static int has_sub(const struct dip_client *client, const struct sub *sub);
+static int receive(struct dip_client *client, struct conn *conn,
+                   struct sub *sub);
+static void handle_frame(struct dip_client *client, struct conn *conn,
+                         struct sub *sub, const uint8_t *hdr, char *data,
+                         uint32_t len);
+static void finish(struct dip_client *client, struct request *req,
+                   enum dip_status status, const char *resp, uint32_t len);
+static void end_sub(struct dip_client *client, struct sub *sub,
+                    enum dip_status status, const char *resp, uint32_t len);
+static void call_done(void *arg, enum dip_status status, const char *resp,
+                      uint32_t len);
+static uint64_t now_ms(void);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Create a client of a proxy. Pooled connections are made as needed,
+ *        commands for the same log session always use the same one so they
+ *        are executed in the order sent. The client isn't thread safe.
+ *
+ * @param [in] host  Host of the proxy.
+ * @param [in] port  Port of the proxy.
+ * @param [in] conns Max number of pooled connections.
+ *
+ * @return Returns the client, or NULL at failure.
+ */
+struct dip_client * dip_open(const char *host, const char *port,
+                             uint32_t conns)
+{
+    struct dip_client *client;
+    struct addrinfo hints;
+    uint32_t i;
+
+    client = calloc(1, sizeof(*client));
+
+    if (NULL == client) {
+        return NULL;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &client->addr) != 0) {
+        free(client);
+        errno = EHOSTUNREACH;
+        return NULL;
+    }
+
+    client->num_conns = (0 == conns) ? 1 :
+                        (conns > DIP_MAX_CONNS) ? DIP_MAX_CONNS : conns;
+
+    for (i = 0; i < DIP_MAX_CONNS; i++) {
+        client->conns[i].fd = -1;
+        client->conns[i].backoff_ms = RECONNECT_MS;
+    }
+
+    return client;
+}
+
+/**
+ * @brief Close a client. Callbacks of requests not answered aren't called.
+ *
+ * @param [in] client Client.
+ */
+void dip_close(struct dip_client *client)
+{
+    struct request *req;
+    struct sub *sub;
+    uint32_t i;
+
+    if (NULL == client) {
+        return;
+    }
+
+    for (i = 0; i < client->num_conns; i++) {
+        close_conn(&client->conns[i]);
+        free_sent(&client->conns[i]);
+    }
+
+    while ((sub = client->subs)) {
+        client->subs = sub->next;
+        close_conn(&sub->conn);
+        free_sent(&sub->conn);
+        free(sub->req);
+        free(sub);
+    }
+
+    while ((req = client->queue)) {
+        client->queue = req->next;
+        free(req);
+    }
+
+    freeaddrinfo(client->addr);
+    free(client->fds);
+    free(client->polled);
+    free(client);
+}
+
+/**
+ * @brief Send a command without waiting for the response. Commands are
+ *        pipelined, the callbacks are called from dip_poll(). A command
+ *        refused as busy is sent again after the delay asked for by the
+ *        proxy. A command on a connection that is lost fails with
+ *        DIP_ERROR, as it may have been executed, later commands are sent
+ *        once connected again. A command also fails with DIP_ERROR if the
+ *        proxy can't be reached for 10 seconds.
+ *
+ * @param [in] client Client.
+ * @param [in] cmd    Command.
+ * @param [in] data   Called with streamed output, e.g. of a log read, or
+ *                    NULL.
+ * @param [in] done   Called with the response, or NULL.
+ * @param [in] arg    Callback argument.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int dip_send(struct dip_client *client, const char *cmd, dip_data_cb data,
+             dip_done_cb done, void *arg)
+{
+    struct request *req;
+
+    req = new_request(client, &cmd, 1, data, done, arg);
+
+    if (NULL == req) {
+        return -1;
+    }
+
+    req->conn = get_conn(client, cmd);
+    enqueue(client, req);
+
+    return 0;
+}
+
+/**
+ * @brief Send commands as one batch, see "BATCHES" in the README.
+ *
+ * @param [in] client Client.
+ * @param [in] opts   Batch options, e.g. "--atomic", or NULL.
+ * @param [in] cmds   Commands.
+ * @param [in] num    Number of commands.
+ * @param [in] done   Called with the response of the batch, or NULL.
+ * @param [in] arg    Callback argument.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int dip_batch(struct dip_client *client, const char *opts,
+              const char * const *cmds, uint32_t num, dip_done_cb done,
+              void *arg)
+{
+    char open[DIP_CMD_LENGTH + 1];
+    const char **all;
+    struct request *req;
+    uint32_t i;
+
+    if (NULL == cmds || 0 == num) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    all = malloc((num + 2) * sizeof(*all));
+
+    if (NULL == all) {
+        return -1;
+    }
+
+    snprintf(open, sizeof(open), "%s%s%s", BATCH_CMD, opts ? " " : "",
+             opts ? opts : "");
+
+    all[0] = open;
+    memcpy(all + 1, cmds, num * sizeof(*all));
+    all[num + 1] = BATCH_END;
+
+    // The batch is answered with the ID of its first frame.
+    req = new_request(client, all, num + 2, NULL, done, arg);
+    free(all);
+
+    if (NULL == req) {
+        return -1;
+    }
+
+    req->conn = -1;
+    for (i = 0; i < num && -1 == req->conn; i++) {
+        req->conn = get_conn(client, cmds[i]);
+    }
+
+    enqueue(client, req);
+
+    return 0;
+}
+
+/**
+ * @brief Subscribe to a live stream, e.g. "stream <name> --match=ERROR".
+ *        The stream uses a connection of its own and is opened again when
+ *        the connection is lost, output sent meanwhile is missed.
+ *
+ * @param [in] client Client.
+ * @param [in] cmd    Stream command.
+ * @param [in] data   Called with the streamed lines.
+ * @param [in] done   Called once the stream ended, or NULL.
+ * @param [in] arg    Callback argument.
+ *
+ * @return Returns the subscription, or -1 at failure.
+ */
+int dip_subscribe(struct dip_client *client, const char *cmd,
+                  dip_data_cb data, dip_done_cb done, void *arg)
+{
+    struct sub *sub;
+
+    sub = calloc(1, sizeof(*sub));
+
+    if (NULL == sub) {
+        return -1;
+    }
+
+    sub->req = new_request(client, &cmd, 1, data, done, arg);
+
+    if (NULL == sub->req) {
+        free(sub);
+        return -1;
+    }
+
+    sub->handle = ++client->last_sub;
+    sub->conn.fd = -1;
+    sub->conn.backoff_ms = RECONNECT_MS;
+    sub->next = client->subs;
+    client->subs = sub;
+
+    // Sent by dip_poll() if not connected yet.
+    if (ensure_conn(client, &sub->conn, now_ms()) == 0 &&
+            add_out(&sub->conn, sub->req->frames, sub->req->len) == 0) {
+        (void)flush_out(&sub->conn);
+    }
+
+    return sub->handle;
+}
+
+/**
+ * @brief End a subscription. The done callback of the subscription is
+ *        called once the stream ended.
+ *
+ * @param [in] client Client.
+ * @param [in] handle Subscription.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int dip_unsubscribe(struct dip_client *client, int handle)
+{
+    const char *cmd = STREAM_STOP;
+    struct request *req;
+    struct sub *sub;
+
+    for (sub = client->subs; sub && sub->handle != handle; sub = sub->next) {
+    }
+
+    if (NULL == sub || sub->stopping) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sub->stopping = 1;
+
+    if (-1 == sub->conn.fd) {
+        end_sub(client, sub, DIP_OK, "", 0);
+        return 0;
+    }
+
+    req = new_request(client, &cmd, 1, NULL, NULL, NULL);
+
+    if (NULL == req || add_out(&sub->conn, req->frames, req->len) == -1) {
+        free(req);
+        drop_conn(client, &sub->conn, sub);
+        return 0;
+    }
+
+    req->tracked = 0;
+    req->next = sub->conn.sent;
+    sub->conn.sent = req;
+
+    (void)flush_out(&sub->conn);
+
+    return 0;
+}
+
+/**
+ * @brief Send and receive, calling the callbacks of answered requests.
+ *
+ * @param [in] client     Client.
+ * @param [in] timeout_ms Max time to wait for I/O, -1 to wait until some.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int dip_poll(struct dip_client *client, int timeout_ms)
+{
+    struct conn *conn;
+    struct sub *sub;
+    uint32_t i, n = 0, max = client->num_conns;
+    uint64_t now = now_ms();
+    int waiting = (NULL != client->queue);
+
+    dispatch(client);
+
+    // Reopen streams of lost connections.
+    for (sub = client->subs; sub; sub = sub->next) {
+        max++;
+        if (-1 == sub->conn.fd && !sub->stopping) {
+            if (ensure_conn(client, &sub->conn, now) == 0 &&
+                    add_out(&sub->conn, sub->req->frames,
+                            sub->req->len) == -1) {
+                drop_conn(client, &sub->conn, sub);
+            }
+            waiting |= (-1 == sub->conn.fd);
+        }
+    }
+
+    if (max > client->max_polled) {
+        free(client->fds);
+        free(client->polled);
+        client->fds = malloc(2 * max * sizeof(*client->fds));
+        client->polled = malloc(2 * max * sizeof(*client->polled));
+        if (NULL == client->fds || NULL == client->polled) {
+            client->max_polled = 0;
+            return -1;
+        }
+        client->max_polled = 2 * max;
+    }
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].fd != -1) {
+            client->polled[n].conn = &client->conns[i];
+            client->polled[n++].sub = NULL;
+        }
+    }
+
+    for (sub = client->subs; sub; sub = sub->next) {
+        if (sub->conn.fd != -1) {
+            client->polled[n].conn = &sub->conn;
+            client->polled[n++].sub = sub;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        conn = client->polled[i].conn;
+        client->fds[i].fd = conn->fd;
+        client->fds[i].events = POLLIN | ((conn->out_len > 0) ? POLLOUT : 0);
+    }
+
+    if (waiting && (timeout_ms < 0 || timeout_ms > RETRY_POLL_MS)) {
+        timeout_ms = RETRY_POLL_MS;
+    }
+
+    if (poll(client->fds, n, timeout_ms) == -1) {
+        return (EINTR == errno) ? 0 : -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        conn = client->polled[i].conn;
+        sub = client->polled[i].sub;
+
+        // Callbacks may have ended a subscription or dropped a connection.
+        if (sub && !has_sub(client, sub)) {
+            continue;
+        }
+        if (conn->fd != client->fds[i].fd) {
+            continue;
+        }
+
+        if (((client->fds[i].revents & POLLOUT) && flush_out(conn) == -1) ||
+                ((client->fds[i].revents & (POLLIN | POLLERR | POLLHUP)) &&
+                 receive(client, conn, sub) == -1)) {
+            drop_conn(client, conn, sub);
+        }
+    }
+
+    dispatch(client);
+
+    return 0;
+}
+
+/**
+ * @brief Wait until all requests are answered.
+ *
+ * @param [in] client     Client.
+ * @param [in] timeout_ms Max time to wait, -1 to wait until answered.
+ *
+ * @return Returns 0 at success, or -1 at failure or timeout.
+ */
+int dip_wait(struct dip_client *client, int timeout_ms)
+{
+    uint64_t end = now_ms() + timeout_ms, now;
+
+    while (client->pending > 0) {
+        now = now_ms();
+        if (timeout_ms >= 0 && now >= end) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (dip_poll(client, (timeout_ms < 0) ? -1 : (int)(end - now)) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Get the number of requests not yet answered.
+ *
+ * @param [in] client Client.
+ *
+ * @return Returns the number of requests.
+ */
+uint32_t dip_pending(const struct dip_client *client)
+{
+    return client->pending;
+}
+
+/**
+ * @brief Send a command and wait for the response. Responses of other
+ *        requests are handled meanwhile.
+ *
+ * @param [in]  client Client.
+ * @param [in]  cmd    Command.
+ * @param [out] resp   Response data, or NULL.
+ * @param [in]  len    Size of resp.
+ *
+ * @return Returns the status of the command, or -1 at failure.
+ */
+int dip_call(struct dip_client *client, const char *cmd, char *resp,
+             uint32_t len)
+{
+    struct call call = {0, DIP_ERROR, resp, len};
+
+    if (dip_send(client, cmd, NULL, call_done, &call) == -1) {
+        return -1;
+    }
+
+    while (!call.done) {
+        if (dip_poll(client, -1) == -1) {
+            return -1;
+        }
+    }
+
+    return call.status;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Create a request of one or more frames, answered with the ID of the
+ *        first one.
+ *
+ * @param [in] client Client.
+ * @param [in] cmds   Commands, one per frame.
+ * @param [in] num    Number of commands.
+ * @param [in] data   Streamed output callback, or NULL.
+ * @param [in] done   Response callback, or NULL.
+ * @param [in] arg    Callback argument.
+ *
+ * @return Returns the request, or NULL at failure.
+ */
+static struct request * new_request(struct dip_client *client,
+                                    const char * const *cmds, uint32_t num,
+                                    dip_data_cb data, dip_done_cb done,
+                                    void *arg)
+{
+    struct request *req;
+    uint32_t i, len = 0;
+    char *p;
+
+    for (i = 0; i < num; i++) {
+        if (NULL == cmds[i] || strlen(cmds[i]) > DIP_CMD_LENGTH) {
+            errno = EINVAL;
+            return NULL;
+        }
+        len += FRAME_HDR_LEN + strlen(cmds[i]);
+    }
+
+    req = calloc(1, sizeof(*req) + len);
+
+    if (NULL == req) {
+        return NULL;
+    }
+
+    for (i = 0, p = req->frames; i < num; i++) {
+        // Request ID 0 is left out, to tell it from none.
+        if (0 == ++client->last_id) {
+            client->last_id++;
+        }
+        if (0 == i) {
+            req->id = client->last_id;
+        }
+        p = put_frame(p, client->last_id, cmds[i]);
+    }
+
+    req->conn = -1;
+    req->data = data;
+    req->done = done;
+    req->arg = arg;
+    req->len = len;
+
+    return req;
+}
+
+/**
+ * @brief Encode a request frame.
+ *
+ * @param [out] p   Output.
+ * @param [in]  id  Request ID.
+ * @param [in]  cmd Command.
+ *
+ * @return Returns the end of the frame.
+ */
+static char * put_frame(char *p, uint32_t id, const char *cmd)
+{
+    uint32_t len = strlen(cmd);
+
+    p[0] = FRAME_REQUEST;
+    p[1] = 0;
+    p[2] = 0;
+    p[3] = 0;
+    p[4] = id >> 24;
+    p[5] = id >> 16;
+    p[6] = id >> 8;
+    p[7] = id;
+    p[8] = len >> 24;
+    p[9] = len >> 16;
+    p[10] = len >> 8;
+    p[11] = len;
+    memcpy(p + FRAME_HDR_LEN, cmd, len);
+
+    return p + FRAME_HDR_LEN + len;
+}
+
+/**
+ * @brief Get the connection of the log session a command is for, the first
+ *        argument that isn't an option, or the value of --start or --stop.
+ *
+ * @param [in] client Client.
+ * @param [in] cmd    Command.
+ *
+ * @return Returns the connection index, or -1 for any connection.
+ */
+static int get_conn(const struct dip_client *client, const char *cmd)
+{
+    const char *p = cmd + strcspn(cmd, " \t");
+    uint32_t hash = 2166136261U;
+    size_t n;
+
+    while (*p) {
+        p += strspn(p, " \t");
+        n = strcspn(p, " \t");
+        if (strncmp(p, "--start=", 8) == 0 || strncmp(p, "--stop=", 7) == 0) {
+            p += strcspn(p, "=") + 1;
+            n = strcspn(p, " \t");
+            break;
+        }
+        if (n > 0 && '-' != *p) {
+            break;
+        }
+        p += n;
+    }
+
+    if ('\0' == *p) {
+        return -1;
+    }
+
+    // FNV-1a.
+    while (n-- > 0) {
+        hash = (hash ^ (uint8_t)*p++) * 16777619U;
+    }
+
+    return hash % client->num_conns;
+}
+
+/**
+ * @brief Queue a request to be sent, and send what can be sent.
+ *
+ * @param [in] client Client.
+ * @param [in] req    Request.
+ */
+static void enqueue(struct dip_client *client, struct request *req)
+{
+    struct request **p;
+
+    for (p = &client->queue; *p; p = &(*p)->next) {
+    }
+
+    req->next = NULL;
+    req->tracked = 1;
+    req->queued_ms = now_ms();
+    *p = req;
+    client->pending++;
+
+    dispatch(client);
+}
+
+/**
+ * @brief Move queued requests to connections with room, in the order
+ *        queued. A request that has to wait holds back the later requests
+ *        for its connection.
+ *
+ * @param [in] client Client.
+ */
+static void dispatch(struct dip_client *client)
+{
+    struct request **p, *req;
+    uint64_t blocked = 0, now = now_ms();
+    struct conn *conn;
+    int c;
+
+    for (p = &client->queue; (req = *p); ) {
+        c = pick_conn(client, req, blocked, now);
+
+        // Fail requests while the proxy can't be reached.
+        if (-1 == c && now - req->queued_ms > QUEUE_TIMEOUT_MS &&
+                !connected(client, req->conn)) {
+            *p = req->next;
+            finish(client, req, DIP_ERROR, "", 0);
+            continue;
+        }
+
+        if (-1 == c) {
+            if (req->conn >= 0) {
+                blocked |= 1ULL << req->conn;
+            }
+            p = &req->next;
+            continue;
+        }
+
+        conn = &client->conns[c];
+
+        if (add_out(conn, req->frames, req->len) == -1) {
+            break;
+        }
+
+        *p = req->next;
+        req->next = conn->sent;
+        conn->sent = req;
+        conn->inflight++;
+    }
+
+    for (c = 0; c < (int)client->num_conns; c++) {
+        conn = &client->conns[c];
+        if (conn->out_len > 0 && flush_out(conn) == -1) {
+            drop_conn(client, conn, NULL);
+        }
+    }
+}
+
+/**
+ * @brief Pick the connection to send a request on, the connection of its
+ *        log session or the least loaded one. Pooled connections are made
+ *        when all connected ones are in use.
+ *
+ * @param [in] client  Client.
+ * @param [in] req     Request.
+ * @param [in] blocked Connections that earlier requests wait for.
+ * @param [in] now     Current time.
+ *
+ * @return Returns the connection index, or -1 if the request has to wait.
+ */
+static int pick_conn(struct dip_client *client, const struct request *req,
+                     uint64_t blocked, uint64_t now)
+{
+    struct conn *conn;
+    int c, best = -1, idle = -1;
+
+    if (req->retry_ms > now) {
+        return -1;
+    }
+
+    if (req->conn >= 0) {
+        conn = &client->conns[req->conn];
+        if ((blocked & (1ULL << req->conn)) ||
+                ensure_conn(client, conn, now) == -1 ||
+                conn->inflight >= MAX_INFLIGHT) {
+            return -1;
+        }
+        return req->conn;
+    }
+
+    for (c = 0; c < (int)client->num_conns; c++) {
+        conn = &client->conns[c];
+        if (conn->fd != -1 &&
+                (conn->inflight > 0 || ensure_conn(client, conn, now) == 0)) {
+            if (conn->inflight < MAX_INFLIGHT &&
+                    (-1 == best || conn->inflight <
+                     client->conns[best].inflight)) {
+                best = c;
+            }
+        } else if (-1 == idle && now >= conn->retry_ms) {
+            idle = c;
+        }
+    }
+
+    if ((-1 == best || client->conns[best].inflight > 0) && idle != -1 &&
+            ensure_conn(client, &client->conns[idle], now) == 0) {
+        best = idle;
+    }
+
+    return best;
+}
+
+/**
+ * @brief Connect to the proxy and switch to the binary protocol, unless
+ *        connected. A failed attempt is retried after a growing delay.
+ *
+ * @param [in] client Client.
+ * @param [in] conn   Connection.
+ * @param [in] now    Current time.
+ *
+ * @return Returns 0 if connected, or -1 if not.
+ */
+static int ensure_conn(struct dip_client *client, struct conn *conn,
+                       uint64_t now)
+{
+    struct timeval tv = {CONNECT_TIMEOUT_MS / 1000,
+                         CONNECT_TIMEOUT_MS % 1000 * 1000};
+    struct addrinfo *ai = client->addr;
+    char resp[sizeof(RES_OK)];
+    int on = 1, fd;
+
+    if (conn->fd != -1) {
+        if (conn->inflight > 0 || !closed_by_peer(conn->fd)) {
+            return 0;
+        }
+        close_conn(conn);
+    }
+
+    if (now < conn->retry_ms) {
+        return -1;
+    }
+
+    fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    // A refused client is answered with BUSY and closed.
+    if (-1 == fd ||
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1 ||
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+            connect(fd, ai->ai_addr, ai->ai_addrlen) == -1 ||
+            send(fd, PROTO_BINARY, strlen(PROTO_BINARY), MSG_NOSIGNAL) == -1 ||
+            recv(fd, resp, strlen(RES_OK), MSG_WAITALL) !=
+            (ssize_t)strlen(RES_OK) || memcmp(resp, RES_OK, 3) != 0 ||
+            fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        conn->retry_ms = now + conn->backoff_ms;
+        conn->backoff_ms = (2 * conn->backoff_ms > MAX_RECONNECT_MS) ?
+                           MAX_RECONNECT_MS : 2 * conn->backoff_ms;
+        return -1;
+    }
+
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    conn->fd = fd;
+    conn->backoff_ms = RECONNECT_MS;
+    conn->in_len = 0;
+
+    return 0;
+}
+
+/**
+ * @brief Check if an idle connection was closed by the proxy, e.g. when
+ *        restarted, so that requests are not lost on it.
+ *
+ * @param [in] fd Socket.
+ *
+ * @return Returns 1 if closed, else 0.
+ */
+static int closed_by_peer(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return 0 == n || (-1 == n && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+/**
+ * @brief Check if a pooled connection is connected.
+ *
+ * @param [in] client Client.
+ * @param [in] c      Connection index, or -1 for any.
+ *
+ * @return Returns 1 if connected, else 0.
+ */
+static int connected(const struct dip_client *client, int c)
+{
+    uint32_t i;
+
+    if (c >= 0) {
+        return client->conns[c].fd != -1;
+    }
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].fd != -1) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Append frames to the output of a connection.
+ *
+ * @param [in] conn Connection.
+ * @param [in] data Frames.
+ * @param [in] len  Length of the frames.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int add_out(struct conn *conn, const char *data, uint32_t len)
+{
+    uint32_t size;
+    char *out;
+
+    if (conn->out_len + len > conn->out_size) {
+        size = 2 * (conn->out_len + len);
+        out = realloc(conn->out, size);
+        if (NULL == out) {
+            return -1;
+        }
+        conn->out = out;
+        conn->out_size = size;
+    }
+
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+
+    return 0;
+}
+
+/**
+ * @brief Send pending output without blocking.
+ *
+ * @param [in] conn Connection.
+ *
+ * @return Returns 0 at success, or -1 if the connection failed.
+ */
+static int flush_out(struct conn *conn)
+{
+    ssize_t n;
+
+    while (conn->out_pos < conn->out_len) {
+        n = send(conn->fd, conn->out + conn->out_pos,
+                 conn->out_len - conn->out_pos, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (-1 == n) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+        }
+        conn->out_pos += n;
+    }
+
+    conn->out_len = 0;
+    conn->out_pos = 0;
+
+    return 0;
+}
+
+/**
+ * @brief Handle a lost connection. Requests sent on it fail, a stream is
+ *        opened again unless being stopped.
+ *
+ * @param [in] client Client.
+ * @param [in] conn   Connection.
+ * @param [in] sub    Subscription of the connection, or NULL.
+ */
+static void drop_conn(struct dip_client *client, struct conn *conn,
+                      struct sub *sub)
+{
+    struct request *req;
+
+    close_conn(conn);
+    conn->retry_ms = now_ms() + conn->backoff_ms;
+
+    while ((req = conn->sent)) {
+        conn->sent = req->next;
+        finish(client, req, DIP_ERROR, "", 0);
+    }
+    conn->inflight = 0;
+
+    if (sub && sub->stopping) {
+        end_sub(client, sub, DIP_ERROR, "", 0);
+    }
+}
+
+/**
+ * @brief Close a connection and drop its buffers.
+ *
+ * @param [in] conn Connection.
+ */
+static void close_conn(struct conn *conn)
+{
+    if (conn->fd != -1) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+
+    free(conn->out);
+    free(conn->in);
+    conn->out = NULL;
+    conn->in = NULL;
+    conn->out_len = conn->out_pos = conn->out_size = 0;
+    conn->in_len = conn->in_size = 0;
+}
+
+/**
+ * @brief Free the requests sent on a connection, without calling their
+ *        callbacks.
+ *
+ * @param [in] conn Connection.
+ */
+static void free_sent(struct conn *conn)
+{
+    struct request *req;
+
+    while ((req = conn->sent)) {
+        conn->sent = req->next;
+        free(req);
+    }
+    conn->inflight = 0;
+}
+
+/**
+ * @brief Check if a subscription still exists.
+ *
+ * @param [in] client Client.
+ * @param [in] sub    Subscription.
+ *
+ * @return Returns 1 if it exists, else 0.
+ */
+static int has_sub(const struct dip_client *client, const struct sub *sub)
+{
+    const struct sub *s;
+
+    for (s = client->subs; s && s != sub; s = s->next) {
+    }
+
+    return NULL != s;
+}
+
+/**
+ * @brief Receive frames and handle the complete ones.
+ *
+ * @param [in] client Client.
+ * @param [in] conn   Connection.
+ * @param [in] sub    Subscription of the connection, or NULL.
+ *
+ * @return Returns 0 at success, or -1 if the connection failed.
+ */
+static int receive(struct dip_client *client, struct conn *conn,
+                   struct sub *sub)
+{
+    uint32_t len, pos = 0;
+    uint8_t *hdr;
+    ssize_t n;
+    char save;
+    char *in;
+
+    if (conn->in_size - conn->in_len < IN_LEN / 4) {
+        in = realloc(conn->in, conn->in_size + IN_LEN);
+        if (NULL == in) {
+            return -1;
+        }
+        conn->in = in;
+        conn->in_size += IN_LEN;
+    }
+
+    n = recv(conn->fd, conn->in + conn->in_len,
+             conn->in_size - conn->in_len - 1, MSG_DONTWAIT);
+
+    if (n <= 0) {
+        return (-1 == n && (EAGAIN == errno || EINTR == errno)) ? 0 : -1;
+    }
+
+    conn->in_len += n;
+
+    while (conn->in_len - pos >= FRAME_HDR_LEN) {
+        hdr = (uint8_t *)conn->in + pos;
+        len = (uint32_t)hdr[8] << 24 | hdr[9] << 16 | hdr[10] << 8 | hdr[11];
+
+        if (conn->in_len - pos - FRAME_HDR_LEN < len) {
+            break;
+        }
+
+        // The payload is terminated in place for the callbacks.
+        save = conn->in[pos + FRAME_HDR_LEN + len];
+        conn->in[pos + FRAME_HDR_LEN + len] = '\0';
+        handle_frame(client, conn, sub, hdr, conn->in + pos + FRAME_HDR_LEN,
+                     len);
+
+        // The callbacks may have ended the stream or lost the connection.
+        if ((sub && !has_sub(client, sub)) || -1 == conn->fd) {
+            return 0;
+        }
+        conn->in[pos + FRAME_HDR_LEN + len] = save;
+
+        pos += FRAME_HDR_LEN + len;
+    }
+
+    conn->in_len -= pos;
+    memmove(conn->in, conn->in + pos, conn->in_len);
+
+    // Make room for the rest of a large frame.
+    if (conn->in_len >= FRAME_HDR_LEN) {
+        hdr = (uint8_t *)conn->in;
+        len = (uint32_t)hdr[8] << 24 | hdr[9] << 16 | hdr[10] << 8 | hdr[11];
+        if (FRAME_HDR_LEN + len + 1 > conn->in_size) {
+            in = realloc(conn->in, FRAME_HDR_LEN + len + 1);
+            if (NULL == in) {
+                return -1;
+            }
+            conn->in = in;
+            conn->in_size = FRAME_HDR_LEN + len + 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Handle a received frame.
+ *
+ * @param [in] client Client.
+ * @param [in] conn   Connection.
+ * @param [in] sub    Subscription of the connection, or NULL.
+ * @param [in] hdr    Frame header.
+ * @param [in] data   Payload, terminated.
+ * @param [in] len    Payload length.
+ */
+static void handle_frame(struct dip_client *client, struct conn *conn,
+                         struct sub *sub, const uint8_t *hdr, char *data,
+                         uint32_t len)
+{
+    uint32_t id = (uint32_t)hdr[4] << 24 | hdr[5] << 16 | hdr[6] << 8 | hdr[7];
+    enum dip_status status;
+    struct request **p, *req;
+    const char *retry;
+
+    if (sub && id == sub->req->id) {
+        if (FRAME_DATA == hdr[0]) {
+            if (sub->req->data) {
+                sub->req->data(sub->req->arg, data, len);
+            }
+        } else if (FRAME_RESPONSE == hdr[0]) {
+            end_sub(client, sub, (hdr[1] & FRAME_F_KO) ? DIP_KO : DIP_OK,
+                    data, len);
+        }
+        return;
+    }
+
+    for (p = &conn->sent; *p && (*p)->id != id; p = &(*p)->next) {
+    }
+
+    if (NULL == (req = *p)) {
+        return;
+    }
+
+    if (FRAME_DATA == hdr[0]) {
+        if (req->data) {
+            req->data(req->arg, data, len);
+        }
+        return;
+    }
+
+    if (hdr[0] != FRAME_RESPONSE) {
+        return;
+    }
+
+    *p = req->next;
+    conn->inflight--;
+
+    // Send again later when refused as busy.
+    if ((hdr[1] & FRAME_F_BUSY) && req->tries < BUSY_RETRIES) {
+        retry = strstr(data, BUSY_RETRY);
+        req->tries++;
+        req->retry_ms = now_ms() +
+            (retry ? strtoul(retry + strlen(BUSY_RETRY), NULL, 10) :
+             RECONNECT_MS);
+        req->next = client->queue;
+        client->queue = req;
+        return;
+    }
+
+    status = (hdr[1] & FRAME_F_BUSY) ? DIP_BUSY :
+             (hdr[1] & FRAME_F_KO) ? DIP_KO : DIP_OK;
+
+    finish(client, req, status, data, len);
+}
+
+/**
+ * @brief Complete a request and free it.
+ *
+ * @param [in] client Client.
+ * @param [in] req    Request.
+ * @param [in] status Result.
+ * @param [in] resp   Response data, terminated.
+ * @param [in] len    Response length.
+ */
+static void finish(struct dip_client *client, struct request *req,
+                   enum dip_status status, const char *resp, uint32_t len)
+{
+    if (req->tracked) {
+        client->pending--;
+    }
+
+    if (req->done) {
+        req->done(req->arg, status, resp, len);
+    }
+
+    free(req);
+}
+
+/**
+ * @brief End a subscription, once its stream ended or failed.
+ *
+ * @param [in] client Client.
+ * @param [in] sub    Subscription.
+ * @param [in] status Result.
+ * @param [in] resp   Response data, terminated.
+ * @param [in] len    Response length.
+ */
+static void end_sub(struct dip_client *client, struct sub *sub,
+                    enum dip_status status, const char *resp, uint32_t len)
+{
+    struct sub **p;
+
+    for (p = &client->subs; *p && *p != sub; p = &(*p)->next) {
+    }
+
+    if (*p) {
+        *p = sub->next;
+    }
+
+    close_conn(&sub->conn);
+    free_sent(&sub->conn);
+
+    if (sub->req->done) {
+        sub->req->done(sub->req->arg, status, resp, len);
+    }
+
+    free(sub->req);
+    free(sub);
+}
+
+/**
+ * @brief Take the response of a synchronous call.
+ *
+ * @param [in out] arg    Call.
+ * @param [in]     status Result.
+ * @param [in]     resp   Response data.
+ * @param [in]     len    Response length.
+ */
+static void call_done(void *arg, enum dip_status status, const char *resp,
+                      uint32_t len)
+{
+    struct call *call = arg;
+
+    call->done = 1;
+    call->status = status;
+
+    if (call->resp && call->len > 0) {
+        snprintf(call->resp, call->len, "%.*s", (int)len, resp);
+    }
+}
+
+/**
+ * @brief Get the monotonic time.
+ *
+ * @return Returns the time in milliseconds.
+ */
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
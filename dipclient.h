@@ -0,0 +1,47 @@
+
+#ifndef DIPCLIENT_H
+#define DIPCLIENT_H
+
+#include <stdint.h>
+
+// Max length of a command.
+#define DIP_CMD_LENGTH 255
+
+// Max number of pooled connections.
+#define DIP_MAX_CONNS 64
+
+// Result of a request.
+enum dip_status {
+    DIP_OK,                     // Command succeeded.
+    DIP_KO,                     // Command failed.
+    DIP_BUSY,                   // Refused as busy, also when retried.
+    DIP_ERROR                   // Connection lost before the response.
+};
+
+struct dip_client;
+
+// Called with the response of a request, the response data is terminated.
+typedef void (*dip_done_cb)(void *arg, enum dip_status status,
+                            const char *resp, uint32_t len);
+
+// Called with output streamed by a request.
+typedef void (*dip_data_cb)(void *arg, const char *data, uint32_t len);
+
+struct dip_client * dip_open(const char *host, const char *port,
+                             uint32_t conns);
+void dip_close(struct dip_client *client);
+int dip_send(struct dip_client *client, const char *cmd, dip_data_cb data,
+             dip_done_cb done, void *arg);
+int dip_batch(struct dip_client *client, const char *opts,
+              const char * const *cmds, uint32_t num, dip_done_cb done,
+              void *arg);
+int dip_subscribe(struct dip_client *client, const char *cmd,
+                  dip_data_cb data, dip_done_cb done, void *arg);
+int dip_unsubscribe(struct dip_client *client, int sub);
+int dip_poll(struct dip_client *client, int timeout_ms);
+int dip_wait(struct dip_client *client, int timeout_ms);
+uint32_t dip_pending(const struct dip_client *client);
+int dip_call(struct dip_client *client, const char *cmd, char *resp,
+             uint32_t len);
+
+#endif
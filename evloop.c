@@ -0,0 +1,341 @@
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "evloop.h"
+#include "pool.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "evloop.c"
+
+// Max number of events handled per wakeup.
+#define MAX_EVENTS 16
+
+// Stack size of the event loop thread.
+#define LOOP_STACK_SIZE (128 * 1024)
+
+struct watcher {
+    struct watcher *next;
+    int fd;
+    evloop_cb cb;
+    void *arg;
+};
+
+// Thread synchronization.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Event loop data.
+static pthread_t thread;
+static int epfd = -1;
+static struct watcher *watchers = NULL;
+
+// Forward declarations.
+static void * loop_thread(void *arg);
+static int lookup_watcher(int fd, evloop_cb *cb, void **arg);
+static void timer_expired(int fd, uint32_t events, void *arg);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Start the housekeeping event loop.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int evloop_start(void)
+{
+    if (epfd != -1) {
+        return 0;
+    }
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        ALOGE("%s:%d: Failed to create epoll instance (errno=%d)", _FILE,
+              __LINE__, errno);
+        return -1;
+    }
+
+    if (pool_start_thread(&thread, LOOP_STACK_SIZE, loop_thread, NULL) == -1) {
+        ALOGE("%s:%d: Failed to create event loop thread", _FILE, __LINE__);
+        close(epfd);
+        epfd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Watch a file descriptor. The callback is invoked from the event loop
+ *        thread.
+ *
+ * @param [in] fd     File descriptor to watch.
+ * @param [in] events Epoll event mask.
+ * @param [in] cb     Callback invoked when an event is pending.
+ * @param [in] arg    Callback argument.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int evloop_add_fd(int fd, uint32_t events, evloop_cb cb, void *arg)
+{
+    struct epoll_event ev;
+    struct watcher *w;
+
+    if (-1 == epfd || fd < 0 || NULL == cb) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    w = malloc(sizeof(*w));
+
+    if (NULL == w) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        return -1;
+    }
+
+    w->fd = fd;
+    w->cb = cb;
+    w->arg = arg;
+
+    pthread_mutex_lock(&mutex);
+    w->next = watchers;
+    watchers = w;
+    pthread_mutex_unlock(&mutex);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        ALOGE("%s:%d: Failed to watch fd %d (errno=%d)", _FILE, __LINE__, fd,
+              errno);
+        (void)evloop_del_fd(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Stop watching a file descriptor. The descriptor is not closed.
+ *
+ * @param [in] fd File descriptor to remove.
+ *
+ * @return Returns 0 at success, or -1 if the descriptor wasn't watched.
+ */
+int evloop_del_fd(int fd)
+{
+    struct watcher *w, *prev = NULL;
+
+    pthread_mutex_lock(&mutex);
+
+    for (w = watchers; w; prev = w, w = w->next) {
+        if (w->fd == fd) {
+            break;
+        }
+    }
+
+    if (w) {
+        if (prev) {
+            prev->next = w->next;
+        } else {
+            watchers = w->next;
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    if (NULL == w) {
+        return -1;
+    }
+
+    (void)epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    free(w);
+
+    return 0;
+}
+
+/**
+ * @brief Add a periodic timer to the event loop.
+ *
+ * @param [in] interval_ms Timer period in milliseconds, 0 to add the timer
+ *                         disarmed.
+ * @param [in] cb          Callback invoked at each expiry (fd is the timer).
+ * @param [in] arg         Callback argument.
+ *
+ * @return Returns the timer file descriptor at success, or -1 at failure.
+ */
+int evloop_add_timer(uint32_t interval_ms, evloop_cb cb, void *arg)
+{
+    struct watcher *w;
+    int fd;
+
+    if (NULL == cb) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK))
+            == -1) {
+        ALOGE("%s:%d: Failed to create timer (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
+
+    if (evloop_set_timer(fd, interval_ms) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // The timer watcher carries the user callback as its argument.
+    w = malloc(sizeof(*w));
+
+    if (NULL == w) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        close(fd);
+        return -1;
+    }
+
+    w->next = NULL;
+    w->fd = fd;
+    w->cb = cb;
+    w->arg = arg;
+
+    if (evloop_add_fd(fd, EPOLLIN, timer_expired, w) == -1) {
+        free(w);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Change the period of a timer added to the event loop. The next
+ *        expiry is one period from now.
+ *
+ * @param [in] fd          Timer file descriptor.
+ * @param [in] interval_ms Timer period in milliseconds, 0 to disarm.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int evloop_set_timer(int fd, uint32_t interval_ms)
+{
+    struct itimerspec its;
+
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+
+    if (timerfd_settime(fd, 0, &its, NULL) == -1) {
+        ALOGE("%s:%d: Failed to arm timer (errno=%d)", _FILE, __LINE__, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Wait for events and run the registered callbacks.
+ *
+ * @param [in] arg <Not in use>.
+ *
+ * @return Returns NULL at thread exit.
+ */
+static void * loop_thread(void *arg)
+{
+    struct epoll_event events[MAX_EVENTS];
+    evloop_cb cb;
+    void *cb_arg;
+    int i, n;
+
+    UNUSED(arg);
+
+    while (1) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+
+        if (-1 == n) {
+            if (EINTR == errno) {
+                continue;
+            }
+            ALOGE("%s:%d: Failed to wait for events (errno=%d)", _FILE,
+                  __LINE__, errno);
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            // The watcher may have been removed by an earlier callback.
+            if (lookup_watcher(events[i].data.fd, &cb, &cb_arg) == 0) {
+                cb(events[i].data.fd, events[i].events, cb_arg);
+            }
+        }
+    }
+
+    ALOGD("%s:%d: Exit event loop thread", _FILE, __LINE__);
+
+    return NULL;
+}
+
+/**
+ * @brief Find the callback registered for a file descriptor.
+ *
+ * @param [in]  fd  Watched file descriptor.
+ * @param [out] cb  Registered callback.
+ * @param [out] arg Registered callback argument.
+ *
+ * @return Returns 0 if found, or -1 if not watched.
+ */
+static int lookup_watcher(int fd, evloop_cb *cb, void **arg)
+{
+    struct watcher *w;
+    int rc = -1;
+
+    pthread_mutex_lock(&mutex);
+
+    for (w = watchers; w; w = w->next) {
+        if (w->fd == fd) {
+            *cb = w->cb;
+            *arg = w->arg;
+            rc = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Acknowledge a timer expiry and run the user callback.
+ *
+ * @param [in] fd     Timer file descriptor.
+ * @param [in] events <Not in use>.
+ * @param [in] arg    Timer watcher holding the user callback.
+ */
+static void timer_expired(int fd, uint32_t events, void *arg)
+{
+    struct watcher *w = (struct watcher *)arg;
+    uint64_t expirations;
+
+    UNUSED(events);
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    w->cb(fd, events, w->arg);
+}
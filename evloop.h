@@ -0,0 +1,15 @@
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <stdint.h>
+
+typedef void (*evloop_cb)(int fd, uint32_t events, void *arg);
+
+int evloop_start(void);
+int evloop_add_fd(int fd, uint32_t events, evloop_cb cb, void *arg);
+int evloop_del_fd(int fd);
+int evloop_add_timer(uint32_t interval_ms, evloop_cb cb, void *arg);
+int evloop_set_timer(int fd, uint32_t interval_ms);
+
+#endif
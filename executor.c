@@ -0,0 +1,333 @@
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "executor.h"
+#include "pool.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "executor.c"
+
+// Default and max number of worker threads.
+#define DEFAULT_WORKERS 4
+#define MAX_WORKERS 32
+
+// Number of strands that keyed tasks are hashed to.
+#define NUM_STRANDS 64
+
+// Stack size of the worker threads, commands keep large buffers on the heap.
+#define WORKER_STACK_SIZE (256 * 1024)
+
+// Tasks added to the pool at a time.
+#define TASKS_PER_SLAB 32
+
+struct task {
+    struct task *next;
+    executor_fn fn;
+    void *arg;
+    int owned;          // Set if the task is freed by the executor.
+};
+
+struct queue {
+    pthread_mutex_t mutex;
+    struct task *head;
+    struct task *tail;
+};
+
+struct worker {
+    pthread_t thread;
+    struct queue queue;
+};
+
+// Tasks with the same key run one at a time, in the order submitted.
+struct strand {
+    struct queue queue;
+    int scheduled;      // Set while the runner is queued or running.
+    struct task runner;
+};
+
+// Thread synchronization, protects the counters below.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+// Tasks queued and not yet claimed by a worker.
+static uint32_t queued = 0;
+
+// Worker to receive the next task.
+static uint32_t next_worker = 0;
+
+// Executor data.
+static struct worker workers[MAX_WORKERS];
+static uint32_t num_workers = 0;
+static struct strand strands[NUM_STRANDS];
+
+// Pool of submitted tasks.
+static struct pool task_pool = POOL_INITIALIZER("tasks", struct task,
+                                                TASKS_PER_SLAB);
+
+// Forward declarations.
+static void * worker_thread(void *arg);
+static void push_task(struct task *task);
+static struct task * pop_task(struct queue *queue);
+static void append_task(struct queue *queue, struct task *task);
+static void run_strand(void *arg);
+static uint32_t hash_key(const char *key);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Start the command executor, a fixed number of worker threads with
+ *        one task queue each. Idle workers steal tasks from the queues of
+ *        busy workers.
+ *
+ * @param [in] num Number of worker threads, or 0 for the default.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int executor_start(uint32_t num)
+{
+    uint32_t i;
+
+    if (num_workers > 0) {
+        return 0;
+    }
+
+    if (0 == num) {
+        num = DEFAULT_WORKERS;
+    } else if (num > MAX_WORKERS) {
+        num = MAX_WORKERS;
+    }
+
+    for (i = 0; i < NUM_STRANDS; i++) {
+        pthread_mutex_init(&strands[i].queue.mutex, NULL);
+        strands[i].runner.fn = run_strand;
+        strands[i].runner.arg = &strands[i];
+    }
+
+    for (i = 0; i < num; i++) {
+        pthread_mutex_init(&workers[i].queue.mutex, NULL);
+    }
+
+    for (i = 0; i < num; i++) {
+        if (pool_start_thread(&workers[i].thread, WORKER_STACK_SIZE,
+                              worker_thread, (void *)(uintptr_t)i) == -1) {
+            ALOGE("%s:%d: Failed to create worker thread", _FILE, __LINE__);
+            break;
+        }
+    }
+
+    // Run with the workers that could be created.
+    num_workers = i;
+
+    return (num_workers > 0) ? 0 : -1;
+}
+
+/**
+ * @brief Submit a task. Tasks with the same key are run one at a time in the
+ *        order submitted, other tasks may run in any order.
+ *
+ * @param [in] key Ordering key, or NULL for no ordering.
+ * @param [in] fn  Task function, invoked from a worker thread.
+ * @param [in] arg Task function argument.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int executor_submit(const char *key, executor_fn fn, void *arg)
+{
+    struct strand *strand;
+    struct task *task;
+
+    if (0 == num_workers || NULL == fn) {
+        ALOGE("%s:%d: Executor not started", _FILE, __LINE__);
+        return -1;
+    }
+
+    task = pool_alloc(&task_pool);
+
+    if (NULL == task) {
+        return -1;
+    }
+
+    task->next = NULL;
+    task->fn = fn;
+    task->arg = arg;
+    task->owned = 1;
+
+    if (NULL == key) {
+        push_task(task);
+        return 0;
+    }
+
+    strand = &strands[hash_key(key) % NUM_STRANDS];
+
+    pthread_mutex_lock(&strand->queue.mutex);
+    append_task(&strand->queue, task);
+
+    if (!strand->scheduled) {
+        strand->scheduled = 1;
+        push_task(&strand->runner);
+    }
+    pthread_mutex_unlock(&strand->queue.mutex);
+
+    return 0;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Run tasks, from the own queue first.
+ *
+ * @param [in] arg Index of the worker.
+ *
+ * @return Returns NULL at thread exit.
+ */
+static void * worker_thread(void *arg)
+{
+    uint32_t self = (uint32_t)(uintptr_t)arg;
+    struct task *task;
+    uint32_t i;
+
+    while (1) {
+        // Claim a task, it is then guaranteed to be in one of the queues.
+        pthread_mutex_lock(&mutex);
+        while (0 == queued) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+        queued--;
+        pthread_mutex_unlock(&mutex);
+
+        task = NULL;
+        while (NULL == task) {
+            for (i = 0; i < num_workers && NULL == task; i++) {
+                task = pop_task(&workers[(self + i) % num_workers].queue);
+            }
+        }
+
+        task->fn(task->arg);
+
+        if (task->owned) {
+            pool_free(&task_pool, task);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Queue a task on the next worker and wake up an idle worker.
+ *
+ * @param [in] task Task to queue.
+ */
+static void push_task(struct task *task)
+{
+    uint32_t index;
+
+    pthread_mutex_lock(&mutex);
+    index = next_worker++ % num_workers;
+    pthread_mutex_unlock(&mutex);
+
+    pthread_mutex_lock(&workers[index].queue.mutex);
+    append_task(&workers[index].queue, task);
+    pthread_mutex_unlock(&workers[index].queue.mutex);
+
+    // Only counted once queued, so a claimed task can always be found.
+    pthread_mutex_lock(&mutex);
+    queued++;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Take the first task of a queue.
+ *
+ * @param [in] queue Task queue.
+ *
+ * @return Returns the task, or NULL if the queue is empty.
+ */
+static struct task * pop_task(struct queue *queue)
+{
+    struct task *task;
+
+    pthread_mutex_lock(&queue->mutex);
+    if ((task = queue->head)) {
+        queue->head = task->next;
+        if (NULL == queue->head) {
+            queue->tail = NULL;
+        }
+        task->next = NULL;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    return task;
+}
+
+/**
+ * @brief Add a task last in a queue. The caller must hold the queue mutex.
+ *
+ * @param [in] queue Task queue.
+ * @param [in] task  Task to add.
+ */
+static void append_task(struct queue *queue, struct task *task)
+{
+    task->next = NULL;
+
+    if (queue->tail) {
+        queue->tail->next = task;
+    } else {
+        queue->head = task;
+    }
+
+    queue->tail = task;
+}
+
+/**
+ * @brief Run the first task of a strand, then queue the strand again if it
+ *        has more tasks.
+ *
+ * @param [in] arg Strand.
+ */
+static void run_strand(void *arg)
+{
+    struct strand *strand = arg;
+    struct task *task;
+
+    task = pop_task(&strand->queue);
+
+    if (task) {
+        task->fn(task->arg);
+        pool_free(&task_pool, task);
+    }
+
+    pthread_mutex_lock(&strand->queue.mutex);
+    if (strand->queue.head) {
+        push_task(&strand->runner);
+    } else {
+        strand->scheduled = 0;
+    }
+    pthread_mutex_unlock(&strand->queue.mutex);
+}
+
+/**
+ * @brief Hash an ordering key.
+ *
+ * @param [in] key Ordering key.
+ *
+ * @return Returns the hash value.
+ */
+static uint32_t hash_key(const char *key)
+{
+    uint32_t hash = 5381;
+
+    while (*key) {
+        hash = hash * 33 + (unsigned char)*key++;
+    }
+
+    return hash;
+}
@@ -0,0 +1,12 @@
+
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <stdint.h>
+
+typedef void (*executor_fn)(void *arg);
+
+int executor_start(uint32_t num_workers);
+int executor_submit(const char *key, executor_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,629 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "evloop.h"
+#include "journal.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "journal.c"
+
+// Journal and snapshot file names.
+#define JOURNAL_FILE "sessions.journal"
+#define SNAPSHOT_FILE "sessions.snap"
+#define SNAPSHOT_TMP "sessions.snap.tmp"
+
+// Record types.
+#define REC_START 'S'
+#define REC_LIMIT 'L'
+#define REC_SCHED 'A'
+#define REC_STOP 'K'
+
+// Max length of a record.
+#define REC_LEN (8 * CMD_LINE_LENGTH)
+
+// Interval between syncs of appended records.
+#define SYNC_INTERVAL_MS 200
+
+// Journal size that triggers compaction into a new snapshot.
+#define COMPACT_SIZE (64 * 1024)
+
+// Permission when creating the state directory.
+#define DIR_PERM 0700
+
+// Thread synchronization.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Journal state.
+static char journal_path[MAX_PATH_LEN];
+static char snapshot_path[MAX_PATH_LEN];
+static char snapshot_tmp[MAX_PATH_LEN];
+static int fd = -1;
+static int dirty = 0;
+static off_t size = 0;
+
+// Live sessions according to the journal.
+static struct journal_rec *records = NULL;
+
+// Forward declarations.
+static int replay(const char *path);
+static int set_record(const char *name, pid_t pid, uint64_t starttime,
+                      int cgroup, const char *logpath);
+static void set_limit(const char *name, uint64_t deadline, uint64_t max_bytes,
+                      uint64_t stall_ms);
+static int set_sched(const char *name, const char *sched);
+static struct journal_rec * add_record(const char *name);
+static void clear_record(const char *name);
+static int append(const char *line);
+static int write_snapshot(void);
+static void sync_timer(int tfd, uint32_t events, void *arg);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Open the session journal. The latest snapshot and all journal records
+ *        written after it are replayed, the result is available through
+ *        journal_foreach().
+ *
+ * @param [in] dir State directory to keep the journal in.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int journal_init(const char *dir)
+{
+    if (NULL == dir) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    if (strlen(dir) + sizeof(SNAPSHOT_TMP) + 1 > MAX_PATH_LEN) {
+        ALOGE("%s:%d: Long path", _FILE, __LINE__);
+        return -1;
+    }
+
+    snprintf(journal_path, MAX_PATH_LEN, "%s/%s", dir, JOURNAL_FILE);
+    snprintf(snapshot_path, MAX_PATH_LEN, "%s/%s", dir, SNAPSHOT_FILE);
+    snprintf(snapshot_tmp, MAX_PATH_LEN, "%s/%s", dir, SNAPSHOT_TMP);
+
+    if (mkdir(dir, DIR_PERM) == -1 && errno != EEXIST) {
+        ALOGE("%s:%d: Failed to create state directory %s (errno=%d)", _FILE,
+              __LINE__, dir, errno);
+        return -1;
+    }
+
+    // The snapshot is written first, records after it are in the journal.
+    (void)replay(snapshot_path);
+    (void)replay(journal_path);
+
+    fd = open(journal_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+    if (-1 == fd) {
+        ALOGE("%s:%d: Failed to open journal (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
+
+    size = lseek(fd, 0, SEEK_END);
+
+    if (evloop_add_timer(SYNC_INTERVAL_MS, sync_timer, NULL) == -1) {
+        ALOGE("%s:%d: Failed to add sync timer", _FILE, __LINE__);
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Record that a session was started.
+ *
+ * @param [in] name      Unique session name.
+ * @param [in] pid       Process ID of MLD.
+ * @param [in] starttime Start time of MLD in clock ticks after boot.
+ * @param [in] cgroup    Set if the session has its own cgroup.
+ * @param [in] logpath   Log file path, NULL if not known.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int journal_start(const char *name, pid_t pid, uint64_t starttime, int cgroup,
+                  const char *logpath)
+{
+    char line[REC_LEN];
+    int rc;
+
+    if (-1 == fd) {
+        return 0;
+    }
+
+    snprintf(line, sizeof(line), "%c %d %llu %d %s %s\n", REC_START, pid,
+             (unsigned long long)starttime, cgroup, name,
+             logpath ? logpath : "");
+
+    pthread_mutex_lock(&mutex);
+    rc = set_record(name, pid, starttime, cgroup, logpath);
+    if (0 == rc) {
+        rc = append(line);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Record the limits of a started session.
+ *
+ * @param [in] name      Unique session name.
+ * @param [in] deadline  Calendar time in ms to stop the session at, 0 for
+ *                       none.
+ * @param [in] max_bytes Output after which the session is stopped, 0 for
+ *                       none.
+ * @param [in] stall_ms  Time without output until stalled, 0 for default.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int journal_limit(const char *name, uint64_t deadline, uint64_t max_bytes,
+                  uint64_t stall_ms)
+{
+    char line[REC_LEN];
+    int rc;
+
+    if (-1 == fd) {
+        return 0;
+    }
+
+    snprintf(line, sizeof(line), "%c %llu %llu %llu %s\n", REC_LIMIT,
+             (unsigned long long)deadline, (unsigned long long)max_bytes,
+             (unsigned long long)stall_ms, name);
+
+    pthread_mutex_lock(&mutex);
+    set_limit(name, deadline, max_bytes, stall_ms);
+    rc = append(line);
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Record that a session was scheduled to start. The record is
+ *        replaced when the session is started.
+ *
+ * @param [in] name  Unique session name.
+ * @param [in] sched Scheduled start, a single line.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int journal_schedule(const char *name, const char *sched)
+{
+    char line[REC_LEN];
+    int n, rc;
+
+    if (-1 == fd) {
+        return 0;
+    }
+
+    n = snprintf(line, sizeof(line), "%c %s %s\n", REC_SCHED, name, sched);
+
+    // A truncated record would run into the next one.
+    if (n < 0 || n >= (int)sizeof(line)) {
+        ALOGE("%s:%d: Record too long (name: %s)", _FILE, __LINE__, name);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+    rc = set_sched(name, sched);
+    if (0 == rc) {
+        rc = append(line);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Record that a session was stopped.
+ *
+ * @param [in] name Unique session name.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int journal_stop(const char *name)
+{
+    char line[CMD_LINE_LENGTH];
+    int rc;
+
+    if (-1 == fd) {
+        return 0;
+    }
+
+    snprintf(line, CMD_LINE_LENGTH, "%c %s\n", REC_STOP, name);
+
+    pthread_mutex_lock(&mutex);
+    clear_record(name);
+    rc = append(line);
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Call a function for each session that is live according to the
+ *        journal. The records must not be modified from the callback.
+ *
+ * @param [in] cb  Callback.
+ * @param [in] arg Callback argument.
+ */
+void journal_foreach(journal_cb cb, void *arg)
+{
+    struct journal_rec *rec;
+
+    pthread_mutex_lock(&mutex);
+    for (rec = records; rec; rec = rec->next) {
+        cb(rec, arg);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Write the live sessions to a new snapshot and truncate the journal.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int journal_compact(void)
+{
+    int rc;
+
+    if (-1 == fd) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&mutex);
+    rc = write_snapshot();
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Flush appended records to storage.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int journal_sync(void)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&mutex);
+
+    if (fd != -1 && dirty) {
+        if (fdatasync(fd) == -1) {
+            ALOGE("%s:%d: Failed to sync journal (errno=%d)", _FILE, __LINE__,
+                  errno);
+            rc = -1;
+        } else {
+            dirty = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Replay a journal or snapshot file into the live session records.
+ *        Malformed lines, e.g. a torn last write, are skipped.
+ *
+ * @param [in] path File to replay.
+ *
+ * @return Returns 0 at success, or -1 if the file can't be read.
+ */
+static int replay(const char *path)
+{
+    char line[REC_LEN];
+    char name[CMD_LINE_LENGTH];
+    char logpath[CMD_LINE_LENGTH];
+    unsigned long long starttime, deadline, max_bytes, stall_ms;
+    int pid, cgroup, n, end;
+    FILE *file;
+
+    file = fopen(path, "r");
+
+    if (NULL == file) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        // Only complete lines are valid records.
+        if (NULL == strchr(line, '\n')) {
+            continue;
+        }
+
+        // Records written before log paths were journaled have none.
+        if (REC_START == line[0] &&
+                (n = sscanf(line + 1, "%d %llu %d %255s %255[^\n]", &pid,
+                            &starttime, &cgroup, name, logpath)) >= 4) {
+            (void)set_record(name, pid, starttime, cgroup,
+                             (5 == n) ? logpath : NULL);
+        } else if (REC_LIMIT == line[0] &&
+                   sscanf(line + 1, "%llu %llu %llu %255[^\n]", &deadline,
+                          &max_bytes, &stall_ms, name) == 4) {
+            set_limit(name, deadline, max_bytes, stall_ms);
+        } else if (REC_SCHED == line[0] &&
+                   sscanf(line + 1, " %255s %n", name, &end) == 1) {
+            *strchr(line, '\n') = '\0';
+            (void)set_sched(name, line + 1 + end);
+        } else if (REC_STOP == line[0] &&
+                   sscanf(line + 1, " %255[^\n]", name) == 1) {
+            clear_record(name);
+        }
+    }
+
+    fclose(file);
+
+    return 0;
+}
+
+/**
+ * @brief Add or replace a live session record.
+ *
+ * @param [in] name      Unique session name.
+ * @param [in] pid       Process ID of MLD.
+ * @param [in] starttime Start time of MLD in clock ticks after boot.
+ * @param [in] cgroup    Set if the session has its own cgroup.
+ * @param [in] logpath   Log file path, NULL if not known.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int set_record(const char *name, pid_t pid, uint64_t starttime,
+                      int cgroup, const char *logpath)
+{
+    struct journal_rec *rec;
+
+    if (NULL == (rec = add_record(name))) {
+        return -1;
+    }
+
+    if (logpath && *logpath != '\0' &&
+            NULL == (rec->logpath = strdup(logpath))) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        clear_record(name);
+        return -1;
+    }
+
+    rec->pid = pid;
+    rec->starttime = starttime;
+    rec->cgroup = cgroup;
+
+    return 0;
+}
+
+/**
+ * @brief Set the limits of a live session record.
+ *
+ * @param [in] name      Unique session name.
+ * @param [in] deadline  Calendar time in ms to stop the session at.
+ * @param [in] max_bytes Output after which the session is stopped.
+ * @param [in] stall_ms  Time without output until stalled.
+ */
+static void set_limit(const char *name, uint64_t deadline, uint64_t max_bytes,
+                      uint64_t stall_ms)
+{
+    struct journal_rec *rec;
+
+    for (rec = records; rec; rec = rec->next) {
+        if (strcmp(rec->name, name) == 0) {
+            rec->deadline = deadline;
+            rec->max_bytes = max_bytes;
+            rec->stall_ms = stall_ms;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Add or replace the record of a scheduled start.
+ *
+ * @param [in] name  Unique session name.
+ * @param [in] sched Scheduled start.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int set_sched(const char *name, const char *sched)
+{
+    struct journal_rec *rec;
+
+    if (NULL == (rec = add_record(name))) {
+        return -1;
+    }
+
+    if (NULL == (rec->sched = strdup(sched))) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        clear_record(name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Add an empty record, replacing any record of the session.
+ *
+ * @param [in] name Unique session name.
+ *
+ * @return Returns the record, or NULL at failure.
+ */
+static struct journal_rec * add_record(const char *name)
+{
+    struct journal_rec *rec;
+
+    clear_record(name);
+
+    rec = calloc(1, sizeof(*rec));
+
+    if (NULL == rec || NULL == (rec->name = strdup(name))) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        free(rec);
+        return NULL;
+    }
+
+    rec->next = records;
+    records = rec;
+
+    return rec;
+}
+
+/**
+ * @brief Remove a live session record.
+ *
+ * @param [in] name Unique session name.
+ */
+static void clear_record(const char *name)
+{
+    struct journal_rec **pp, *rec;
+
+    for (pp = &records; *pp; pp = &(*pp)->next) {
+        if (strcmp((*pp)->name, name) == 0) {
+            rec = *pp;
+            *pp = rec->next;
+            free(rec->name);
+            free(rec->logpath);
+            free(rec->sched);
+            free(rec);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Append a record to the journal. The record is synced to storage by
+ *        the sync timer. Called with the journal locked.
+ *
+ * @param [in] line Null-terminated record.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int append(const char *line)
+{
+    size_t len = strlen(line);
+
+    if (write(fd, line, len) != (ssize_t)len) {
+        ALOGE("%s:%d: Failed to write journal (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
+
+    dirty = 1;
+    size += len;
+
+    if (size >= COMPACT_SIZE) {
+        return write_snapshot();
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write the live session records to a new snapshot, replace the old
+ *        snapshot atomically and truncate the journal. Called with the journal
+ *        locked.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int write_snapshot(void)
+{
+    struct journal_rec *rec;
+    FILE *file;
+    int rc = 0;
+
+    file = fopen(snapshot_tmp, "w");
+
+    if (NULL == file) {
+        ALOGE("%s:%d: Failed to create snapshot (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
+
+    for (rec = records; rec; rec = rec->next) {
+        if (rec->sched) {
+            if (fprintf(file, "%c %s %s\n", REC_SCHED, rec->name,
+                        rec->sched) < 0) {
+                rc = -1;
+            }
+            continue;
+        }
+
+        if (fprintf(file, "%c %d %llu %d %s %s\n", REC_START, rec->pid,
+                    (unsigned long long)rec->starttime, rec->cgroup,
+                    rec->name, rec->logpath ? rec->logpath : "") < 0) {
+            rc = -1;
+        }
+
+        if ((rec->deadline || rec->max_bytes || rec->stall_ms) &&
+                fprintf(file, "%c %llu %llu %llu %s\n", REC_LIMIT,
+                        (unsigned long long)rec->deadline,
+                        (unsigned long long)rec->max_bytes,
+                        (unsigned long long)rec->stall_ms, rec->name) < 0) {
+            rc = -1;
+        }
+    }
+
+    if (fflush(file) != 0 || fsync(fileno(file)) == -1) {
+        rc = -1;
+    }
+
+    fclose(file);
+
+    if (-1 == rc || rename(snapshot_tmp, snapshot_path) == -1) {
+        ALOGE("%s:%d: Failed to write snapshot (errno=%d)", _FILE, __LINE__,
+              errno);
+        (void)unlink(snapshot_tmp);
+        return -1;
+    }
+
+    // Records replayed twice after a crash here are harmless.
+    if (ftruncate(fd, 0) == -1) {
+        ALOGE("%s:%d: Failed to truncate journal (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
+
+    (void)fdatasync(fd);
+    dirty = 0;
+    size = 0;
+
+    return 0;
+}
+
+/**
+ * @brief Sync appended records in one batch.
+ *
+ * @param [in] tfd    <Not in use>.
+ * @param [in] events <Not in use>.
+ * @param [in] arg    <Not in use>.
+ */
+static void sync_timer(int tfd, uint32_t events, void *arg)
+{
+    UNUSED(tfd);
+    UNUSED(events);
+    UNUSED(arg);
+
+    (void)journal_sync();
+}
@@ -0,0 +1,35 @@
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Journaled session, running or scheduled to start.
+struct journal_rec {
+    struct journal_rec *next;
+    pid_t pid;
+    uint64_t starttime; // Start time in clock ticks after system boot.
+    int cgroup;
+    char *name;
+    char *logpath;      // Log file path, NULL if not known.
+    uint64_t deadline;  // Calendar time in ms to stop at, 0 for none.
+    uint64_t max_bytes; // Output after which it is stopped, 0 for none.
+    uint64_t stall_ms;  // Time without output until stalled, 0 for default.
+    char *sched;        // Scheduled start, NULL for a running session.
+};
+
+typedef void (*journal_cb)(const struct journal_rec *rec, void *arg);
+
+int journal_init(const char *dir);
+int journal_start(const char *name, pid_t pid, uint64_t starttime,
+                  int cgroup, const char *logpath);
+int journal_limit(const char *name, uint64_t deadline, uint64_t max_bytes,
+                  uint64_t stall_ms);
+int journal_schedule(const char *name, const char *sched);
+int journal_stop(const char *name);
+void journal_foreach(journal_cb cb, void *arg);
+int journal_compact(void);
+int journal_sync(void);
+
+#endif
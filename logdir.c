@@ -0,0 +1,358 @@
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "executor.h"
+#include "logdir.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "logdir.c"
+
+// Path delimiter.
+#define PATH_DELIM '/'
+#define PATH_DELIMS "/"
+
+// Permissions of created directories.
+#define DIR_PERM 0777
+
+// Permissions of preallocated log files.
+#define FILE_PERM 0666
+
+// Max log directories kept open.
+#define MAX_DIRS 32
+
+// Log file preallocated for the next session started in a directory. Not
+// named *.log so that it is never taken for a session log.
+#define SPARE_NAME ".dip_next"
+
+// Flags of opened directories.
+#define DIR_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+
+// Known log directory, kept open to create files relative to it.
+struct logdir {
+    char path[MAX_PATH_LEN];
+    int fd;
+    int spare;      // Preallocated file ready.
+    int filling;    // Preallocation in progress.
+    int failed;     // Preallocation not supported, not tried again.
+};
+
+// Thread synchronization, protects the directories.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Known log directories. Entries are never removed, so a pointer stays
+// valid for background tasks.
+static struct logdir dirs[MAX_DIRS];
+static uint32_t num_dirs = 0;
+
+// Bytes to preallocate, 0 for none.
+static uint64_t prealloc = 0;
+
+// Forward declarations.
+static struct logdir * find_dir(const char *path);
+static int open_path(const char *path);
+static void refill(struct logdir *d);
+static void fill_spare(void *arg);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Set the size of the log file preallocated in each log directory
+ *        for the next session.
+ *
+ * @param [in] prealloc_bytes Bytes to preallocate, 0 for none.
+ */
+void logdir_init(uint64_t prealloc_bytes)
+{
+    pthread_mutex_lock(&mutex);
+    prealloc = prealloc_bytes;
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Create a log directory and the missing directories above it. A
+ *        directory already known is only checked to still exist. A file is
+ *        preallocated in the background for the next session.
+ *
+ * @param [in] path Log directory.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int logdir_prepare(const char *path)
+{
+    struct logdir *d;
+    struct stat sb;
+    int fd;
+
+    if (NULL == path || '\0' == *path) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    d = find_dir(path);
+
+    // A directory removed since is created again.
+    if (d && (fstat(d->fd, &sb) == -1 || 0 == sb.st_nlink)) {
+        if ((fd = open_path(path)) == -1) {
+            pthread_mutex_unlock(&mutex);
+            return -1;
+        }
+        close(d->fd);
+        d->fd = fd;
+        d->spare = 0;
+    }
+
+    if (NULL == d) {
+        if ((fd = open_path(path)) == -1) {
+            pthread_mutex_unlock(&mutex);
+            return -1;
+        }
+
+        if (num_dirs == MAX_DIRS || strlen(path) >= MAX_PATH_LEN) {
+            // Created, but not kept open.
+            close(fd);
+            pthread_mutex_unlock(&mutex);
+            return 0;
+        }
+
+        d = &dirs[num_dirs++];
+        snprintf(d->path, sizeof(d->path), "%s", path);
+        d->fd = fd;
+        d->spare = 0;
+        d->filling = 0;
+        d->failed = 0;
+    }
+
+    refill(d);
+
+    pthread_mutex_unlock(&mutex);
+
+    return 0;
+}
+
+/**
+ * @brief Give the file preallocated in a log directory the name of a new
+ *        log file, for MLD to write to. Another one is preallocated in the
+ *        background for the next session.
+ *
+ * @param [in] path Log directory, prepared by logdir_prepare().
+ * @param [in] file Log file name.
+ *
+ * @return Returns 0 at success, or -1 if MLD has to create the file.
+ */
+int logdir_take(const char *path, const char *file)
+{
+    struct logdir *d;
+    int rc = -1;
+
+    if (NULL == path || NULL == file) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    d = find_dir(path);
+
+    if (d && d->spare) {
+        // Never replace an existing file, unlike rename().
+        if (linkat(d->fd, SPARE_NAME, d->fd, file, 0) == 0) {
+            (void)unlinkat(d->fd, SPARE_NAME, 0);
+            rc = 0;
+        }
+        d->spare = 0;
+        refill(d);
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Remove a log file given by logdir_take() when its session fails to
+ *        start, so that no empty log is left.
+ *
+ * @param [in] path Log directory, prepared by logdir_prepare().
+ * @param [in] file Log file name.
+ */
+void logdir_discard(const char *path, const char *file)
+{
+    struct logdir *d;
+
+    if (NULL == path || NULL == file) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    d = find_dir(path);
+
+    if (d && unlinkat(d->fd, file, 0) == -1) {
+        ALOGE("%s:%d: Failed to remove log file (errno=%d)", _FILE, __LINE__,
+              errno);
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Find a known log directory. Called with the directories locked.
+ *
+ * @param [in] path Log directory.
+ *
+ * @return Returns the directory, or NULL if not known.
+ */
+static struct logdir * find_dir(const char *path)
+{
+    uint32_t i;
+
+    for (i = 0; i < num_dirs; i++) {
+        if (strcmp(dirs[i].path, path) == 0) {
+            return &dirs[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Open a directory, creating each missing component relative to the
+ *        one above it.
+ *
+ * @param [in] path Directory.
+ *
+ * @return Returns the opened directory, or -1 at failure.
+ */
+static int open_path(const char *path)
+{
+    char tmp[CMD_LINE_LENGTH];
+    char *name, *save;
+    int fd, next;
+
+    if (snprintf(tmp, sizeof(tmp), "%s", path) >= (int)sizeof(tmp)) {
+        ALOGE("%s:%d: Long path", _FILE, __LINE__);
+        return -1;
+    }
+
+    if ((fd = open((PATH_DELIM == *path) ? "/" : ".", DIR_FLAGS)) == -1) {
+        ALOGE("%s:%d: Failed to open directory (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
+
+    for (name = strtok_r(tmp, PATH_DELIMS, &save); name;
+            name = strtok_r(NULL, PATH_DELIMS, &save)) {
+        if (mkdirat(fd, name, DIR_PERM) == -1 && errno != EEXIST) {
+            ALOGE("%s:%d: Failed to create directory (errno=%d)", _FILE,
+                  __LINE__, errno);
+            close(fd);
+            return -1;
+        }
+
+        next = openat(fd, name, DIR_FLAGS);
+        close(fd);
+
+        if (-1 == next) {
+            ALOGE("%s:%d: Failed to open directory (errno=%d)", _FILE,
+                  __LINE__, errno);
+            return -1;
+        }
+
+        fd = next;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Preallocate a file in a log directory in the background, unless
+ *        one is ready or being made. Called with the directories locked.
+ *
+ * @param [in out] d Log directory.
+ */
+static void refill(struct logdir *d)
+{
+    if (0 == prealloc || d->spare || d->filling || d->failed) {
+        return;
+    }
+
+    d->filling = 1;
+
+    if (executor_submit(d->path, fill_spare, d) == -1) {
+        d->filling = 0;
+    }
+}
+
+/**
+ * @brief Create and preallocate the file for the next session started in a
+ *        log directory. The size is kept at 0 so that MLD finds an empty
+ *        file, only the blocks are reserved.
+ *
+ * @param [in out] arg Log directory.
+ */
+static void fill_spare(void *arg)
+{
+    struct logdir *d = arg;
+    uint64_t bytes;
+    int dfd, fd, rc = -1, err = 0;
+
+    pthread_mutex_lock(&mutex);
+    dfd = fcntl(d->fd, F_DUPFD_CLOEXEC, 0);
+    bytes = prealloc;
+    pthread_mutex_unlock(&mutex);
+
+    if (dfd != -1) {
+        fd = openat(dfd, SPARE_NAME, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    FILE_PERM);
+
+        if (fd != -1) {
+            rc = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, bytes);
+            err = errno;
+            close(fd);
+
+            if (-1 == rc) {
+                (void)unlinkat(dfd, SPARE_NAME, 0);
+            }
+        } else {
+            err = errno;
+        }
+
+        close(dfd);
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    d->filling = 0;
+
+    if (0 == rc) {
+        d->spare = 1;
+    } else if (EOPNOTSUPP == err || ENOSYS == err) {
+        ALOGD("%s:%d: Preallocation not supported in %s", _FILE, __LINE__,
+              d->path);
+        d->failed = 1;
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,12 @@
+
+#ifndef LOGDIR_H
+#define LOGDIR_H
+
+#include <stdint.h>
+
+void logdir_init(uint64_t prealloc_bytes);
+int logdir_prepare(const char *path);
+int logdir_take(const char *path, const char *file);
+void logdir_discard(const char *path, const char *file);
+
+#endif
@@ -0,0 +1,1036 @@
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "logfilter.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "logfilter.c"
+
+// Max number of substrings and regular expressions of a filter, each.
+#define MAX_PATTERNS 16
+
+// Max length of a substring or of the literal of a regular expression.
+#define MAX_PATTERN_LEN 128
+
+// Max number of tokens of a regular expression.
+#define MAX_TOKENS 64
+
+// Bytes scanned for line ends at a time.
+#define BLOCK_LEN 64
+
+// Max number of byte pairs prefiltering the lines.
+#define MAX_PAIRS 8
+
+// Hit of an automaton state: a substring, or the regular expressions whose
+// literal was found, one bit each.
+#define HIT_TEXT 0x80000000U
+
+// Transition not yet set while the automaton is built.
+#define NO_STATE 0xFFFFFFFFU
+
+// Bytes matched by the wildcard, all but the line end.
+#define ANY_BYTE(c) ((c) != '\n')
+
+// Token of a regular expression: a set of bytes and how often it repeats.
+struct retoken {
+    uint8_t set[32];                 // Matched bytes, one bit each.
+    char quant;                      // '\0', '*', '+' or '?'.
+};
+
+struct regex {
+    int bol;                         // Anchored at the start of the line.
+    int eol;                         // Anchored at the end of the line.
+    uint32_t num_tokens;
+    struct retoken tokens[MAX_TOKENS];
+};
+
+// Literal searched by the automaton.
+struct pattern {
+    uint8_t text[MAX_PATTERN_LEN];
+    uint32_t len;
+    uint32_t hit;                    // Hit when found.
+};
+
+struct logfilter {
+    uint32_t num_patterns;
+    struct pattern patterns[2 * MAX_PATTERNS];
+    uint32_t num_texts;
+    uint32_t num_regexes;
+    struct regex regexes[MAX_PATTERNS];
+    uint32_t always;                 // Regexes without a literal.
+    int compiled;
+
+    // Aho-Corasick automaton over byte classes. Each row of transitions
+    // has a power of two entries, so a transition is a row offset.
+    uint8_t classes[256];            // Class of each byte, 0 if unused.
+    uint32_t shift;                  // Log2 of the row length.
+    uint32_t num_states;
+    uint32_t *next;                  // Row offset of the next state.
+    uint32_t *hits;                  // Hit of each state.
+
+    // A byte pair of each literal, lines without any of them don't match.
+    // Lines aren't prefiltered without pairs.
+    uint32_t num_pairs;
+    uint8_t pairs[MAX_PAIRS][2];
+};
+
+// Forward declarations.
+static int add_pattern(struct logfilter *filter, const uint8_t *text,
+                       uint32_t len, uint32_t hit);
+static int build(struct logfilter *filter);
+static void choose_pairs(struct logfilter *filter);
+static uint32_t pair_rank(const uint8_t *pair);
+static int match_line(const struct logfilter *filter, const char *line,
+                      uint32_t len);
+static int match_regexes(const struct logfilter *filter, uint32_t which,
+                         const char *line, uint32_t len);
+static int parse_regex(const char *src, struct regex *re, uint8_t *literal,
+                       uint32_t *literal_len);
+static const char * parse_set(const char *p, uint8_t *set);
+static const char * parse_escape(const char *p, uint8_t *set, int *literal);
+static int regex_match(const struct regex *re, const char *line,
+                       uint32_t len);
+static int match_here(const struct regex *re, uint32_t t, const uint8_t *s,
+                      const uint8_t *end);
+static uint64_t newline_mask(const char *p);
+static uint64_t pair_mask(const struct logfilter *filter, const char *p);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Create an empty line filter. A filter without substrings or
+ *        regular expressions passes all lines.
+ *
+ * @return Returns the filter, or NULL at failure.
+ */
+struct logfilter * logfilter_create(void)
+{
+    struct logfilter *filter = calloc(1, sizeof(*filter));
+
+    if (NULL == filter) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+    }
+
+    return filter;
+}
+
+/**
+ * @brief Pass lines containing a substring.
+ *
+ * @param [in out] filter Filter, not compiled.
+ * @param [in]     text   Substring.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int logfilter_add_text(struct logfilter *filter, const char *text)
+{
+    uint32_t len = strlen(text);
+
+    if (filter->compiled || filter->num_texts >= MAX_PATTERNS || 0 == len ||
+            len > MAX_PATTERN_LEN) {
+        ALOGE("%s:%d: Bad substring %s", _FILE, __LINE__, text);
+        return -1;
+    }
+
+    if (add_pattern(filter, (const uint8_t *)text, len, HIT_TEXT) == -1) {
+        return -1;
+    }
+
+    filter->num_texts++;
+
+    return 0;
+}
+
+/**
+ * @brief Pass lines matching a regular expression. The expressions are
+ *        anchored with ^ and $, and made of bytes, '.', [sets], and the
+ *        escapes \d, \w and \s, each optionally repeated by '*', '+' or '?'.
+ *
+ * @param [in out] filter Filter, not compiled.
+ * @param [in]     regex  Regular expression.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int logfilter_add_regex(struct logfilter *filter, const char *regex)
+{
+    uint8_t literal[MAX_PATTERN_LEN];
+    uint32_t literal_len, bit;
+    struct regex *re;
+
+    if (filter->compiled || filter->num_regexes >= MAX_PATTERNS) {
+        ALOGE("%s:%d: Too many regular expressions", _FILE, __LINE__);
+        return -1;
+    }
+
+    re = &filter->regexes[filter->num_regexes];
+    bit = 1U << filter->num_regexes;
+
+    if (parse_regex(regex, re, literal, &literal_len) == -1) {
+        ALOGE("%s:%d: Bad regular expression %s", _FILE, __LINE__, regex);
+        return -1;
+    }
+
+    // Only lines containing the longest literal of the expression are
+    // matched against it.
+    if (0 == literal_len) {
+        filter->always |= bit;
+    } else if (add_pattern(filter, literal, literal_len, bit) == -1) {
+        return -1;
+    }
+
+    filter->num_regexes++;
+
+    return 0;
+}
+
+/**
+ * @brief Compile a filter once all substrings and regular expressions are
+ *        added.
+ *
+ * @param [in out] filter Filter.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int logfilter_compile(struct logfilter *filter)
+{
+    if (filter->compiled) {
+        return 0;
+    }
+
+    if (build(filter) == -1) {
+        return -1;
+    }
+
+    choose_pairs(filter);
+    filter->compiled = 1;
+
+    return 0;
+}
+
+/**
+ * @brief Scan data for complete lines and pass on the lines matching the
+ *        filter. Line ends and the prefilter pairs are located a block at a
+ *        time with vector compares, and only lines with a pair are run
+ *        through the automaton. Consecutive matching lines are passed on
+ *        together.
+ *
+ * @param [in] filter Compiled filter.
+ * @param [in] data   Data to scan.
+ * @param [in] len    Data length.
+ * @param [in] fn     Called with matching lines, line ends included.
+ * @param [in] arg    Callback argument.
+ *
+ * @return Returns the number of bytes scanned, i.e. up to the end of the
+ *         last complete line.
+ */
+uint32_t logfilter_scan(const struct logfilter *filter, const char *data,
+                        uint32_t len, logfilter_fn fn, void *arg)
+{
+    char tail[BLOCK_LEN + 1];
+    const char *line = data;         // Start of the current line.
+    const char *run = NULL;          // Matching lines not yet passed on.
+    const char *block, *nl;
+    uint64_t lines, pairs = 0, below;
+    int pending = 0;                 // Pair found in the current line.
+    int candidate = 1;
+    uint32_t pos, k;
+
+    // Without patterns all complete lines pass.
+    if (0 == filter->num_patterns && 0 == filter->always) {
+        nl = memrchr(data, '\n', len);
+        if (NULL == nl) {
+            return 0;
+        }
+        fn(arg, data, nl + 1 - data);
+        return nl + 1 - data;
+    }
+
+    for (pos = 0; pos < len; pos += BLOCK_LEN) {
+        // Pairs are compared up to one byte past the block.
+        if (len - pos > BLOCK_LEN) {
+            block = data + pos;
+        } else {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, data + pos, len - pos);
+            block = tail;
+        }
+
+        lines = newline_mask(block);
+        if (filter->num_pairs > 0) {
+            pairs = pair_mask(filter, block);
+        }
+
+        while (lines) {
+            k = __builtin_ctzll(lines);
+            lines &= lines - 1;
+            nl = data + pos + k;
+
+            if (filter->num_pairs > 0) {
+                below = (2ULL << k) - 1;
+                candidate = pending || (pairs & below);
+                pairs &= ~below;
+                pending = 0;
+            }
+
+            if (candidate && match_line(filter, line, nl - line)) {
+                if (NULL == run) {
+                    run = line;
+                }
+            } else if (run) {
+                fn(arg, run, line - run);
+                run = NULL;
+            }
+
+            line = nl + 1;
+        }
+
+        pending |= (pairs != 0);
+    }
+
+    if (run) {
+        fn(arg, run, line - run);
+    }
+
+    return line - data;
+}
+
+/**
+ * @brief Free a filter.
+ *
+ * @param [in] filter Filter, or NULL.
+ */
+void logfilter_free(struct logfilter *filter)
+{
+    if (NULL == filter) {
+        return;
+    }
+
+    free(filter->next);
+    free(filter->hits);
+    free(filter);
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Add a literal for the automaton to search.
+ *
+ * @param [in out] filter Filter.
+ * @param [in]     text   Literal.
+ * @param [in]     len    Literal length.
+ * @param [in]     hit    Hit when found.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int add_pattern(struct logfilter *filter, const uint8_t *text,
+                       uint32_t len, uint32_t hit)
+{
+    struct pattern *pattern;
+
+    if (filter->num_patterns >= sizeof(filter->patterns) /
+                                sizeof(filter->patterns[0])) {
+        ALOGE("%s:%d: Too many patterns", _FILE, __LINE__);
+        return -1;
+    }
+
+    pattern = &filter->patterns[filter->num_patterns++];
+    memcpy(pattern->text, text, len);
+    pattern->len = len;
+    pattern->hit = hit;
+
+    return 0;
+}
+
+/**
+ * @brief Build the automaton of the literals. Bytes found in no literal
+ *        share one class, which keeps the rows short. Missing transitions
+ *        are resolved through the failure links, so scanning takes one
+ *        lookup per byte.
+ *
+ * @param [in out] filter Filter.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int build(struct logfilter *filter)
+{
+    uint32_t num_classes = 1;
+    uint32_t max_states = 1;
+    uint32_t *fail, *queue;
+    uint32_t i, j, c, s, t, row, head = 0, tail = 0;
+    const struct pattern *pattern;
+
+    memset(filter->classes, 0, sizeof(filter->classes));
+
+    for (i = 0; i < filter->num_patterns; i++) {
+        pattern = &filter->patterns[i];
+        for (j = 0; j < pattern->len; j++) {
+            if (0 == filter->classes[pattern->text[j]]) {
+                filter->classes[pattern->text[j]] = num_classes++;
+            }
+        }
+        max_states += pattern->len;
+    }
+
+    // Without literals there is a single state.
+    for (filter->shift = 0; (1U << filter->shift) < num_classes;
+            filter->shift++);
+
+    row = 1U << filter->shift;
+    filter->next = malloc(max_states * row * sizeof(*filter->next));
+    filter->hits = calloc(max_states, sizeof(*filter->hits));
+    fail = calloc(max_states, sizeof(*fail));
+    queue = malloc(max_states * sizeof(*queue));
+
+    if (NULL == filter->next || NULL == filter->hits || NULL == fail ||
+            NULL == queue) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        free(fail);
+        free(queue);
+        return -1;
+    }
+
+    memset(filter->next, 0xFF, max_states * row * sizeof(*filter->next));
+
+    // Trie of the literals, states are kept as row offsets.
+    filter->num_states = 1;
+
+    for (i = 0; i < filter->num_patterns; i++) {
+        pattern = &filter->patterns[i];
+        s = 0;
+        for (j = 0; j < pattern->len; j++) {
+            c = filter->classes[pattern->text[j]];
+            if (NO_STATE == filter->next[s + c]) {
+                filter->next[s + c] = filter->num_states++ << filter->shift;
+            }
+            s = filter->next[s + c];
+        }
+        filter->hits[s >> filter->shift] |= pattern->hit;
+    }
+
+    // Failure links, breadth first.
+    for (c = 0; c < row; c++) {
+        t = filter->next[c];
+        if (NO_STATE == t) {
+            filter->next[c] = 0;
+        } else {
+            fail[t >> filter->shift] = 0;
+            queue[tail++] = t;
+        }
+    }
+
+    while (head < tail) {
+        s = queue[head++];
+        filter->hits[s >> filter->shift] |=
+            filter->hits[fail[s >> filter->shift] >> filter->shift];
+
+        for (c = 0; c < row; c++) {
+            t = filter->next[s + c];
+            if (NO_STATE == t) {
+                filter->next[s + c] = filter->next[fail[s >> filter->shift] +
+                                                   c];
+            } else {
+                fail[t >> filter->shift] =
+                    filter->next[fail[s >> filter->shift] + c];
+                queue[tail++] = t;
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+
+    return 0;
+}
+
+/**
+ * @brief Choose a byte pair of each literal to prefilter the lines on, the
+ *        one least likely found in log lines.
+ *
+ * @param [in out] filter Filter.
+ */
+static void choose_pairs(struct logfilter *filter)
+{
+    const struct pattern *pattern;
+    uint32_t i, j, best;
+
+    filter->num_pairs = 0;
+
+    // Each line is matched if a regex has no literal.
+    if (filter->always) {
+        return;
+    }
+
+    for (i = 0; i < filter->num_patterns; i++) {
+        pattern = &filter->patterns[i];
+
+        if (pattern->len < 2) {
+            filter->num_pairs = 0;
+            return;
+        }
+
+        for (best = 0, j = 1; j + 1 < pattern->len; j++) {
+            if (pair_rank(pattern->text + j) >=
+                    pair_rank(pattern->text + best)) {
+                best = j;
+            }
+        }
+
+        for (j = 0; j < filter->num_pairs; j++) {
+            if (memcmp(filter->pairs[j], pattern->text + best, 2) == 0) {
+                break;
+            }
+        }
+
+        if (j < filter->num_pairs) {
+            continue;
+        }
+
+        // Too many pairs to compare, no prefilter.
+        if (MAX_PAIRS == filter->num_pairs) {
+            filter->num_pairs = 0;
+            return;
+        }
+
+        memcpy(filter->pairs[filter->num_pairs++], pattern->text + best, 2);
+    }
+}
+
+/**
+ * @brief Rank a byte pair by how rare it is in log lines. Spaces, digits
+ *        and lower case letters are common.
+ *
+ * @param [in] pair Byte pair.
+ *
+ * @return Returns the rank, higher for rarer pairs.
+ */
+static uint32_t pair_rank(const uint8_t *pair)
+{
+    uint32_t rank = 0;
+    uint32_t i;
+
+    for (i = 0; i < 2; i++) {
+        if (' ' == pair[i]) {
+            rank += 0;
+        } else if ('0' <= pair[i] && pair[i] <= '9') {
+            rank += 1;
+        } else if ('a' <= pair[i] && pair[i] <= 'z') {
+            rank += 2;
+        } else {
+            rank += 3;
+        }
+    }
+
+    return rank;
+}
+
+/**
+ * @brief Check if a line passes a filter.
+ *
+ * @param [in] filter Filter.
+ * @param [in] line   Line, without line end.
+ * @param [in] len    Line length.
+ *
+ * @return Returns 1 if the line matches, else 0.
+ */
+static int match_line(const struct logfilter *filter, const char *line,
+                      uint32_t len)
+{
+    const uint8_t *p = (const uint8_t *)line;
+    const uint8_t *end = p + len;
+    uint32_t checked = filter->always;
+    uint32_t s = 0;
+    uint32_t hit;
+
+    if (checked && match_regexes(filter, checked, line, len)) {
+        return 1;
+    }
+
+    for (; p < end; p++) {
+        s = filter->next[s + filter->classes[*p]];
+        hit = filter->hits[s >> filter->shift];
+
+        if (0 == hit) {
+            continue;
+        }
+
+        if (hit & HIT_TEXT) {
+            return 1;
+        }
+
+        // Each regular expression is matched at most once per line.
+        hit &= ~checked;
+        if (hit) {
+            checked |= hit;
+            if (match_regexes(filter, hit, line, len)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Match a line against some of the regular expressions of a filter.
+ *
+ * @param [in] filter Filter.
+ * @param [in] which  Regular expressions, one bit each.
+ * @param [in] line   Line, without line end.
+ * @param [in] len    Line length.
+ *
+ * @return Returns 1 if any expression matches, else 0.
+ */
+static int match_regexes(const struct logfilter *filter, uint32_t which,
+                         const char *line, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < filter->num_regexes; i++) {
+        if ((which & (1U << i)) && regex_match(&filter->regexes[i], line,
+                                               len)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Parse a regular expression into tokens, and find the longest run
+ *        of bytes that any match contains.
+ *
+ * @param [in]  src         Regular expression.
+ * @param [out] re          Parsed expression.
+ * @param [out] literal     Destination of MAX_PATTERN_LEN bytes.
+ * @param [out] literal_len Literal length, 0 for none.
+ *
+ * @return Returns 0 at success, or -1 if the expression is bad.
+ */
+static int parse_regex(const char *src, struct regex *re, uint8_t *literal,
+                       uint32_t *literal_len)
+{
+    uint8_t run[MAX_PATTERN_LEN];
+    uint32_t run_len = 0;
+    struct retoken *tok;
+    const char *p = src;
+    int c, lit;
+
+    memset(re, 0, sizeof(*re));
+    *literal_len = 0;
+
+    if ('^' == *p) {
+        re->bol = 1;
+        p++;
+    }
+
+    while (*p) {
+        if ('$' == p[0] && '\0' == p[1]) {
+            re->eol = 1;
+            break;
+        }
+
+        if (re->num_tokens >= MAX_TOKENS) {
+            return -1;
+        }
+
+        tok = &re->tokens[re->num_tokens++];
+        lit = -1;
+
+        switch (*p) {
+        case '.':
+            for (c = 0; c < 256; c++) {
+                if (ANY_BYTE(c)) {
+                    tok->set[c >> 3] |= 1 << (c & 7);
+                }
+            }
+            p++;
+            break;
+        case '[':
+            p = parse_set(p + 1, tok->set);
+            break;
+        case '\\':
+            p = parse_escape(p + 1, tok->set, &lit);
+            break;
+        case '*':
+        case '+':
+        case '?':
+            // Nothing to repeat.
+            return -1;
+        default:
+            lit = (uint8_t)*p++;
+            tok->set[lit >> 3] |= 1 << (lit & 7);
+            break;
+        }
+
+        if (NULL == p) {
+            return -1;
+        }
+
+        if ('*' == *p || '+' == *p || '?' == *p) {
+            tok->quant = *p++;
+        }
+
+        // A byte is part of every match unless it is optional, and a
+        // repeated byte ends the run.
+        if (lit != -1 && tok->quant != '*' && tok->quant != '?' &&
+                run_len < MAX_PATTERN_LEN) {
+            run[run_len++] = lit;
+            if (tok->quant != '+') {
+                continue;
+            }
+        }
+
+        if (run_len > *literal_len) {
+            memcpy(literal, run, run_len);
+            *literal_len = run_len;
+        }
+        run_len = 0;
+    }
+
+    if (run_len > *literal_len) {
+        memcpy(literal, run, run_len);
+        *literal_len = run_len;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Parse a byte set, e.g. [a-z_], or [^0-9] for bytes not in it.
+ *
+ * @param [in]  p   Set, after the opening bracket.
+ * @param [out] set Bytes in the set, one bit each.
+ *
+ * @return Returns the position after the set, or NULL if it is bad.
+ */
+static const char * parse_set(const char *p, uint8_t *set)
+{
+    uint8_t members[32];
+    int negate = 0;
+    int first = 1;
+    int c, lo, hi;
+    uint32_t i;
+
+    memset(members, 0, sizeof(members));
+
+    if ('^' == *p) {
+        negate = 1;
+        p++;
+    }
+
+    while (*p && (first || *p != ']')) {
+        first = 0;
+
+        if ('\\' == *p) {
+            if ((p = parse_escape(p + 1, members, &lo)) == NULL) {
+                return NULL;
+            }
+            continue;
+        }
+
+        lo = (uint8_t)*p++;
+        hi = lo;
+
+        if ('-' == p[0] && p[1] && p[1] != ']') {
+            hi = (uint8_t)p[1];
+            p += 2;
+        }
+
+        for (c = lo; c <= hi; c++) {
+            members[c >> 3] |= 1 << (c & 7);
+        }
+    }
+
+    if (*p != ']') {
+        return NULL;
+    }
+
+    for (i = 0; i < sizeof(members); i++) {
+        set[i] |= negate ? ~members[i] : members[i];
+    }
+
+    // The line end is never matched.
+    set['\n' >> 3] &= ~(1 << ('\n' & 7));
+
+    return p + 1;
+}
+
+/**
+ * @brief Parse an escape, a class of bytes or an escaped byte.
+ *
+ * @param [in]  p       Escape, after the backslash.
+ * @param [out] set     Bytes matched are added, one bit each.
+ * @param [out] literal Escaped byte, or -1 for a class.
+ *
+ * @return Returns the position after the escape, or NULL if it is bad.
+ */
+static const char * parse_escape(const char *p, uint8_t *set, int *literal)
+{
+    int c;
+
+    *literal = -1;
+
+    switch (*p) {
+    case '\0':
+        return NULL;
+    case 'd':
+        for (c = '0'; c <= '9'; c++) {
+            set[c >> 3] |= 1 << (c & 7);
+        }
+        break;
+    case 'w':
+        for (c = 0; c < 256; c++) {
+            if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') ||
+                    ('0' <= c && c <= '9') || '_' == c) {
+                set[c >> 3] |= 1 << (c & 7);
+            }
+        }
+        break;
+    case 's':
+        set[' ' >> 3] |= 1 << (' ' & 7);
+        set['\t' >> 3] |= 1 << ('\t' & 7);
+        set['\r' >> 3] |= 1 << ('\r' & 7);
+        break;
+    default:
+        *literal = (uint8_t)*p;
+        set[*literal >> 3] |= 1 << (*literal & 7);
+        break;
+    }
+
+    return p + 1;
+}
+
+/**
+ * @brief Match a line against a regular expression.
+ *
+ * @param [in] re   Parsed expression.
+ * @param [in] line Line, without line end.
+ * @param [in] len  Line length.
+ *
+ * @return Returns 1 if the expression matches, else 0.
+ */
+static int regex_match(const struct regex *re, const char *line, uint32_t len)
+{
+    const uint8_t *s = (const uint8_t *)line;
+    const uint8_t *end = s + len;
+
+    if (re->bol) {
+        return match_here(re, 0, s, end);
+    }
+
+    for (; s <= end; s++) {
+        if (match_here(re, 0, s, end)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Match the tokens of a regular expression from a position, with
+ *        repeats taken as long as possible first.
+ *
+ * @param [in] re  Parsed expression.
+ * @param [in] t   First token to match.
+ * @param [in] s   Position in the line.
+ * @param [in] end End of the line.
+ *
+ * @return Returns 1 if the tokens match, else 0.
+ */
+static int match_here(const struct regex *re, uint32_t t, const uint8_t *s,
+                      const uint8_t *end)
+{
+    const struct retoken *tok;
+    uint32_t n, min;
+
+    for (; t < re->num_tokens; t++) {
+        tok = &re->tokens[t];
+
+        if ('\0' == tok->quant) {
+            if (s == end || !(tok->set[*s >> 3] & (1 << (*s & 7)))) {
+                return 0;
+            }
+            s++;
+            continue;
+        }
+
+        min = ('+' == tok->quant) ? 1 : 0;
+
+        for (n = 0; s + n < end && (tok->set[s[n] >> 3] & (1 << (s[n] & 7)));
+                n++) {
+            if ('?' == tok->quant) {
+                n++;
+                break;
+            }
+        }
+
+        for (; n >= min; n--) {
+            if (match_here(re, t + 1, s + n, end)) {
+                return 1;
+            }
+            if (0 == n) {
+                break;
+            }
+        }
+
+        return 0;
+    }
+
+    return !re->eol || s == end;
+}
+
+#if defined(__aarch64__) && defined(__ARM_NEON) && !defined(__SSE2__)
+/**
+ * @brief Gather the compare results of a block into a mask, weighing them
+ *        by bit position and adding them pairwise.
+ *
+ * @param [in] m Compare results, 16 bytes each.
+ *
+ * @return Returns a mask with a bit set for each byte compared equal.
+ */
+static uint64_t neon_mask(const uint8x16_t *m)
+{
+    static const uint8_t weights[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    const uint8x16_t w = vld1q_u8(weights);
+    uint8x16_t m0, m1;
+
+    m0 = vpaddq_u8(vandq_u8(m[0], w), vandq_u8(m[1], w));
+    m1 = vpaddq_u8(vandq_u8(m[2], w), vandq_u8(m[3], w));
+    m0 = vpaddq_u8(m0, m1);
+    m0 = vpaddq_u8(m0, m0);
+
+    return vgetq_lane_u64(vreinterpretq_u64_u8(m0), 0);
+}
+#endif
+
+/**
+ * @brief Locate the line ends in a block of data.
+ *
+ * @param [in] p Block of BLOCK_LEN bytes.
+ *
+ * @return Returns a mask with a bit set for each line end.
+ */
+static uint64_t newline_mask(const char *p)
+{
+#if defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+    uint64_t mask = 0;
+    uint32_t i;
+
+    for (i = 0; i < BLOCK_LEN; i += 16) {
+        mask |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i *)(p + i)), nl)) << i;
+    }
+
+    return mask;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t nl = vdupq_n_u8('\n');
+    uint8x16_t m[BLOCK_LEN / 16];
+    uint32_t i;
+
+    for (i = 0; i < BLOCK_LEN / 16; i++) {
+        m[i] = vceqq_u8(vld1q_u8((const uint8_t *)p + 16 * i), nl);
+    }
+
+    return neon_mask(m);
+#else
+    uint64_t mask = 0;
+    uint32_t i;
+
+    for (i = 0; i < BLOCK_LEN; i++) {
+        if ('\n' == p[i]) {
+            mask |= (uint64_t)1 << i;
+        }
+    }
+
+    return mask;
+#endif
+}
+
+/**
+ * @brief Locate the prefilter pairs in a block of data.
+ *
+ * @param [in] filter Filter.
+ * @param [in] p      Block of BLOCK_LEN bytes, and the byte after it.
+ *
+ * @return Returns a mask with a bit set for each pair found, at its first
+ *         byte.
+ */
+static uint64_t pair_mask(const struct logfilter *filter, const char *p)
+{
+#if defined(__SSE2__)
+    __m128i first[MAX_PAIRS], second[MAX_PAIRS];
+    __m128i v0, v1, m;
+    uint64_t mask = 0;
+    uint32_t i, j;
+
+    for (j = 0; j < filter->num_pairs; j++) {
+        first[j] = _mm_set1_epi8(filter->pairs[j][0]);
+        second[j] = _mm_set1_epi8(filter->pairs[j][1]);
+    }
+
+    for (i = 0; i < BLOCK_LEN; i += 16) {
+        v0 = _mm_loadu_si128((const __m128i *)(p + i));
+        v1 = _mm_loadu_si128((const __m128i *)(p + i + 1));
+        m = _mm_setzero_si128();
+        for (j = 0; j < filter->num_pairs; j++) {
+            m = _mm_or_si128(m, _mm_and_si128(_mm_cmpeq_epi8(v0, first[j]),
+                                              _mm_cmpeq_epi8(v1, second[j])));
+        }
+        mask |= (uint64_t)(uint32_t)_mm_movemask_epi8(m) << i;
+    }
+
+    return mask;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    uint8x16_t m[BLOCK_LEN / 16];
+    uint8x16_t v0, v1;
+    uint32_t i, j;
+
+    for (i = 0; i < BLOCK_LEN / 16; i++) {
+        v0 = vld1q_u8((const uint8_t *)p + 16 * i);
+        v1 = vld1q_u8((const uint8_t *)p + 16 * i + 1);
+        m[i] = vdupq_n_u8(0);
+        for (j = 0; j < filter->num_pairs; j++) {
+            m[i] = vorrq_u8(m[i], vandq_u8(
+                       vceqq_u8(v0, vdupq_n_u8(filter->pairs[j][0])),
+                       vceqq_u8(v1, vdupq_n_u8(filter->pairs[j][1]))));
+        }
+    }
+
+    return neon_mask(m);
+#else
+    uint64_t mask = 0;
+    uint32_t i, j;
+
+    for (i = 0; i < BLOCK_LEN; i++) {
+        for (j = 0; j < filter->num_pairs; j++) {
+            if ((uint8_t)p[i] == filter->pairs[j][0] &&
+                    (uint8_t)p[i + 1] == filter->pairs[j][1]) {
+                mask |= (uint64_t)1 << i;
+                break;
+            }
+        }
+    }
+
+    return mask;
+#endif
+}
@@ -0,0 +1,19 @@
+
+#ifndef LOGFILTER_H
+#define LOGFILTER_H
+
+#include <stdint.h>
+
+struct logfilter;
+
+typedef void (*logfilter_fn)(void *arg, const char *data, uint32_t len);
+
+struct logfilter * logfilter_create(void);
+int logfilter_add_text(struct logfilter *filter, const char *text);
+int logfilter_add_regex(struct logfilter *filter, const char *regex);
+int logfilter_compile(struct logfilter *filter);
+uint32_t logfilter_scan(const struct logfilter *filter, const char *data,
+                        uint32_t len, logfilter_fn fn, void *arg);
+void logfilter_free(struct logfilter *filter);
+
+#endif
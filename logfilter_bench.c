@@ -0,0 +1,178 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "logfilter.h"
+#include "utils.h"
+
+// Default size of the generated log data.
+#define DEFAULT_SIZE_MB 256
+
+// Number of timed scans of each filter, the best is reported.
+#define ROUNDS 5
+
+// Filter options of each benchmark, as given to the stream command.
+static const char *benches[][6] = {
+    {"one substring", "m:ERROR", NULL},
+    {"four substrings", "m:ERROR", "m:panic", "m:LOG_D_ACC", "m:Exception",
+     NULL},
+    {"common substring", "m:line 4242 ", NULL},
+    {"regex, rare literal", "r:^\\d+\\.\\d+\\sLOG_W_\\w+", NULL},
+    {"regex, common literal", "r:line\\s\\d*77\\s", NULL},
+    {"regex without literal", "r:^\\d+\\.\\d*999\\s", NULL},
+    {"every line matching", "m:payload", NULL},
+};
+
+// Forward declarations.
+static char * generate(uint32_t size, uint32_t *len);
+static struct logfilter * create(const char * const *opts);
+static void count(void *arg, const char *data, uint32_t len);
+static double now_s(void);
+
+/**
+ * @brief Measure the throughput of the live stream filters on log lines as
+ *        written by the fake MLD, "logfilter_bench [<size MB>]".
+ */
+int main(int argc, char *argv[])
+{
+    uint32_t size = DEFAULT_SIZE_MB;
+    struct logfilter *filter;
+    uint64_t passed;
+    double start, best;
+    uint32_t len, i, r;
+    char *data;
+
+    if (argc > 1) {
+        size = strtoul(argv[1], NULL, 10);
+    }
+
+    if (NULL == (data = generate(size << 20, &len))) {
+        return 1;
+    }
+
+    printf("%-24s %10s %12s\n", "FILTER", "GB/s", "PASSED_MB");
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (NULL == (filter = create(&benches[i][1]))) {
+            return 1;
+        }
+
+        best = 0;
+
+        for (r = 0; r < ROUNDS; r++) {
+            passed = 0;
+            start = now_s();
+            (void)logfilter_scan(filter, data, len, count, &passed);
+            start = now_s() - start;
+            if (0 == r || start < best) {
+                best = start;
+            }
+        }
+
+        printf("%-24s %10.2f %12.1f\n", benches[i][0], len / best / 1e9,
+               passed / 1048576.0);
+
+        logfilter_free(filter);
+    }
+
+    free(data);
+
+    return 0;
+}
+
+/**
+ * @brief Generate log lines in the format written by the fake MLD.
+ *
+ * @param [in]  size Approximate size.
+ * @param [out] len  Length of the generated data.
+ *
+ * @return Returns the data, or NULL at failure.
+ */
+static char * generate(uint32_t size, uint32_t *len)
+{
+    char *data = malloc(size + 128);
+    uint64_t line = 0;
+    long sec = 1792317483, nsec = 13869935;
+    uint32_t pos = 0;
+
+    if (NULL == data) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return NULL;
+    }
+
+    while (pos < size) {
+        pos += sprintf(data + pos,
+                       "%ld.%09ld LOG_D_APP line %llu payload "
+                       "abcdefghijklmnopqrstuvwxyz\n", sec, nsec,
+                       (unsigned long long)++line);
+        nsec += 50000000;
+        if (nsec >= 1000000000) {
+            nsec -= 1000000000;
+            sec++;
+        }
+    }
+
+    *len = pos;
+
+    return data;
+}
+
+/**
+ * @brief Create a filter from benchmark options, "m:" for substrings and
+ *        "r:" for regular expressions.
+ *
+ * @param [in] opts Options, NULL terminated.
+ *
+ * @return Returns the filter, or NULL at failure.
+ */
+static struct logfilter * create(const char * const *opts)
+{
+    struct logfilter *filter = logfilter_create();
+    int rc = 0;
+
+    for (; filter && *opts && 0 == rc; opts++) {
+        if (strncmp(*opts, "m:", 2) == 0) {
+            rc = logfilter_add_text(filter, *opts + 2);
+        } else {
+            rc = logfilter_add_regex(filter, *opts + 2);
+        }
+    }
+
+    if (NULL == filter || -1 == rc || logfilter_compile(filter) == -1) {
+        fprintf(stderr, "Failed to create filter\n");
+        logfilter_free(filter);
+        return NULL;
+    }
+
+    return filter;
+}
+
+/**
+ * @brief Count the output passed by a filter.
+ *
+ * @param [in out] arg  Byte counter.
+ * @param [in]     data <Not in use>.
+ * @param [in]     len  Output length.
+ */
+static void count(void *arg, const char *data, uint32_t len)
+{
+    UNUSED(data);
+
+    *(uint64_t *)arg += len;
+}
+
+/**
+ * @brief Get the monotonic time.
+ *
+ * @return Returns the time in seconds.
+ */
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
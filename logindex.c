@@ -0,0 +1,1223 @@
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "evloop.h"
+#include "logindex.h"
+#include "mldproc.h"
+#include "pool.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "logindex.c"
+
+// Options of the log command.
+#define OPT_TAIL "--tail="
+#define OPT_SINCE "--since="
+#define OPT_UNTIL "--until="
+#define OPT_LINE "--line="
+#define OPT_COUNT "--count="
+
+// Appended to the path of a log file for its index.
+#define INDEX_EXT ".idx"
+
+// Index file signature ("DIPX") and format version.
+#define INDEX_MAGIC 0x58504944U
+#define INDEX_VERSION 1
+
+// Log data between index entries, at least.
+#define INDEX_STRIDE (64 * 1024)
+
+// Log data read at a time.
+#define SCAN_BUF_LEN (1024 * 1024)
+
+// Log data indexed per file at each follow tick, the rest follows at the
+// next tick.
+#define FOLLOW_STEP (32 * 1024 * 1024)
+
+// Interval at which the logs of running sessions are indexed.
+#define FOLLOW_INTERVAL_MS 1000
+
+// Longest time stamp at the start of a line.
+#define MAX_TIME_LEN 32
+
+// Max output of a log command, in whole lines.
+#define MAX_READ_LEN (1024 * 1024)
+
+// Response of the log command: first line number, number of lines, and if
+// the output was cut.
+#define READ_RESP "line=%" PRIu64 " lines=%" PRIu64 " more=%d"
+
+enum read_mode {
+    READ_NONE,
+    READ_TAIL,
+    READ_SINCE,
+    READ_LINE
+};
+
+// Start of an index file, followed by the entries.
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t stride;
+    uint32_t reserved;
+    uint64_t size;                   // Log data indexed, up to a line end.
+    uint64_t lines;                  // Lines in the indexed data.
+    uint64_t time_ns;                // Last time stamp of an entry.
+    uint64_t count;                  // Number of entries.
+};
+
+// Index entry, one per stride of log data.
+struct index_entry {
+    uint64_t offset;                 // Start of a line.
+    uint64_t line;                   // Number of the line, from 0.
+    uint64_t time_ns;                // Time stamp, or of an earlier entry.
+};
+
+// Index of a log file, locked while open.
+struct logindex {
+    int fd;                          // Index file.
+    int log_fd;                      // Log file.
+    struct index_header hdr;
+    struct index_entry last;         // Last entry, if any.
+};
+
+struct read_req {
+    enum read_mode mode;
+    const char *name;
+    uint64_t tail;                   // Number of last lines.
+    uint64_t since_ns;               // First time stamp.
+    uint64_t until_ns;               // Last time stamp, 0 for none.
+    uint64_t line;                   // First line number.
+    uint64_t count;                  // Max number of lines, 0 for any.
+};
+
+// Log file of a running session, indexed as it grows.
+struct follow {
+    struct follow *next;
+    char *path;
+};
+
+// Thread synchronization of the followed files.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Followed log files.
+static struct follow *follows = NULL;
+
+// Forward declarations.
+static void follow_logs(int fd, uint32_t events, void *arg);
+static int parse_read(char *line, struct read_req *req);
+static int open_index(const char *path, int wait, struct logindex *idx);
+static void close_index(struct logindex *idx);
+static int reset_index(struct logindex *idx);
+static int write_header(struct logindex *idx);
+static int add_entry(struct logindex *idx, uint64_t offset,
+                     const char *data, uint32_t len);
+static int read_entry(struct logindex *idx, uint64_t i,
+                      struct index_entry *e);
+static int extend_index(struct logindex *idx, uint64_t max);
+static int64_t scan_data(struct logindex *idx, const char *data,
+                         uint32_t len, uint64_t base, int eof, int *start);
+static int find_entry(struct logindex *idx, int by_time, uint64_t key,
+                      struct index_entry *e);
+static int seek_line(struct logindex *idx, uint64_t line, uint64_t *offset);
+static int seek_time(struct logindex *idx, uint64_t time_ns,
+                     uint64_t *offset, uint64_t *line);
+static int send_tail(struct logindex *idx, uint64_t n, logindex_fn fn,
+                     void *arg, char *resp, uint32_t len);
+static int send_lines(struct logindex *idx, const struct read_req *req,
+                      uint64_t offset, uint64_t line, logindex_fn fn,
+                      void *arg, char *resp, uint32_t len);
+static uint64_t parse_time(const char *p, uint32_t len);
+static uint64_t count_newlines(const char *p, uint32_t len);
+static const char * rfind_newline(const char *start, const char *end,
+                                  uint64_t *n);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Initialize log indexing. The log files of running sessions are
+ *        indexed from the event loop as they grow, so reads find their
+ *        index mostly up to date.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int logindex_init(void)
+{
+    if (evloop_add_timer(FOLLOW_INTERVAL_MS, follow_logs, NULL) == -1) {
+        ALOGE("%s:%d: Failed to add index timer", _FILE, __LINE__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Start indexing a log file as it grows.
+ *
+ * @param [in] path Log file path, NULL for none.
+ */
+void logindex_follow(const char *path)
+{
+    struct follow *f;
+
+    if (NULL == path) {
+        return;
+    }
+
+    f = malloc(sizeof(*f));
+
+    if (NULL == f || NULL == (f->path = strdup(path))) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        free(f);
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+    f->next = follows;
+    follows = f;
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Stop indexing a log file as it grows. The index is kept and
+ *        completed when the file is read.
+ *
+ * @param [in] path Log file path, NULL for none.
+ */
+void logindex_unfollow(const char *path)
+{
+    struct follow **p, *f;
+
+    if (NULL == path) {
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    for (p = &follows; *p; p = &(*p)->next) {
+        if (strcmp((*p)->path, path) == 0) {
+            f = *p;
+            *p = f->next;
+            free(f->path);
+            free(f);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Check if a command reads the output of a session.
+ *
+ * @param [in] cmd Command string.
+ *
+ * @return Returns 1 if the command is a log read, else 0.
+ */
+int logindex_is_read(const char *cmd)
+{
+    size_t n = strlen(LOG_CMD);
+
+    return strncmp(cmd, LOG_CMD, n) == 0 &&
+           (' ' == cmd[n] || '\t' == cmd[n] || '\0' == cmd[n]);
+}
+
+/**
+ * @brief Read a part of the log file of a session,
+ *        "log <name> (--tail=<n> | --since=<time> [--until=<time>] |
+ *        --line=<n>) [--count=<n>]". The index of the file is brought up to
+ *        date, or built if there is none, and the start of the part is
+ *        found from it without reading the file up to there.
+ *
+ * @param [in]  cmd  Command string.
+ * @param [in]  fn   Called with the output, in whole lines, returns -1
+ *                   to fail the read.
+ * @param [in]  arg  Callback argument.
+ * @param [out] resp Response buffer, the first line number, the number of
+ *                   lines and if the output was cut.
+ * @param [in]  len  Length of response buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int logindex_read(const char *cmd, logindex_fn fn, void *arg, char *resp,
+                  uint32_t len)
+{
+    char line[CMD_LINE_LENGTH];
+    char path[CMD_LINE_LENGTH];
+    struct logindex idx;
+    struct read_req req;
+    uint64_t offset = 0, first = 0;
+    int rc;
+
+    snprintf(line, sizeof(line), "%s", cmd + strlen(LOG_CMD));
+
+    if (parse_read(line, &req) == -1) {
+        return -1;
+    }
+
+    if (mldproc_logpath(req.name, path, sizeof(path)) == -1) {
+        ALOGE("%s:%d: No log file to read (name: %s)", _FILE, __LINE__,
+              req.name);
+        return -1;
+    }
+
+    if (open_index(path, 1, &idx) == -1) {
+        return -1;
+    }
+
+    rc = extend_index(&idx, 0);
+
+    if (0 == rc) {
+        switch (req.mode) {
+        case READ_TAIL:
+            rc = send_tail(&idx, req.tail, fn, arg, resp, len);
+            break;
+
+        case READ_SINCE:
+            rc = seek_time(&idx, req.since_ns, &offset, &first);
+            break;
+
+        default:
+            first = req.line;
+            rc = seek_line(&idx, req.line, &offset);
+            break;
+        }
+    }
+
+    if (0 == rc && req.mode != READ_TAIL) {
+        rc = send_lines(&idx, &req, offset, first, fn, arg, resp, len);
+    }
+
+    close_index(&idx);
+
+    return rc;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Index the new output of the followed log files. Files being read
+ *        are skipped, the read completes their index.
+ *
+ * @param [in] fd     <Not in use>.
+ * @param [in] events <Not in use>.
+ * @param [in] arg    <Not in use>.
+ */
+static void follow_logs(int fd, uint32_t events, void *arg)
+{
+    struct logindex idx;
+    struct follow *f;
+
+    UNUSED(fd);
+    UNUSED(events);
+    UNUSED(arg);
+
+    pthread_mutex_lock(&mutex);
+
+    for (f = follows; f; f = f->next) {
+        if (open_index(f->path, 0, &idx) == 0) {
+            (void)extend_index(&idx, FOLLOW_STEP);
+            close_index(&idx);
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Parse the options of a log command.
+ *
+ * @param [in]  line Options, modified.
+ * @param [out] req  Parsed request, refers to line.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int parse_read(char *line, struct read_req *req)
+{
+    char *token, *save, *end;
+    uint64_t *value;
+    int modes = 0;
+
+    memset(req, 0, sizeof(*req));
+
+    for (token = strtok_r(line, " \t", &save); token;
+            token = strtok_r(NULL, " \t", &save)) {
+        if (strncmp(token, OPT_TAIL, strlen(OPT_TAIL)) == 0) {
+            req->mode = READ_TAIL;
+            value = &req->tail;
+            token += strlen(OPT_TAIL);
+            modes++;
+        } else if (strncmp(token, OPT_LINE, strlen(OPT_LINE)) == 0) {
+            req->mode = READ_LINE;
+            value = &req->line;
+            token += strlen(OPT_LINE);
+            modes++;
+        } else if (strncmp(token, OPT_COUNT, strlen(OPT_COUNT)) == 0) {
+            value = &req->count;
+            token += strlen(OPT_COUNT);
+        } else if (strncmp(token, OPT_SINCE, strlen(OPT_SINCE)) == 0) {
+            req->mode = READ_SINCE;
+            req->since_ns = parse_time(token + strlen(OPT_SINCE),
+                                       MAX_TIME_LEN);
+            modes++;
+            continue;
+        } else if (strncmp(token, OPT_UNTIL, strlen(OPT_UNTIL)) == 0) {
+            req->until_ns = parse_time(token + strlen(OPT_UNTIL),
+                                       MAX_TIME_LEN);
+            if (0 == req->until_ns) {
+                ALOGE("%s:%d: Bad log option: %s", _FILE, __LINE__, token);
+                return -1;
+            }
+            continue;
+        } else if ('-' == token[0] || req->name) {
+            ALOGE("%s:%d: Bad log option: %s", _FILE, __LINE__, token);
+            return -1;
+        } else {
+            req->name = token;
+            continue;
+        }
+
+        errno = 0;
+        *value = strtoull(token, &end, 10);
+
+        if (errno != 0 || end == token || *end != '\0') {
+            ALOGE("%s:%d: Bad log option value: %s", _FILE, __LINE__, token);
+            return -1;
+        }
+    }
+
+    if (NULL == req->name || modes != 1 ||
+            (READ_TAIL == req->mode && (0 == req->tail || req->count > 0)) ||
+            (req->until_ns > 0 && req->mode != READ_SINCE)) {
+        ALOGE("%s:%d: Bad log command", _FILE, __LINE__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Open and lock the index of a log file, created empty if there is
+ *        none. An index not matching the file is started over.
+ *
+ * @param [in]  path Log file path.
+ * @param [in]  wait Set to wait for the index while locked by another
+ *                   thread, else the open fails.
+ * @param [out] idx  Index.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int open_index(const char *path, int wait, struct logindex *idx)
+{
+    char ipath[CMD_LINE_LENGTH + sizeof(INDEX_EXT)];
+    struct stat st;
+
+    idx->log_fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    // MLD may not have created a followed file yet.
+    if (-1 == idx->log_fd) {
+        if (wait) {
+            ALOGE("%s:%d: Failed to open %s (errno=%d)", _FILE, __LINE__,
+                  path, errno);
+        }
+        return -1;
+    }
+
+    snprintf(ipath, sizeof(ipath), "%s%s", path, INDEX_EXT);
+    idx->fd = open(ipath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (-1 == idx->fd) {
+        ALOGE("%s:%d: Failed to open %s (errno=%d)", _FILE, __LINE__, ipath,
+              errno);
+        close(idx->log_fd);
+        return -1;
+    }
+
+    if (flock(idx->fd, LOCK_EX | (wait ? 0 : LOCK_NB)) == -1) {
+        if (wait) {
+            ALOGE("%s:%d: Failed to lock %s (errno=%d)", _FILE, __LINE__,
+                  ipath, errno);
+        }
+        close_index(idx);
+        return -1;
+    }
+
+    if (pread(idx->fd, &idx->hdr, sizeof(idx->hdr), 0) !=
+                (ssize_t)sizeof(idx->hdr) ||
+            idx->hdr.magic != INDEX_MAGIC ||
+            idx->hdr.version != INDEX_VERSION ||
+            idx->hdr.stride != INDEX_STRIDE ||
+            fstat(idx->log_fd, &st) == -1 ||
+            (uint64_t)st.st_size < idx->hdr.size ||
+            (idx->hdr.count > 0 &&
+             read_entry(idx, idx->hdr.count - 1, &idx->last) == -1)) {
+        if (reset_index(idx) == -1) {
+            close_index(idx);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Close the index of a log file, which releases its lock.
+ *
+ * @param [in] idx Index.
+ */
+static void close_index(struct logindex *idx)
+{
+    close(idx->fd);
+    close(idx->log_fd);
+}
+
+/**
+ * @brief Empty an index, the log file is indexed from the start.
+ *
+ * @param [in out] idx Index.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int reset_index(struct logindex *idx)
+{
+    memset(&idx->hdr, 0, sizeof(idx->hdr));
+    idx->hdr.magic = INDEX_MAGIC;
+    idx->hdr.version = INDEX_VERSION;
+    idx->hdr.stride = INDEX_STRIDE;
+
+    if (ftruncate(idx->fd, 0) == -1) {
+        ALOGE("%s:%d: Failed to truncate index (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
+
+    return write_header(idx);
+}
+
+/**
+ * @brief Write the header of an index, after its entries.
+ *
+ * @param [in] idx Index.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int write_header(struct logindex *idx)
+{
+    if (pwrite(idx->fd, &idx->hdr, sizeof(idx->hdr), 0) !=
+            (ssize_t)sizeof(idx->hdr)) {
+        ALOGE("%s:%d: Failed to write index (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Append an entry to an index.
+ *
+ * @param [in out] idx    Index.
+ * @param [in]     offset Start of the line.
+ * @param [in]     data   Line data.
+ * @param [in]     len    Length of the line data.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int add_entry(struct logindex *idx, uint64_t offset,
+                     const char *data, uint32_t len)
+{
+    struct index_entry e;
+
+    e.offset = offset;
+    e.line = idx->hdr.lines;
+    e.time_ns = parse_time(data, len);
+
+    // Lines without a time stamp take the last one.
+    if (0 == e.time_ns) {
+        e.time_ns = idx->hdr.time_ns;
+    }
+
+    if (pwrite(idx->fd, &e, sizeof(e),
+               sizeof(idx->hdr) + idx->hdr.count * sizeof(e)) !=
+            (ssize_t)sizeof(e)) {
+        ALOGE("%s:%d: Failed to write index (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
+
+    idx->hdr.count++;
+    idx->hdr.time_ns = e.time_ns;
+    idx->last = e;
+
+    return 0;
+}
+
+/**
+ * @brief Read an entry of an index.
+ *
+ * @param [in]  idx Index.
+ * @param [in]  i   Entry number.
+ * @param [out] e   Entry.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int read_entry(struct logindex *idx, uint64_t i,
+                      struct index_entry *e)
+{
+    if (pread(idx->fd, e, sizeof(*e), sizeof(idx->hdr) + i * sizeof(*e)) !=
+            (ssize_t)sizeof(*e)) {
+        ALOGE("%s:%d: Failed to read index (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Index the log data written since the index was last extended.
+ *
+ * @param [in out] idx Index.
+ * @param [in]     max Max log data to index, 0 for all.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int extend_index(struct logindex *idx, uint64_t max)
+{
+    uint64_t pos = idx->hdr.size;
+    uint64_t end;
+    struct stat st;
+    int64_t used;
+    int start = 1;
+    ssize_t n;
+    char *buf;
+    int rc = 0;
+
+    if (fstat(idx->log_fd, &st) == -1) {
+        ALOGE("%s:%d: Failed to stat log (errno=%d)", _FILE, __LINE__, errno);
+        return -1;
+    }
+
+    end = st.st_size;
+
+    if (max > 0 && end - pos > max) {
+        end = pos + max;
+    }
+
+    if (pos >= end) {
+        return 0;
+    }
+
+    buf = pool_buf_alloc(SCAN_BUF_LEN);
+
+    if (NULL == buf) {
+        return -1;
+    }
+
+    while (pos < end) {
+        n = pread(idx->log_fd, buf,
+                  (end - pos < SCAN_BUF_LEN) ? end - pos : SCAN_BUF_LEN, pos);
+
+        if (-1 == n && EINTR == errno) {
+            continue;
+        } else if (n <= 0) {
+            if (-1 == n) {
+                ALOGE("%s:%d: Failed to read log (errno=%d)", _FILE,
+                      __LINE__, errno);
+                rc = -1;
+            }
+            break;
+        }
+
+        used = scan_data(idx, buf, n, pos, pos + n >= end, &start);
+
+        if (used <= 0) {
+            rc = (int)used;
+            break;
+        }
+
+        pos += used;
+    }
+
+    pool_buf_free(buf, SCAN_BUF_LEN);
+
+    if (write_header(idx) == -1) {
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Count the lines of log data and add an entry at the first line
+ *        starting a stride after the last entry.
+ *
+ * @param [in out] idx   Index.
+ * @param [in]     data  Log data.
+ * @param [in]     len   Length of the log data.
+ * @param [in]     base  File offset of the data.
+ * @param [in]     eof   Set if the data ends at the end of the file.
+ * @param [in out] start Set if the data starts at a line start, updated for
+ *                       the data following the used part.
+ *
+ * @return Returns the length of the used data, the rest is scanned again
+ *         with the following data, or -1 at failure.
+ */
+static int64_t scan_data(struct logindex *idx, const char *data,
+                         uint32_t len, uint64_t base, int eof, int *start)
+{
+    const char *p = data;
+    const char *end = data + len;
+    const char *q, *nl;
+    uint64_t off, due, n;
+
+    while (p < end) {
+        off = base + (p - data);
+        due = (0 == idx->hdr.count) ? 0 : idx->last.offset + INDEX_STRIDE;
+
+        // Only count the lines up to where the next entry is due.
+        if (off < due) {
+            q = (due - off < (uint64_t)(end - p)) ? p + (due - off) : end;
+            n = count_newlines(p, q - p);
+            if (n > 0) {
+                nl = memrchr(p, '\n', q - p);
+                idx->hdr.lines += n;
+                idx->hdr.size = base + (nl + 1 - data);
+            }
+            *start = ('\n' == q[-1]);
+            p = q;
+            continue;
+        }
+
+        if (!*start) {
+            nl = memchr(p, '\n', end - p);
+            if (NULL == nl) {
+                p = end;
+                break;
+            }
+            idx->hdr.lines++;
+            idx->hdr.size = base + (nl + 1 - data);
+            p = nl + 1;
+            *start = 1;
+            continue;
+        }
+
+        // The entry is added once its line is complete, a line longer than
+        // the data is indexed by what there is of it.
+        if (NULL == memchr(p, '\n', end - p) && (p > data || eof)) {
+            break;
+        }
+
+        if (add_entry(idx, off, p, (end - p < MAX_TIME_LEN) ? end - p :
+                      MAX_TIME_LEN) == -1) {
+            return -1;
+        }
+    }
+
+    return p - data;
+}
+
+/**
+ * @brief Find the entry to start a search from by binary search, the last
+ *        entry before a time stamp or at most at a line number.
+ *
+ * @param [in]  idx     Index.
+ * @param [in]  by_time Set to search by time stamp, else by line number.
+ * @param [in]  key     Time stamp or line number.
+ * @param [out] e       Entry, the first one if none is before the key.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int find_entry(struct logindex *idx, int by_time, uint64_t key,
+                      struct index_entry *e)
+{
+    uint64_t lo = 0, hi = idx->hdr.count, mid;
+
+    memset(e, 0, sizeof(*e));
+
+    if (0 == hi) {
+        return 0;
+    }
+
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+
+        if (read_entry(idx, mid, e) == -1) {
+            return -1;
+        }
+
+        if (by_time ? e->time_ns < key : e->line <= key) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return read_entry(idx, lo, e);
+}
+
+/**
+ * @brief Find the start of a line.
+ *
+ * @param [in]  idx    Index.
+ * @param [in]  line   Line number.
+ * @param [out] offset Start of the line, or the end of the indexed data if
+ *                     there is no such line.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int seek_line(struct logindex *idx, uint64_t line, uint64_t *offset)
+{
+    struct index_entry e;
+    uint64_t n, found;
+    const char *p;
+    char *buf;
+    ssize_t len;
+
+    if (line >= idx->hdr.lines) {
+        *offset = idx->hdr.size;
+        return 0;
+    }
+
+    if (find_entry(idx, 0, line, &e) == -1) {
+        return -1;
+    }
+
+    *offset = e.offset;
+    n = line - e.line;
+
+    if (0 == n) {
+        return 0;
+    }
+
+    if (NULL == (buf = pool_buf_alloc(SCAN_BUF_LEN))) {
+        return -1;
+    }
+
+    while (n > 0) {
+        len = pread(idx->log_fd, buf,
+                    (idx->hdr.size - *offset < SCAN_BUF_LEN) ?
+                    idx->hdr.size - *offset : SCAN_BUF_LEN, *offset);
+
+        if (len <= 0) {
+            ALOGE("%s:%d: Failed to read log (errno=%d)", _FILE, __LINE__,
+                  errno);
+            pool_buf_free(buf, SCAN_BUF_LEN);
+            return -1;
+        }
+
+        found = count_newlines(buf, len);
+
+        if (found < n) {
+            n -= found;
+            *offset += len;
+            continue;
+        }
+
+        for (p = buf; n > 0; n--) {
+            p = (const char *)memchr(p, '\n', buf + len - p) + 1;
+        }
+
+        *offset += p - buf;
+    }
+
+    pool_buf_free(buf, SCAN_BUF_LEN);
+
+    return 0;
+}
+
+/**
+ * @brief Find the first line with a time stamp at or after a time.
+ *
+ * @param [in]  idx     Index.
+ * @param [in]  time_ns Time stamp.
+ * @param [out] offset  Start of the line, or the end of the indexed data if
+ *                      there is no such line.
+ * @param [out] line    Line number.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int seek_time(struct logindex *idx, uint64_t time_ns,
+                     uint64_t *offset, uint64_t *line)
+{
+    struct index_entry e;
+    const char *p, *nl;
+    int skip = 0;
+    uint64_t t;
+    char *buf;
+    ssize_t len;
+
+    if (find_entry(idx, 1, time_ns, &e) == -1) {
+        return -1;
+    }
+
+    if (NULL == (buf = pool_buf_alloc(SCAN_BUF_LEN))) {
+        return -1;
+    }
+
+    *offset = e.offset;
+    *line = e.line;
+
+    while (*offset < idx->hdr.size) {
+        len = pread(idx->log_fd, buf,
+                    (idx->hdr.size - *offset < SCAN_BUF_LEN) ?
+                    idx->hdr.size - *offset : SCAN_BUF_LEN, *offset);
+
+        if (len <= 0) {
+            ALOGE("%s:%d: Failed to read log (errno=%d)", _FILE, __LINE__,
+                  errno);
+            pool_buf_free(buf, SCAN_BUF_LEN);
+            return -1;
+        }
+
+        for (p = buf; (nl = memchr(p, '\n', buf + len - p)) != NULL;
+                p = nl + 1) {
+            t = skip ? 0 : parse_time(p, nl - p);
+            skip = 0;
+
+            if (t >= time_ns && t > 0) {
+                *offset += p - buf;
+                pool_buf_free(buf, SCAN_BUF_LEN);
+                return 0;
+            }
+
+            (*line)++;
+        }
+
+        // The rest of a line longer than the buffer has no time stamp.
+        if (p == buf) {
+            p += len;
+            skip = 1;
+        }
+
+        *offset += p - buf;
+    }
+
+    pool_buf_free(buf, SCAN_BUF_LEN);
+
+    return 0;
+}
+
+/**
+ * @brief Pass on the last lines of a log file, scanning back from its end
+ *        in a mapping of the file.
+ *
+ * @param [in]  idx  Index.
+ * @param [in]  n    Number of lines.
+ * @param [in]  fn   Called with the lines, -1 fails the read.
+ * @param [in]  arg  Callback argument.
+ * @param [out] resp Response buffer.
+ * @param [in]  len  Length of response buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int send_tail(struct logindex *idx, uint64_t n, logindex_fn fn,
+                     void *arg, char *resp, uint32_t len)
+{
+    uint64_t size = idx->hdr.size;
+    uint64_t floor = (size > MAX_READ_LEN) ? size - MAX_READ_LEN : 0;
+    uint64_t map_off, left = n, start, lines;
+    long page = sysconf(_SC_PAGESIZE);
+    const char *map, *end, *nl;
+    int more = 0;
+
+    if (0 == size) {
+        snprintf(resp, len, READ_RESP, (uint64_t)0, (uint64_t)0, 0);
+        return 0;
+    }
+
+    // A line end just before the output limit is included.
+    map_off = ((floor > 0) ? floor - 1 : 0) / page * page;
+    map = mmap(NULL, size - map_off, PROT_READ, MAP_PRIVATE, idx->log_fd,
+               map_off);
+
+    if (MAP_FAILED == map) {
+        ALOGE("%s:%d: Failed to map log (errno=%d)", _FILE, __LINE__, errno);
+        return -1;
+    }
+
+    end = map + (size - map_off) - 1;
+    nl = rfind_newline(map + ((floor > 0) ? floor - 1 - map_off : 0), end,
+                       &left);
+
+    if (nl) {
+        start = map_off + (nl + 1 - map);
+        lines = n;
+    } else if (0 == floor) {
+        start = 0;
+        lines = n - left + 1;
+    } else {
+        // Cut at the output limit, at the first line end after it.
+        nl = memchr(map + (floor - 1 - map_off), '\n',
+                    end - (map + (floor - 1 - map_off)));
+        start = nl ? map_off + (nl + 1 - map) : size;
+        lines = n - left;
+        more = 1;
+    }
+
+    if (start < size && fn(arg, map + (start - map_off), size - start) == -1) {
+        munmap((void *)map, size - map_off);
+        return -1;
+    }
+
+    munmap((void *)map, size - map_off);
+
+    snprintf(resp, len, READ_RESP, idx->hdr.lines - lines, lines, more);
+
+    return 0;
+}
+
+/**
+ * @brief Pass on the lines of a log file from a line on, until the count,
+ *        the time or the output limit is reached.
+ *
+ * @param [in]  idx    Index.
+ * @param [in]  req    Request.
+ * @param [in]  offset Start of the first line.
+ * @param [in]  line   Number of the first line.
+ * @param [in]  fn     Called with the lines, -1 fails the read.
+ * @param [in]  arg    Callback argument.
+ * @param [out] resp   Response buffer.
+ * @param [in]  len    Length of response buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int send_lines(struct logindex *idx, const struct read_req *req,
+                      uint64_t offset, uint64_t line, logindex_fn fn,
+                      void *arg, char *resp, uint32_t len)
+{
+    uint64_t lines = 0, total = 0;
+    const char *p, *nl;
+    int done = 0, more = 0;
+    char *buf;
+    ssize_t n;
+
+    if (NULL == (buf = pool_buf_alloc(SCAN_BUF_LEN))) {
+        return -1;
+    }
+
+    while (!done && offset < idx->hdr.size) {
+        n = pread(idx->log_fd, buf,
+                  (idx->hdr.size - offset < SCAN_BUF_LEN) ?
+                  idx->hdr.size - offset : SCAN_BUF_LEN, offset);
+
+        if (n <= 0) {
+            ALOGE("%s:%d: Failed to read log (errno=%d)", _FILE, __LINE__,
+                  errno);
+            pool_buf_free(buf, SCAN_BUF_LEN);
+            return -1;
+        }
+
+        for (p = buf; (nl = memchr(p, '\n', buf + n - p)) != NULL;
+                p = nl + 1) {
+            if (req->until_ns > 0 && parse_time(p, nl - p) > req->until_ns) {
+                done = 1;
+                break;
+            }
+
+            if ((req->count > 0 && lines == req->count) ||
+                    total + (nl + 1 - buf) > MAX_READ_LEN) {
+                done = 1;
+                more = 1;
+                break;
+            }
+
+            lines++;
+        }
+
+        // A line longer than the buffer isn't passed on.
+        if (p == buf && !done) {
+            more = 1;
+            break;
+        }
+
+        if (p > buf) {
+            if (fn(arg, buf, p - buf) == -1) {
+                pool_buf_free(buf, SCAN_BUF_LEN);
+                return -1;
+            }
+            total += p - buf;
+            offset += p - buf;
+        }
+    }
+
+    pool_buf_free(buf, SCAN_BUF_LEN);
+
+    snprintf(resp, len, READ_RESP, line, lines, more);
+
+    return 0;
+}
+
+/**
+ * @brief Parse the time stamp at the start of a line, seconds with an
+ *        optional fraction, e.g. "1792317483.013869935".
+ *
+ * @param [in] p   Line data.
+ * @param [in] len Length of the line data.
+ *
+ * @return Returns the time stamp in nanoseconds, or 0 if there is none.
+ */
+static uint64_t parse_time(const char *p, uint32_t len)
+{
+    const char *end = p + ((len < MAX_TIME_LEN) ? len : MAX_TIME_LEN);
+    uint64_t sec = 0, frac = 0, scale = 1000000000;
+    uint32_t digits = 0;
+
+    for (; p < end && *p >= '0' && *p <= '9' && digits < 11; p++, digits++) {
+        sec = sec * 10 + (*p - '0');
+    }
+
+    if (0 == digits) {
+        return 0;
+    }
+
+    if (p < end && '.' == *p) {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (scale > 1) {
+                scale /= 10;
+                frac += (*p - '0') * scale;
+            }
+        }
+    }
+
+    return sec * 1000000000 + frac;
+}
+
+/**
+ * @brief Count the line ends in data.
+ *
+ * @param [in] p   Data.
+ * @param [in] len Length of the data.
+ *
+ * @return Returns the number of line ends.
+ */
+static uint64_t count_newlines(const char *p, uint32_t len)
+{
+    uint64_t n = 0;
+
+#if defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+
+    for (; len >= 16; p += 16, len -= 16) {
+        n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(
+                 _mm_loadu_si128((const __m128i *)p), nl)));
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t nl = vdupq_n_u8('\n');
+    uint8x16_t acc;
+    uint32_t i;
+
+    // Byte counters are added up before they can overflow.
+    while (len >= 16) {
+        acc = vdupq_n_u8(0);
+        for (i = 0; i < 255 && len >= 16; i++, p += 16, len -= 16) {
+            acc = vsubq_u8(acc, vceqq_u8(vld1q_u8((const uint8_t *)p), nl));
+        }
+        n += vaddlvq_u8(acc);
+    }
+#endif
+
+    for (; len > 0; p++, len--) {
+        n += ('\n' == *p);
+    }
+
+    return n;
+}
+
+/**
+ * @brief Scan back for the n-th line end before the end of data.
+ *
+ * @param [in]     start Start of the data.
+ * @param [in]     end   End of the data.
+ * @param [in out] n     Number of line ends, reduced by those found.
+ *
+ * @return Returns the n-th line end, or NULL if there are fewer.
+ */
+static const char * rfind_newline(const char *start, const char *end,
+                                  uint64_t *n)
+{
+#if defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+    uint32_t mask, found, bit;
+
+    while (end - start >= 16) {
+        end -= 16;
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                   _mm_loadu_si128((const __m128i *)end), nl));
+        found = __builtin_popcount(mask);
+
+        if (found < *n) {
+            *n -= found;
+            continue;
+        }
+
+        while (1) {
+            bit = 31 - __builtin_clz(mask);
+            if (0 == --*n) {
+                return end + bit;
+            }
+            mask &= ~(1U << bit);
+        }
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t nl = vdupq_n_u8('\n');
+    uint64_t mask, found;
+    uint32_t bit;
+    uint8x16_t eq;
+
+    // Narrowing the compare results leaves four mask bits per byte.
+    while (end - start >= 16) {
+        end -= 16;
+        eq = vceqq_u8(vld1q_u8((const uint8_t *)end), nl);
+        mask = vget_lane_u64(vreinterpret_u64_u8(
+                   vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        found = __builtin_popcountll(mask) / 4;
+
+        if (found < *n) {
+            *n -= found;
+            continue;
+        }
+
+        while (1) {
+            bit = (63 - __builtin_clzll(mask)) / 4;
+            if (0 == --*n) {
+                return end + bit;
+            }
+            mask &= ~((uint64_t)0xF << (4 * bit));
+        }
+    }
+#endif
+
+    while (end > start) {
+        if ('\n' == *--end && 0 == --*n) {
+            return end;
+        }
+    }
+
+    return NULL;
+}
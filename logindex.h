@@ -0,0 +1,19 @@
+
+#ifndef LOGINDEX_H
+#define LOGINDEX_H
+
+#include <stdint.h>
+
+// Command reading a part of the output of a session.
+#define LOG_CMD "log"
+
+typedef int (*logindex_fn)(void *arg, const char *data, uint32_t len);
+
+int logindex_init(void);
+void logindex_follow(const char *path);
+void logindex_unfollow(const char *path);
+int logindex_is_read(const char *cmd);
+int logindex_read(const char *cmd, logindex_fn fn, void *arg, char *resp,
+                  uint32_t len);
+
+#endif
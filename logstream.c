@@ -0,0 +1,338 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+
+#include "evloop.h"
+#include "logfilter.h"
+#include "logstream.h"
+#include "mldproc.h"
+#include "pool.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "logstream.c"
+
+// Options adding a substring and a regular expression to the filter.
+#define OPT_MATCH "--match="
+#define OPT_REGEX "--regex="
+
+// Log data read at a time, also the longest line passed on.
+#define STREAM_BUF_LEN (64 * 1024)
+
+// Size of the buffer for inotify events.
+#define NOTIFY_BUF_LEN 4096
+
+struct logstream {
+    struct logstream *next;
+    int fd;                          // Log file.
+    int wd;                          // Inotify watch of the log file.
+    struct logfilter *filter;
+    char *buf;
+    uint32_t len;                    // Partial line carried over.
+    int skip;                        // Set while dropping a too long line.
+    logstream_fn fn;
+    void *arg;
+};
+
+// Thread synchronization, held while output is passed on.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Inotify instance of all streams.
+static int notify_fd = -1;
+
+// Open streams.
+static struct logstream *streams = NULL;
+
+// Forward declarations.
+static void file_changed(int fd, uint32_t events, void *arg);
+static void read_stream(struct logstream *stream);
+static void free_stream(struct logstream *stream);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Initialize live log streams. Log files are followed from the event
+ *        loop as they change.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int logstream_init(void)
+{
+    if ((notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+        ALOGE("%s:%d: Failed to init inotify (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
+
+    if (evloop_add_fd(notify_fd, EPOLLIN, file_changed, NULL) == -1) {
+        close(notify_fd);
+        notify_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Check if a command opens a live log stream.
+ *
+ * @param [in] cmd Command string.
+ *
+ * @return Returns 1 if the command opens a stream, else 0.
+ */
+int logstream_is_open(const char *cmd)
+{
+    size_t n = strlen(STREAM_CMD);
+
+    return strncmp(cmd, STREAM_CMD, n) == 0 &&
+           (' ' == cmd[n] || '\t' == cmd[n] || '\0' == cmd[n]);
+}
+
+/**
+ * @brief Open a live stream of the output of a session,
+ *        "stream <name> [--match=<text>]... [--regex=<regex>]...".
+ *        Output written from now on is passed on, the lines containing any
+ *        of the substrings or matching any of the expressions, or all lines
+ *        without a filter.
+ *
+ * @param [in] cmd Command string.
+ * @param [in] fn  Called from the event loop thread with the output passed
+ *                 on, in whole lines.
+ * @param [in] arg Callback argument.
+ *
+ * @return Returns the stream, or NULL at failure.
+ */
+struct logstream * logstream_open(const char *cmd, logstream_fn fn, void *arg)
+{
+    char line[CMD_LINE_LENGTH];
+    char path[CMD_LINE_LENGTH];
+    char *token, *save;
+    char *name = NULL;
+    struct logstream *stream;
+    int rc = 0;
+
+    if (-1 == notify_fd) {
+        ALOGE("%s:%d: Live log streams not available", _FILE, __LINE__);
+        return NULL;
+    }
+
+    stream = calloc(1, sizeof(*stream));
+
+    if (NULL == stream) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        return NULL;
+    }
+
+    stream->fd = -1;
+    stream->wd = -1;
+    stream->fn = fn;
+    stream->arg = arg;
+    stream->filter = logfilter_create();
+    stream->buf = pool_buf_alloc(STREAM_BUF_LEN);
+
+    if (NULL == stream->filter || NULL == stream->buf) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        free_stream(stream);
+        return NULL;
+    }
+
+    snprintf(line, sizeof(line), "%s", cmd + strlen(STREAM_CMD));
+
+    for (token = strtok_r(line, " \t", &save); token && 0 == rc;
+            token = strtok_r(NULL, " \t", &save)) {
+        if (strncmp(token, OPT_MATCH, strlen(OPT_MATCH)) == 0) {
+            rc = logfilter_add_text(stream->filter,
+                                    token + strlen(OPT_MATCH));
+        } else if (strncmp(token, OPT_REGEX, strlen(OPT_REGEX)) == 0) {
+            rc = logfilter_add_regex(stream->filter,
+                                     token + strlen(OPT_REGEX));
+        } else if ('-' == token[0] || name) {
+            ALOGE("%s:%d: Bad stream option: %s", _FILE, __LINE__, token);
+            rc = -1;
+        } else {
+            name = token;
+        }
+    }
+
+    if (-1 == rc || NULL == name || logfilter_compile(stream->filter) == -1) {
+        free_stream(stream);
+        return NULL;
+    }
+
+    if (mldproc_logpath(name, path, sizeof(path)) == -1) {
+        ALOGE("%s:%d: No log file to stream (name: %s)", _FILE, __LINE__,
+              name);
+        free_stream(stream);
+        return NULL;
+    }
+
+    // Only output written from now on is streamed.
+    if ((stream->fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 ||
+            lseek(stream->fd, 0, SEEK_END) == -1) {
+        ALOGE("%s:%d: Failed to open %s (errno=%d)", _FILE, __LINE__, path,
+              errno);
+        free_stream(stream);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    // Streams of the same log file share the watch.
+    stream->wd = inotify_add_watch(notify_fd, path, IN_MODIFY);
+
+    if (-1 == stream->wd) {
+        pthread_mutex_unlock(&mutex);
+        ALOGE("%s:%d: Failed to watch %s (errno=%d)", _FILE, __LINE__, path,
+              errno);
+        free_stream(stream);
+        return NULL;
+    }
+
+    stream->next = streams;
+    streams = stream;
+
+    pthread_mutex_unlock(&mutex);
+
+    ALOGD("%s:%d: Stream opened (name: %s)", _FILE, __LINE__, name);
+
+    return stream;
+}
+
+/**
+ * @brief Close a live log stream. The callback isn't invoked once this
+ *        returns.
+ *
+ * @param [in] stream Stream.
+ */
+void logstream_close(struct logstream *stream)
+{
+    struct logstream **p, *q;
+
+    pthread_mutex_lock(&mutex);
+
+    for (p = &streams; *p; p = &(*p)->next) {
+        if (*p == stream) {
+            *p = stream->next;
+            break;
+        }
+    }
+
+    for (q = streams; q; q = q->next) {
+        if (q->wd == stream->wd) {
+            break;
+        }
+    }
+
+    if (NULL == q) {
+        (void)inotify_rm_watch(notify_fd, stream->wd);
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    free_stream(stream);
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Pass on the output of the streams whose log files changed.
+ *
+ * @param [in] fd     Inotify instance.
+ * @param [in] events <Not in use>.
+ * @param [in] arg    <Not in use>.
+ */
+static void file_changed(int fd, uint32_t events, void *arg)
+{
+    char buf[NOTIFY_BUF_LEN]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    struct logstream *stream;
+    ssize_t n, pos;
+
+    UNUSED(events);
+    UNUSED(arg);
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        pthread_mutex_lock(&mutex);
+
+        for (pos = 0; pos < n; pos += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)(buf + pos);
+
+            // Events may have been lost, read all streams.
+            for (stream = streams; stream; stream = stream->next) {
+                if ((ev->mask & IN_Q_OVERFLOW) || stream->wd == ev->wd) {
+                    read_stream(stream);
+                }
+            }
+        }
+
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+/**
+ * @brief Read the output of a stream up to the end of its log file and pass
+ *        on the complete lines. Called with the streams locked.
+ *
+ * @param [in out] stream Stream.
+ */
+static void read_stream(struct logstream *stream)
+{
+    uint32_t used;
+    char *nl;
+    ssize_t n;
+
+    while ((n = read(stream->fd, stream->buf + stream->len,
+                     STREAM_BUF_LEN - stream->len)) > 0) {
+        stream->len += n;
+        used = 0;
+
+        // Drop the rest of a line longer than the buffer.
+        if (stream->skip) {
+            nl = memchr(stream->buf, '\n', stream->len);
+            used = nl ? (uint32_t)(nl + 1 - stream->buf) : stream->len;
+            stream->skip = (NULL == nl);
+        }
+
+        used += logfilter_scan(stream->filter, stream->buf + used,
+                               stream->len - used, stream->fn, stream->arg);
+
+        if (0 == used && STREAM_BUF_LEN == stream->len) {
+            used = stream->len;
+            stream->skip = 1;
+        }
+
+        stream->len -= used;
+        memmove(stream->buf, stream->buf + used, stream->len);
+    }
+}
+
+/**
+ * @brief Free a stream, no longer listed.
+ *
+ * @param [in] stream Stream.
+ */
+static void free_stream(struct logstream *stream)
+{
+    if (stream->fd != -1) {
+        close(stream->fd);
+    }
+
+    logfilter_free(stream->filter);
+    pool_buf_free(stream->buf, STREAM_BUF_LEN);
+    free(stream);
+}
@@ -0,0 +1,21 @@
+
+#ifndef LOGSTREAM_H
+#define LOGSTREAM_H
+
+#include <stdint.h>
+
+// Command streaming the output of a session, and the request stopping it.
+#define STREAM_CMD "stream"
+#define STREAM_STOP "stream --stop"
+
+struct logstream;
+
+typedef void (*logstream_fn)(void *arg, const char *data, uint32_t len);
+
+int logstream_init(void);
+int logstream_is_open(const char *cmd);
+struct logstream * logstream_open(const char *cmd, logstream_fn fn,
+                                  void *arg);
+void logstream_close(struct logstream *stream);
+
+#endif
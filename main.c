@@ -2,21 +2,64 @@
 #include <getopt.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "activation.h"
 #include "autoconf.h"
+#include "cgroup.h"
 #include "cmdserver.h"
+#include "evloop.h"
+#include "executor.h"
+#include "journal.h"
+#include "logdir.h"
+#include "logindex.h"
+#include "logstream.h"
+#include "metrics.h"
+#include "mldproc.h"
+#include "pool.h"
+#include "recorder.h"
+#include "spawnopt.h"
+#include "template.h"
+#include "upgrade.h"
 #include "utils.h"
 
 #define _FILE "main.c"
 
 // Short and long options for command-line parsing.
-static const char *shortopts = "p:c:";
+static const char *shortopts = "p:c:g:t:j:a:b:Sm:P:Q:i:w:I:W:Rr:T:M:X:L:F:";
 static const struct option longopts[] = {
     {"port", required_argument, NULL, 'p'},
     {"confpath", required_argument, NULL, 'c'},
+    {"cgroup", required_argument, NULL, 'g'},
+    {"stop-timeout", required_argument, NULL, 't'},
+    {"journal", required_argument, NULL, 'j'},
+    {"acceptors", required_argument, NULL, 'a'},
+    {"backlog", required_argument, NULL, 'b'},
+    {"steer-cpu", no_argument, NULL, 'S'},
+    {"max-clients", required_argument, NULL, 'm'},
+    {"max-per-peer", required_argument, NULL, 'P'},
+    {"max-pending", required_argument, NULL, 'Q'},
+    {"idle-timeout", required_argument, NULL, 'i'},
+    {"workers", required_argument, NULL, 'w'},
+    {"io-backend", required_argument, NULL, 'I'},
+    {"stall-window", required_argument, NULL, 'W'},
+    {"stall-restart", no_argument, NULL, 'R'},
+    {"client-rate", required_argument, NULL, 'r'},
+    {"total-rate", required_argument, NULL, 'T'},
+    {"metrics-port", required_argument, NULL, 'M'},
+    {"record", required_argument, NULL, 'X'},
+    {"memory-limit", required_argument, NULL, 'L'},
+    {"prealloc", required_argument, NULL, 'F'},
     {0, 0, 0, 0}
 };
 
+// Option value that disables cgroup confinement or the session journal.
+#define OPT_NONE "none"
+
+// Default location of the session journal.
+#define JOURNAL_DIR "/data/local/tmp/dip"
+
+
 /*============================================================================
  * Public functions
  *============================================================================
@@ -28,12 +71,29 @@ static const struct option longopts[] = {
 int main(int argc, char *argv[])
 {
     int opt;
+    int steer = 0;
+    int restart = 0;
+    uint32_t acceptors = 1;
+    uint32_t clients = 0, per_peer = 0, pending = 0, idle_ms = 0;
+    uint32_t workers = 0;
+    uint32_t stall_s = 0;
+    uint64_t client_rate = 0, total_rate = 0;
     const char *port = NULL;
+    const char *metrics_port = NULL;
+    const char *record = NULL;
     const char *confpath = NULL;
+    const char *cgroup = NULL;
+    const char *journal = JOURNAL_DIR;
 
     // Prevent creation of child zombie processes.
     signal(SIGCHLD, SIG_IGN);
 
+    // Pick up state handed over if started by an upgrade.
+    upgrade_init(argv);
+
+    // Pick up listening sockets passed by the supervisor.
+    activation_init();
+
     // Parse command-line.
     while ((opt = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1) {
         switch (opt) {
@@ -44,18 +104,185 @@ int main(int argc, char *argv[])
         case 'c':
             confpath = optarg;
             break;
+
+        case 'g':
+            cgroup = optarg;
+            break;
+
+        case 't':
+            mldproc_set_stop_timeout(strtoul(optarg, NULL, 10));
+            break;
+
+        case 'j':
+            journal = optarg;
+            break;
+
+        case 'a':
+            acceptors = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'b':
+            cmdserver_set_backlog(strtol(optarg, NULL, 10));
+            break;
+
+        case 'S':
+            steer = 1;
+            break;
+
+        case 'm':
+            clients = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'P':
+            per_peer = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'Q':
+            pending = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'i':
+            idle_ms = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'w':
+            workers = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'I':
+            if (cmdserver_set_backend(optarg) == -1) {
+                ALOGE("%s:%d: Failed to set I/O backend", _FILE, __LINE__);
+                return -1;
+            }
+            break;
+
+        case 'W':
+            stall_s = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'R':
+            restart = 1;
+            break;
+
+        case 'r':
+            client_rate = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'T':
+            total_rate = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'M':
+            metrics_port = optarg;
+            break;
+
+        case 'X':
+            record = optarg;
+            break;
+
+        case 'L':
+            pool_set_limit(strtoull(optarg, NULL, 10) * 1024);
+            break;
+
+        case 'F':
+            logdir_init(strtoull(optarg, NULL, 10) * 1024);
+            break;
+        }
+    }
+
+    cmdserver_set_acceptors(acceptors, steer);
+    cmdserver_set_limits(clients, per_peer, pending, idle_ms);
+    cmdserver_set_rates(client_rate, total_rate);
+    mldproc_set_stall(stall_s * 1000, restart);
+
+    // Command threads may be pinned, MLD keeps the affinity of the proxy.
+    spawnopt_save_affinity();
+
+    // Place MLD sessions in cgroups when cgroup v2 is available.
+    if (NULL == cgroup || strcmp(cgroup, OPT_NONE) != 0) {
+        if (cgroup_init(cgroup) == -1) {
+            ALOGD("%s:%d: Sessions are started without cgroups", _FILE,
+                  __LINE__);
+        }
+    }
+
+    // Start the housekeeping event loop.
+    if (evloop_start() == -1) {
+        ALOGE("%s:%d: Failed to start event loop", _FILE, __LINE__);
+        return -1;
+    }
+
+    // Serve metrics for monitoring, if asked for.
+    if (metrics_port && metrics_start(metrics_port) == -1) {
+        ALOGE("%s:%d: Metrics not served", _FILE, __LINE__);
+    }
+
+    // Record client commands for replay, if asked for.
+    if (record && recorder_open(record) == -1) {
+        ALOGE("%s:%d: Commands not recorded", _FILE, __LINE__);
+    }
+
+    // Sample MLD resource usage periodically.
+    if (mldproc_init() == -1) {
+        ALOGE("%s:%d: Failed to init MLD process handling", _FILE, __LINE__);
+        return -1;
+    }
+
+    // Session output can be streamed live to clients.
+    if (logstream_init() == -1) {
+        ALOGE("%s:%d: Live log streams not available", _FILE, __LINE__);
+    }
+
+    // Session output is indexed as it is written, for fast reads.
+    if (logindex_init() == -1) {
+        ALOGE("%s:%d: Session logs not indexed", _FILE, __LINE__);
+    }
+
+    // Take over sessions from the binary that was upgraded.
+    if (upgrade_sessions()) {
+        ALOGD("%s:%d: Took over %d log sessions", _FILE, __LINE__,
+              mldproc_import(upgrade_sessions()));
+    }
+
+    // Re-adopt MLD processes that outlived an earlier instance.
+    if (strcmp(journal, OPT_NONE) != 0) {
+        if (journal_init(journal) == 0) {
+            ALOGD("%s:%d: Adopted %d log sessions", _FILE, __LINE__,
+                  mldproc_recover());
+        } else {
+            ALOGE("%s:%d: Sessions are not journaled", _FILE, __LINE__);
         }
     }
 
-    // Check config files for autostart option.
+    // Commands are executed apart from the client I/O.
+    if (executor_start(workers) == -1) {
+        ALOGE("%s:%d: Failed to start command executor", _FILE, __LINE__);
+        return -1;
+    }
+
+    // Set the location of config files.
     autoconf_init(confpath);
 
+    // Session templates are kept with the config files.
+    if (template_init(autoconf_getpath()) == -1) {
+        ALOGE("%s:%d: Session templates not reloaded", _FILE, __LINE__);
+    }
+
     // Start the command server.
     if (cmdserver_start(port) == -1) {
         ALOGE("%s:%d: Failed to start command server", _FILE, __LINE__);
         return -1;
     }
 
+    // Clients may connect while autostarted sessions are being started.
+    (void)activation_notify("READY=1");
+
+    // Check config files for autostart option, unless the sessions are
+    // already running after an upgrade.
+    if (NULL == upgrade_sessions()) {
+        autoconf_autostart();
+    }
+
     // Wait while the server is running.
     cmdserver_wait();
 
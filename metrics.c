@@ -0,0 +1,635 @@
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "evloop.h"
+#include "metrics.h"
+#include "procstat.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "metrics.c"
+
+// Max number of sessions exported, further sessions are left out.
+#define MAX_SESSION_SLOTS 64
+
+// Upper bounds of the histogram buckets, in microseconds.
+#define NUM_BUCKETS 12
+
+// Max number of scrapes served at the same time.
+#define MAX_HTTP_CONNS 4
+
+// Time after which a scrape that hasn't completed is dropped.
+#define HTTP_TIMEOUT_MS 5000
+
+// Longest request read, the rest is ignored.
+#define HTTP_REQUEST_LEN 1024
+
+// Size of the rendered metrics.
+#define RENDER_LEN (64 * 1024)
+
+// Path of the metrics.
+#define METRICS_PATH "/metrics"
+
+// HTTP responses.
+#define HTTP_OK "HTTP/1.1 200 OK\r\n" \
+                "Content-Type: text/plain; version=0.0.4\r\n" \
+                "Content-Length: %u\r\n" \
+                "Connection: close\r\n\r\n"
+#define HTTP_NOT_FOUND "HTTP/1.1 404 Not Found\r\n" \
+                       "Content-Length: 0\r\n" \
+                       "Connection: close\r\n\r\n"
+
+// End of the request header.
+#define HEADER_END "\r\n\r\n"
+
+// Description of a counter, counters of the same name differ by labels.
+struct counter_desc {
+    const char *name;
+    const char *labels;
+    const char *type;
+    const char *help;
+};
+
+struct histogram {
+    uint64_t buckets[NUM_BUCKETS + 1]; // Last bucket for larger values.
+    uint64_t sum_us;
+    uint64_t count;
+};
+
+// Sampled usage of a session, written under a sequence count. A reader
+// retries while the count is odd or changes.
+struct session_slot {
+    uint32_t seq;
+    uint64_t id;                     // Session ID, 0 if free.
+    char name[MAX_NAME_LEN];
+    uint64_t cpu_ms;
+    uint64_t wchar;
+    uint64_t rss_kb;
+};
+
+// Scrape being served.
+struct http_conn {
+    int fd;                          // -1 if free.
+    uint64_t start_ms;
+    char req[HTTP_REQUEST_LEN];
+    uint32_t req_len;
+    char *out;
+    uint32_t out_len;
+    uint32_t out_pos;
+};
+
+// Names of the counters, in the order of enum metrics_counter.
+static const struct counter_desc counter_descs[NUM_METRICS_COUNTERS] = {
+    {"dip_clients_connected", NULL, "gauge", "Connected clients."},
+    {"dip_commands_pending", NULL, "gauge",
+     "Commands queued or executing."},
+    {"dip_connections_accepted_total", NULL, "counter",
+     "Accepted connections."},
+    {"dip_connections_rejected_total", NULL, "counter",
+     "Connections refused as busy."},
+    {"dip_connections_timed_out_total", NULL, "counter",
+     "Connections closed when idle."},
+    {"dip_commands_busy_total", NULL, "counter",
+     "Commands refused as busy."},
+    {"dip_command_errors_total", NULL, "counter", "Failed commands."},
+    {"dip_session_exits_total", "reason=\"stopped\"", "counter",
+     "Exited MLD log sessions."},
+    {"dip_session_exits_total", "reason=\"killed\"", NULL, NULL},
+    {"dip_session_exits_total", "reason=\"unexpected\"", NULL, NULL}
+};
+
+// Names of the histograms, in the order of enum metrics_histogram.
+static const struct counter_desc hist_descs[NUM_METRICS_HISTOGRAMS] = {
+    {"dip_command_duration_seconds", NULL, "histogram",
+     "Time to execute a command."},
+    {"dip_spawn_duration_seconds", NULL, "histogram",
+     "Time to start a MLD log session."}
+};
+
+// Bucket bounds, from forking MLD to a slow session stop.
+static const uint64_t bucket_us[NUM_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 1000000,
+    10000000
+};
+
+// Metrics, updated by atomic operations.
+static uint64_t counters[NUM_METRICS_COUNTERS];
+static struct histogram hists[NUM_METRICS_HISTOGRAMS];
+static struct session_slot slots[MAX_SESSION_SLOTS];
+
+// Scrapes, only used by the event loop thread.
+static struct http_conn conns[MAX_HTTP_CONNS];
+
+// Forward declarations.
+static void accept_scrape(int fd, uint32_t events, void *arg);
+static void serve_scrape(int fd, uint32_t events, void *arg);
+static int send_scrape(struct http_conn *conn);
+static void close_scrape(struct http_conn *conn);
+static uint32_t render(char *buf, uint32_t len);
+static uint32_t render_sessions(char *buf, uint32_t len);
+static void read_slot(const struct session_slot *slot,
+                      struct session_slot *copy);
+static void escape_label(const char *value, char *buf, uint32_t len);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Serve the metrics in the Prometheus text format over HTTP, on a
+ *        port of the loopback interface. Scrapes are served by the event
+ *        loop and read the metrics without taking any locks.
+ *
+ * @param [in] port TCP port.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int metrics_start(const char *port)
+{
+    struct sockaddr_in addr;
+    int reuse = 1;
+    uint32_t i;
+    int fd;
+
+    for (i = 0; i < MAX_HTTP_CONNS; i++) {
+        conns[i].fd = -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(strtoul(port, NULL, 10));
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (-1 == fd) {
+        ALOGE("%s:%d: Failed to create socket (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
+
+    (void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(fd, MAX_HTTP_CONNS) == -1) {
+        ALOGE("%s:%d: Failed to listen on port %s (errno=%d)", _FILE,
+              __LINE__, port, errno);
+        close(fd);
+        return -1;
+    }
+
+    if (evloop_add_fd(fd, EPOLLIN, accept_scrape, NULL) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Add to a counter or gauge.
+ *
+ * @param [in] counter Counter.
+ * @param [in] n       Amount, negative to decrease a gauge.
+ */
+void metrics_add(enum metrics_counter counter, int64_t n)
+{
+    (void)__atomic_add_fetch(&counters[counter], (uint64_t)n,
+                             __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Count a duration in a histogram.
+ *
+ * @param [in] hist Histogram.
+ * @param [in] us   Duration in microseconds.
+ */
+void metrics_observe(enum metrics_histogram hist, uint64_t us)
+{
+    struct histogram *h = &hists[hist];
+    uint32_t i;
+
+    for (i = 0; i < NUM_BUCKETS && us > bucket_us[i]; i++) {
+    }
+
+    (void)__atomic_add_fetch(&h->buckets[i], 1, __ATOMIC_RELAXED);
+    (void)__atomic_add_fetch(&h->sum_us, us, __ATOMIC_RELAXED);
+    (void)__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Publish the sampled usage of a session. Calls for sessions must
+ *        not overlap, e.g. made with the session list locked.
+ *
+ * @param [in] id   Session ID.
+ * @param [in] name Session name.
+ * @param [in] stat Sampled usage.
+ */
+void metrics_session(uint64_t id, const char *name,
+                     const struct procstat *stat)
+{
+    struct session_slot *slot = NULL;
+    uint32_t i, seq;
+
+    for (i = 0; i < MAX_SESSION_SLOTS; i++) {
+        if (id == slots[i].id) {
+            slot = &slots[i];
+            break;
+        } else if (NULL == slot && 0 == slots[i].id) {
+            slot = &slots[i];
+        }
+    }
+
+    if (NULL == slot) {
+        return;
+    }
+
+    seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->id = id;
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+    slot->cpu_ms = stat->cpu_ms;
+    slot->wchar = stat->wchar;
+    slot->rss_kb = stat->rss_kb;
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Stop publishing the usage of a session.
+ *
+ * @param [in] id Session ID.
+ */
+void metrics_session_end(uint64_t id)
+{
+    uint32_t i, seq;
+
+    for (i = 0; i < MAX_SESSION_SLOTS; i++) {
+        if (id == slots[i].id) {
+            seq = slots[i].seq;
+            __atomic_store_n(&slots[i].seq, seq + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            slots[i].id = 0;
+            __atomic_store_n(&slots[i].seq, seq + 2, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Accept scrapes. Scrapes that haven't completed in time are
+ *        dropped to make room.
+ *
+ * @param [in] fd     Listening socket.
+ * @param [in] events <Not in use>.
+ * @param [in] arg    <Not in use>.
+ */
+static void accept_scrape(int fd, uint32_t events, void *arg)
+{
+    struct http_conn *conn;
+    uint64_t now = get_monotonic_ms();
+    uint32_t i;
+    int cfd;
+
+    UNUSED(events);
+    UNUSED(arg);
+
+    for (i = 0; i < MAX_HTTP_CONNS; i++) {
+        if (conns[i].fd != -1 && now - conns[i].start_ms >= HTTP_TIMEOUT_MS) {
+            close_scrape(&conns[i]);
+        }
+    }
+
+    while ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))
+            != -1) {
+        for (i = 0, conn = NULL; i < MAX_HTTP_CONNS && NULL == conn; i++) {
+            if (-1 == conns[i].fd) {
+                conn = &conns[i];
+            }
+        }
+
+        if (NULL == conn) {
+            close(cfd);
+            continue;
+        }
+
+        memset(conn, 0, sizeof(*conn));
+        conn->fd = cfd;
+        conn->start_ms = now;
+
+        if (evloop_add_fd(cfd, EPOLLIN, serve_scrape, conn) == -1) {
+            close(cfd);
+            conn->fd = -1;
+        }
+    }
+}
+
+/**
+ * @brief Read the request of a scrape and send the metrics once the request
+ *        is complete.
+ *
+ * @param [in] fd     Client socket.
+ * @param [in] events Events.
+ * @param [in] arg    Scrape.
+ */
+static void serve_scrape(int fd, uint32_t events, void *arg)
+{
+    struct http_conn *conn = arg;
+    char *path;
+    ssize_t n;
+    int found;
+
+    if (conn->out) {
+        if (send_scrape(conn) != 0) {
+            close_scrape(conn);
+        }
+        return;
+    }
+
+    n = read(fd, conn->req + conn->req_len,
+             sizeof(conn->req) - 1 - conn->req_len);
+
+    if (n <= 0) {
+        if (0 == n || (errno != EAGAIN && errno != EINTR)) {
+            close_scrape(conn);
+        }
+        return;
+    }
+
+    conn->req_len += n;
+    conn->req[conn->req_len] = '\0';
+
+    if (NULL == strstr(conn->req, HEADER_END) &&
+            conn->req_len < sizeof(conn->req) - 1) {
+        return;
+    }
+
+    conn->out = malloc(RENDER_LEN);
+
+    if (NULL == conn->out) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        close_scrape(conn);
+        return;
+    }
+
+    // Only the metrics are served, any query is ignored.
+    path = conn->req + strlen("GET ");
+    found = strncmp(conn->req, "GET ", strlen("GET ")) == 0 &&
+            strncmp(path, METRICS_PATH, strlen(METRICS_PATH)) == 0 &&
+            strchr(" ?", path[strlen(METRICS_PATH)]) != NULL;
+
+    if (found) {
+        // The header is written in front of the metrics once their length
+        // is known.
+        conn->out_pos = sizeof(HTTP_OK) + 10;
+        n = render(conn->out + conn->out_pos, RENDER_LEN - conn->out_pos);
+        conn->out_len = snprintf(conn->req, sizeof(conn->req), HTTP_OK,
+                                 (uint32_t)n);
+        conn->out_pos -= conn->out_len;
+        memcpy(conn->out + conn->out_pos, conn->req, conn->out_len);
+        conn->out_len += conn->out_pos + n;
+    } else {
+        conn->out_len = snprintf(conn->out, RENDER_LEN, HTTP_NOT_FOUND);
+    }
+
+    if (send_scrape(conn) != 0) {
+        close_scrape(conn);
+    } else if (evloop_del_fd(fd) == -1 ||
+               evloop_add_fd(fd, EPOLLOUT, serve_scrape, conn) == -1) {
+        close_scrape(conn);
+    }
+}
+
+/**
+ * @brief Send the response of a scrape, as far as the socket accepts it.
+ *
+ * @param [in] conn Scrape.
+ *
+ * @return Returns 0 if more is to be sent, 1 when sent, or -1 at failure.
+ */
+static int send_scrape(struct http_conn *conn)
+{
+    ssize_t n;
+
+    while (conn->out_pos < conn->out_len) {
+        n = send(conn->fd, conn->out + conn->out_pos,
+                 conn->out_len - conn->out_pos, MSG_NOSIGNAL);
+
+        if (-1 == n) {
+            if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                return 0;
+            } else if (errno != EINTR) {
+                return -1;
+            }
+        } else {
+            conn->out_pos += n;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Close a scrape.
+ *
+ * @param [in] conn Scrape.
+ */
+static void close_scrape(struct http_conn *conn)
+{
+    (void)evloop_del_fd(conn->fd);
+    close(conn->fd);
+    conn->fd = -1;
+    free(conn->out);
+    conn->out = NULL;
+}
+
+/**
+ * @brief Render the metrics in the Prometheus text format.
+ *
+ * @param [out] buf Metrics.
+ * @param [in]  len Size of the buffer.
+ *
+ * @return Returns the length of the metrics, cut at the buffer size.
+ */
+static uint32_t render(char *buf, uint32_t len)
+{
+    const struct counter_desc *d;
+    const struct histogram *h;
+    uint64_t sum, count, n;
+    uint32_t pos = 0, i, j;
+
+    for (i = 0; i < NUM_METRICS_COUNTERS && pos < len; i++) {
+        d = &counter_descs[i];
+
+        if (d->help) {
+            pos += snprintf(buf + pos, len - pos, "# HELP %s %s\n"
+                            "# TYPE %s %s\n", d->name, d->help, d->name,
+                            d->type);
+        }
+
+        if (pos < len) {
+            pos += snprintf(buf + pos, len - pos, "%s%s%s%s %llu\n", d->name,
+                            d->labels ? "{" : "",
+                            d->labels ? d->labels : "",
+                            d->labels ? "}" : "",
+                            (unsigned long long)__atomic_load_n(
+                                &counters[i], __ATOMIC_RELAXED));
+        }
+    }
+
+    for (i = 0; i < NUM_METRICS_HISTOGRAMS && pos < len; i++) {
+        d = &hist_descs[i];
+        h = &hists[i];
+
+        pos += snprintf(buf + pos, len - pos, "# HELP %s %s\n# TYPE %s %s\n",
+                        d->name, d->help, d->name, d->type);
+
+        // The buckets are cumulative, the count is their total so they add
+        // up while observations are made.
+        for (j = 0, n = 0; j <= NUM_BUCKETS && pos < len; j++) {
+            n += __atomic_load_n(&h->buckets[j], __ATOMIC_RELAXED);
+
+            if (j < NUM_BUCKETS) {
+                pos += snprintf(buf + pos, len - pos,
+                                "%s_bucket{le=\"%g\"} %llu\n", d->name,
+                                bucket_us[j] / 1e6, (unsigned long long)n);
+            } else {
+                pos += snprintf(buf + pos, len - pos,
+                                "%s_bucket{le=\"+Inf\"} %llu\n", d->name,
+                                (unsigned long long)n);
+            }
+        }
+
+        count = n;
+        sum = __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED);
+
+        if (pos < len) {
+            pos += snprintf(buf + pos, len - pos, "%s_sum %.6f\n"
+                            "%s_count %llu\n", d->name, sum / 1e6, d->name,
+                            (unsigned long long)count);
+        }
+    }
+
+    if (pos < len) {
+        pos += render_sessions(buf + pos, len - pos);
+    }
+
+    return (pos < len) ? pos : len;
+}
+
+/**
+ * @brief Render the sampled usage of the sessions.
+ *
+ * @param [out] buf Metrics.
+ * @param [in]  len Size of the buffer.
+ *
+ * @return Returns the length of the metrics, may exceed the buffer size.
+ */
+static uint32_t render_sessions(char *buf, uint32_t len)
+{
+    static const char *names[] = {
+        "dip_session_cpu_seconds_total", "dip_session_written_bytes_total",
+        "dip_session_resident_bytes"
+    };
+    static const char *helps[] = {
+        "CPU time of MLD.", "Bytes written by MLD.", "Resident memory of MLD."
+    };
+    static const char *types[] = {"counter", "counter", "gauge"};
+    struct session_slot copy;
+    char label[2 * MAX_NAME_LEN];
+    uint32_t pos = 0, i, m;
+
+    for (m = 0; m < 3 && pos < len; m++) {
+        pos += snprintf(buf + pos, len - pos, "# HELP %s %s\n# TYPE %s %s\n",
+                        names[m], helps[m], names[m], types[m]);
+
+        for (i = 0; i < MAX_SESSION_SLOTS && pos < len; i++) {
+            read_slot(&slots[i], &copy);
+
+            if (0 == copy.id) {
+                continue;
+            }
+
+            escape_label(copy.name, label, sizeof(label));
+
+            if (0 == m) {
+                pos += snprintf(buf + pos, len - pos,
+                                "%s{session=\"%s\"} %.3f\n", names[m], label,
+                                copy.cpu_ms / 1e3);
+            } else {
+                pos += snprintf(buf + pos, len - pos,
+                                "%s{session=\"%s\"} %llu\n", names[m], label,
+                                (unsigned long long)((1 == m) ? copy.wchar :
+                                                     copy.rss_kb * 1024));
+            }
+        }
+    }
+
+    return pos;
+}
+
+/**
+ * @brief Copy a session slot consistently, retrying while it is written.
+ *
+ * @param [in]  slot Session slot.
+ * @param [out] copy Copy of the slot.
+ */
+static void read_slot(const struct session_slot *slot,
+                      struct session_slot *copy)
+{
+    uint32_t seq;
+
+    do {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        memcpy(copy, slot, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) ||
+             seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED));
+
+    copy->name[sizeof(copy->name) - 1] = '\0';
+}
+
+/**
+ * @brief Escape a label value, backslash, double quote and newline.
+ *
+ * @param [in]  value Label value.
+ * @param [out] buf   Escaped value.
+ * @param [in]  len   Size of the buffer, at least twice the value length.
+ */
+static void escape_label(const char *value, char *buf, uint32_t len)
+{
+    uint32_t n = 0;
+
+    for (; *value && n + 2 < len; value++) {
+        if ('\\' == *value || '"' == *value) {
+            buf[n++] = '\\';
+            buf[n++] = *value;
+        } else if ('\n' == *value) {
+            buf[n++] = '\\';
+            buf[n++] = 'n';
+        } else {
+            buf[n++] = *value;
+        }
+    }
+
+    buf[n] = '\0';
+}
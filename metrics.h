@@ -0,0 +1,38 @@
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+struct procstat;
+
+// Counters and gauges, updated without locks.
+enum metrics_counter {
+    METRICS_CONNECTED,          // Connected clients, gauge.
+    METRICS_PENDING,            // Queued and executing commands, gauge.
+    METRICS_ACCEPTED,           // Accepted connections.
+    METRICS_REJECTED,           // Connections refused as busy.
+    METRICS_TIMED_OUT,          // Connections closed when idle.
+    METRICS_BUSY,               // Commands refused as busy.
+    METRICS_COMMAND_ERRORS,     // Failed commands.
+    METRICS_EXITS_STOPPED,      // Sessions that exited when stopped.
+    METRICS_EXITS_KILLED,       // Sessions killed when not exiting in time.
+    METRICS_EXITS_UNEXPECTED,   // Sessions that exited on their own.
+    NUM_METRICS_COUNTERS
+};
+
+// Latency histograms.
+enum metrics_histogram {
+    METRICS_COMMAND,            // Command execution.
+    METRICS_SPAWN,              // Session start.
+    NUM_METRICS_HISTOGRAMS
+};
+
+int metrics_start(const char *port);
+void metrics_add(enum metrics_counter counter, int64_t n);
+void metrics_observe(enum metrics_histogram hist, uint64_t us);
+void metrics_session(uint64_t id, const char *name,
+                     const struct procstat *stat);
+void metrics_session_end(uint64_t id);
+
+#endif
@@ -1,23 +1,40 @@
 
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 
+#include "activation.h"
+#include "cgroup.h"
 #include "cmdserver.h"
+#include "evloop.h"
+#include "executor.h"
+#include "journal.h"
+#include "logdir.h"
+#include "logindex.h"
+#include "metrics.h"
 #include "mldproc.h"
+#include "pool.h"
+#include "procstat.h"
+#include "spawnopt.h"
+#include "timerwheel.h"
 #include "utils.h"
 
 // For logging.
 #define _FILE "mldproc.c"
 
 // Max arguments on the command-line.
-#define MAX_ARGC 64
+#define MAX_ARGC MLDARGS_MAX
 
 // The MLD binary.
 #define MLD_BIN "/system/bin/mld"
@@ -32,251 +49,2022 @@
 #define MACC "LOG_D_ACC"
 #define MAPP "LOG_D_APP"
 
-// Permisson when creating directories.
-#define DIR_PERM 0777
+// Interval between resource usage samples of all sessions.
+#define SAMPLE_INTERVAL_MS 2000
+
+// Default time to wait for MLD to exit before it is killed.
+#define STOP_TIMEOUT_MS 5000
+
+// Time to wait for a killed MLD process to exit.
+#define KILL_TIMEOUT_MS 1000
+
+// Interval between exit checks of sessions that can't be watched by pidfd.
+#define EXIT_POLL_MS 100
+
+// Time until a scheduled action that couldn't be queued is retried.
+#define SCHED_RETRY_MS 1000
+
+// Size of the buffer for inotify events.
+#define NOTIFY_BUF_LEN 4096
+
+// Sessions added to the pool at a time.
+#define SESSIONS_PER_SLAB 4
+
+// Scheduled actions added to the pool at a time.
+#define SCHEDS_PER_SLAB 8
+
+// Max length of a scheduled start, as handed over or journaled.
+#define SCHED_LEN (4 * CMD_LINE_LENGTH)
+
+// Marks a scheduled start in the exported session table.
+#define SCHED_MARK '@'
+
+// Separates the spawn options of a scheduled start from its command-line.
+#define SCHED_CMD_MARK "-- "
+
+// Column header of the verbose query.
+#define QUERY_HEADER \
+    "NAME PID CPU_MS RSS_KB WCHAR UPTIME_S CG_CPU_MS CG_MEM_KB STALLED"
+
+// Scheduled actions.
+enum sched_op {
+    SCHED_START,
+    SCHED_STOP,
+    SCHED_STALL,
+    SCHED_REAP
+};
+
+// Scheduled start or stop of a session, or removal of an exited one, run by
+// the executor in order with the commands for the session.
+struct sched {
+    struct sched *next;         // Next scheduled start.
+    struct timer timer;
+    enum sched_op op;
+    uint64_t id;                // Session to stop or check.
+    char name[CMD_LINE_LENGTH];
+    char cmd[CMD_LINE_LENGTH];
+    struct spawnopt opt;
+    struct mldlimit limit;      // Limits of a started session.
+    uint64_t due_ms;            // Calendar time of a scheduled start.
+};
 
 struct session {
     struct session *next;
     pid_t pid;
-    char *name;
+    char name[CMD_LINE_LENGTH];
+    uint64_t id;        // Unique ID, names may be reused.
+    struct procstat stat;
+    int cgroup;         // Session has its own cgroup.
+    uint64_t cg_cpu_ms; // CPU time of all processes in the cgroup.
+    uint64_t cg_mem_kb; // Memory usage of all processes in the cgroup.
+    int pidfd;          // Signalled when MLD exits, -1 if not supported.
+    int stopping;       // Stop in progress, the name can't be reused yet.
+    int exited;
+    int killed;         // MLD didn't exit in time and was killed.
+    uint64_t stop_ms;   // Monotonic time when the stop started.
+    uint64_t exit_ms;   // Monotonic time when the exit was detected.
+    uint64_t max_bytes; // Output after which the session is stopped.
+    struct sched *deadline; // Stop at the max duration, NULL for none.
+    int limited;        // Stop at a limit requested.
+    char cmd[CMD_LINE_LENGTH]; // MLD command-line, empty if adopted.
+    struct spawnopt opt;
+    struct mldlimit limit;
+    uint64_t start_ms;  // Monotonic time when started.
+    int wd;             // Inotify watch of the log directory, -1 for none.
+    char logname[CMD_LINE_LENGTH]; // Log file name without extension.
+    char logpath[CMD_LINE_LENGTH]; // Log file path, empty if not known.
+    uint64_t output_ms; // Monotonic time of the last output.
+    uint64_t stall_ms;  // Time without output until stalled, 0 for none.
+    struct sched *watch; // Stall check, NULL for none.
+    int stalled;
 };
 
-// Session list head and tail.
-static struct session *head = NULL;
-static struct session *tail = NULL;
+// Thread synchronization.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Signalled when a MLD process has exited.
+static pthread_cond_t exit_cond;
+
+// Time to wait for MLD to exit before it is killed.
+static uint32_t stop_timeout_ms = STOP_TIMEOUT_MS;
+
+// Session list head and tail.
+static struct session *head = NULL;
+static struct session *tail = NULL;
+
+// Last assigned session ID.
+static uint64_t last_id = 0;
+
+// Pool of session nodes, one object each including the strings.
+static struct pool session_pool = POOL_INITIALIZER("sessions", struct session,
+                                                   SESSIONS_PER_SLAB);
+
+// Pool of scheduled actions.
+static struct pool sched_pool = POOL_INITIALIZER("scheds", struct sched,
+                                                 SCHEDS_PER_SLAB);
+
+// Sessions waiting to be started.
+static struct sched *scheduled = NULL;
+
+// Stall watchdog settings.
+static uint32_t stall_window_ms = 0;
+static int stall_restart = 0;
+
+// Inotify instance watching the log directories, -1 if not supported.
+static int notify_fd = -1;
+
+// Forward declarations.
+static int start_session(const char *name, const char *cmd,
+                         const struct spawnopt *opt);
+static int spawn_session(const char *name, struct mldargs *args,
+                         const struct spawnopt *opt);
+static int stop_sessions(const char *name, uint32_t timeout_ms, char *resp,
+                         uint32_t len);
+static int schedule_start(const char *name, const char *cmd,
+                          const struct spawnopt *opt,
+                          const struct mldlimit *limit);
+static int cancel_scheduled(const char *name, char *resp, uint32_t len);
+static int format_sched(const struct sched *s, char *buf, uint32_t len);
+static int restore_sched(const char *name, const char *sched);
+static void set_limits(struct session *p, const struct mldlimit *limit);
+static void request_stop(struct session *p);
+static struct sched * new_sched(const char *name, enum sched_op op,
+                                uint64_t id);
+static void sched_expired(void *arg);
+static void run_sched(void *arg);
+static int check_stall(struct session *p, struct sched *s);
+static void restart_session(struct session *p);
+static void watch_output(struct session *p, const char *dir,
+                         const char *file);
+static void unwatch_output(struct session *p);
+static void output_changed(int fd, uint32_t events, void *arg);
+static void wait_exited(struct session **targets, uint32_t n,
+                        uint64_t deadline_ms);
+static void kill_session(struct session *p);
+static void mark_exited(struct session *p);
+static void session_exited(int fd, uint32_t events, void *arg);
+static void poll_sessions(int fd, uint32_t events, void *arg);
+static void watch_session(struct session *p);
+static void sample_sessions(int fd, uint32_t events, void *arg);
+static void copy_record(const struct journal_rec *rec, void *arg);
+static int adoptable(const struct journal_rec *rec);
+static int adopt_session(const struct journal_rec *rec);
+static int add_session(pid_t pid, const char *name, int cgroup);
+static struct session * get_session(const char *name, struct session **prev);
+static int remove_session(const char *name);
+static int session_active(const char *name);
+static int session_scheduled(const char *name);
+static int add_mld_option(const char *option, char *argv[], uint32_t *argc);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Initialize MLD process handling. Resource usage of all sessions is
+ *        sampled periodically, and MLD exits are detected and session timers
+ *        run from the event loop.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int mldproc_init(void)
+{
+    pthread_condattr_t attr;
+
+    // Stop timeouts are measured on the monotonic clock.
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&exit_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (evloop_add_timer(SAMPLE_INTERVAL_MS, sample_sessions, NULL) == -1) {
+        ALOGE("%s:%d: Failed to add sample timer", _FILE, __LINE__);
+        return -1;
+    }
+
+    if (evloop_add_timer(EXIT_POLL_MS, poll_sessions, NULL) == -1) {
+        ALOGE("%s:%d: Failed to add exit poll timer", _FILE, __LINE__);
+        return -1;
+    }
+
+    if (timerwheel_init() == -1) {
+        ALOGE("%s:%d: Failed to init session timers", _FILE, __LINE__);
+        return -1;
+    }
+
+    // Output of the sessions is tracked from changes to their log files.
+    if ((notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+        ALOGE("%s:%d: Session output not tracked (errno=%d)", _FILE, __LINE__,
+              errno);
+    } else if (evloop_add_fd(notify_fd, EPOLLIN, output_changed, NULL)
+               == -1) {
+        close(notify_fd);
+        notify_fd = -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Re-adopt MLD processes started before a restart of the proxy. Each
+ *        session in the journal is adopted if its process is still running,
+ *        which is verified by the command-line and start time of the process.
+ *        Sessions not yet started are scheduled again. The journal is
+ *        compacted afterwards.
+ *
+ * @return Returns the number of adopted sessions.
+ */
+int mldproc_recover(void)
+{
+    struct journal_rec *recs = NULL;
+    struct journal_rec *rec;
+    int n = 0;
+
+    // Copy the records, the journal is updated while adopting.
+    journal_foreach(copy_record, &recs);
+
+    pthread_mutex_lock(&mutex);
+
+    while ((rec = recs)) {
+        recs = rec->next;
+
+        // Sessions handed over at upgrade are already active.
+        if (session_active(rec->name) || session_scheduled(rec->name)) {
+            // Keep the record.
+        } else if (rec->sched) {
+            if (restore_sched(rec->name, rec->sched) == -1) {
+                (void)journal_stop(rec->name);
+            }
+        } else if (adopt_session(rec) == 0) {
+            ALOGD("%s:%d: Adopted log session (name: %s, pid: %d)", _FILE,
+                  __LINE__, rec->name, rec->pid);
+            n++;
+        } else {
+            (void)journal_stop(rec->name);
+        }
+
+        free(rec->name);
+        free(rec->logpath);
+        free(rec->sched);
+        free(rec);
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    (void)journal_compact();
+
+    return n;
+}
+
+/**
+ * @brief Export the session table, to be imported by a new binary at upgrade.
+ *        Each running session is written as one line "<pid> <starttime>
+ *        <cgroup> <deadline> <max_bytes> <stall_ms> <name> <logpath>", the
+ *        deadline in calendar time and the log path empty if not known. Each
+ *        session not yet started is written as "@ <name> <start>", see
+ *        format_sched().
+ *
+ * @param [out] buf Destination buffer.
+ * @param [in]  len Length of destination buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int mldproc_export(char *buf, uint32_t len)
+{
+    char start[SCHED_LEN];
+    struct session *p;
+    struct sched *s;
+    uint64_t now_ms, wall_ms, deadline;
+    uint32_t pos = 0;
+
+    if (NULL == buf || 0 == len) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    buf[0] = '\0';
+
+    pthread_mutex_lock(&mutex);
+
+    now_ms = get_monotonic_ms();
+    wall_ms = get_realtime_ms();
+
+    for (p = head; p && pos < len; p = p->next) {
+        if (p->exited || p->stopping) {
+            continue;
+        }
+
+        // A max duration that has passed stops the session at import.
+        deadline = 0;
+        if (p->deadline) {
+            deadline = wall_ms;
+            if (p->start_ms + p->limit.max_ms > now_ms) {
+                deadline += p->start_ms + p->limit.max_ms - now_ms;
+            }
+        }
+
+        pos += snprintf(buf + pos, len - pos, "%d %llu %d %llu %llu %llu %s "
+                        "%s\n", p->pid, (unsigned long long)p->stat.starttime,
+                        p->cgroup, (unsigned long long)deadline,
+                        (unsigned long long)p->max_bytes,
+                        (unsigned long long)p->limit.stall_ms, p->name,
+                        p->logpath);
+    }
+
+    for (s = scheduled; s && pos < len; s = s->next) {
+        if (format_sched(s, start, sizeof(start)) == 0) {
+            pos += snprintf(buf + pos, len - pos, "%c %s %s\n", SCHED_MARK,
+                            s->name, start);
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    if (pos >= len) {
+        ALOGE("%s:%d: Not enough space for the session table", _FILE,
+              __LINE__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Import a session table exported by mldproc_export(). The processes
+ *        are verified the same way as journaled sessions, and sessions not
+ *        yet started are scheduled again.
+ *
+ * @param [in] table Session table.
+ *
+ * @return Returns the number of imported sessions.
+ */
+int mldproc_import(const char *table)
+{
+    struct journal_rec rec;
+    char line[SCHED_LEN + CMD_LINE_LENGTH];
+    char name[CMD_LINE_LENGTH];
+    char logpath[CMD_LINE_LENGTH];
+    unsigned long long starttime, deadline, max_bytes, stall_ms;
+    const char *pos;
+    int pid, cgroup, fields, end, n = 0;
+
+    if (NULL == table) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    for (pos = table; *pos; pos = strchr(pos, '\n') + 1) {
+        // Scan one line at a time, a missing log path must not match the
+        // next line.
+        snprintf(line, sizeof(line), "%.*s", (int)strcspn(pos, "\n"), pos);
+
+        if (SCHED_MARK == line[0]) {
+            if (sscanf(line + 1, " %255s %n", name, &end) == 1 &&
+                    !session_active(name) && !session_scheduled(name)) {
+                (void)restore_sched(name, line + 1 + end);
+            }
+        } else if ((fields = sscanf(line, "%d %llu %d %llu %llu %llu %255s "
+                                    "%255[^\n]", &pid, &starttime, &cgroup,
+                                    &deadline, &max_bytes, &stall_ms, name,
+                                    logpath)) >= 7) {
+            memset(&rec, 0, sizeof(rec));
+            rec.pid = pid;
+            rec.starttime = starttime;
+            rec.cgroup = cgroup;
+            rec.name = name;
+            rec.logpath = (8 == fields) ? logpath : NULL;
+            rec.deadline = deadline;
+            rec.max_bytes = max_bytes;
+            rec.stall_ms = stall_ms;
+
+            if (!session_active(name) && adopt_session(&rec) == 0) {
+                n++;
+            }
+        }
+
+        if (NULL == strchr(pos, '\n')) {
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return n;
+}
+
+/**
+ * @brief Set the default time to wait for MLD to exit when a session is
+ *        stopped, before it is killed.
+ *
+ * @param [in] timeout_ms Stop timeout in milliseconds.
+ */
+void mldproc_set_stop_timeout(uint32_t timeout_ms)
+{
+    pthread_mutex_lock(&mutex);
+    stop_timeout_ms = timeout_ms;
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Set the stall watchdog. A session whose log files haven't changed
+ *        within the window is reported as stalled, and optionally restarted.
+ *
+ * @param [in] window_ms Time without output until a session is stalled, 0 to
+ *                       disable the watchdog unless set for a session.
+ * @param [in] restart   Set to restart stalled sessions.
+ */
+void mldproc_set_stall(uint32_t window_ms, int restart)
+{
+    pthread_mutex_lock(&mutex);
+    stall_window_ms = window_ms;
+    stall_restart = restart;
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Start a MLD log session, now or after a delay. A session with
+ *        limits is stopped when it has run for the max duration or written
+ *        the max output, whichever comes first.
+ *
+ * @param [in] name  Unique session name.
+ * @param [in] cmd   MLD command-line (without log file name).
+ * @param [in] opt   Spawn options for the MLD process, or NULL to inherit the
+ *                   scheduling and resource limits of the proxy.
+ * @param [in] limit Start delay and limits, or NULL for none.
+ *
+ * @return Returns 0 at success, or -1 at failure. A delayed start succeeds
+ *         when it is scheduled.
+ */
+int mldproc_start(const char *name, const char *cmd,
+                  const struct spawnopt *opt, const struct mldlimit *limit)
+{
+    int rc;
+
+    pthread_mutex_lock(&mutex);
+
+    if (limit && limit->delay_ms > 0) {
+        rc = schedule_start(name, cmd, opt, limit);
+    } else {
+        rc = start_session(name, cmd, opt);
+        if (0 == rc) {
+            set_limits(tail, limit);
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Start a MLD log session from a command-line already split into
+ *        arguments, e.g. filled in from a session template. A scheduled
+ *        start keeps the command-line instead.
+ *
+ * @param [in]     name  Unique session name.
+ * @param [in out] args  MLD arguments, the last one being the log directory.
+ * @param [in]     opt   Spawn options for the MLD process (may be NULL).
+ * @param [in]     limit Schedule and limits of the session (may be NULL).
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int mldproc_start_args(const char *name, struct mldargs *args,
+                       const struct spawnopt *opt,
+                       const struct mldlimit *limit)
+{
+    int rc;
+
+    if (NULL == name || NULL == args || 0 == args->argc) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    if (limit && limit->delay_ms > 0) {
+        rc = schedule_start(name, args->cmd, opt, limit);
+    } else {
+        rc = spawn_session(name, args, opt);
+        if (0 == rc) {
+            set_limits(tail, limit);
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Get the MLD CPU that a command-line argument names, used in the
+ *        log file name.
+ *
+ * @param [in] arg Command-line or argument.
+ *
+ * @return Returns "acc", "app", or an empty string for none.
+ */
+const char * mldproc_cpu(const char *arg)
+{
+    if (strstr(arg, MACC)) {
+        return "acc";
+    } else if (strstr(arg, MAPP)) {
+        return "app";
+    }
+
+    return "";
+}
+
+/**
+ * @brief Stop a MLD log session. MLD is asked to terminate and the call
+ *        returns when it has exited. If it doesn't exit within the timeout it
+ *        is killed. The response buffer will be populated by the session name
+ *        and the time it took to drain, e.g. "name drain_ms=12". A session
+ *        not yet started is cancelled, e.g. "name cancelled".
+ *
+ * @param [in]  name       Unique session name.
+ * @param [in]  timeout_ms Time to wait before MLD is killed, 0 for default.
+ * @param [out] resp       Response buffer.
+ * @param [in]  len        Length of response buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int mldproc_stop(const char *name, uint32_t timeout_ms, char *resp,
+                 uint32_t len)
+{
+    int rc;
+
+    if (NULL == name || NULL == resp) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    if (cancel_scheduled(name, resp, len) > 0) {
+        rc = 0;
+    } else {
+        rc = stop_sessions(name, timeout_ms ? timeout_ms : stop_timeout_ms,
+                           resp, len);
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Stop all MLD log sessions in parallel, and cancel those not yet
+ *        started. The response buffer will be populated by one line per
+ *        session, as for mldproc_stop().
+ *
+ * @param [in]  timeout_ms Time to wait before MLD is killed, 0 for default.
+ * @param [out] resp       Response buffer.
+ * @param [in]  len        Length of response buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int mldproc_stop_all(uint32_t timeout_ms, char *resp, uint32_t len)
+{
+    int rc;
+
+    if (NULL == resp) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+    (void)cancel_scheduled(NULL, resp, len);
+    rc = stop_sessions(NULL, timeout_ms ? timeout_ms : stop_timeout_ms, resp,
+                       len);
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Get the log file of a running session.
+ *
+ * @param [in]  name Session name.
+ * @param [out] path Destination buffer.
+ * @param [in]  len  Size of the destination buffer.
+ *
+ * @return Returns 0 at success, or -1 if the session isn't running or its
+ *         log file isn't known.
+ */
+int mldproc_logpath(const char *name, char *path, uint32_t len)
+{
+    struct session *prev;
+    struct session *p;
+    int rc = -1;
+
+    pthread_mutex_lock(&mutex);
+
+    p = get_session(name, &prev);
+
+    if (p && !p->stopping && p->logpath[0] != '\0') {
+        snprintf(path, len, "%s", p->logpath);
+        rc = 0;
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Query for a MLD log session. The response buffer will be populated
+ *        by active session names sperated by space.
+ *
+ * @param [out] resp Response buffer.
+ * @param [in]  len  Length of response buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int mldproc_query(char *resp, uint32_t len)
+{
+    struct session *p;
+    uint32_t n = 0;
+    int rc = 0;
+
+    if (NULL == resp) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    p = head;
+
+    while (p) {
+        size_t namelen = strlen(p->name) + 1; // + 1 for space separator.
+        if ((namelen + n) >= len) {
+            ALOGE("%s:%d: Not enough space in the response buffer", _FILE,
+                  __LINE__);
+            rc = -1;
+            break;
+        }
+
+        // Separate session names with space.
+        if (n > 0) {
+            strcat(resp, " ");
+        }
+
+        // Add session name and update position.
+        strcat(resp, p->name);
+        n += namelen;
+
+        p = p->next;
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Query resource usage of all MLD log sessions. The response buffer
+ *        will be populated by a header line followed by one line per session
+ *        with the most recently sampled values.
+ *
+ * @param [out] resp Response buffer.
+ * @param [in]  len  Length of response buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int mldproc_query_verbose(char *resp, uint32_t len)
+{
+    struct session *p;
+    uint32_t pos;
+
+    if (NULL == resp || 0 == len) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    pos = snprintf(resp, len, "%s", QUERY_HEADER);
+
+    pthread_mutex_lock(&mutex);
+
+    for (p = head; p && pos < len; p = p->next) {
+        pos += snprintf(resp + pos, len - pos, "\n%s %d %llu %llu %llu %llu",
+                        p->name, p->pid,
+                        (unsigned long long)p->stat.cpu_ms,
+                        (unsigned long long)p->stat.rss_kb,
+                        (unsigned long long)p->stat.wchar,
+                        (unsigned long long)p->stat.uptime_s);
+
+        // Cgroup accounting includes any processes forked by MLD.
+        if (pos >= len) {
+            break;
+        } else if (p->cgroup) {
+            pos += snprintf(resp + pos, len - pos, " %llu %llu",
+                            (unsigned long long)p->cg_cpu_ms,
+                            (unsigned long long)p->cg_mem_kb);
+        } else {
+            pos += snprintf(resp + pos, len - pos, " - -");
+        }
+
+        if (pos >= len) {
+            break;
+        } else if (p->watch) {
+            pos += snprintf(resp + pos, len - pos, " %d", p->stalled);
+        } else {
+            pos += snprintf(resp + pos, len - pos, " -");
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    if (pos >= len) {
+        ALOGE("%s:%d: Not enough space in the response buffer", _FILE,
+              __LINE__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Start a MLD log session. Called with the session list locked.
+ *
+ * @param [in] name Unique session name.
+ * @param [in] cmd  MLD command-line (without log file name).
+ * @param [in] opt  Spawn options for the MLD process (may be NULL).
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int start_session(const char *name, const char *cmd,
+                         const struct spawnopt *opt)
+{
+    struct mldargs args;
+
+    if (NULL == name || NULL == cmd) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    snprintf(args.cmd, sizeof(args.cmd), "%s", cmd);
+    snprintf(args.buf, sizeof(args.buf), "%s", cmd);
+
+    // Split the MLD command-line.
+    if (split_cmd_line(args.buf, args.argv, MAX_ARGC, &args.argc) == -1) {
+        ALOGE("%s:%d: Missing MLD arguments", _FILE, __LINE__);
+        return -1;
+    }
+
+    args.mcpu = mldproc_cpu(cmd);
+
+    return spawn_session(name, &args, opt);
+}
+
+/**
+ * @brief Start a MLD log session from a split command-line. Called with the
+ *        session list locked.
+ *
+ * @param [in]     name Unique session name.
+ * @param [in out] args MLD arguments, the last one being the log directory.
+ * @param [in]     opt  Spawn options for the MLD process (may be NULL).
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int spawn_session(const char *name, struct mldargs *args,
+                         const struct spawnopt *opt)
+{
+    struct tm *time;
+    char log_path[CMD_LINE_LENGTH];
+    char log_dir[CMD_LINE_LENGTH];
+    char *log_file;
+    char **argv = args->argv;
+    uint32_t argc = args->argc;
+    pid_t pid;
+    int procs = -1, taken;
+    struct procstat stat;
+    uint64_t start_us = get_monotonic_us();
+
+    // Make sure the session name doesn't already exist.
+    if (session_active(name) || session_scheduled(name)) {
+        ALOGE("%s:%d: Session name already exist (name: %s)", _FILE, __LINE__,
+              name);
+        return -1;
+    }
+
+    time = get_time();
+
+    // Complete the log directory with a log file name.
+    if (time) {
+        snprintf(log_path, sizeof(log_path),
+                 "%s/%04d-%02d-%02d_%02dh%02dm%02ds_%s.log", argv[argc - 1],
+                 time->tm_year + 1900, time->tm_mon + 1, time->tm_mday,
+                 time->tm_hour, time->tm_min, time->tm_sec, args->mcpu);
+    } else {
+        snprintf(log_path, sizeof(log_path), "%s/log_%s.log", argv[argc - 1],
+                 args->mcpu);
+    }
+
+    argv[argc - 1] = log_path;
+
+    // Create the log directory. The log file is created by MLD, unless one
+    // was preallocated.
+    snprintf(log_dir, sizeof(log_dir), "%s", argv[argc - 1]);
+    log_file = strrchr(log_dir, PATH_DELIM);
+
+    if (NULL == log_file) {
+        ALOGE("%s:%d: Missing MLD log path", _FILE, __LINE__);
+        return -1;
+    }
+
+    *log_file++ = '\0';
+
+    if (logdir_prepare(('\0' == log_dir[0]) ? "/" : log_dir) == -1) {
+        ALOGE("%s:%d: Failed to create MLD log path", _FILE, __LINE__);
+        return -1;
+    }
+
+    // Make sure MLD doesn't start as a demon.
+    if (add_mld_option(MLD_OPT_DONT_DEMONIZE, argv, &argc) == -1) {
+        ALOGE("%s:%d: Failed to add mandatory MLD option", _FILE, __LINE__);
+        return -1;
+    }
+
+    // Finalize the option vector for execve() call.
+    argv[0] = MLD_BIN;
+    argv[argc] = NULL;
+
+    // Confine the session to its own cgroup if available.
+    if (!cgroup_enabled()) {
+        if (opt && (opt->cpu_max[0] || opt->memory_max[0] || opt->io_max[0])) {
+            ALOGD("%s:%d: Cgroup limits ignored (name: %s)", _FILE, __LINE__,
+                  name);
+        }
+    } else {
+        if (cgroup_create(name, opt) == -1) {
+            ALOGE("%s:%d: Failed to create cgroup (name: %s)", _FILE,
+                  __LINE__, name);
+            return -1;
+        }
+
+        if ((procs = cgroup_open_procs(name)) == -1) {
+            (void)cgroup_remove(name);
+            return -1;
+        }
+    }
+
+    // Hand the preallocated file to MLD only once nothing else can fail.
+    taken = (logdir_take(('\0' == log_dir[0]) ? "/" : log_dir, log_file)
+             == 0);
+
+    // Create a new process for MLD.
+    if ((pid = fork()) == -1) {
+        ALOGE("%s:%d: Failed to create process for MLD", _FILE, __LINE__);
+        if (taken) {
+            logdir_discard(('\0' == log_dir[0]) ? "/" : log_dir, log_file);
+        }
+        if (procs != -1) {
+            close(procs);
+            (void)cgroup_remove(name);
+        }
+        return -1;
+    }
+
+    if (0 == pid) {
+        // Close inherited open file descriptor in the new child process.
+        cmdserver_closefd();
+
+        // Join the session cgroup, children of MLD will be members as well.
+        if (procs != -1 && write(procs, "0", 1) != 1) {
+            ALOGE("%s:%d: Failed to join cgroup", _FILE, __LINE__);
+        }
+
+        // Apply scheduling and resource options before MLD is started.
+        spawnopt_apply(opt);
+
+        // Execute the MLD binary with the provided arguments.
+        if (execve(MLD_BIN, argv, NULL) == -1) {
+            ALOGE("%s:%d: Failed to execute MLD", _FILE, __LINE__);
+        }
+
+        // In case execve() fails.
+        _exit(1);
+    } else {
+        if (procs != -1) {
+            close(procs);
+        }
+
+        // Store MLD session.
+        if (add_session(pid, name, procs != -1) == -1) {
+            ALOGE("%s:%d: Failed store session (name: %s)", _FILE, __LINE__,
+                  name);
+            // Don't leave an MLD running that can't be stopped.
+            (void)kill(pid, SIGKILL);
+            return -1;
+        }
+
+        // The start time identifies the process when it is re-adopted.
+        if (procstat_read(pid, &stat) == 0) {
+            tail->stat = stat;
+        }
+
+        // Keep what is needed to restart the session.
+        snprintf(tail->cmd, sizeof(tail->cmd), "%s", args->cmd);
+        snprintf(tail->logpath, sizeof(tail->logpath), "%s", argv[argc - 1]);
+        if (opt) {
+            tail->opt = *opt;
+        }
+
+        logindex_follow(tail->logpath);
+
+        watch_output(tail, ('\0' == log_dir[0]) ? "/" : log_dir, log_file);
+
+        if (journal_start(name, pid, tail->stat.starttime, procs != -1,
+                          tail->logpath) == -1) {
+            ALOGE("%s:%d: Failed to journal session (name: %s)", _FILE,
+                  __LINE__, name);
+        }
+
+        metrics_observe(METRICS_SPAWN, get_monotonic_us() - start_us);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Stop MLD log sessions. Called with the session list locked, which
+ *        is released while waiting. All sessions are signalled before
+ *        waiting, so they drain in parallel. Sessions that haven't exited
+ *        when the timeout expires are killed.
+ *
+ * @param [in]  name       Unique session name, or NULL for all sessions.
+ * @param [in]  timeout_ms Time to wait for exit before MLD is killed.
+ * @param [out] resp       Response buffer.
+ * @param [in]  len        Length of response buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int stop_sessions(const char *name, uint32_t timeout_ms, char *resp,
+                         uint32_t len)
+{
+    struct session **targets;
+    struct session *p, *prev;
+    uint32_t i, n = 0, count = 0, killed = 0;
+    uint64_t now, drain;
+    size_t pos;
+
+    if (name) {
+        p = get_session(name, &prev);
+
+        if (NULL == p) {
+            ALOGE("%s:%d: Session not active (name: %s)", _FILE, __LINE__,
+                  name);
+            return -1;
+        } else if (p->stopping) {
+            ALOGE("%s:%d: Session already stopping (name: %s)", _FILE,
+                  __LINE__, name);
+            return -1;
+        }
+    }
+
+    for (p = head; p; p = p->next) {
+        count++;
+    }
+
+    targets = malloc(sizeof(*targets) * (count ? count : 1));
+
+    if (NULL == targets) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        return -1;
+    }
+
+    now = get_monotonic_ms();
+
+    // Ask MLD to flush and exit. Sessions stopped by others are skipped.
+    for (p = head; p; p = p->next) {
+        if ((name && strcmp(p->name, name) != 0) || p->stopping) {
+            continue;
+        }
+
+        p->stopping = 1;
+        p->stop_ms = now;
+
+        if (!p->exited && kill(p->pid, SIGTERM) == -1) {
+            ALOGE("%s:%d: Failed to send termination signal (name: %s, pid: %d)",
+                  _FILE, __LINE__, p->name, p->pid);
+        }
+
+        targets[n++] = p;
+    }
+
+    wait_exited(targets, n, now + timeout_ms);
+
+    // Escalate for sessions that didn't exit in time.
+    for (i = 0; i < n; i++) {
+        if (!targets[i]->exited) {
+            kill_session(targets[i]);
+            killed++;
+        }
+    }
+
+    if (killed) {
+        wait_exited(targets, n, get_monotonic_ms() + KILL_TIMEOUT_MS);
+    }
+
+    now = get_monotonic_ms();
+    pos = strlen(resp);
+
+    for (i = 0; i < n; i++) {
+        p = targets[i];
+        // Sessions that exited on their own before the stop have no drain.
+        drain = (p->exited ? p->exit_ms : now);
+        drain = (drain > p->stop_ms) ? drain - p->stop_ms : 0;
+
+        if (pos < len) {
+            pos += snprintf(resp + pos, len - pos, "%s%s drain_ms=%llu%s",
+                            (pos > 0) ? "\n" : "", p->name,
+                            (unsigned long long)drain,
+                            p->killed ? " killed" : "");
+        }
+    }
+
+    // Sweep any processes left behind by MLD. Removing a cgroup waits for
+    // it to be empty, so the session list is unlocked meanwhile. Stopping
+    // sessions stay listed, so their names can't be reused until removed.
+    pthread_mutex_unlock(&mutex);
+
+    for (i = 0; i < n; i++) {
+        if (targets[i]->cgroup) {
+            (void)cgroup_kill(targets[i]->name);
+            (void)cgroup_remove(targets[i]->name);
+        }
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    for (i = 0; i < n; i++) {
+        if (remove_session(targets[i]->name) == -1) {
+            ALOGE("%s:%d: Failed to remove session (name: %s)", _FILE,
+                  __LINE__, targets[i]->name);
+        }
+    }
+
+    free(targets);
+
+    return 0;
+}
+
+/**
+ * @brief Schedule a MLD log session to be started after its delay. Called
+ *        with the session list locked.
+ *
+ * @param [in] name  Unique session name.
+ * @param [in] cmd   MLD command-line (without log file name).
+ * @param [in] opt   Spawn options for the MLD process (may be NULL).
+ * @param [in] limit Start delay and limits.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int schedule_start(const char *name, const char *cmd,
+                          const struct spawnopt *opt,
+                          const struct mldlimit *limit)
+{
+    char start[SCHED_LEN];
+    struct sched *s;
+
+    if (NULL == name || NULL == cmd) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    if (session_active(name) || session_scheduled(name)) {
+        ALOGE("%s:%d: Session name already exist (name: %s)", _FILE, __LINE__,
+              name);
+        return -1;
+    }
+
+    if ((s = new_sched(name, SCHED_START, 0)) == NULL) {
+        return -1;
+    }
+
+    snprintf(s->cmd, sizeof(s->cmd), "%s", cmd);
+
+    if (opt) {
+        s->opt = *opt;
+    } else {
+        spawnopt_init(&s->opt);
+    }
+
+    s->limit = *limit;
+    s->limit.delay_ms = 0;
+    s->due_ms = get_realtime_ms() + limit->delay_ms;
+
+    s->next = scheduled;
+    scheduled = s;
+
+    (void)timerwheel_add(&s->timer, limit->delay_ms);
+
+    if (format_sched(s, start, sizeof(start)) == -1 ||
+            journal_schedule(name, start) == -1) {
+        ALOGE("%s:%d: Failed to journal scheduled session (name: %s)", _FILE,
+              __LINE__, name);
+    }
+
+    ALOGD("%s:%d: Scheduled log session (name: %s, delay_ms: %llu)", _FILE,
+          __LINE__, name, (unsigned long long)limit->delay_ms);
+
+    return 0;
+}
+
+/**
+ * @brief Cancel sessions not yet started. Called with the session list
+ *        locked. One line per session is added to the response buffer.
+ *
+ * @param [in]     name Session name, or NULL for all sessions.
+ * @param [in out] resp Response buffer.
+ * @param [in]     len  Length of response buffer.
+ *
+ * @return Returns the number of cancelled sessions.
+ */
+static int cancel_scheduled(const char *name, char *resp, uint32_t len)
+{
+    struct sched **pp = &scheduled;
+    struct sched *s;
+    size_t pos = strlen(resp);
+    int n = 0;
+
+    while ((s = *pp)) {
+        if (name && strcmp(s->name, name) != 0) {
+            pp = &s->next;
+            continue;
+        }
+
+        *pp = s->next;
+
+        if (pos < len) {
+            pos += snprintf(resp + pos, len - pos, "%s%s cancelled",
+                            (pos > 0) ? "\n" : "", s->name);
+        }
+
+        (void)journal_stop(s->name);
+
+        // An expired start is freed when run, it is no longer listed.
+        if (timerwheel_cancel(&s->timer) == 0) {
+            pool_free(&sched_pool, s);
+        }
+
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * @brief Format a scheduled start as "<due> <max_ms> <max_bytes> <stall_ms>
+ *        [<key>=<value> ...] -- <cmd>", with the spawn options as keys and
+ *        the start in calendar time, to be journaled or handed over.
+ *
+ * @param [in]  s   Scheduled start.
+ * @param [out] buf Destination buffer.
+ * @param [in]  len Length of destination buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int format_sched(const struct sched *s, char *buf, uint32_t len)
+{
+    char opts[SCHED_LEN];
+    int n;
+
+    if (spawnopt_format(&s->opt, opts, sizeof(opts)) == -1) {
+        return -1;
+    }
+
+    n = snprintf(buf, len, "%llu %llu %llu %llu %s%s%s%s",
+                 (unsigned long long)s->due_ms,
+                 (unsigned long long)s->limit.max_ms,
+                 (unsigned long long)s->limit.max_bytes,
+                 (unsigned long long)s->limit.stall_ms, opts,
+                 ('\0' == opts[0]) ? "" : " ", SCHED_CMD_MARK, s->cmd);
+
+    if (n < 0 || (uint32_t)n >= len) {
+        ALOGE("%s:%d: Scheduled start too long (name: %s)", _FILE, __LINE__,
+              s->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Schedule a start formatted by format_sched() again. A start that
+ *        is already due is run at once. Called with the session list locked.
+ *
+ * @param [in] name  Unique session name.
+ * @param [in] sched Scheduled start.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int restore_sched(const char *name, const char *sched)
+{
+    char opts[SCHED_LEN];
+    unsigned long long due, max_ms, max_bytes, stall_ms;
+    const char *cmd;
+    struct spawnopt opt;
+    struct mldlimit limit;
+    uint64_t now = get_realtime_ms();
+    int end;
+
+    if (sscanf(sched, "%llu %llu %llu %llu %n", &due, &max_ms, &max_bytes,
+               &stall_ms, &end) != 4) {
+        ALOGE("%s:%d: Bad scheduled start (name: %s)", _FILE, __LINE__, name);
+        return -1;
+    }
+
+    // The spawn options are single words, the command-line follows them.
+    cmd = sched + end;
+
+    while (strncmp(cmd, SCHED_CMD_MARK, strlen(SCHED_CMD_MARK)) != 0) {
+        if (NULL == (cmd = strchr(cmd, ' '))) {
+            ALOGE("%s:%d: Bad scheduled start (name: %s)", _FILE, __LINE__,
+                  name);
+            return -1;
+        }
+        cmd++;
+    }
+
+    snprintf(opts, sizeof(opts), "%.*s", (int)(cmd - (sched + end)),
+             sched + end);
+
+    if (spawnopt_parse(&opt, opts) == -1) {
+        return -1;
+    }
+
+    limit.delay_ms = (due > now) ? due - now : 0;
+    limit.max_ms = max_ms;
+    limit.max_bytes = max_bytes;
+    limit.stall_ms = stall_ms;
+
+    return schedule_start(name, cmd + strlen(SCHED_CMD_MARK), &opt, &limit);
+}
+
+/**
+ * @brief Apply the limits of a started session and start watching it for
+ *        stalls. Called with the session list locked.
+ *
+ * @param [in out] p     Session.
+ * @param [in]     limit Limits, or NULL for none.
+ */
+static void set_limits(struct session *p, const struct mldlimit *limit)
+{
+    if (limit) {
+        p->limit = *limit;
+        p->limit.delay_ms = 0;
+    }
+
+    p->max_bytes = p->limit.max_bytes;
+    p->stall_ms = p->limit.stall_ms ? p->limit.stall_ms : stall_window_ms;
+
+    // Journaled to be kept when the session is re-adopted.
+    if (p->limit.max_ms || p->max_bytes || p->limit.stall_ms) {
+        (void)journal_limit(p->name, p->limit.max_ms ?
+                            get_realtime_ms() + p->limit.max_ms : 0,
+                            p->max_bytes, p->limit.stall_ms);
+    }
+
+    // Only sessions with tracked output can be found stalled.
+    if (p->stall_ms > 0 && p->wd != -1) {
+        if ((p->watch = new_sched(p->name, SCHED_STALL, p->id)) == NULL) {
+            ALOGE("%s:%d: Session not watched for stalls (name: %s)", _FILE,
+                  __LINE__, p->name);
+        } else {
+            (void)timerwheel_add(&p->watch->timer, p->stall_ms);
+        }
+    }
+
+    if (0 == p->limit.max_ms) {
+        return;
+    }
+
+    if ((p->deadline = new_sched(p->name, SCHED_STOP, p->id)) == NULL) {
+        ALOGE("%s:%d: Session runs without max duration (name: %s)", _FILE,
+              __LINE__, p->name);
+        return;
+    }
+
+    (void)timerwheel_add(&p->deadline->timer, p->limit.max_ms);
+}
+
+/**
+ * @brief Request a session to be stopped, as it has reached a limit. Called
+ *        with the session list locked.
+ *
+ * @param [in out] p Session.
+ */
+static void request_stop(struct session *p)
+{
+    struct sched *s;
+
+    if ((s = new_sched(p->name, SCHED_STOP, p->id)) == NULL) {
+        return;
+    }
+
+    if (executor_submit(p->name, run_sched, s) == -1) {
+        pool_free(&sched_pool, s);
+        return;
+    }
+
+    p->limited = 1;
+}
+
+/**
+ * @brief Allocate a scheduled action.
+ *
+ * @param [in] name Session name.
+ * @param [in] op   Action.
+ * @param [in] id   Session to stop or check.
+ *
+ * @return Returns the action, or NULL at failure.
+ */
+static struct sched * new_sched(const char *name, enum sched_op op,
+                                uint64_t id)
+{
+    struct sched *s = pool_alloc(&sched_pool);
+
+    if (NULL == s) {
+        return NULL;
+    }
+
+    memset(s, 0, sizeof(*s));
+
+    s->op = op;
+    s->id = id;
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    timerwheel_setup(&s->timer, sched_expired, s);
+
+    return s;
+}
+
+/**
+ * @brief Hand an expired action to the executor, called from the event loop
+ *        thread.
+ *
+ * @param [in] arg Scheduled action.
+ */
+static void sched_expired(void *arg)
+{
+    struct sched *s = arg;
+
+    if (executor_submit(s->name, run_sched, s) == -1) {
+        ALOGE("%s:%d: Failed to queue scheduled action (name: %s)", _FILE,
+              __LINE__, s->name);
+        (void)timerwheel_add(&s->timer, SCHED_RETRY_MS);
+    }
+}
+
+/**
+ * @brief Start, stop or check a session as scheduled, called from an
+ *        executor thread. Nothing is done for a cancelled start, or for a
+ *        session already stopped.
+ *
+ * @param [in] arg Scheduled action, freed when done.
+ */
+static void run_sched(void *arg)
+{
+    struct sched *s = arg;
+    struct sched **pp;
+    struct session *p, *prev;
+    char resp[RESP_LENGTH];
+
+    pthread_mutex_lock(&mutex);
+
+    p = get_session(s->name, &prev);
+
+    if (p && p->id != s->id) {
+        p = NULL;
+    }
+
+    if (SCHED_START == s->op) {
+        pp = &scheduled;
+        while (*pp && *pp != s) {
+            pp = &(*pp)->next;
+        }
+
+        if (*pp) {
+            *pp = s->next;
+            if (start_session(s->name, s->cmd, &s->opt) == 0) {
+                set_limits(tail, &s->limit);
+            } else {
+                ALOGE("%s:%d: Failed to start scheduled session (name: %s)",
+                      _FILE, __LINE__, s->name);
+                (void)journal_stop(s->name);
+            }
+        }
+    } else if (SCHED_STALL == s->op) {
+        // The check stays scheduled while the session is watched.
+        if (p && p->watch == s && check_stall(p, s) == 0) {
+            s = NULL;
+        }
+    } else if (p) {
+        if (p->deadline == s) {
+            p->deadline = NULL;
+        }
+
+        if (!p->stopping) {
+            resp[0] = '\0';
+            (void)stop_sessions(s->name, stop_timeout_ms, resp, sizeof(resp));
+            ALOGD("%s:%d: %s: %s", _FILE, __LINE__, (SCHED_REAP == s->op) ?
+                  "Exited session removed" : "Session limit reached", resp);
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    pool_free(&sched_pool, s);
+}
+
+/**
+ * @brief Check if a session has produced output within its stall window. A
+ *        stalled session is reported, and restarted if configured. Called
+ *        with the session list locked.
+ *
+ * @param [in out] p Session.
+ * @param [in]     s Stall check of the session.
+ *
+ * @return Returns 0 if the check is scheduled again, or -1 if the session is
+ *         no longer watched.
+ */
+static int check_stall(struct session *p, struct sched *s)
+{
+    char status[CMD_LINE_LENGTH + 32];
+    uint64_t idle = get_monotonic_ms() - p->output_ms;
+
+    // Check again when the window since the last output has passed.
+    if (p->stopping) {
+        (void)timerwheel_add(&s->timer, p->stall_ms);
+        return 0;
+    } else if (idle < p->stall_ms) {
+        (void)timerwheel_add(&s->timer, p->stall_ms - idle);
+        return 0;
+    }
+
+    if (!p->stalled) {
+        p->stalled = 1;
+        ALOGE("%s:%d: MLD stalled (name: %s, pid: %d, idle_ms: %llu)", _FILE,
+              __LINE__, p->name, p->pid, (unsigned long long)idle);
+        snprintf(status, sizeof(status), "STATUS=Log session %s stalled",
+                 p->name);
+        (void)activation_notify(status);
+    }
+
+    if (stall_restart && p->cmd[0] != '\0') {
+        p->watch = NULL;
+        restart_session(p);
+        return -1;
+    }
+
+    (void)timerwheel_add(&s->timer, p->stall_ms);
+
+    return 0;
+}
+
+/**
+ * @brief Restart a stalled session with the same command-line, options and
+ *        remaining limits. Called with the session list locked.
+ *
+ * @param [in] p Session, removed when stopped.
+ */
+static void restart_session(struct session *p)
+{
+    char name[CMD_LINE_LENGTH];
+    char cmd[CMD_LINE_LENGTH];
+    char resp[RESP_LENGTH];
+    struct spawnopt opt = p->opt;
+    struct mldlimit limit = p->limit;
+    uint64_t elapsed = get_monotonic_ms() - p->start_ms;
+
+    // A session at its max duration is stopped instead.
+    if (limit.max_ms > 0) {
+        if (elapsed >= limit.max_ms) {
+            return;
+        }
+        limit.max_ms -= elapsed;
+    }
+
+    snprintf(name, sizeof(name), "%s", p->name);
+    snprintf(cmd, sizeof(cmd), "%s", p->cmd);
+
+    resp[0] = '\0';
+    (void)stop_sessions(name, stop_timeout_ms, resp, sizeof(resp));
+
+    if (start_session(name, cmd, &opt) == -1) {
+        ALOGE("%s:%d: Failed to restart stalled session (name: %s)", _FILE,
+              __LINE__, name);
+        return;
+    }
+
+    set_limits(tail, &limit);
+
+    ALOGD("%s:%d: Restarted stalled session (name: %s, pid: %d)", _FILE,
+          __LINE__, name, tail->pid);
+}
+
+/**
+ * @brief Track the output of a session from changes in its log directory.
+ *        Called with the session list locked.
+ *
+ * @param [in out] p    Session.
+ * @param [in]     dir  Log directory.
+ * @param [in]     file Log file name.
+ */
+static void watch_output(struct session *p, const char *dir,
+                         const char *file)
+{
+    char *ext;
+
+    p->output_ms = get_monotonic_ms();
+
+    if (-1 == notify_fd) {
+        return;
+    }
+
+    // MLD may rotate the log to files named after it.
+    snprintf(p->logname, sizeof(p->logname), "%s", file);
+
+    if ((ext = strrchr(p->logname, '.')) != NULL) {
+        *ext = '\0';
+    }
+
+    // Sessions logging to the same directory share the watch.
+    if ((p->wd = inotify_add_watch(notify_fd, dir, IN_MODIFY)) == -1) {
+        ALOGE("%s:%d: Failed to watch log directory %s (errno=%d)", _FILE,
+              __LINE__, dir, errno);
+    }
+}
+
+/**
+ * @brief Stop tracking the output of a removed session. Called with the
+ *        session list locked.
+ *
+ * @param [in out] p Session, no longer listed.
+ */
+static void unwatch_output(struct session *p)
+{
+    struct session *q;
+
+    if (p->wd != -1) {
+        for (q = head; q; q = q->next) {
+            if (q->wd == p->wd) {
+                break;
+            }
+        }
+
+        if (NULL == q) {
+            (void)inotify_rm_watch(notify_fd, p->wd);
+        }
+    }
+}
+
+/**
+ * @brief Note the time of output for the sessions whose log files changed.
+ *
+ * @param [in] fd     Inotify instance.
+ * @param [in] events <Not in use>.
+ * @param [in] arg    <Not in use>.
+ */
+static void output_changed(int fd, uint32_t events, void *arg)
+{
+    char buf[NOTIFY_BUF_LEN]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    struct session *p;
+    uint64_t now;
+    ssize_t n, pos;
+
+    UNUSED(events);
+    UNUSED(arg);
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        now = get_monotonic_ms();
 
-// Forward declarations.
-static int add_session(pid_t pid, const char *name);
-static struct session * get_session(const char *name, struct session **prev);
-static int remove_session(const char *name);
-static int session_active(const char *name);
-static int add_mld_option(const char *option, char *argv[], uint32_t *argc);
-static int mkpath(const char *path, mode_t mode);
+        pthread_mutex_lock(&mutex);
 
-/*============================================================================
- * Public functions
- *============================================================================
- */
+        for (pos = 0; pos < n; pos += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)(buf + pos);
+
+            for (p = head; p; p = p->next) {
+                // Events may have been lost, count it as output of all.
+                if (!(ev->mask & IN_Q_OVERFLOW) && (p->wd != ev->wd ||
+                        0 == ev->len || strncmp(ev->name, p->logname,
+                                                strlen(p->logname)) != 0)) {
+                    continue;
+                }
+
+                p->output_ms = now;
+
+                if (p->stalled) {
+                    p->stalled = 0;
+                    ALOGD("%s:%d: MLD output resumed (name: %s)", _FILE,
+                          __LINE__, p->name);
+                }
+            }
+        }
+
+        pthread_mutex_unlock(&mutex);
+    }
+}
 
 /**
- * @brief Start a MLD log session.
+ * @brief Wait until the sessions have exited. Called with the session list
+ *        locked, the lock is released while waiting.
  *
- * @param [in] name Unique session name.
- * @param [in] cmd  MLD command-line (without log file name).
+ * @param [in] targets     Sessions to wait for.
+ * @param [in] n           Number of sessions.
+ * @param [in] deadline_ms Monotonic time to give up at.
+ */
+static void wait_exited(struct session **targets, uint32_t n,
+                        uint64_t deadline_ms)
+{
+    struct timespec ts;
+    uint32_t i;
+
+    ts.tv_sec = deadline_ms / 1000;
+    ts.tv_nsec = (deadline_ms % 1000) * 1000000L;
+
+    for (i = 0; i < n; i++) {
+        while (!targets[i]->exited) {
+            if (pthread_cond_timedwait(&exit_cond, &mutex, &ts) == ETIMEDOUT) {
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Kill a session that didn't exit in time.
  *
- * @return Returns 0 at success, or -1 at failure.
+ * @param [in out] p Session to kill.
  */
-int mldproc_start(const char *name, const char *cmd)
+static void kill_session(struct session *p)
 {
-    struct tm *time;
-    char *mcpu = "";
-    char mld_cmd[CMD_LINE_LENGTH];
-    char *argv[MAX_ARGC + 1]; // + 1 for null pointer termination.
-    uint32_t argc;
-    pid_t pid;
+    ALOGD("%s:%d: Killing session (name: %s, pid: %d)", _FILE, __LINE__,
+          p->name, p->pid);
 
-    if (NULL == name || NULL == cmd) {
-        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
-        return -1;
+    p->killed = 1;
+
+    // Killing the cgroup also reaches processes forked by MLD.
+    if (p->cgroup && cgroup_kill(p->name) == 0) {
+        return;
     }
 
-    // Make sure the session name doesn't already exist.
-    if (session_active(name)) {
-        ALOGE("%s:%d: Session name already exist (name: %s)", _FILE, __LINE__,
-              name);
-        return -1;
+    if (kill(p->pid, SIGKILL) == -1) {
+        ALOGE("%s:%d: Failed to send kill signal (name: %s, pid: %d)",
+              _FILE, __LINE__, p->name, p->pid);
     }
+}
 
-    time = get_time();
+/**
+ * @brief Mark a session as exited and wake up threads waiting for it. A
+ *        session whose MLD exited on its own is removed by the executor.
+ *        Called with the session list locked.
+ *
+ * @param [in out] p Session that has exited.
+ */
+static void mark_exited(struct session *p)
+{
+    struct sched *s;
 
-    if (strstr(cmd, MACC)) {
-        mcpu = "acc";
-    } else if (strstr(cmd, MAPP)) {
-        mcpu = "app";
-    }
+    p->exited = 1;
+    p->exit_ms = get_monotonic_ms();
 
-    // Complete the command-line with a log file name.
-    if (time) {
-        snprintf(mld_cmd, CMD_LINE_LENGTH,
-                 "%s/%04d-%02d-%02d_%02dh%02dm%02ds_%s.log", cmd,
-                 time->tm_year + 1900, time->tm_mon + 1, time->tm_mday,
-                 time->tm_hour, time->tm_min, time->tm_sec, mcpu);
-    } else {
-        snprintf(mld_cmd, CMD_LINE_LENGTH, "%s/log_%s.log", cmd, mcpu);
+    if (p->pidfd != -1) {
+        (void)evloop_del_fd(p->pidfd);
+        close(p->pidfd);
+        p->pidfd = -1;
     }
 
-    // Split the MLD command-line.
-    if (split_cmd_line(mld_cmd, argv, MAX_ARGC, &argc) == -1) {
-        ALOGE("%s:%d: Missing MLD arguments", _FILE, __LINE__);
-        return -1;
+    if (!p->stopping) {
+        ALOGE("%s:%d: MLD exited (name: %s, pid: %d)", _FILE, __LINE__,
+              p->name, p->pid);
+
+        // The session is removed as if stopped, unless restarted when found
+        // stalled.
+        if (!(stall_restart && p->watch && p->cmd[0] != '\0') &&
+                (s = new_sched(p->name, SCHED_REAP, p->id)) != NULL) {
+            sched_expired(s);
+        }
     }
 
-    // Create the log path.
-    if (mkpath(argv[argc - 1], DIR_PERM) == -1) {
-        ALOGE("%s:%d: Failed to create MLD log path", _FILE, __LINE__);
-        return -1;
+    metrics_add(p->killed ? METRICS_EXITS_KILLED : p->stopping ?
+                METRICS_EXITS_STOPPED : METRICS_EXITS_UNEXPECTED, 1);
+
+    pthread_cond_broadcast(&exit_cond);
+}
+
+/**
+ * @brief Handle exit of a MLD process signalled through its pidfd.
+ *
+ * @param [in] fd     Pidfd of the process.
+ * @param [in] events <Not in use>.
+ * @param [in] arg    <Not in use>.
+ */
+static void session_exited(int fd, uint32_t events, void *arg)
+{
+    struct session *p;
+
+    UNUSED(events);
+    UNUSED(arg);
+
+    pthread_mutex_lock(&mutex);
+
+    for (p = head; p; p = p->next) {
+        if (p->pidfd == fd) {
+            mark_exited(p);
+            break;
+        }
     }
 
-    // Make sure MLD doesn't start as a demon.
-    if (add_mld_option(MLD_OPT_DONT_DEMONIZE, argv, &argc) == -1) {
-        ALOGE("%s:%d: Failed to add mandatory MLD option", _FILE, __LINE__);
-        return -1;
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Check for exit of MLD processes that can't be watched with a pidfd.
+ *
+ * @param [in] fd     <Not in use>.
+ * @param [in] events <Not in use>.
+ * @param [in] arg    <Not in use>.
+ */
+static void poll_sessions(int fd, uint32_t events, void *arg)
+{
+    struct session *p;
+
+    UNUSED(fd);
+    UNUSED(events);
+    UNUSED(arg);
+
+    pthread_mutex_lock(&mutex);
+
+    for (p = head; p; p = p->next) {
+        if (!p->exited && -1 == p->pidfd && kill(p->pid, 0) == -1 &&
+                ESRCH == errno) {
+            mark_exited(p);
+        }
     }
 
-    // Finalize the option vector for execve() call.
-    argv[0] = MLD_BIN;
-    argv[argc] = NULL;
+    pthread_mutex_unlock(&mutex);
+}
 
-    // Create a new process for MLD.
-    if ((pid = fork()) == -1) {
-        ALOGE("%s:%d: Failed to create process for MLD", _FILE, __LINE__);
-        return -1;
+/**
+ * @brief Watch a session for exit with a pidfd. Called with the session list
+ *        locked. Exit is polled for if pidfds are not supported.
+ *
+ * @param [in out] p Session to watch.
+ */
+static void watch_session(struct session *p)
+{
+#ifdef SYS_pidfd_open
+    p->pidfd = syscall(SYS_pidfd_open, p->pid, 0);
+#else
+    p->pidfd = -1;
+    errno = ENOSYS;
+#endif
+
+    if (-1 == p->pidfd) {
+        // The process is already gone if it can't be found.
+        if (ESRCH == errno) {
+            mark_exited(p);
+        }
+        return;
     }
 
-    if (0 == pid) {
-        // Close inherited open file descriptor in the new child process.
-        cmdserver_closefd();
-        
-        // Execute the MLD binary with the provided arguments.
-        if (execve(MLD_BIN, argv, NULL) == -1) {
-            ALOGE("%s:%d: Failed to execute MLD", _FILE, __LINE__);
+    if (evloop_add_fd(p->pidfd, EPOLLIN, session_exited, NULL) == -1) {
+        close(p->pidfd);
+        p->pidfd = -1;
+    }
+}
+
+/**
+ * @brief Sample resource usage of all sessions in one batch.
+ *
+ * @param [in] fd     <Not in use>.
+ * @param [in] events <Not in use>.
+ * @param [in] arg    <Not in use>.
+ */
+static void sample_sessions(int fd, uint32_t events, void *arg)
+{
+    struct session *p;
+
+    UNUSED(fd);
+    UNUSED(events);
+    UNUSED(arg);
+
+    pthread_mutex_lock(&mutex);
+
+    for (p = head; p; p = p->next) {
+        if (p->exited) {
+            continue;
         }
 
-        // In case execve() fails.
-        _exit(1);
-    } else {
-        // Store MLD session.
-        if (add_session(pid, name) == -1) {
-            ALOGE("%s:%d: Failed store session (name: %s)", _FILE, __LINE__,
-                  name);
-            return -1;
+        if (procstat_read(p->pid, &p->stat) == -1) {
+            ALOGD("%s:%d: Failed to sample session (name: %s, pid: %d)",
+                  _FILE, __LINE__, p->name, p->pid);
+        }
+
+        if (p->cgroup) {
+            (void)cgroup_stat(p->name, &p->cg_cpu_ms, &p->cg_mem_kb);
+        }
+
+        metrics_session(p->id, p->name, &p->stat);
+
+        if (p->max_bytes > 0 && p->stat.wchar >= p->max_bytes &&
+                !p->limited && !p->stopping) {
+            request_stop(p);
         }
     }
 
-    return 0;
+    pthread_mutex_unlock(&mutex);
 }
 
 /**
- * @brief Stop a MLD log session.
- *
- * @param [in] name Unique session name.
+ * @brief Copy a journal record to a list.
  *
- * @return Returns 0 at success, or -1 at failure.
+ * @param [in]     rec Journal record.
+ * @param [in out] arg Pointer to the head of the list.
  */
-int mldproc_stop(const char *name)
+static void copy_record(const struct journal_rec *rec, void *arg)
 {
-    struct session *mld, *tmp;
+    struct journal_rec **list = (struct journal_rec **)arg;
+    struct journal_rec *copy;
 
-    if (NULL == name) {
-        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
-        return -1;
+    copy = malloc(sizeof(*copy));
+
+    if (NULL == copy || NULL == (copy->name = strdup(rec->name))) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        free(copy);
+        return;
     }
 
-    mld = get_session(name, &tmp);
+    copy->logpath = NULL;
 
-    if (mld) {
-        if (kill(mld->pid, SIGTERM) == -1) {
-            ALOGE("%s:%d: Failed to send termination signal (name: %s, pid: %d)",
-                  _FILE, __LINE__, name, mld->pid);
-        }
+    if (rec->logpath && NULL == (copy->logpath = strdup(rec->logpath))) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        free(copy->name);
+        free(copy);
+        return;
+    }
 
-        if (remove_session(name) == -1) {
-            ALOGE("%s:%d: Failed to remove session (name: %s)", _FILE,
-                  __LINE__, name);
-            return -1;
-        }
-    } else {
-        ALOGE("%s:%d: Session not active (name: %s)", _FILE, __LINE__, name);
-        return -1;
+    copy->sched = NULL;
+
+    if (rec->sched && NULL == (copy->sched = strdup(rec->sched))) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        free(copy->logpath);
+        free(copy->name);
+        free(copy);
+        return;
     }
 
-    return 0;
+    copy->pid = rec->pid;
+    copy->starttime = rec->starttime;
+    copy->cgroup = rec->cgroup;
+    copy->deadline = rec->deadline;
+    copy->max_bytes = rec->max_bytes;
+    copy->stall_ms = rec->stall_ms;
+    copy->next = *list;
+    *list = copy;
 }
 
 /**
- * @brief Query for a MLD log session. The response buffer will be populated
- *        by active session names sperated by space.
+ * @brief Check if a journaled session still runs the same MLD process. The
+ *        start time guards against reuse of the process ID.
  *
- * @param [out] resp Response buffer.
- * @param [in]  len  Length of response buffer.
+ * @param [in] rec Journal record.
  *
- * @return Returns 0 at success, or -1 at failure.
+ * @return Returns 1 if the process can be adopted, else 0.
  */
-int mldproc_query(char *resp, uint32_t len)
+static int adoptable(const struct journal_rec *rec)
 {
-    struct session *p;
-    uint32_t n = 0;
+    struct procstat stat;
+    char exe[MAX_PATH_LEN];
+
+    if (procstat_read(rec->pid, &stat) == -1 ||
+            stat.starttime != rec->starttime ||
+            procstat_exe(rec->pid, exe, sizeof(exe)) == -1 ||
+            strcmp(exe, MLD_BIN) != 0) {
+        ALOGD("%s:%d: Not adopting log session (name: %s, pid: %d)", _FILE,
+              __LINE__, rec->name, rec->pid);
+        return 0;
+    }
 
-    if (NULL == resp) {
-        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+    return 1;
+}
+
+/**
+ * @brief Adopt a running MLD process as a session, e.g. one handed over at
+ *        upgrade or journaled by an earlier instance. Its log file is
+ *        indexed and watched for output again. Called with the session list
+ *        locked.
+ *
+ * @param [in] rec Session record.
+ *
+ * @return Returns 0 at success, or -1 if the process can't be adopted.
+ */
+static int adopt_session(const struct journal_rec *rec)
+{
+    char log_dir[CMD_LINE_LENGTH];
+    char *log_file;
+    struct mldlimit limit;
+    uint64_t now = get_realtime_ms();
+
+    if (!adoptable(rec) ||
+            add_session(rec->pid, rec->name, rec->cgroup) == -1) {
         return -1;
     }
 
-    p = head;
+    tail->stat.starttime = rec->starttime;
 
-    while (p) {
-        size_t namelen = strlen(p->name) + 1; // + 1 for space separator.
-        if ((namelen + n) >= len) {
-            ALOGE("%s:%d: Not enough space in the response buffer", _FILE,
-                  __LINE__);
-            return -1;
-        }
+    // Reads, streams and archives of the session need its log file.
+    if (rec->logpath) {
+        snprintf(tail->logpath, sizeof(tail->logpath), "%s", rec->logpath);
+        logindex_follow(tail->logpath);
 
-        // Separate session names with space.
-        if (n > 0) {
-            strcat(resp, " ");
-        }
+        snprintf(log_dir, sizeof(log_dir), "%s", rec->logpath);
 
-        // Add session name and update position.
-        strcat(resp, p->name);
-        n += namelen;
+        if ((log_file = strrchr(log_dir, PATH_DELIM)) != NULL) {
+            *log_file++ = '\0';
+            watch_output(tail, ('\0' == log_dir[0]) ? "/" : log_dir,
+                         log_file);
+        }
+    }
 
-        p = p->next;
+    // The remaining time to the max duration, one that has passed stops the
+    // session at once.
+    memset(&limit, 0, sizeof(limit));
+    if (rec->deadline) {
+        limit.max_ms = (rec->deadline > now) ? rec->deadline - now : 1;
     }
+    limit.max_bytes = rec->max_bytes;
+    limit.stall_ms = rec->stall_ms;
+
+    set_limits(tail, &limit);
 
     return 0;
 }
 
-/*============================================================================
- * Private functions
- *============================================================================
- */
-
 /**
- * @brief Add a session to the list of active sessions.
+ * @brief Add a session to the list of active sessions and watch it for exit.
  *
- * @param [in] pid  Process ID of the MLD session.
- * @param [in] name Unique name of the MLD session.
+ * @param [in] pid    Process ID of the MLD session.
+ * @param [in] name   Unique name of the MLD session.
+ * @param [in] cgroup Set if the session has its own cgroup.
  *
  * @return Returns 0 at success, or -1 at failure.
  */
-static int add_session(pid_t pid, const char *name)
+static int add_session(pid_t pid, const char *name, int cgroup)
 {
     struct session *node;
 
-    node = malloc(sizeof(struct session));
+    node = pool_alloc(&session_pool);
 
     if (node) {
+        memset(&node->stat, 0, sizeof(node->stat));
+        node->cgroup = cgroup;
+        node->cg_cpu_ms = 0;
+        node->cg_mem_kb = 0;
+        node->pidfd = -1;
+        node->stopping = 0;
+        node->exited = 0;
+        node->killed = 0;
+        node->stop_ms = 0;
+        node->exit_ms = 0;
+        node->max_bytes = 0;
+        node->deadline = NULL;
+        node->limited = 0;
+        node->cmd[0] = '\0';
+        spawnopt_init(&node->opt);
+        memset(&node->limit, 0, sizeof(node->limit));
+        node->start_ms = get_monotonic_ms();
+        node->wd = -1;
+        node->logname[0] = '\0';
+        node->logpath[0] = '\0';
+        node->output_ms = node->start_ms;
+        node->stall_ms = 0;
+        node->watch = NULL;
+        node->stalled = 0;
+        node->id = ++last_id;
         node->next = NULL;
         node->pid = pid;
-        node->name = malloc(strlen(name) + 1);
-
-        if (node->name) {
-            strcpy(node->name, name);
+        snprintf(node->name, sizeof(node->name), "%s", name);
 
-            if (NULL == head) {
-                // First session.
-                head = node;
-            } else {
-                // Add session last in list.
-                tail->next = node;
-            }
-            tail = node;
+        if (NULL == head) {
+            // First session.
+            head = node;
         } else {
-            ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
-            free(node);
-            return -1;
+            // Add session last in list.
+            tail->next = node;
         }
+        tail = node;
     } else {
         ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
         return -1;
@@ -285,6 +2073,8 @@ static int add_session(pid_t pid, const char *name)
     ALOGD("%s:%d: Added log session (name: %s, pid: %d)", _FILE, __LINE__,
           node->name, node->pid);
 
+    watch_session(node);
+
     return 0;
 }
 
@@ -344,10 +2134,28 @@ static int remove_session(const char *name)
         tail = prev;
     }
 
+    (void)journal_stop(curr->name);
+
     // Delete session data.
     ALOGD("%s:%d: Removed log session (name: %s)", _FILE, __LINE__, curr->name);
-    free(curr->name);
-    free(curr);
+    if (curr->pidfd != -1) {
+        (void)evloop_del_fd(curr->pidfd);
+        close(curr->pidfd);
+    }
+
+    // Expired timers are freed when run.
+    if (curr->deadline && timerwheel_cancel(&curr->deadline->timer) == 0) {
+        pool_free(&sched_pool, curr->deadline);
+    }
+
+    if (curr->watch && timerwheel_cancel(&curr->watch->timer) == 0) {
+        pool_free(&sched_pool, curr->watch);
+    }
+
+    unwatch_output(curr);
+    metrics_session_end(curr->id);
+    logindex_unfollow(curr->logpath);
+    pool_free(&session_pool, curr);
 
     return 0;
 }
@@ -370,6 +2178,26 @@ static int session_active(const char *name)
     return 0;
 }
 
+/**
+ * @brief Check if the session is scheduled to be started.
+ *
+ * @param [in] name Session name.
+ *
+ * @return Returns 1 if it is scheduled, else 0.
+ */
+static int session_scheduled(const char *name)
+{
+    struct sched *s;
+
+    for (s = scheduled; s; s = s->next) {
+        if (strcmp(s->name, name) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 /**
  * @brief Add an option to the MLD command-line.
  *
@@ -406,74 +2234,3 @@ static int add_mld_option(const char *option, char *argv[], uint32_t *argc)
 
     return 0;
 }
-
-/**
- * @brief Create directory path.
- *
- * @param [in] path Directory path to create.
- * @param [in] mode Permission to use when creating directories.
- *
- * @return Returns 0 at success, or -1 at failure.
- */
-static int mkpath(const char *path, mode_t mode)
-{
-    const char *pos = path;
-    uint32_t len;
-    char tmp[MAX_PATH_LEN];
-    struct stat sb;
-
-    if (NULL == path) {
-        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
-        return -1;
-    }
-
-    // Check for root.
-    if (strlen(path) == 1 && PATH_DELIM == *path) {
-        return 0;
-    }
-
-    // Check each component of the path.
-    while ((pos = strchr(pos, PATH_DELIM)) != NULL) {
-        if (pos == path) {
-            // Path starts with PATH_DELIM.
-            pos++;
-            continue;
-        }
-
-        // Intermediate path length.
-        len = pos - path;
-
-        if (len >= MAX_PATH_LEN) {
-            ALOGE("%s:%d: Long path", _FILE, __LINE__);
-            return -1;
-        }
-
-        strncpy(tmp, path, len);
-        tmp[len] = '\0';
-
-        // Create component if it doesn't exist.
-        if ((stat(tmp, &sb) == -1) && (ENOENT == errno)) {
-            if (mkdir(tmp, mode) == -1) {
-                ALOGE("%s:%d: Failed to create directory (errno=%d)", _FILE,
-                      __LINE__, errno);
-                return -1;
-            }
-        }
-
-        pos++;
-    }
-
-    // If path doesn't end with PATH_DELIM we need to create one more
-    // directory.
-    if (PATH_DELIM != path[strlen(path) - 1]) {
-        if ((stat(path, &sb) == -1) && (ENOENT == errno)) {
-            if (mkdir(path, mode) == -1) {
-                ALOGE("%s:%d: Failed to create tail directory (errno=%d)",
-                      _FILE, __LINE__, errno);
-                return -1;
-            }
-        }
-    }
-
-    return 0;
-}
@@ -2,8 +2,48 @@
 #ifndef MLDPROC_H
 #define MLDPROC_H
 
-int mldproc_start(const char *name, const char *cmd);
-int mldproc_stop(const char *name);
+#include <stdint.h>
+
+struct spawnopt;
+
+// Max number and total length of the arguments of a MLD command-line.
+#define MLDARGS_MAX 64
+#define MLDARGS_LEN 256
+
+// Schedule and limits of a log session, 0 for none.
+struct mldlimit {
+    uint64_t delay_ms;  // Time until the session is started.
+    uint64_t max_ms;    // Time after which the session is stopped.
+    uint64_t max_bytes; // Output after which the session is stopped.
+    uint64_t stall_ms;  // Time without output until stalled, 0 for default.
+};
+
+// MLD command-line split into arguments, e.g. filled in from a template.
+struct mldargs {
+    char cmd[MLDARGS_LEN];       // Command-line, to schedule or restart.
+    char buf[MLDARGS_LEN];       // Arguments, each terminated.
+    char *argv[MLDARGS_MAX + 1]; // + 1 for null pointer termination.
+    uint32_t argc;
+    const char *mcpu;            // MLD CPU, named in the log file name.
+};
+
+int mldproc_init(void);
+int mldproc_recover(void);
+int mldproc_export(char *buf, uint32_t len);
+int mldproc_import(const char *table);
+int mldproc_start(const char *name, const char *cmd,
+                  const struct spawnopt *opt, const struct mldlimit *limit);
+int mldproc_start_args(const char *name, struct mldargs *args,
+                       const struct spawnopt *opt,
+                       const struct mldlimit *limit);
+const char * mldproc_cpu(const char *arg);
+void mldproc_set_stop_timeout(uint32_t timeout_ms);
+void mldproc_set_stall(uint32_t window_ms, int restart);
+int mldproc_stop(const char *name, uint32_t timeout_ms, char *resp,
+                 uint32_t len);
+int mldproc_stop_all(uint32_t timeout_ms, char *resp, uint32_t len);
+int mldproc_logpath(const char *name, char *path, uint32_t len);
 int mldproc_query(char *resp, uint32_t len);
+int mldproc_query_verbose(char *resp, uint32_t len);
 
 #endif
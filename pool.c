@@ -0,0 +1,421 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "pool.c"
+
+// Alignment of pooled objects.
+#define POOL_ALIGN 16
+
+// Size of the per-thread arena of a command.
+#define ARENA_LEN 4096
+
+// Column headers of the memory report.
+#define POOL_HEADER "POOL SIZE OBJECTS IN_USE PEAK FAILED"
+#define ARENA_HEADER "ARENAS SIZE PEAK_USED FAILED"
+#define STACK_HEADER "THREADS STACK_KB"
+#define BUFFER_HEADER "BUFFERS_KB FAILED"
+#define TOTAL_HEADER "RESERVED_KB LIMIT_KB"
+
+// Scratch memory of the command executing on a thread.
+struct arena {
+    char *base;
+    uint32_t used;
+};
+
+// Thread synchronization, protects the accounting below.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Memory reserved by slabs, arenas and buffers, and its ceiling, 0 for
+// none.
+static uint64_t reserved = 0;
+static uint64_t limit = 0;
+
+// Pools in the memory report.
+static struct pool *pools = NULL;
+
+// Arena accounting.
+static uint32_t num_arenas = 0;
+static uint32_t arena_peak = 0;
+static uint64_t arena_failed = 0;
+
+// Buffers and queued output, allocated outside the pools.
+static uint64_t buffer_bytes = 0;
+static uint64_t buffer_failed = 0;
+
+// Thread stacks.
+static uint32_t num_threads = 0;
+static uint64_t stack_bytes = 0;
+
+// Arena of the calling thread.
+static __thread struct arena arena = {NULL, 0};
+
+// Forward declarations.
+static int reserve(int64_t bytes);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Allocate an object from a pool. A slab is added when the pool is
+ *        empty, unless the memory ceiling is reached.
+ *
+ * @param [in out] pool Pool.
+ *
+ * @return Returns the object, uninitialized, or NULL at failure.
+ */
+void * pool_alloc(struct pool *pool)
+{
+    uint32_t size = (pool->size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+    char *slab, *obj;
+    uint32_t i;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (!pool->listed) {
+        pthread_mutex_lock(&mutex);
+        pool->next = pools;
+        pools = pool;
+        pthread_mutex_unlock(&mutex);
+        pool->listed = 1;
+    }
+
+    if (NULL == pool->free) {
+        slab = NULL;
+        if (reserve((uint64_t)size * pool->per_slab) == 0) {
+            slab = malloc((size_t)size * pool->per_slab);
+            if (NULL == slab) {
+                (void)reserve(-(int64_t)size * pool->per_slab);
+            }
+        }
+
+        if (NULL == slab) {
+            pool->failed++;
+            pthread_mutex_unlock(&pool->mutex);
+            ALOGE("%s:%d: Pool %s exhausted", _FILE, __LINE__, pool->name);
+            return NULL;
+        }
+
+        // Chain the new objects into the free list.
+        for (i = 0; i < pool->per_slab; i++) {
+            *(void **)(slab + i * size) = pool->free;
+            pool->free = slab + i * size;
+        }
+        pool->objects += pool->per_slab;
+    }
+
+    obj = pool->free;
+    pool->free = *(void **)obj;
+
+    if (++pool->used > pool->peak) {
+        pool->peak = pool->used;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return obj;
+}
+
+/**
+ * @brief Return an object to its pool.
+ *
+ * @param [in out] pool Pool.
+ * @param [in]     obj  Object, or NULL.
+ */
+void pool_free(struct pool *pool, void *obj)
+{
+    if (NULL == obj) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    *(void **)obj = pool->free;
+    pool->free = obj;
+    pool->used--;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * @brief Allocate scratch memory for the command executing on the calling
+ *        thread. It is released all at once by arena_reset().
+ *
+ * @param [in] size Size in bytes.
+ *
+ * @return Returns the memory, or NULL at failure.
+ */
+void * arena_alloc(uint32_t size)
+{
+    void *p;
+
+    size = (size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+
+    if (NULL == arena.base) {
+        if (reserve(ARENA_LEN) == -1) {
+            __atomic_add_fetch(&arena_failed, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        if (NULL == (arena.base = malloc(ARENA_LEN))) {
+            (void)reserve(-ARENA_LEN);
+            return NULL;
+        }
+        __atomic_add_fetch(&num_arenas, 1, __ATOMIC_RELAXED);
+    }
+
+    if (size > ARENA_LEN - arena.used) {
+        ALOGE("%s:%d: Arena exhausted (size: %u)", _FILE, __LINE__, size);
+        __atomic_add_fetch(&arena_failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    p = arena.base + arena.used;
+    arena.used += size;
+
+    return p;
+}
+
+/**
+ * @brief Copy a string to the arena of the calling thread.
+ *
+ * @param [in] str String.
+ *
+ * @return Returns the copy, or NULL at failure.
+ */
+char * arena_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = (len <= ARENA_LEN) ? arena_alloc(len) : NULL;
+
+    if (copy) {
+        memcpy(copy, str, len);
+    }
+
+    return copy;
+}
+
+/**
+ * @brief Release the arena of the calling thread, after each command.
+ */
+void arena_reset(void)
+{
+    uint32_t peak = __atomic_load_n(&arena_peak, __ATOMIC_RELAXED);
+
+    while (arena.used > peak &&
+           !__atomic_compare_exchange_n(&arena_peak, &peak, arena.used, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    arena.used = 0;
+}
+
+/**
+ * @brief Account memory allocated outside the pools against the ceiling,
+ *        e.g. output queued for a client, or give it back.
+ *
+ * @param [in] bytes Bytes to account, negative to give back.
+ *
+ * @return Returns 0 at success, or -1 if the ceiling would be exceeded.
+ */
+int pool_charge(int64_t bytes)
+{
+    if (reserve(bytes) == -1) {
+        __atomic_add_fetch(&buffer_failed, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    __atomic_add_fetch(&buffer_bytes, bytes, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/**
+ * @brief Allocate a large buffer outside the pools, accounted against the
+ *        ceiling.
+ *
+ * @param [in] size Size in bytes.
+ *
+ * @return Returns the buffer, or NULL at failure.
+ */
+void * pool_buf_alloc(uint32_t size)
+{
+    void *buf;
+
+    if (pool_charge(size) == -1) {
+        ALOGE("%s:%d: Memory limit reached (size: %u)", _FILE, __LINE__,
+              size);
+        return NULL;
+    }
+
+    if (NULL == (buf = malloc(size))) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        (void)pool_charge(-(int64_t)size);
+    }
+
+    return buf;
+}
+
+/**
+ * @brief Free a buffer allocated by pool_buf_alloc().
+ *
+ * @param [in] buf  Buffer, or NULL.
+ * @param [in] size Size given at allocation.
+ */
+void pool_buf_free(void *buf, uint32_t size)
+{
+    if (buf) {
+        free(buf);
+        (void)pool_charge(-(int64_t)size);
+    }
+}
+
+/**
+ * @brief Create a thread with an explicit stack size, instead of the
+ *        default of the C library which is far larger than needed.
+ *
+ * @param [out] thread     Thread.
+ * @param [in]  stack_size Stack size in bytes.
+ * @param [in]  fn         Thread function.
+ * @param [in]  arg        Thread function argument.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int pool_start_thread(pthread_t *thread, size_t stack_size,
+                      void *(*fn)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    int rc;
+
+    if (pthread_attr_init(&attr) != 0) {
+        return -1;
+    }
+
+    rc = pthread_attr_setstacksize(&attr, stack_size);
+
+    if (0 == rc) {
+        rc = pthread_create(thread, &attr, fn, arg);
+    }
+
+    pthread_attr_destroy(&attr);
+
+    if (rc != 0) {
+        ALOGE("%s:%d: Failed to create thread (rc=%d)", _FILE, __LINE__, rc);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+    num_threads++;
+    stack_bytes += stack_size;
+    pthread_mutex_unlock(&mutex);
+
+    return 0;
+}
+
+/**
+ * @brief Set the ceiling of the memory reserved by pools, arenas and
+ *        buffers. Memory already reserved is kept.
+ *
+ * @param [in] bytes Ceiling in bytes, 0 for none.
+ */
+void pool_set_limit(uint64_t bytes)
+{
+    pthread_mutex_lock(&mutex);
+    limit = bytes;
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Get the memory report, the usage of each pool, the command arenas,
+ *        the buffers, the thread stacks and the memory reserved.
+ *
+ * @param [out] resp Response buffer.
+ * @param [in]  len  Length of response buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int pool_report(char *resp, uint32_t len)
+{
+    struct pool *pool;
+    uint32_t pos;
+
+    if (NULL == resp || 0 == len) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    pos = snprintf(resp, len, "%s", POOL_HEADER);
+
+    // Pools are only ever added at the head, and locked before the
+    // accounting when allocating.
+    pthread_mutex_lock(&mutex);
+    pool = pools;
+    pthread_mutex_unlock(&mutex);
+
+    for (; pool && pos < len; pool = pool->next) {
+        pthread_mutex_lock(&pool->mutex);
+        pos += snprintf(resp + pos, len - pos, "\n%s %u %u %u %u %llu",
+                        pool->name, pool->size, pool->objects, pool->used,
+                        pool->peak, (unsigned long long)pool->failed);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    if (pos < len) {
+        pos += snprintf(resp + pos, len - pos,
+                        "\n%s\n%u %u %u %llu\n%s\n%llu %llu\n%s\n%u %llu"
+                        "\n%s\n%llu %llu",
+                        ARENA_HEADER,
+                        __atomic_load_n(&num_arenas, __ATOMIC_RELAXED),
+                        ARENA_LEN,
+                        __atomic_load_n(&arena_peak, __ATOMIC_RELAXED),
+                        (unsigned long long)__atomic_load_n(&arena_failed,
+                                                            __ATOMIC_RELAXED),
+                        BUFFER_HEADER,
+                        (unsigned long long)__atomic_load_n(&buffer_bytes,
+                                                            __ATOMIC_RELAXED)
+                        / 1024,
+                        (unsigned long long)__atomic_load_n(&buffer_failed,
+                                                            __ATOMIC_RELAXED),
+                        STACK_HEADER, num_threads,
+                        (unsigned long long)stack_bytes / 1024,
+                        TOTAL_HEADER, (unsigned long long)reserved / 1024,
+                        (unsigned long long)limit / 1024);
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return (pos >= len) ? -1 : 0;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Reserve memory for a slab, an arena or a buffer, or give it back.
+ *
+ * @param [in] bytes Bytes to reserve, negative to give back.
+ *
+ * @return Returns 0 at success, or -1 if the ceiling would be exceeded.
+ */
+static int reserve(int64_t bytes)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&mutex);
+    if (limit > 0 && bytes > 0 && reserved + bytes > limit) {
+        rc = -1;
+    } else {
+        reserved += bytes;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
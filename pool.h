@@ -0,0 +1,43 @@
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Pool of fixed-size objects, carved from slabs of a few objects each. Slabs
+// are kept once made, so the footprint is set by the peak use.
+struct pool {
+    const char *name;
+    uint32_t size;              // Object size.
+    uint32_t per_slab;          // Objects per slab.
+    pthread_mutex_t mutex;      // Protects the fields below.
+    void *free;                 // Free objects.
+    uint32_t objects;           // Objects in slabs.
+    uint32_t used;
+    uint32_t peak;
+    uint64_t failed;            // Allocations refused at the ceiling.
+    int listed;                 // Set once in the memory report.
+    struct pool *next;
+};
+
+// Initializer of a pool of objects of a type.
+#define POOL_INITIALIZER(name, type, per_slab) \
+    {name, sizeof(type), per_slab, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, \
+     0, 0, NULL}
+
+void * pool_alloc(struct pool *pool);
+void pool_free(struct pool *pool, void *obj);
+void * arena_alloc(uint32_t size);
+char * arena_strdup(const char *str);
+void arena_reset(void);
+int pool_charge(int64_t bytes);
+void * pool_buf_alloc(uint32_t size);
+void pool_buf_free(void *buf, uint32_t size);
+int pool_start_thread(pthread_t *thread, size_t stack_size,
+                      void *(*fn)(void *), void *arg);
+void pool_set_limit(uint64_t bytes);
+int pool_report(char *resp, uint32_t len);
+
+#endif
@@ -0,0 +1,225 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "procstat.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "procstat.c"
+
+// Buffer size for a /proc file.
+#define PROC_BUF_LEN 1024
+
+// Fields of /proc/<pid>/stat (1-based, as documented in proc(5)).
+#define STAT_UTIME     14
+#define STAT_STIME     15
+#define STAT_STARTTIME 22
+
+// Write counter key in /proc/<pid>/io.
+#define IO_WCHAR "wchar:"
+
+// Forward declarations.
+static int read_file(const char *path, char *buf, size_t size);
+static int parse_stat(char *buf, struct procstat *stat);
+static uint64_t parse_io_wchar(const char *buf);
+static uint64_t get_uptime_ms(void);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Sample resource usage of a process from /proc.
+ *
+ * @param [in]  pid  Process ID.
+ * @param [out] stat Sampled resource usage.
+ *
+ * @return Returns 0 at success, or -1 if the process is gone.
+ */
+int procstat_read(pid_t pid, struct procstat *stat)
+{
+    char path[MAX_PATH_LEN];
+    char buf[PROC_BUF_LEN];
+    unsigned long size, resident;
+    long hz = sysconf(_SC_CLK_TCK);
+    long pagesize = sysconf(_SC_PAGESIZE);
+    uint64_t started_ms;
+
+    if (NULL == stat || hz <= 0) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    memset(stat, 0, sizeof(*stat));
+
+    // CPU time and start time.
+    snprintf(path, MAX_PATH_LEN, "/proc/%d/stat", pid);
+
+    if (read_file(path, buf, PROC_BUF_LEN) == -1 ||
+            parse_stat(buf, stat) == -1) {
+        return -1;
+    }
+
+    stat->cpu_ms = stat->cpu_ms * 1000 / hz;
+    started_ms = stat->starttime * 1000 / hz;
+    stat->uptime_s = (get_uptime_ms() - started_ms) / 1000;
+
+    // Resident memory.
+    snprintf(path, MAX_PATH_LEN, "/proc/%d/statm", pid);
+
+    if (read_file(path, buf, PROC_BUF_LEN) == 0 &&
+            sscanf(buf, "%lu %lu", &size, &resident) == 2) {
+        stat->rss_kb = (uint64_t)resident * pagesize / 1024;
+    }
+
+    // I/O accounting might not be enabled in the kernel.
+    snprintf(path, MAX_PATH_LEN, "/proc/%d/io", pid);
+
+    if (read_file(path, buf, PROC_BUF_LEN) == 0) {
+        stat->wchar = parse_io_wchar(buf);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Get the program a process was started as (the first command-line
+ *        argument).
+ *
+ * @param [in]  pid  Process ID.
+ * @param [out] exe  Destination buffer.
+ * @param [in]  size Size of destination buffer.
+ *
+ * @return Returns 0 at success, or -1 if the process is gone.
+ */
+int procstat_exe(pid_t pid, char *exe, size_t size)
+{
+    char path[MAX_PATH_LEN];
+    char buf[PROC_BUF_LEN];
+
+    if (NULL == exe || 0 == size) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    snprintf(path, MAX_PATH_LEN, "/proc/%d/cmdline", pid);
+
+    // Arguments are null-separated, the first one ends the string.
+    if (read_file(path, buf, PROC_BUF_LEN) == -1) {
+        return -1;
+    }
+
+    snprintf(exe, size, "%s", buf);
+
+    return 0;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Read a small file into a null-terminated buffer.
+ *
+ * @param [in]  path File path.
+ * @param [out] buf  Destination buffer.
+ * @param [in]  size Size of destination buffer.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int read_file(const char *path, char *buf, size_t size)
+{
+    FILE *file;
+    size_t n;
+
+    file = fopen(path, "r");
+
+    if (NULL == file) {
+        return -1;
+    }
+
+    n = fread(buf, 1, size - 1, file);
+    buf[n] = '\0';
+    fclose(file);
+
+    return (n > 0) ? 0 : -1;
+}
+
+/**
+ * @brief Parse CPU and start time from the content of /proc/<pid>/stat.
+ *
+ * @param [in]  buf  Content of the stat file.
+ * @param [out] stat CPU time (in clock ticks) and start time.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int parse_stat(char *buf, struct procstat *stat)
+{
+    char *pos, *token, *saveptr;
+    uint32_t field;
+
+    // The command name may contain spaces, skip past its closing bracket.
+    pos = strrchr(buf, ')');
+
+    if (NULL == pos) {
+        ALOGE("%s:%d: Malformed stat file", _FILE, __LINE__);
+        return -1;
+    }
+
+    // The state is field 3.
+    field = 3;
+
+    for (token = strtok_r(pos + 1, " ", &saveptr); token;
+            token = strtok_r(NULL, " ", &saveptr), field++) {
+        if (STAT_UTIME == field || STAT_STIME == field) {
+            stat->cpu_ms += strtoull(token, NULL, 10);
+        } else if (STAT_STARTTIME == field) {
+            stat->starttime = strtoull(token, NULL, 10);
+            return 0;
+        }
+    }
+
+    ALOGE("%s:%d: Truncated stat file", _FILE, __LINE__);
+    return -1;
+}
+
+/**
+ * @brief Get the write counter from the content of /proc/<pid>/io.
+ *
+ * @param [in] buf Content of the io file.
+ *
+ * @return Returns the number of bytes written, or 0 if not found.
+ */
+static uint64_t parse_io_wchar(const char *buf)
+{
+    const char *pos = strstr(buf, IO_WCHAR);
+
+    if (NULL == pos) {
+        return 0;
+    }
+
+    return strtoull(pos + strlen(IO_WCHAR), NULL, 10);
+}
+
+/**
+ * @brief Get the system uptime.
+ *
+ * @return Returns milliseconds since boot, or 0 at failure.
+ */
+static uint64_t get_uptime_ms(void)
+{
+    struct timespec ts;
+
+    // CLOCK_BOOTTIME has the same base as the process start time.
+    if (clock_gettime(CLOCK_BOOTTIME, &ts) == -1) {
+        return 0;
+    }
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
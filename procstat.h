@@ -0,0 +1,19 @@
+
+#ifndef PROCSTAT_H
+#define PROCSTAT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct procstat {
+    uint64_t cpu_ms;    // User and system CPU time.
+    uint64_t rss_kb;    // Resident set size.
+    uint64_t wchar;     // Bytes passed to write() and similar calls.
+    uint64_t uptime_s;  // Time since the process was started.
+    uint64_t starttime; // Start time in clock ticks after system boot.
+};
+
+int procstat_read(pid_t pid, struct procstat *stat);
+int procstat_exe(pid_t pid, char *exe, size_t size);
+
+#endif
@@ -0,0 +1,211 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+
+#include "evloop.h"
+#include "recorder.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "recorder.c"
+
+// Size of the buffer collecting records between writes.
+#define BUF_LEN (64 * 1024)
+
+// Max length of a record: type, three varints and the command.
+#define MAX_REC_LEN (1 + 10 + 5 + 5 + CMD_LINE_LENGTH)
+
+// Interval between writes of buffered records.
+#define FLUSH_INTERVAL_MS 1000
+
+// Thread synchronization.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Recording state.
+static int fd = -1;
+static char buf[BUF_LEN];
+static uint32_t buf_len = 0;
+static uint64_t last_us = 0;
+
+// Forward declarations.
+static uint32_t put_varint(char *p, uint64_t val);
+static void write_out(void);
+static void flush_timer(int tfd, uint32_t events, void *arg);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Start recording the received commands to a file. Records are
+ *        appended, a recording continued by an upgraded binary starts with
+ *        a SYNC record.
+ *
+ * @param [in] path Recording file.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int recorder_open(const char *path)
+{
+    if (NULL == path) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+    if (-1 == fd) {
+        ALOGE("%s:%d: Failed to open %s (errno=%d)", _FILE, __LINE__, path,
+              errno);
+        return -1;
+    }
+
+    if (0 == lseek(fd, 0, SEEK_END)) {
+        memcpy(buf, RECORDER_MAGIC, RECORDER_MAGIC_LEN);
+        buf_len = RECORDER_MAGIC_LEN;
+    }
+
+    if (evloop_add_timer(FLUSH_INTERVAL_MS, flush_timer, NULL) == -1) {
+        ALOGE("%s:%d: Failed to add flush timer", _FILE, __LINE__);
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+
+    recorder_add(RECORDER_SYNC, 0, NULL);
+
+    return 0;
+}
+
+/**
+ * @brief Record a client event, if recording.
+ *
+ * @param [in] type Record type.
+ * @param [in] conn Connection number.
+ * @param [in] cmd  Received command, for TEXT and BINARY records.
+ */
+void recorder_add(enum recorder_type type, uint32_t conn, const char *cmd)
+{
+    uint32_t len = 0;
+    uint64_t now;
+    char *p;
+
+    if (-1 == fd) {
+        return;
+    }
+
+    if (cmd) {
+        len = strnlen(cmd, CMD_LINE_LENGTH);
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    if (buf_len + MAX_REC_LEN > BUF_LEN) {
+        write_out();
+    }
+
+    if (fd != -1) {
+        now = get_monotonic_us();
+        p = buf + buf_len;
+        *p++ = type;
+        p += put_varint(p, (RECORDER_SYNC == type) ? now : now - last_us);
+        p += put_varint(p, conn);
+        if (RECORDER_TEXT == type || RECORDER_BINARY == type) {
+            p += put_varint(p, len);
+            memcpy(p, cmd, len);
+            p += len;
+        }
+        buf_len = p - buf;
+        last_us = now;
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Write buffered records, e.g. before the binary is replaced.
+ */
+void recorder_flush(void)
+{
+    pthread_mutex_lock(&mutex);
+    write_out();
+    pthread_mutex_unlock(&mutex);
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Encode an unsigned value as varint, 7 bits per byte with the
+ *        least significant group first.
+ *
+ * @param [out] p   Output, room for 10 bytes.
+ * @param [in]  val Value.
+ *
+ * @return Returns the number of bytes written.
+ */
+static uint32_t put_varint(char *p, uint64_t val)
+{
+    uint32_t n = 0;
+
+    while (val >= 0x80) {
+        p[n++] = (char)(val | 0x80);
+        val >>= 7;
+    }
+    p[n++] = (char)val;
+
+    return n;
+}
+
+/**
+ * @brief Write the buffered records. Recording stops at a write error.
+ *        The mutex must be held.
+ */
+static void write_out(void)
+{
+    uint32_t pos = 0;
+    ssize_t n;
+
+    while (fd != -1 && pos < buf_len) {
+        n = write(fd, buf + pos, buf_len - pos);
+        if (-1 == n && EINTR == errno) {
+            continue;
+        }
+        if (n <= 0) {
+            ALOGE("%s:%d: Recording stopped (errno=%d)", _FILE, __LINE__,
+                  errno);
+            close(fd);
+            fd = -1;
+            break;
+        }
+        pos += n;
+    }
+
+    buf_len = 0;
+}
+
+/**
+ * @brief Periodically write buffered records, so a recording is complete up
+ *        to the last interval when the proxy is killed.
+ *
+ * @param [in] tfd    <Not in use>.
+ * @param [in] events <Not in use>.
+ * @param [in] arg    <Not in use>.
+ */
+static void flush_timer(int tfd, uint32_t events, void *arg)
+{
+    UNUSED(tfd);
+    UNUSED(events);
+    UNUSED(arg);
+
+    recorder_flush();
+}
@@ -0,0 +1,27 @@
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdint.h>
+
+// Magic at the start of a recording.
+#define RECORDER_MAGIC "DIPREC1\n"
+#define RECORDER_MAGIC_LEN 8
+
+// Record types. Each record is the type byte followed by the time and the
+// connection number as varints, commands then hold the length as varint and
+// the command bytes. The time is the microseconds since the previous record,
+// except for SYNC records holding the monotonic time.
+enum recorder_type {
+    RECORDER_SYNC,              // Recording (re)started, connections reset.
+    RECORDER_OPEN,              // Client connected.
+    RECORDER_TEXT,              // Command received as text line.
+    RECORDER_BINARY,            // Command received as request frame.
+    RECORDER_CLOSE              // Client disconnected.
+};
+
+int recorder_open(const char *path);
+void recorder_add(enum recorder_type type, uint32_t conn, const char *cmd);
+void recorder_flush(void);
+
+#endif
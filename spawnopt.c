@@ -0,0 +1,652 @@
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "spawnopt.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "spawnopt.c"
+
+// Option keys, used both as trace command long options and conf file keys.
+#define KEY_AFFINITY "affinity"
+#define KEY_NICE     "nice"
+#define KEY_POLICY   "policy"
+#define KEY_IONICE   "ionice"
+#define KEY_RLIMIT   "rlimit"
+#define KEY_CPU_MAX  "cpu-max"
+#define KEY_MEM_MAX  "memory-max"
+#define KEY_IO_MAX   "io-max"
+
+// I/O priority encoding, see ioprio_set(2).
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_CLASS_RT     1
+#define IOPRIO_CLASS_BE     2
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_LEVEL_MAX    7
+#define IOPRIO_LEVEL_DFLT   4
+
+// Separator between the key and value of a formatted option.
+#define KEY_DELIM '='
+
+// Separator between a class or resource and its value.
+#define VALUE_DELIM ':'
+
+// Unlimited resource value.
+#define RLIMIT_UNLIMITED "unlimited"
+
+// Max number of CPUs in an affinity mask.
+#define MAX_CPUS 64
+
+struct keyword {
+    const char *name;
+    int value;
+};
+
+static const struct keyword policies[] = {
+    {"other", SCHED_OTHER},
+    {"batch", SCHED_BATCH},
+    {"idle", SCHED_IDLE},
+    {NULL, 0}
+};
+
+static const struct keyword ioclasses[] = {
+    {"rt", IOPRIO_CLASS_RT},
+    {"be", IOPRIO_CLASS_BE},
+    {"idle", IOPRIO_CLASS_IDLE},
+    {NULL, 0}
+};
+
+static const struct keyword resources[] = {
+    {"as", RLIMIT_AS},
+    {"core", RLIMIT_CORE},
+    {"cpu", RLIMIT_CPU},
+    {"fsize", RLIMIT_FSIZE},
+    {"nofile", RLIMIT_NOFILE},
+    {NULL, 0}
+};
+
+// CPU affinity of the proxy, applied to MLD processes without own affinity.
+static cpu_set_t proxy_cpus;
+static int proxy_cpus_saved = 0;
+
+// Forward declarations.
+static int keycmp(const char *key1, const char *key2);
+static int set_limit(char *limit, const char *value);
+static int lookup(const struct keyword *table, const char *name, size_t len,
+                  int *value);
+static const char * keyword_name(const struct keyword *table, int value);
+static int parse_int(const char *str, long min, long max, long *value);
+static int parse_cpumask(const char *str, uint64_t *mask);
+static int parse_ioprio(const char *str, int *ioprio);
+static int parse_rlimit(const char *str, struct spawnopt *opt);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Save the CPU affinity of the proxy. MLD processes are forked from
+ *        command threads that may be pinned to a core, without an affinity
+ *        option they get the affinity of the proxy instead.
+ *
+ * NOTE! Must be called before any thread is pinned.
+ */
+void spawnopt_save_affinity(void)
+{
+    if (sched_getaffinity(0, sizeof(proxy_cpus), &proxy_cpus) == 0) {
+        proxy_cpus_saved = 1;
+    }
+}
+
+/**
+ * @brief Initialize spawn options to inherit everything from the proxy.
+ *
+ * @param [out] opt Spawn options.
+ */
+void spawnopt_init(struct spawnopt *opt)
+{
+    memset(opt, 0, sizeof(*opt));
+    opt->policy = -1;
+    opt->ioprio = -1;
+}
+
+/**
+ * @brief Check if the key is a spawn option.
+ *
+ * @param [in] key Option key (case insensitive, '_' matches '-').
+ *
+ * @return Returns 1 if it is a spawn option, else 0.
+ */
+int spawnopt_iskey(const char *key)
+{
+    return (keycmp(key, KEY_AFFINITY) == 0 ||
+            keycmp(key, KEY_NICE) == 0 ||
+            keycmp(key, KEY_POLICY) == 0 ||
+            keycmp(key, KEY_IONICE) == 0 ||
+            keycmp(key, KEY_RLIMIT) == 0 ||
+            keycmp(key, KEY_CPU_MAX) == 0 ||
+            keycmp(key, KEY_MEM_MAX) == 0 ||
+            keycmp(key, KEY_IO_MAX) == 0);
+}
+
+/**
+ * @brief Set a spawn option.
+ *
+ * @param [in out] opt   Spawn options.
+ * @param [in]     key   Option key (case insensitive, '_' matches '-').
+ * @param [in]     value Option value.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int spawnopt_set(struct spawnopt *opt, const char *key, const char *value)
+{
+    long nice;
+    int rc = -1;
+
+    if (NULL == opt || NULL == key || NULL == value) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    if (keycmp(key, KEY_AFFINITY) == 0) {
+        rc = parse_cpumask(value, &opt->cpumask);
+    } else if (keycmp(key, KEY_NICE) == 0) {
+        if ((rc = parse_int(value, -20, 19, &nice)) == 0) {
+            opt->nice_set = 1;
+            opt->nice = (int)nice;
+        }
+    } else if (keycmp(key, KEY_POLICY) == 0) {
+        rc = lookup(policies, value, strlen(value), &opt->policy);
+    } else if (keycmp(key, KEY_IONICE) == 0) {
+        rc = parse_ioprio(value, &opt->ioprio);
+    } else if (keycmp(key, KEY_RLIMIT) == 0) {
+        rc = parse_rlimit(value, opt);
+    } else if (keycmp(key, KEY_CPU_MAX) == 0) {
+        rc = set_limit(opt->cpu_max, value);
+    } else if (keycmp(key, KEY_MEM_MAX) == 0) {
+        rc = set_limit(opt->memory_max, value);
+    } else if (keycmp(key, KEY_IO_MAX) == 0) {
+        rc = set_limit(opt->io_max, value);
+    }
+
+    if (-1 == rc) {
+        ALOGE("%s:%d: Bad spawn option (%s: %s)", _FILE, __LINE__, key, value);
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Apply spawn options to the calling process.
+ *
+ * NOTE! This is intended for child processes created with fork(), between
+ * fork() and execve(). Failures are logged and the remaining options are
+ * still applied.
+ *
+ * @param [in] opt Spawn options.
+ */
+void spawnopt_apply(const struct spawnopt *opt)
+{
+    struct sched_param param;
+    cpu_set_t set;
+    uint32_t i;
+
+    if (NULL == opt) {
+        return;
+    }
+
+    if (opt->cpumask) {
+        CPU_ZERO(&set);
+        for (i = 0; i < MAX_CPUS; i++) {
+            if (opt->cpumask & (1ULL << i)) {
+                CPU_SET(i, &set);
+            }
+        }
+
+        if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+            ALOGE("%s:%d: Failed to set CPU affinity (errno=%d)", _FILE,
+                  __LINE__, errno);
+        }
+    } else if (proxy_cpus_saved) {
+        (void)sched_setaffinity(0, sizeof(proxy_cpus), &proxy_cpus);
+    }
+
+    if (opt->policy != -1) {
+        memset(&param, 0, sizeof(param));
+        if (sched_setscheduler(0, opt->policy, &param) == -1) {
+            ALOGE("%s:%d: Failed to set scheduling policy (errno=%d)", _FILE,
+                  __LINE__, errno);
+        }
+    }
+
+    if (opt->nice_set) {
+        if (setpriority(PRIO_PROCESS, 0, opt->nice) == -1) {
+            ALOGE("%s:%d: Failed to set nice level (errno=%d)", _FILE,
+                  __LINE__, errno);
+        }
+    }
+
+    if (opt->ioprio != -1) {
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, opt->ioprio) == -1) {
+            ALOGE("%s:%d: Failed to set I/O priority (errno=%d)", _FILE,
+                  __LINE__, errno);
+        }
+    }
+
+    for (i = 0; i < opt->num_rlimits; i++) {
+        if (setrlimit(opt->rlimits[i].resource, &opt->rlimits[i].limit)
+                == -1) {
+            ALOGE("%s:%d: Failed to set resource limit %d (errno=%d)", _FILE,
+                  __LINE__, opt->rlimits[i].resource, errno);
+        }
+    }
+}
+
+/**
+ * @brief Format spawn options as space separated "<key>=<value>" options,
+ *        e.g. to hand them over to a new binary. Inherited options are left
+ *        out.
+ *
+ * @param [in]  opt Spawn options.
+ * @param [out] buf Destination buffer.
+ * @param [in]  len Length of destination buffer.
+ *
+ * @return Returns 0 at success, or -1 if the buffer is too small.
+ */
+int spawnopt_format(const struct spawnopt *opt, char *buf, uint32_t len)
+{
+    const struct spawnrlimit *rlim;
+    const char *name;
+    size_t pos = 0;
+    uint32_t i;
+
+    buf[0] = '\0';
+
+    if (opt->cpumask && pos < len) {
+        pos += snprintf(buf + pos, len - pos, " %s%c0x%llx", KEY_AFFINITY,
+                        KEY_DELIM, (unsigned long long)opt->cpumask);
+    }
+
+    if (opt->nice_set && pos < len) {
+        pos += snprintf(buf + pos, len - pos, " %s%c%d", KEY_NICE, KEY_DELIM,
+                        opt->nice);
+    }
+
+    if ((name = keyword_name(policies, opt->policy)) && pos < len) {
+        pos += snprintf(buf + pos, len - pos, " %s%c%s", KEY_POLICY,
+                        KEY_DELIM, name);
+    }
+
+    if (opt->ioprio != -1 && pos < len &&
+            (name = keyword_name(ioclasses,
+                                 opt->ioprio >> IOPRIO_CLASS_SHIFT))) {
+        pos += snprintf(buf + pos, len - pos, " %s%c%s%c%d", KEY_IONICE,
+                        KEY_DELIM, name, VALUE_DELIM,
+                        opt->ioprio & ((1 << IOPRIO_CLASS_SHIFT) - 1));
+    }
+
+    for (i = 0; i < opt->num_rlimits && pos < len; i++) {
+        rlim = &opt->rlimits[i];
+
+        if (NULL == (name = keyword_name(resources, rlim->resource))) {
+            continue;
+        }
+
+        if (RLIM_INFINITY == rlim->limit.rlim_cur) {
+            pos += snprintf(buf + pos, len - pos, " %s%c%s%c%s", KEY_RLIMIT,
+                            KEY_DELIM, name, VALUE_DELIM, RLIMIT_UNLIMITED);
+        } else {
+            pos += snprintf(buf + pos, len - pos, " %s%c%s%c%llu",
+                            KEY_RLIMIT, KEY_DELIM, name, VALUE_DELIM,
+                            (unsigned long long)rlim->limit.rlim_cur);
+        }
+    }
+
+    if (opt->cpu_max[0] != '\0' && pos < len) {
+        pos += snprintf(buf + pos, len - pos, " %s%c%s", KEY_CPU_MAX,
+                        KEY_DELIM, opt->cpu_max);
+    }
+
+    if (opt->memory_max[0] != '\0' && pos < len) {
+        pos += snprintf(buf + pos, len - pos, " %s%c%s", KEY_MEM_MAX,
+                        KEY_DELIM, opt->memory_max);
+    }
+
+    if (opt->io_max[0] != '\0' && pos < len) {
+        pos += snprintf(buf + pos, len - pos, " %s%c%s", KEY_IO_MAX,
+                        KEY_DELIM, opt->io_max);
+    }
+
+    if (pos >= len) {
+        ALOGE("%s:%d: Spawn options too long", _FILE, __LINE__);
+        return -1;
+    }
+
+    // Drop the leading separator.
+    if (pos > 0) {
+        memmove(buf, buf + 1, pos);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Parse spawn options formatted by spawnopt_format().
+ *
+ * @param [out] opt Spawn options.
+ * @param [in]  str Space separated "<key>=<value>" options.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int spawnopt_parse(struct spawnopt *opt, const char *str)
+{
+    char *copy, *token, *save, *value;
+    int rc = 0;
+
+    spawnopt_init(opt);
+
+    if (NULL == (copy = strdup(str))) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        return -1;
+    }
+
+    for (token = strtok_r(copy, " ", &save); token && 0 == rc;
+            token = strtok_r(NULL, " ", &save)) {
+        if (NULL == (value = strchr(token, KEY_DELIM))) {
+            ALOGE("%s:%d: Bad spawn option (%s)", _FILE, __LINE__, token);
+            rc = -1;
+        } else {
+            *value++ = '\0';
+            rc = spawnopt_set(opt, token, value);
+        }
+    }
+
+    free(copy);
+
+    return rc;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Compare option keys, ignoring case and treating '_' as '-'.
+ *
+ * @param [in] key1 First key.
+ * @param [in] key2 Second key.
+ *
+ * @return Returns 0 if the keys match, else non-zero.
+ */
+static int keycmp(const char *key1, const char *key2)
+{
+    int c1, c2;
+
+    do {
+        c1 = ('_' == *key1) ? '-' : tolower((unsigned char)*key1);
+        c2 = ('_' == *key2) ? '-' : tolower((unsigned char)*key2);
+        key1++;
+        key2++;
+    } while (c1 == c2 && c1 != '\0');
+
+    return c1 - c2;
+}
+
+/**
+ * @brief Set a cgroup limit. The value is written to the cgroup interface file
+ *        with commas replaced by spaces (e.g. "50000,100000" for cpu.max).
+ *
+ * @param [out] limit Destination of SPAWNOPT_LIMIT_LEN bytes.
+ * @param [in]  value Limit value.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int set_limit(char *limit, const char *value)
+{
+    if ('\0' == value[0] || strlen(value) >= SPAWNOPT_LIMIT_LEN ||
+            strpbrk(value, " \t\r\n")) {
+        return -1;
+    }
+
+    strcpy(limit, value);
+
+    return 0;
+}
+
+/**
+ * @brief Look up a keyword.
+ *
+ * @param [in]  table Keyword table terminated by a NULL name.
+ * @param [in]  name  Keyword to look up (not necessarily null-terminated).
+ * @param [in]  len   Length of keyword.
+ * @param [out] value Value of the keyword.
+ *
+ * @return Returns 0 at success, or -1 if not found.
+ */
+static int lookup(const struct keyword *table, const char *name, size_t len,
+                  int *value)
+{
+    for (; table->name; table++) {
+        if (strlen(table->name) == len &&
+                strncasecmp(table->name, name, len) == 0) {
+            *value = table->value;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Look up the name of a keyword.
+ *
+ * @param [in] table Keyword table terminated by a NULL name.
+ * @param [in] value Value of the keyword.
+ *
+ * @return Returns the name, or NULL if not found.
+ */
+static const char * keyword_name(const struct keyword *table, int value)
+{
+    for (; table->name; table++) {
+        if (table->value == value) {
+            return table->name;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Parse a decimal integer within a range.
+ *
+ * @param [in]  str   String to parse.
+ * @param [in]  min   Min allowed value.
+ * @param [in]  max   Max allowed value.
+ * @param [out] value Parsed value.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int parse_int(const char *str, long min, long max, long *value)
+{
+    char *end;
+    long n;
+
+    errno = 0;
+    n = strtol(str, &end, 10);
+
+    if (errno != 0 || end == str || *end != '\0' || n < min || n > max) {
+        return -1;
+    }
+
+    *value = n;
+
+    return 0;
+}
+
+/**
+ * @brief Parse a CPU affinity mask. Either a hexadecimal mask (0x3) or a CPU
+ *        list (0-1,3) is accepted.
+ *
+ * @param [in]  str  String to parse.
+ * @param [out] mask CPU affinity mask.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int parse_cpumask(const char *str, uint64_t *mask)
+{
+    const char *pos = str;
+    char *end;
+    unsigned long first, last;
+    uint64_t bits = 0;
+
+    if (strncasecmp(str, "0x", 2) == 0) {
+        errno = 0;
+        bits = strtoull(str + 2, &end, 16);
+        if (errno != 0 || end == str + 2 || *end != '\0') {
+            return -1;
+        }
+    } else {
+        while (*pos) {
+            first = strtoul(pos, &end, 10);
+            if (end == pos) {
+                return -1;
+            }
+
+            last = first;
+            if ('-' == *end) {
+                pos = end + 1;
+                last = strtoul(pos, &end, 10);
+                if (end == pos) {
+                    return -1;
+                }
+            }
+
+            if (first > last || last >= MAX_CPUS) {
+                return -1;
+            }
+
+            for (; first <= last; first++) {
+                bits |= (1ULL << first);
+            }
+
+            if (',' == *end) {
+                end++;
+            } else if (*end != '\0') {
+                return -1;
+            }
+            pos = end;
+        }
+    }
+
+    // An empty mask would prevent the process from running at all.
+    if (0 == bits) {
+        return -1;
+    }
+
+    *mask = bits;
+
+    return 0;
+}
+
+/**
+ * @brief Parse an I/O priority on the form <class>[:<level>].
+ *
+ * @param [in]  str    String to parse.
+ * @param [out] ioprio Encoded I/O priority.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int parse_ioprio(const char *str, int *ioprio)
+{
+    const char *delim = strchr(str, VALUE_DELIM);
+    size_t len = delim ? (size_t)(delim - str) : strlen(str);
+    long level = IOPRIO_LEVEL_DFLT;
+    int class;
+
+    if (lookup(ioclasses, str, len, &class) == -1) {
+        return -1;
+    }
+
+    if (delim && parse_int(delim + 1, 0, IOPRIO_LEVEL_MAX, &level) == -1) {
+        return -1;
+    }
+
+    // The idle class has no levels.
+    if (IOPRIO_CLASS_IDLE == class) {
+        level = 0;
+    }
+
+    *ioprio = (class << IOPRIO_CLASS_SHIFT) | (int)level;
+
+    return 0;
+}
+
+/**
+ * @brief Parse a resource limit on the form <resource>:<value> and add it to
+ *        the spawn options. The value sets both the soft and hard limit.
+ *
+ * @param [in]     str String to parse.
+ * @param [in out] opt Spawn options.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int parse_rlimit(const char *str, struct spawnopt *opt)
+{
+    const char *delim = strchr(str, VALUE_DELIM);
+    struct spawnrlimit *rlim;
+    unsigned long long value;
+    char *end;
+    int resource;
+    uint32_t i;
+
+    if (NULL == delim ||
+            lookup(resources, str, delim - str, &resource) == -1) {
+        return -1;
+    }
+
+    if (strcmp(delim + 1, RLIMIT_UNLIMITED) == 0) {
+        value = RLIM_INFINITY;
+    } else {
+        errno = 0;
+        value = strtoull(delim + 1, &end, 10);
+        if (errno != 0 || end == delim + 1 || *end != '\0') {
+            return -1;
+        }
+    }
+
+    // A later limit for the same resource replaces the earlier one.
+    for (i = 0; i < opt->num_rlimits; i++) {
+        if (opt->rlimits[i].resource == resource) {
+            break;
+        }
+    }
+
+    if (i == opt->num_rlimits) {
+        if (opt->num_rlimits >= SPAWNOPT_MAX_RLIMITS) {
+            return -1;
+        }
+        opt->num_rlimits++;
+    }
+
+    rlim = &opt->rlimits[i];
+    rlim->resource = resource;
+    rlim->limit.rlim_cur = (rlim_t)value;
+    rlim->limit.rlim_max = (rlim_t)value;
+
+    return 0;
+}
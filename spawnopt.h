@@ -0,0 +1,41 @@
+
+#ifndef SPAWNOPT_H
+#define SPAWNOPT_H
+
+#include <stdint.h>
+#include <sys/resource.h>
+
+// Max number of resource limits per spawn.
+#define SPAWNOPT_MAX_RLIMITS 8
+
+// Max length of a cgroup limit value.
+#define SPAWNOPT_LIMIT_LEN 64
+
+struct spawnrlimit {
+    int resource;
+    struct rlimit limit;
+};
+
+// Scheduling and resource options applied to a spawned MLD process.
+struct spawnopt {
+    uint64_t cpumask;  // CPU affinity, 0 to inherit.
+    int nice_set;
+    int nice;
+    int policy;        // Scheduling policy, -1 to inherit.
+    int ioprio;        // I/O priority, -1 to inherit.
+    uint32_t num_rlimits;
+    struct spawnrlimit rlimits[SPAWNOPT_MAX_RLIMITS];
+    char cpu_max[SPAWNOPT_LIMIT_LEN];    // Cgroup limits, empty for no limit.
+    char memory_max[SPAWNOPT_LIMIT_LEN];
+    char io_max[SPAWNOPT_LIMIT_LEN];
+};
+
+void spawnopt_save_affinity(void);
+void spawnopt_init(struct spawnopt *opt);
+int spawnopt_iskey(const char *key);
+int spawnopt_set(struct spawnopt *opt, const char *key, const char *value);
+void spawnopt_apply(const struct spawnopt *opt);
+int spawnopt_format(const struct spawnopt *opt, char *buf, uint32_t len);
+int spawnopt_parse(struct spawnopt *opt, const char *str);
+
+#endif
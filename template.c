@@ -0,0 +1,507 @@
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+
+#include "evloop.h"
+#include "logdir.h"
+#include "mldproc.h"
+#include "template.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "template.c"
+
+// Template file suffix.
+#define TEMPLATE_SUFFIX ".tmpl"
+
+// Program name, optional first argument of a template.
+#define MLD_TOOL "mld"
+
+// Marks of a slot argument, "${key}" or "${key=default}".
+#define SLOT_START "${"
+#define SLOT_END '}'
+#define SLOT_DEFAULT '='
+
+// Separator of the key and value of an override.
+#define OVERRIDE_SEP '='
+
+// Comment line mark.
+#define COMMENT_MARK '#'
+
+// Size of the buffer for inotify events.
+#define NOTIFY_BUF_LEN 4096
+
+// Argument of a template, a literal or a slot filled in at start.
+struct targ {
+    const char *text;   // Literal, or default of a slot, NULL if none.
+    const char *key;    // Slot key, NULL for a literal.
+};
+
+// MLD command-line split into arguments when loaded.
+struct template {
+    struct template *next;
+    char name[MAX_NAME_LEN];
+    char buf[MLDARGS_LEN];          // Arguments, each terminated.
+    struct targ args[MLDARGS_MAX];
+    uint32_t argc;
+    const char *mcpu;               // MLD CPU of the literals, "" if none.
+};
+
+// Thread synchronization, protects the template list.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Loaded templates, replaced as a whole when reloaded.
+static struct template *templates = NULL;
+
+// Directory of the template files.
+static char tmpl_dir[MAX_PATH_LEN];
+
+// Forward declarations.
+static void reload(void);
+static struct template * load(const char *dir, const char *file);
+static int parse(struct template *t, const char *line);
+static void free_list(struct template *list);
+static const char * find_override(char * const overrides[], uint32_t num,
+                                  const char *key);
+static int has_slot(const struct template *t, const char *override);
+static int is_template(const char *file);
+static void dir_changed(int fd, uint32_t events, void *arg);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Load the session templates, files named <template>.tmpl holding a
+ *        MLD command-line, and reload them when the files change.
+ *
+ * @param [in] dir Directory of the template files.
+ *
+ * @return Returns 0 at success, or -1 if changes are not watched.
+ */
+int template_init(const char *dir)
+{
+    int fd;
+
+    if (NULL == dir) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    snprintf(tmpl_dir, sizeof(tmpl_dir), "%s", dir);
+
+    reload();
+
+    if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+        ALOGE("%s:%d: Failed to create inotify instance (errno=%d)", _FILE,
+              __LINE__, errno);
+        return -1;
+    }
+
+    if (inotify_add_watch(fd, tmpl_dir, IN_CLOSE_WRITE | IN_MOVED_TO |
+                          IN_MOVED_FROM | IN_DELETE) == -1 ||
+            evloop_add_fd(fd, EPOLLIN, dir_changed, NULL) == -1) {
+        ALOGD("%s:%d: Templates not watched (errno=%d)", _FILE, __LINE__,
+              errno);
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Fill in the slots of a template. Each slot takes the value of the
+ *        override with its key, or else its default.
+ *
+ * @param [in]  name      Template name.
+ * @param [in]  overrides Slot values, "<key>=<value>".
+ * @param [in]  num       Number of overrides.
+ * @param [out] args      MLD arguments.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int template_fill(const char *name, char * const overrides[], uint32_t num,
+                  struct mldargs *args)
+{
+    const struct targ *arg;
+    struct template *t;
+    const char *value;
+    uint32_t i, pos = 0, cmd_pos = 0;
+    size_t len;
+    int rc = 0;
+
+    if (NULL == name || NULL == args) {
+        ALOGE("%s:%d: Bad input", _FILE, __LINE__);
+        return -1;
+    }
+
+    for (i = 0; i < num; i++) {
+        if (NULL == strchr(overrides[i], OVERRIDE_SEP)) {
+            ALOGE("%s:%d: Bad template override: %s", _FILE, __LINE__,
+                  overrides[i]);
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    for (t = templates; t; t = t->next) {
+        if (strcmp(t->name, name) == 0) {
+            break;
+        }
+    }
+
+    if (NULL == t) {
+        ALOGE("%s:%d: Template not found (name: %s)", _FILE, __LINE__, name);
+        pthread_mutex_unlock(&mutex);
+        return -1;
+    }
+
+    args->mcpu = t->mcpu;
+    args->argc = t->argc;
+
+    for (i = 0; i < t->argc; i++) {
+        arg = &t->args[i];
+        value = arg->key ? find_override(overrides, num, arg->key) : NULL;
+
+        if (NULL == value) {
+            value = arg->text;
+        }
+
+        if (arg->key) {
+            if (NULL == value) {
+                ALOGE("%s:%d: Missing value of slot %s (template: %s)",
+                      _FILE, __LINE__, arg->key, name);
+                rc = -1;
+                break;
+            }
+
+            if ('\0' == args->mcpu[0]) {
+                args->mcpu = mldproc_cpu(value);
+            }
+        }
+
+        len = strlen(value) + 1;
+
+        if (pos + len > sizeof(args->buf) ||
+                cmd_pos + len > sizeof(args->cmd)) {
+            ALOGE("%s:%d: Command-line too long (template: %s)", _FILE,
+                  __LINE__, name);
+            rc = -1;
+            break;
+        }
+
+        // Keep the command-line too, to schedule or restart the session.
+        memcpy(args->buf + pos, value, len);
+        args->argv[i] = args->buf + pos;
+        pos += len;
+
+        cmd_pos += snprintf(args->cmd + cmd_pos, sizeof(args->cmd) - cmd_pos,
+                            (i > 0) ? " %s" : "%s", value);
+    }
+
+    args->argv[args->argc] = NULL;
+
+    // Every override must fill in a slot.
+    for (i = 0; i < num && 0 == rc; i++) {
+        if (!has_slot(t, overrides[i])) {
+            ALOGE("%s:%d: Unknown slot %s (template: %s)", _FILE, __LINE__,
+                  overrides[i], name);
+            rc = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Load all templates and replace the loaded ones at once, so that a
+ *        start sees either the old or the new templates.
+ */
+static void reload(void)
+{
+    struct template *list = NULL, *t, *old;
+    struct dirent *file;
+    uint32_t count = 0;
+    DIR *dir;
+
+    dir = opendir(tmpl_dir);
+
+    if (NULL == dir) {
+        ALOGD("%s:%d: Template path does not exist", _FILE, __LINE__);
+    } else {
+        while ((file = readdir(dir))) {
+            if (is_template(file->d_name) &&
+                    (t = load(tmpl_dir, file->d_name)) != NULL) {
+                t->next = list;
+                list = t;
+                count++;
+            }
+        }
+        closedir(dir);
+    }
+
+    pthread_mutex_lock(&mutex);
+    old = templates;
+    templates = list;
+    pthread_mutex_unlock(&mutex);
+
+    free_list(old);
+
+    ALOGD("%s:%d: Loaded %u session templates", _FILE, __LINE__, count);
+}
+
+/**
+ * @brief Load a template file. The first line that is neither empty nor a
+ *        comment holds the MLD command-line.
+ *
+ * @param [in] dir  Directory of the template file.
+ * @param [in] file Template file name.
+ *
+ * @return Returns the template, or NULL at failure.
+ */
+static struct template * load(const char *dir, const char *file)
+{
+    char path[MAX_PATH_LEN + MAX_NAME_LEN];
+    char line[MLDARGS_LEN];
+    struct template *t;
+    size_t len = strlen(file) - strlen(TEMPLATE_SUFFIX);
+    FILE *fp;
+    int rc = -1;
+
+    if (len >= MAX_NAME_LEN ||
+            snprintf(path, sizeof(path), "%s/%s", dir, file) >=
+            (int)sizeof(path)) {
+        ALOGE("%s:%d: Template name too long: %s", _FILE, __LINE__, file);
+        return NULL;
+    }
+
+    if (NULL == (fp = fopen(path, "r"))) {
+        ALOGE("%s:%d: Failed to open template %s (errno=%d)", _FILE,
+              __LINE__, file, errno);
+        return NULL;
+    }
+
+    t = calloc(1, sizeof(*t));
+
+    if (NULL == t) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        fclose(fp);
+        return NULL;
+    }
+
+    memcpy(t->name, file, len);
+    t->name[len] = '\0';
+
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!space_only(line) && line[strspn(line, " \t")] != COMMENT_MARK) {
+            rc = parse(t, line);
+            break;
+        }
+    }
+
+    fclose(fp);
+
+    if (-1 == rc) {
+        ALOGE("%s:%d: Bad template %s", _FILE, __LINE__, file);
+        free(t);
+        return NULL;
+    }
+
+    // Have the log directory ready before the first start, unless a slot
+    // without default decides it.
+    if (t->args[t->argc - 1].text &&
+            logdir_prepare(t->args[t->argc - 1].text) == -1) {
+        ALOGD("%s:%d: Log directory of template %s not created", _FILE,
+              __LINE__, file);
+    }
+
+    return t;
+}
+
+/**
+ * @brief Split the command-line of a template into literals and slots.
+ *
+ * @param [in out] t    Template.
+ * @param [in]     line MLD command-line.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int parse(struct template *t, const char *line)
+{
+    char *argv[MLDARGS_MAX];
+    char *end, *def;
+    uint32_t argc, i, first;
+
+    snprintf(t->buf, sizeof(t->buf), "%s", line);
+
+    if (split_cmd_line(t->buf, argv, MLDARGS_MAX, &argc) == -1) {
+        return -1;
+    }
+
+    // The program name is optional, the first argument is replaced by it.
+    first = (strcmp(argv[0], MLD_TOOL) == 0) ? 1 : 0;
+
+    if (argc - first + 1 > MLDARGS_MAX || argc == first) {
+        return -1;
+    }
+
+    t->args[0].text = MLD_TOOL;
+    t->args[0].key = NULL;
+    t->argc = 1;
+    t->mcpu = "";
+
+    for (i = first; i < argc; i++, t->argc++) {
+        if (strncmp(argv[i], SLOT_START, strlen(SLOT_START)) == 0) {
+            end = strchr(argv[i], SLOT_END);
+            if (NULL == end || end[1] != '\0') {
+                return -1;
+            }
+            *end = '\0';
+            t->args[t->argc].key = argv[i] + strlen(SLOT_START);
+            t->args[t->argc].text = NULL;
+            if ((def = strchr(argv[i], SLOT_DEFAULT)) != NULL) {
+                *def = '\0';
+                t->args[t->argc].text = def + 1;
+            }
+        } else {
+            t->args[t->argc].key = NULL;
+            t->args[t->argc].text = argv[i];
+            if ('\0' == t->mcpu[0]) {
+                t->mcpu = mldproc_cpu(argv[i]);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Free a list of templates.
+ *
+ * @param [in] list Templates.
+ */
+static void free_list(struct template *list)
+{
+    struct template *next;
+
+    for (; list; list = next) {
+        next = list->next;
+        free(list);
+    }
+}
+
+/**
+ * @brief Find the value of the last override of a slot.
+ *
+ * @param [in] overrides Slot values, "<key>=<value>".
+ * @param [in] num       Number of overrides.
+ * @param [in] key       Slot key.
+ *
+ * @return Returns the value, or NULL if the slot is not overridden.
+ */
+static const char * find_override(char * const overrides[], uint32_t num,
+                                  const char *key)
+{
+    size_t key_len = strlen(key);
+    const char *value = NULL;
+    uint32_t i;
+
+    for (i = 0; i < num; i++) {
+        if (strncmp(overrides[i], key, key_len) == 0 &&
+                OVERRIDE_SEP == overrides[i][key_len]) {
+            value = overrides[i] + key_len + 1;
+        }
+    }
+
+    return value;
+}
+
+/**
+ * @brief Check if an override fills in a slot of a template.
+ *
+ * @param [in] t        Template.
+ * @param [in] override Slot value, "<key>=<value>".
+ *
+ * @return Returns 1 if a slot of the template, else 0.
+ */
+static int has_slot(const struct template *t, const char *override)
+{
+    size_t key_len = strchr(override, OVERRIDE_SEP) - override;
+    uint32_t i;
+
+    for (i = 0; i < t->argc; i++) {
+        if (t->args[i].key && strlen(t->args[i].key) == key_len &&
+                strncmp(t->args[i].key, override, key_len) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Check if a file name is that of a template.
+ *
+ * @param [in] file File name.
+ *
+ * @return Returns 1 if a template, else 0.
+ */
+static int is_template(const char *file)
+{
+    const char *suffix = strrchr(file, '.');
+
+    return suffix && suffix != file && strcmp(suffix, TEMPLATE_SUFFIX) == 0;
+}
+
+/**
+ * @brief Reload the templates when a template file has been written,
+ *        renamed or removed.
+ *
+ * @param [in] fd     Inotify instance.
+ * @param [in] events <Not in use>.
+ * @param [in] arg    <Not in use>.
+ */
+static void dir_changed(int fd, uint32_t events, void *arg)
+{
+    char buf[NOTIFY_BUF_LEN]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    int changed = 0;
+    ssize_t n, pos;
+
+    UNUSED(events);
+    UNUSED(arg);
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (pos = 0; pos < n; pos += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)(buf + pos);
+            if ((ev->mask & IN_Q_OVERFLOW) ||
+                    (ev->len > 0 && is_template(ev->name))) {
+                changed = 1;
+            }
+        }
+    }
+
+    if (changed) {
+        reload();
+    }
+}
@@ -0,0 +1,13 @@
+
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include <stdint.h>
+
+struct mldargs;
+
+int template_init(const char *dir);
+int template_fill(const char *name, char * const overrides[], uint32_t num,
+                  struct mldargs *args);
+
+#endif
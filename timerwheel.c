@@ -0,0 +1,302 @@
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "evloop.h"
+#include "timerwheel.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "timerwheel.c"
+
+// Timer resolution.
+#define TICK_MS 10
+
+// Each wheel has 64 slots and covers 64 slots of the wheel below it.
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+// Number of wheels, together covering 2^24 ticks (about 46 hours).
+#define WHEEL_LEVELS 4
+
+// Longest delay held by the wheels, longer timers are placed again when
+// the delay has passed.
+#define MAX_DELTA (((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+// Thread synchronization.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Timer wheel data.
+static struct timer *wheels[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t now_tick = 0;        // Next tick to run.
+static uint32_t num_timers = 0;      // Pending timers.
+static int tick_fd = -1;             // Tick timer, armed while timers pend.
+
+// Forward declarations.
+static void tick_expired(int fd, uint32_t events, void *arg);
+static void run_tick(struct timer **expired);
+static void cascade(uint32_t level, uint32_t index);
+static void insert(struct timer *timer);
+static void unlink_timer(struct timer *timer);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Initialize the timer wheel, driven by a tick timer of the event
+ *        loop. The tick timer only runs while timers are pending.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int timerwheel_init(void)
+{
+    if (tick_fd != -1) {
+        return 0;
+    }
+
+    if ((tick_fd = evloop_add_timer(0, tick_expired, NULL)) == -1) {
+        ALOGE("%s:%d: Failed to add tick timer", _FILE, __LINE__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Set up a timer before it is added the first time.
+ *
+ * @param [out] timer Timer.
+ * @param [in]  cb    Callback invoked from the event loop thread when the
+ *                    timer expires. The timer may be freed or added again by
+ *                    the callback.
+ * @param [in]  arg   Callback argument.
+ */
+void timerwheel_setup(struct timer *timer, timer_cb cb, void *arg)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->cb = cb;
+    timer->arg = arg;
+}
+
+/**
+ * @brief Add a timer. Adding and expiring a timer is O(1), whatever the
+ *        number of pending timers.
+ *
+ * @param [in out] timer    Timer, not pending.
+ * @param [in]     delay_ms Time until the timer expires.
+ *
+ * @return Returns 0 at success, or -1 if the timer is already pending.
+ */
+int timerwheel_add(struct timer *timer, uint64_t delay_ms)
+{
+    uint64_t now = get_monotonic_ms();
+
+    pthread_mutex_lock(&mutex);
+
+    if (timer->pprev) {
+        pthread_mutex_unlock(&mutex);
+        ALOGE("%s:%d: Timer already pending", _FILE, __LINE__);
+        return -1;
+    }
+
+    // An empty wheel continues from the current time.
+    if (0 == num_timers) {
+        now_tick = now / TICK_MS;
+        (void)evloop_set_timer(tick_fd, TICK_MS);
+    }
+
+    timer->expires = (now + delay_ms + TICK_MS - 1) / TICK_MS;
+    insert(timer);
+    num_timers++;
+
+    pthread_mutex_unlock(&mutex);
+
+    return 0;
+}
+
+/**
+ * @brief Cancel a pending timer. A timer that can't be cancelled has expired
+ *        and its callback is invoked or already done.
+ *
+ * @param [in out] timer Timer.
+ *
+ * @return Returns 0 at success, or -1 if the timer isn't pending.
+ */
+int timerwheel_cancel(struct timer *timer)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&mutex);
+
+    if (timer->pprev) {
+        unlink_timer(timer);
+        if (0 == --num_timers) {
+            (void)evloop_set_timer(tick_fd, 0);
+        }
+        rc = 0;
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Run the ticks up to the current time and invoke the callbacks of
+ *        the expired timers.
+ *
+ * @param [in] fd     <Not in use>.
+ * @param [in] events <Not in use>.
+ * @param [in] arg    <Not in use>.
+ */
+static void tick_expired(int fd, uint32_t events, void *arg)
+{
+    struct timer *expired = NULL;
+    struct timer *timer, *next;
+    uint64_t tick = get_monotonic_ms() / TICK_MS;
+
+    UNUSED(fd);
+    UNUSED(events);
+    UNUSED(arg);
+
+    pthread_mutex_lock(&mutex);
+
+    // Catch up with ticks missed while the loop was busy.
+    while (num_timers > 0 && now_tick <= tick) {
+        run_tick(&expired);
+    }
+
+    if (0 == num_timers) {
+        (void)evloop_set_timer(tick_fd, 0);
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    // The callbacks own the expired timers.
+    for (timer = expired; timer; timer = next) {
+        next = timer->next;
+        timer->next = NULL;
+        timer->cb(timer->arg);
+    }
+}
+
+/**
+ * @brief Run one tick. Timers of the higher wheels are moved down as the
+ *        lower wheels wrap. Called with the wheel locked.
+ *
+ * @param [in out] expired List to add the expired timers to.
+ */
+static void run_tick(struct timer **expired)
+{
+    uint32_t index = now_tick & WHEEL_MASK;
+    uint32_t level;
+    struct timer *timer, *next;
+
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        if ((now_tick >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) {
+            break;
+        }
+        cascade(level, (now_tick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    }
+
+    timer = wheels[0][index];
+    wheels[0][index] = NULL;
+
+    for (; timer; timer = next) {
+        next = timer->next;
+        timer->pprev = NULL;
+
+        // Timers longer than the wheels are placed again.
+        if (timer->expires > now_tick) {
+            insert(timer);
+            continue;
+        }
+
+        timer->next = *expired;
+        *expired = timer;
+        num_timers--;
+    }
+
+    now_tick++;
+}
+
+/**
+ * @brief Move the timers of a slot to the lower wheels. Called with the
+ *        wheel locked.
+ *
+ * @param [in] level Wheel.
+ * @param [in] index Slot.
+ */
+static void cascade(uint32_t level, uint32_t index)
+{
+    struct timer *timer = wheels[level][index];
+    struct timer *next;
+
+    wheels[level][index] = NULL;
+
+    for (; timer; timer = next) {
+        next = timer->next;
+        timer->pprev = NULL;
+        insert(timer);
+    }
+}
+
+/**
+ * @brief Place a timer in the slot of the lowest wheel covering its expiry.
+ *        Called with the wheel locked.
+ *
+ * @param [in out] timer Timer.
+ */
+static void insert(struct timer *timer)
+{
+    uint64_t expires = timer->expires;
+    struct timer **slot;
+    uint32_t level;
+
+    if (expires < now_tick) {
+        expires = now_tick;
+    } else if (expires - now_tick > MAX_DELTA) {
+        expires = now_tick + MAX_DELTA;
+    }
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (expires - now_tick <
+                ((uint64_t)1 << (WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+
+    slot = &wheels[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+    timer->next = *slot;
+    if (*slot) {
+        (*slot)->pprev = &timer->next;
+    }
+    *slot = timer;
+    timer->pprev = slot;
+}
+
+/**
+ * @brief Remove a timer from its slot. Called with the wheel locked.
+ *
+ * @param [in out] timer Timer.
+ */
+static void unlink_timer(struct timer *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
@@ -0,0 +1,23 @@
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+typedef void (*timer_cb)(void *arg);
+
+// Timer, embedded in the data it is set for.
+struct timer {
+    struct timer *next;
+    struct timer **pprev;   // Link to this timer, NULL if not pending.
+    uint64_t expires;       // Tick to expire at.
+    timer_cb cb;
+    void *arg;
+};
+
+int timerwheel_init(void);
+void timerwheel_setup(struct timer *timer, timer_cb cb, void *arg);
+int timerwheel_add(struct timer *timer, uint64_t delay_ms);
+int timerwheel_cancel(struct timer *timer);
+
+#endif
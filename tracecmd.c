@@ -1,12 +1,22 @@
 
+#include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "autoconf.h"
+#include "cmdserver.h"
 #include "mldproc.h"
+#include "pool.h"
+#include "spawnopt.h"
+#include "template.h"
 #include "tracecmd.h"
+#include "upgrade.h"
 #include "utils.h"
 
 #define _FILE "tracecmd.c"
@@ -20,35 +30,82 @@
 // Max arguments on the command-line.
 #define MAX_ARGC 64
 
+// Command options, only one of them can be used per trace command.
+#define COMMAND_OPTS "skqcKUSm"
+
+// Long-only option values.
+#define OPT_SPAWN    256
+#define OPT_TIMEOUT  257
+#define OPT_AT       258
+#define OPT_MAX_TIME 259
+#define OPT_MAX_SIZE 260
+#define OPT_STALL    261
+
 // Trace commands.
 enum tracecmd {
     TRACECMD_NONE,
     TRACECMD_START,
     TRACECMD_STOP,
+    TRACECMD_STOP_ALL,
     TRACECMD_QUERY,
-    TRACECMD_CONFPATH
+    TRACECMD_CONFPATH,
+    TRACECMD_UPGRADE,
+    TRACECMD_STATS,
+    TRACECMD_MEMORY
 };
 
 // Trace command option data.
 struct traceopt {
     enum tracecmd cmd;
     char *startopt;
+    char *templateopt;
     char *stopopt;
+    char *upgradeopt;
+    int verbose;
+    uint32_t timeout_ms;
+    struct spawnopt spawn;
+    struct mldlimit limit;
 };
 
 // Thread synchronization.
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Short and long options for command-line parsing.
-static const char *sopts = "s:k:qc";
+static const char *sopts = "s:k:qcvKU::Smt:";
 static const struct option lopts[] = {
     {"start", required_argument, NULL, 's'},
     {"stop", required_argument, NULL, 'k'},
     {"query", no_argument, NULL, 'q'},
     {"confpath", no_argument, NULL, 'c'},
+    {"stop-all", no_argument, NULL, 'K'},
+    {"upgrade", optional_argument, NULL, 'U'},
+    {"stats", no_argument, NULL, 'S'},
+    {"memory", no_argument, NULL, 'm'},
+    {"verbose", no_argument, NULL, 'v'},
+    {"template", required_argument, NULL, 't'},
+    {"timeout", required_argument, NULL, OPT_TIMEOUT},
+    {"affinity", required_argument, NULL, OPT_SPAWN},
+    {"nice", required_argument, NULL, OPT_SPAWN},
+    {"policy", required_argument, NULL, OPT_SPAWN},
+    {"ionice", required_argument, NULL, OPT_SPAWN},
+    {"rlimit", required_argument, NULL, OPT_SPAWN},
+    {"cpu-max", required_argument, NULL, OPT_SPAWN},
+    {"memory-max", required_argument, NULL, OPT_SPAWN},
+    {"io-max", required_argument, NULL, OPT_SPAWN},
+    {"at", required_argument, NULL, OPT_AT},
+    {"max-time", required_argument, NULL, OPT_MAX_TIME},
+    {"max-size", required_argument, NULL, OPT_MAX_SIZE},
+    {"stall", required_argument, NULL, OPT_STALL},
     {0, 0, 0, 0}
 };
 
+// Forward declarations.
+static int parse_number(const char *str, uint64_t max, uint64_t *value);
+static int parse_at(const char *str, uint64_t *delay_ms);
+static int parse_size(const char *str, uint64_t *bytes);
+static int find_session(const char *cmd, char *key, uint32_t size,
+                        int *start);
+
 /*============================================================================
  * Public functions
  *============================================================================
@@ -69,7 +126,10 @@ int tracecmd_exec(const char *cmd, char *resp, uint32_t len)
     char *mld_cmd;
     char *argv[MAX_ARGC];
     uint32_t argc = 0;
-    int opt;
+    uint32_t first_arg;
+    struct mldargs *args;
+    uint64_t value;
+    int opt, index;
     int rc = 0;
     struct traceopt trace;
 
@@ -86,7 +146,8 @@ int tracecmd_exec(const char *cmd, char *resp, uint32_t len)
         return -1;
     }
 
-    trace_cmd = strdup(cmd);
+    // Released with the arena once the command has been dispatched.
+    trace_cmd = arena_strdup(cmd);
 
     if (NULL == trace_cmd) {
         ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
@@ -107,22 +168,34 @@ int tracecmd_exec(const char *cmd, char *resp, uint32_t len)
     // Split the trace command-line.
     if (split_cmd_line(trace_cmd, argv, MAX_ARGC, &argc) == -1) {
         ALOGE("%s:%d: Failed to split command-line", _FILE, __LINE__);
-        free(trace_cmd);
         return -1;
     }
 
     // Reset trace option data.
     trace.cmd = TRACECMD_NONE;
     trace.startopt = NULL;
+    trace.templateopt = NULL;
     trace.stopopt = NULL;
+    trace.upgradeopt = NULL;
+    trace.verbose = 0;
+    trace.timeout_ms = 0;
+    spawnopt_init(&trace.spawn);
+    memset(&trace.limit, 0, sizeof(trace.limit));
 
     pthread_mutex_lock(&mutex);
 
     // Reset option parser (global state).
     optind = 0;
 
-    // Parse command-line.
-    while ((opt = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+    // Parse command-line. Only the first command option is used, modifier
+    // options may be given in any order. Options not recognized after the
+    // command option are ignored, as when only the first option was parsed.
+    while ((opt = getopt_long(argc, argv, sopts, lopts, &index)) != -1) {
+        if (trace.cmd != TRACECMD_NONE && opt < OPT_SPAWN &&
+                strchr(COMMAND_OPTS, opt)) {
+            continue;
+        }
+
         switch (opt) {
         case 's':
             trace.cmd = TRACECMD_START;
@@ -142,38 +215,136 @@ int tracecmd_exec(const char *cmd, char *resp, uint32_t len)
             trace.cmd = TRACECMD_CONFPATH;
             break;
 
+        case 'K':
+            trace.cmd = TRACECMD_STOP_ALL;
+            break;
+
+        case 'U':
+            trace.cmd = TRACECMD_UPGRADE;
+            trace.upgradeopt = optarg;
+            break;
+
+        case 'S':
+            trace.cmd = TRACECMD_STATS;
+            break;
+
+        case 'm':
+            trace.cmd = TRACECMD_MEMORY;
+            break;
+
+        case 'v':
+            trace.verbose = 1;
+            break;
+
+        case 't':
+            trace.templateopt = optarg;
+            break;
+
+        case OPT_TIMEOUT:
+            if (parse_number(optarg, UINT32_MAX, &value) == -1) {
+                rc = -1;
+            } else {
+                trace.timeout_ms = (uint32_t)value;
+            }
+            break;
+
+        case OPT_SPAWN:
+            if (spawnopt_set(&trace.spawn, lopts[index].name, optarg) == -1) {
+                rc = -1;
+            }
+            break;
+
+        case OPT_AT:
+            if (parse_at(optarg, &trace.limit.delay_ms) == -1) {
+                rc = -1;
+            }
+            break;
+
+        case OPT_MAX_TIME:
+            if (parse_number(optarg, UINT64_MAX / 1000, &value) == -1) {
+                rc = -1;
+            } else {
+                trace.limit.max_ms = value * 1000;
+            }
+            break;
+
+        case OPT_MAX_SIZE:
+            if (parse_size(optarg, &trace.limit.max_bytes) == -1) {
+                rc = -1;
+            }
+            break;
+
+        case OPT_STALL:
+            if (parse_number(optarg, UINT64_MAX / 1000, &value) == -1) {
+                rc = -1;
+            } else {
+                trace.limit.stall_ms = value * 1000;
+            }
+            break;
+
         default:
-            ALOGE("%s:%d: Option not recognized", _FILE, __LINE__);
-            rc = -1;
+            if (trace.cmd != TRACECMD_NONE) {
+                ALOGD("%s:%d: Option not recognized, ignored", _FILE,
+                      __LINE__);
+            } else {
+                ALOGE("%s:%d: Option not recognized", _FILE, __LINE__);
+                rc = -1;
+            }
             break;
         }
-
-        // Parse only one option.
-        break;
     }
 
+    // Arguments left are slot values of a template, moved last by the parser.
+    first_arg = optind;
+
     pthread_mutex_unlock(&mutex);
 
+    // Don't execute a command with bad options.
+    if (-1 == rc) {
+        return -1;
+    }
+
     // Execute command.
     switch (trace.cmd) {
     case TRACECMD_START:
         // Start MLD.
         if (mld_cmd) {
-            rc = mldproc_start(trace.startopt, mld_cmd);
+            rc = mldproc_start(trace.startopt, mld_cmd, &trace.spawn,
+                               &trace.limit);
+        } else if (trace.templateopt) {
+            args = arena_alloc(sizeof(*args));
+            if (NULL == args ||
+                    template_fill(trace.templateopt, argv + first_arg,
+                                  argc - first_arg, args) == -1) {
+                rc = -1;
+            } else {
+                rc = mldproc_start_args(trace.startopt, args, &trace.spawn,
+                                        &trace.limit);
+            }
         } else {
-            ALOGE("%s:%d: Missing MLD command-line", _FILE, __LINE__);
+            ALOGE("%s:%d: Missing MLD command-line or template", _FILE,
+                  __LINE__);
             rc = -1;
         }
         break;
 
     case TRACECMD_STOP:
         // Stop MLD.
-        rc = mldproc_stop(trace.stopopt);
+        rc = mldproc_stop(trace.stopopt, trace.timeout_ms, resp, len);
+        break;
+
+    case TRACECMD_STOP_ALL:
+        // Stop all MLD sessions.
+        rc = mldproc_stop_all(trace.timeout_ms, resp, len);
         break;
 
     case TRACECMD_QUERY:
         // Query MLD.
-        rc = mldproc_query(resp, len);
+        if (trace.verbose) {
+            rc = mldproc_query_verbose(resp, len);
+        } else {
+            rc = mldproc_query(resp, len);
+        }
         break;
 
     case TRACECMD_CONFPATH:
@@ -181,12 +352,248 @@ int tracecmd_exec(const char *cmd, char *resp, uint32_t len)
         strncpy(resp, autoconf_getpath(), len);
         break;
 
+    case TRACECMD_UPGRADE:
+        // Replace the binary once the response has been sent.
+        rc = upgrade_request(trace.upgradeopt);
+        break;
+
+    case TRACECMD_STATS:
+        // Get connection statistics.
+        rc = cmdserver_stats(resp, len);
+        break;
+
+    case TRACECMD_MEMORY:
+        // Get pool usage.
+        rc = pool_report(resp, len);
+        break;
+
     default:
         break;
     }
 
-    free(trace_cmd);
-
     return rc;
 }
 
+/**
+ * @brief Get the name of the log session that a trace command starts or
+ *        stops. Commands for the same session must execute in order.
+ *
+ * @param [in]  cmd  Trace command.
+ * @param [out] key  Destination buffer for the session name.
+ * @param [in]  size Size of destination buffer.
+ *
+ * @return Returns 0 if the command refers to a session, or -1 if not.
+ */
+int tracecmd_key(const char *cmd, char *key, uint32_t size)
+{
+    int start;
+
+    return find_session(cmd, key, size, &start);
+}
+
+/**
+ * @brief Get the command reverting a trace command that starts a log
+ *        session, i.e. stopping it.
+ *
+ * @param [in]  cmd  Trace command.
+ * @param [out] undo Destination buffer for the reverting command.
+ * @param [in]  size Size of destination buffer.
+ *
+ * @return Returns 0 if the command starts a session, or -1 if not.
+ */
+int tracecmd_undo(const char *cmd, char *undo, uint32_t size)
+{
+    char name[CMD_LINE_LENGTH];
+    int start;
+
+    if (find_session(cmd, name, sizeof(name), &start) == -1 || !start) {
+        return -1;
+    }
+
+    snprintf(undo, size, "%s -k %s", TRACE_CMD, name);
+
+    return 0;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Parse a decimal number option value.
+ *
+ * @param [in]  str   Number.
+ * @param [in]  max   Largest value allowed.
+ * @param [out] value Parsed value.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int parse_number(const char *str, uint64_t max, uint64_t *value)
+{
+    unsigned long long num;
+    char *end;
+
+    errno = 0;
+    num = strtoull(str, &end, 10);
+
+    // strtoull() takes leading blanks and a sign, an option value can't.
+    if (!isdigit((unsigned char)*str) || *end != '\0' || ERANGE == errno ||
+            num > max) {
+        ALOGE("%s:%d: Bad number: %s", _FILE, __LINE__, str);
+        return -1;
+    }
+
+    *value = num;
+
+    return 0;
+}
+
+/**
+ * @brief Parse the start time of a session, "+<seconds>" from now or
+ *        seconds since the Epoch. A time that has passed starts the session
+ *        now.
+ *
+ * @param [in]  str      Start time.
+ * @param [out] delay_ms Time until the start.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int parse_at(const char *str, uint64_t *delay_ms)
+{
+    unsigned long long value;
+    time_t now = time(NULL);
+    char *end;
+
+    value = strtoull(str + ('+' == *str), &end, 10);
+
+    if (end == str || *end != '\0') {
+        ALOGE("%s:%d: Bad start time: %s", _FILE, __LINE__, str);
+        return -1;
+    }
+
+    if ('+' == *str) {
+        *delay_ms = value * 1000;
+    } else if (value > (unsigned long long)now) {
+        *delay_ms = (value - now) * 1000;
+    } else {
+        *delay_ms = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Parse a size in bytes, with an optional k, m or g suffix for
+ *        kibibytes, mebibytes or gibibytes.
+ *
+ * @param [in]  str   Size.
+ * @param [out] bytes Size in bytes.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int parse_size(const char *str, uint64_t *bytes)
+{
+    unsigned long long value;
+    char *end;
+    uint32_t shift = 0;
+
+    value = strtoull(str, &end, 10);
+
+    if (end == str) {
+        ALOGE("%s:%d: Bad size: %s", _FILE, __LINE__, str);
+        return -1;
+    }
+
+    switch (*end) {
+    case '\0':
+        break;
+
+    case 'k':
+    case 'K':
+        shift = 10;
+        break;
+
+    case 'm':
+    case 'M':
+        shift = 20;
+        break;
+
+    case 'g':
+    case 'G':
+        shift = 30;
+        break;
+
+    default:
+        ALOGE("%s:%d: Bad size: %s", _FILE, __LINE__, str);
+        return -1;
+    }
+
+    if (*end != '\0' && end[1] != '\0') {
+        ALOGE("%s:%d: Bad size: %s", _FILE, __LINE__, str);
+        return -1;
+    }
+
+    *bytes = (uint64_t)value << shift;
+
+    return 0;
+}
+
+/**
+ * @brief Find the name of the log session that a trace command starts or
+ *        stops.
+ *
+ * @param [in]  cmd   Trace command.
+ * @param [out] key   Destination buffer for the session name.
+ * @param [in]  size  Size of destination buffer.
+ * @param [out] start Set if the session is started, cleared if stopped.
+ *
+ * @return Returns 0 if the command refers to a session, or -1 if not.
+ */
+static int find_session(const char *cmd, char *key, uint32_t size,
+                        int *start)
+{
+    char line[CMD_LINE_LENGTH];
+    char *token, *save, *mld;
+    const char *name = NULL;
+    int next = 0;
+
+    snprintf(line, sizeof(line), "%s", cmd);
+
+    // Anything after the MLD marker belongs to the MLD command-line.
+    if ((mld = strstr(line, MLD_TOOL))) {
+        *mld = '\0';
+    }
+
+    for (token = strtok_r(line, " \t", &save); token && NULL == name;
+            token = strtok_r(NULL, " \t", &save)) {
+        if (next) {
+            name = token;
+        } else if (strncmp(token, "--start=", strlen("--start=")) == 0) {
+            *start = 1;
+            name = token + strlen("--start=");
+        } else if (strncmp(token, "--stop=", strlen("--stop=")) == 0) {
+            *start = 0;
+            name = token + strlen("--stop=");
+        } else if (strcmp(token, "--start") == 0 ||
+                   strcmp(token, "--stop") == 0 ||
+                   strcmp(token, "-s") == 0 || strcmp(token, "-k") == 0) {
+            *start = (strcmp(token, "--start") == 0 ||
+                      strcmp(token, "-s") == 0);
+            next = 1;
+        } else if (strncmp(token, "-s", 2) == 0 ||
+                   strncmp(token, "-k", 2) == 0) {
+            *start = ('s' == token[1]);
+            name = token + 2;
+        }
+    }
+
+    if (NULL == name || '\0' == *name) {
+        return -1;
+    }
+
+    snprintf(key, size, "%s", name);
+
+    return 0;
+}
+
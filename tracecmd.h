@@ -5,5 +5,7 @@
 #define TRACE_CMD "trace"
 
 int tracecmd_exec(const char *cmd, char *resp, uint32_t len);
+int tracecmd_key(const char *cmd, char *key, uint32_t size);
+int tracecmd_undo(const char *cmd, char *undo, uint32_t size);
 
 #endif
@@ -0,0 +1,353 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "mldproc.h"
+#include "upgrade.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "upgrade.c"
+
+// Environment used to hand over state to the new binary.
+#define ENV_LISTEN_FDS "DIP_UPGRADE_LISTEN_FDS"
+#define ENV_CLIENT_FDS "DIP_UPGRADE_CLIENT_FDS"
+#define ENV_SESSIONS "DIP_UPGRADE_SESSIONS"
+
+// Separator in the list of client descriptors.
+#define FD_DELIM ','
+
+// Suffix of a client descriptor using the binary protocol.
+#define FD_BINARY ":b"
+
+// Max size of the handed over session table.
+#define SESSIONS_LEN (64 * 1024)
+
+// Link to the running binary.
+#define PROC_SELF_EXE "/proc/self/exe"
+
+// Thread synchronization.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Command-line to start the new binary with.
+static char **args = NULL;
+
+// Path of the running binary, resolved at startup since the file may be
+// replaced before the upgrade.
+static char exe[PATH_MAX] = "";
+
+// Binary requested by the upgrade command.
+static char target[PATH_MAX] = "";
+static int pending = 0;
+
+// State inherited from the previous binary.
+static char listen_fds[CMD_LINE_LENGTH] = "";
+static char client_fds[CMD_LINE_LENGTH] = "";
+static char *sessions = NULL;
+
+// Forward declarations.
+static void set_fds(const char *env, const int *fds, const int *binary,
+                    uint32_t num);
+static uint32_t get_fds(char *list, int *fds, int *binary, uint32_t size);
+static int set_inherit(int fd, int inherit);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Save the command-line for the new binary and pick up any state
+ *        handed over by a previous binary. The handover environment is
+ *        cleared so it isn't passed on further.
+ *
+ * @param [in] argv Command-line of the proxy.
+ */
+void upgrade_init(char *argv[])
+{
+    const char *env;
+    ssize_t n;
+
+    args = argv;
+
+    n = readlink(PROC_SELF_EXE, exe, sizeof(exe) - 1);
+    exe[(n > 0) ? n : 0] = '\0';
+
+    if ((env = getenv(ENV_LISTEN_FDS))) {
+        snprintf(listen_fds, sizeof(listen_fds), "%s", env);
+    }
+
+    if ((env = getenv(ENV_CLIENT_FDS))) {
+        snprintf(client_fds, sizeof(client_fds), "%s", env);
+    }
+
+    if ((env = getenv(ENV_SESSIONS))) {
+        sessions = strdup(env);
+    }
+
+    unsetenv(ENV_LISTEN_FDS);
+    unsetenv(ENV_CLIENT_FDS);
+    unsetenv(ENV_SESSIONS);
+}
+
+/**
+ * @brief Request an upgrade. The upgrade is carried out by the command server
+ *        once the response to the upgrade command has been sent.
+ *
+ * @param [in] path New binary, or NULL to re-execute the binary at the path
+ *                  the proxy was started from.
+ *
+ * @return Returns 0 at success, or -1 if the binary can't be executed.
+ */
+int upgrade_request(const char *path)
+{
+    if (NULL == path) {
+        path = exe;
+    }
+
+    if ('\0' == *path || access(path, X_OK) == -1) {
+        ALOGE("%s:%d: Can't execute new binary (%s)", _FILE, __LINE__, path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+    snprintf(target, sizeof(target), "%s", path);
+    pending = 1;
+    pthread_mutex_unlock(&mutex);
+
+    return 0;
+}
+
+/**
+ * @brief Check if an upgrade has been requested.
+ *
+ * @return Returns 1 if requested, else 0.
+ */
+int upgrade_pending(void)
+{
+    int rc;
+
+    pthread_mutex_lock(&mutex);
+    rc = pending;
+    pthread_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+/**
+ * @brief Execute the new binary in place of the running one. The process ID
+ *        is kept, so MLD processes remain children of the proxy. The listening
+ *        socket, client connections and session table are handed over.
+ *
+ * NOTE! The caller must make sure no command is executing.
+ *
+ * @param [in] listeners     Listening sockets.
+ * @param [in] num_listeners Number of listening sockets.
+ * @param [in] clients       Connected client sockets.
+ * @param [in] binary        Set for each client using the binary protocol.
+ * @param [in] num_clients   Number of connected client sockets.
+ *
+ * @return Does not return at success, returns -1 at failure.
+ */
+int upgrade_exec(const int *listeners, uint32_t num_listeners,
+                 const int *clients, const int *binary, uint32_t num_clients)
+{
+    char *table;
+    uint32_t i;
+
+    pthread_mutex_lock(&mutex);
+    pending = 0;
+    pthread_mutex_unlock(&mutex);
+
+    table = malloc(SESSIONS_LEN);
+
+    if (NULL == table) {
+        ALOGE("%s:%d: Failed to allocate memory", _FILE, __LINE__);
+        return -1;
+    }
+
+    if (mldproc_export(table, SESSIONS_LEN) == -1) {
+        free(table);
+        return -1;
+    }
+
+    setenv(ENV_SESSIONS, table, 1);
+    free(table);
+
+    set_fds(ENV_LISTEN_FDS, listeners, NULL, num_listeners);
+    set_fds(ENV_CLIENT_FDS, clients, binary, num_clients);
+
+    // Keep the sockets open across execve().
+    for (i = 0; i < num_listeners; i++) {
+        (void)set_inherit(listeners[i], 1);
+    }
+    for (i = 0; i < num_clients; i++) {
+        (void)set_inherit(clients[i], 1);
+    }
+
+    // Make sure journaled records are on storage.
+    (void)journal_sync();
+
+    ALOGD("%s:%d: Upgrading to %s", _FILE, __LINE__, target);
+
+    execv(target, args);
+
+    // Still running the old binary.
+    ALOGE("%s:%d: Failed to execute %s (errno=%d)", _FILE, __LINE__, target,
+          errno);
+
+    for (i = 0; i < num_listeners; i++) {
+        (void)set_inherit(listeners[i], 0);
+    }
+    for (i = 0; i < num_clients; i++) {
+        (void)set_inherit(clients[i], 0);
+    }
+
+    unsetenv(ENV_LISTEN_FDS);
+    unsetenv(ENV_CLIENT_FDS);
+    unsetenv(ENV_SESSIONS);
+
+    return -1;
+}
+
+/**
+ * @brief Get the listening sockets handed over by a previous binary.
+ *
+ * @param [out] fds  Listening sockets.
+ * @param [in]  size Max number of sockets.
+ *
+ * @return Returns the number of listening sockets, 0 if not upgraded.
+ */
+uint32_t upgrade_listen_fds(int *fds, uint32_t size)
+{
+    return get_fds(listen_fds, fds, NULL, size);
+}
+
+/**
+ * @brief Get the client connections handed over by a previous binary.
+ *
+ * @param [out] fds    Client sockets.
+ * @param [out] binary Set for each client using the binary protocol.
+ * @param [in]  size   Max number of sockets.
+ *
+ * @return Returns the number of client sockets.
+ */
+uint32_t upgrade_client_fds(int *fds, int *binary, uint32_t size)
+{
+    return get_fds(client_fds, fds, binary, size);
+}
+
+/**
+ * @brief Get the session table handed over by a previous binary.
+ *
+ * @return Returns the table (see mldproc_export()), or NULL if not upgraded.
+ */
+const char * upgrade_sessions(void)
+{
+    return sessions;
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief Hand over a list of descriptors in the environment.
+ *
+ * @param [in] env    Environment variable.
+ * @param [in] fds    File descriptors.
+ * @param [in] binary Set for each descriptor using the binary protocol, or
+ *                    NULL.
+ * @param [in] num    Number of file descriptors.
+ */
+static void set_fds(const char *env, const int *fds, const int *binary,
+                    uint32_t num)
+{
+    char list[CMD_LINE_LENGTH];
+    size_t pos = 0;
+    uint32_t i;
+
+    list[0] = '\0';
+    for (i = 0; i < num && pos < sizeof(list); i++) {
+        pos += snprintf(list + pos, sizeof(list) - pos, "%s%d%s",
+                        (i > 0) ? "," : "", fds[i],
+                        (binary && binary[i]) ? FD_BINARY : "");
+    }
+
+    setenv(env, list, 1);
+}
+
+/**
+ * @brief Take a list of handed over descriptors. The descriptors are closed
+ *        at execve() again and the list is cleared.
+ *
+ * @param [in out] list   Comma separated list of descriptors.
+ * @param [out]    fds    File descriptors.
+ * @param [out]    binary Set for each descriptor using the binary protocol,
+ *                        or NULL.
+ * @param [in]     size   Max number of file descriptors.
+ *
+ * @return Returns the number of file descriptors.
+ */
+static uint32_t get_fds(char *list, int *fds, int *binary, uint32_t size)
+{
+    const char *pos = list;
+    char *end;
+    uint32_t n = 0;
+    long fd;
+    int bin;
+
+    while (*pos && n < size) {
+        fd = strtol(pos, &end, 10);
+        if (end == pos) {
+            break;
+        }
+
+        bin = (strncmp(end, FD_BINARY, strlen(FD_BINARY)) == 0);
+        if (bin) {
+            end += strlen(FD_BINARY);
+        }
+
+        if (fd >= 0 && set_inherit((int)fd, 0) == 0) {
+            if (binary) {
+                binary[n] = bin;
+            }
+            fds[n++] = (int)fd;
+        }
+
+        pos = (FD_DELIM == *end) ? end + 1 : end;
+    }
+
+    list[0] = '\0';
+
+    return n;
+}
+
+/**
+ * @brief Control if a descriptor is inherited across execve().
+ *
+ * @param [in] fd      File descriptor.
+ * @param [in] inherit Set to keep the descriptor open across execve().
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+static int set_inherit(int fd, int inherit)
+{
+    int flags = fcntl(fd, F_GETFD);
+
+    if (-1 == flags) {
+        return -1;
+    }
+
+    flags = inherit ? (flags & ~FD_CLOEXEC) : (flags | FD_CLOEXEC);
+
+    return fcntl(fd, F_SETFD, flags);
+}
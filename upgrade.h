@@ -0,0 +1,16 @@
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdint.h>
+
+void upgrade_init(char *argv[]);
+int upgrade_request(const char *path);
+int upgrade_pending(void);
+int upgrade_exec(const int *listeners, uint32_t num_listeners,
+                 const int *clients, const int *binary, uint32_t num_clients);
+uint32_t upgrade_listen_fds(int *fds, uint32_t size);
+uint32_t upgrade_client_fds(int *fds, int *binary, uint32_t size);
+const char * upgrade_sessions(void);
+
+#endif
@@ -0,0 +1,318 @@
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "utils.h"
+
+// For logging.
+#define _FILE "uring.c"
+
+// Number of opcodes checked by the probe.
+#define PROBE_OPS 256
+
+// Forward declarations.
+static int sys_setup(uint32_t entries, struct io_uring_params *params);
+static int sys_enter(int fd, uint32_t to_submit, uint32_t min_complete,
+                     uint32_t flags);
+static int sys_register(int fd, uint32_t opcode, void *arg, uint32_t nr_args);
+
+/*============================================================================
+ * Public functions
+ *============================================================================
+ */
+
+/**
+ * @brief Check if io_uring is available and supports the given opcodes.
+ *
+ * @param [in] ops     Required opcodes.
+ * @param [in] num_ops Number of required opcodes.
+ *
+ * @return Returns 1 if supported, else 0.
+ */
+int uring_supported(const uint8_t *ops, uint32_t num_ops)
+{
+    struct io_uring_probe *probe;
+    struct uring ring;
+    uint32_t i;
+    int rc = 0;
+
+    if (uring_init(&ring, 2) == -1) {
+        return 0;
+    }
+
+    probe = calloc(1, sizeof(*probe) +
+                   PROBE_OPS * sizeof(struct io_uring_probe_op));
+
+    if (probe && sys_register(ring.fd, IORING_REGISTER_PROBE, probe,
+                              PROBE_OPS) == 0) {
+        rc = 1;
+        for (i = 0; i < num_ops; i++) {
+            if (ops[i] > probe->last_op ||
+                    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+                rc = 0;
+            }
+        }
+    }
+
+    free(probe);
+    uring_exit(&ring);
+
+    return rc;
+}
+
+/**
+ * @brief Set up an io_uring instance and map its rings.
+ *
+ * @param [out] ring    Ring data.
+ * @param [in]  entries Number of submission queue entries.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int uring_init(struct uring *ring, uint32_t entries)
+{
+    struct io_uring_params params;
+    uint8_t *sq, *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    if ((ring->fd = sys_setup(entries, &params)) == -1) {
+        ALOGD("%s:%d: io_uring not available (errno=%d)", _FILE, __LINE__,
+              errno);
+        return -1;
+    }
+
+    ring->sq_ring_len = params.sq_off.array +
+                        params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_len = params.cq_off.cqes +
+                        params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Both rings share one mapping on kernels supporting it.
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_len > ring->sq_ring_len) {
+            ring->sq_ring_len = ring->cq_ring_len;
+        }
+        ring->cq_ring_len = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+
+    if (MAP_FAILED == ring->sq_ring) {
+        ring->sq_ring = NULL;
+        goto fail;
+    }
+
+    if (ring->cq_ring_len > 0) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+
+        if (MAP_FAILED == ring->cq_ring) {
+            ring->cq_ring = NULL;
+            goto fail;
+        }
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (MAP_FAILED == ring->sqes) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    sq = ring->sq_ring;
+    cq = ring->cq_ring ? ring->cq_ring : ring->sq_ring;
+
+    ring->sq_head = (uint32_t *)(sq + params.sq_off.head);
+    ring->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+    ring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+    ring->sq_mask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+
+    ring->cq_head = (uint32_t *)(cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+
+fail:
+    ALOGE("%s:%d: Failed to map io_uring (errno=%d)", _FILE, __LINE__, errno);
+    uring_exit(ring);
+    return -1;
+}
+
+/**
+ * @brief Unmap the rings and close an io_uring instance.
+ *
+ * @param [in] ring Ring data.
+ */
+void uring_exit(struct uring *ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+
+    if (ring->cq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_len);
+    }
+
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/**
+ * @brief Get a cleared submission queue entry. Queued entries are submitted
+ *        if the queue is full.
+ *
+ * @param [in] ring Ring data.
+ *
+ * @return Returns the entry, or NULL if the queue is full.
+ */
+struct io_uring_sqe * uring_get_sqe(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    uint32_t head, tail;
+
+    tail = *ring->sq_tail;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= ring->sq_entries) {
+        (void)uring_submit(ring, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+        if (tail - head >= ring->sq_entries) {
+            ALOGE("%s:%d: Submission queue full", _FILE, __LINE__);
+            return NULL;
+        }
+    }
+
+    sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+
+    return sqe;
+}
+
+/**
+ * @brief Submit queued entries and wait for completions.
+ *
+ * @param [in] ring    Ring data.
+ * @param [in] wait_nr Number of completions to wait for.
+ *
+ * @return Returns 0 at success, or -1 at failure.
+ */
+int uring_submit(struct uring *ring, uint32_t wait_nr)
+{
+    int n;
+
+    while (1) {
+        n = sys_enter(ring->fd, ring->to_submit, wait_nr,
+                      (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0);
+
+        if (n >= 0) {
+            ring->to_submit -= ((uint32_t)n < ring->to_submit) ?
+                               (uint32_t)n : ring->to_submit;
+            return 0;
+        }
+
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Get the next completion queue entry.
+ *
+ * @param [in] ring Ring data.
+ *
+ * @return Returns the entry, or NULL if there are no completions.
+ */
+struct io_uring_cqe * uring_peek_cqe(struct uring *ring)
+{
+    uint32_t head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+/**
+ * @brief Release the entry returned by uring_peek_cqe().
+ *
+ * @param [in] ring Ring data.
+ */
+void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*============================================================================
+ * Private functions
+ *============================================================================
+ */
+
+/**
+ * @brief io_uring_setup(2) system call.
+ */
+static int sys_setup(uint32_t entries, struct io_uring_params *params)
+{
+#ifdef __NR_io_uring_setup
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * @brief io_uring_enter(2) system call.
+ */
+static int sys_enter(int fd, uint32_t to_submit, uint32_t min_complete,
+                     uint32_t flags)
+{
+#ifdef __NR_io_uring_enter
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * @brief io_uring_register(2) system call.
+ */
+static int sys_register(int fd, uint32_t opcode, void *arg, uint32_t nr_args)
+{
+#ifdef __NR_io_uring_register
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
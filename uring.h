@@ -0,0 +1,39 @@
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/io_uring.h>
+
+// Submission and completion rings of one io_uring instance.
+struct uring {
+    int fd;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_array;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t to_submit;     // Queued entries not yet submitted.
+    struct io_uring_sqe *sqes;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+};
+
+int uring_supported(const uint8_t *ops, uint32_t num_ops);
+int uring_init(struct uring *ring, uint32_t entries);
+void uring_exit(struct uring *ring);
+struct io_uring_sqe * uring_get_sqe(struct uring *ring);
+int uring_submit(struct uring *ring, uint32_t wait_nr);
+struct io_uring_cqe * uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+#endif
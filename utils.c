@@ -83,6 +83,45 @@ struct tm * get_time(void)
     return localtime(&timer);
 }
 
+/**
+ * @brief Get monotonic time, not affected by changes of the calendar time.
+ *
+ * @return Returns the monotonic time in milliseconds.
+ */
+uint64_t get_monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Get monotonic time, for measuring short durations.
+ *
+ * @return Returns the monotonic time in microseconds.
+ */
+uint64_t get_monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Get calendar time, for times that must outlive the process.
+ *
+ * @return Returns the calendar time in milliseconds since the Epoch.
+ */
+uint64_t get_realtime_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /**
  * @brief Check if the string contains white-space only.
  *
@@ -39,6 +39,7 @@ extern int printf_trace;
 #define MAX_PATH_LEN    128
 #define MAX_NAME_LEN    128
 #define CMD_LINE_LENGTH 256
+#define RESP_LENGTH     4096
 
 #define UNUSED(a) ((void)(a))
 
@@ -46,6 +47,9 @@ extern int printf_trace;
 int split_cmd_line(const char *cmd_line, char *argv[], uint32_t argv_size,
                    uint32_t *argc);
 struct tm * get_time(void);
+uint64_t get_monotonic_ms(void);
+uint64_t get_monotonic_us(void);
+uint64_t get_realtime_ms(void);
 int space_only(const char *str);
 
 #endif // UTILS_H